@@ -8,6 +8,7 @@
 #include "File.h"
 #include "Display.h"
 #include "LAHBPCG.h"
+#include "Multigrid.h"
 #include "Statistics.h"
 namespace ImageStack {
 
@@ -108,7 +109,13 @@ bool Integrate::test() {
     Image b = a.copy();
     Gradient::apply(b, "xyt");
     Integrate::apply(b, "xty");
-    return nearlyEqual(a, b);
+    if (!nearlyEqual(a, b)) return false;
+
+    // Check that precision holds up over large images
+    Image c(4000, 4000, 1, 1);
+    c.set(1.0f);
+    Integrate::apply(c, "xy");
+    return c(3999, 3999) == 4000.0f * 4000.0f && c(1234, 2345) == 1235.0f * 2346.0f;
 }
 
 void Integrate::parse(vector<string> args) {
@@ -126,33 +133,120 @@ void Integrate::apply(Image im, string dimensions) {
 }
 
 void Integrate::apply(Image im, char dimension) {
-    int minx = 0, miny = 0, mint = 0;
-    int dx = 0, dy = 0, dt = 0;
-
+    // Running sums are accumulated in double precision, so that they
+    // stay accurate over large images. Several scanlines are summed
+    // at once, one per vector lane, as a sum along a single scanline
+    // is a serial chain of dependent additions.
     if (dimension == 'x') {
-        dx = 1;
-        minx = 1;
-    } else if (dimension == 'y') {
-        dy = 1;
-        miny = 1;
-    } else if (dimension == 't') {
-        dt = 1;
-        mint = 1;
+        const int lanes = 8;
+        const int groups = (im.height + lanes - 1) / lanes;
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (int i = 0; i < groups * im.frames * im.channels; i++) {
+            int y0 = (i % groups) * lanes;
+            int t = (i / groups) % im.frames, c = i / (groups * im.frames);
+            int n = min(lanes, im.height - y0);
+            float *row[lanes];
+            for (int l = 0; l < lanes; l++) {
+                row[l] = &im(0, y0 + min(l, n-1), t, c);
+            }
+            double sum[lanes] = {0};
+            if (n == lanes) {
+                float v[lanes];
+                for (int x = 0; x < im.width; x++) {
+                    for (int l = 0; l < lanes; l++) { v[l] = row[l][x]; }
+                    for (int l = 0; l < lanes; l++) {
+                        sum[l] += v[l];
+                        v[l] = (float)sum[l];
+                    }
+                    for (int l = 0; l < lanes; l++) { row[l][x] = v[l]; }
+                }
+            } else {
+                for (int l = 0; l < n; l++) {
+                    for (int x = 0; x < im.width; x++) {
+                        sum[l] += row[l][x];
+                        row[l][x] = (float)sum[l];
+                    }
+                }
+            }
+        }
+    } else if (dimension == 'y' || dimension == 't') {
+        // Walk down blocks of columns, so that each thread reads
+        // contiguous runs of each scanline, with the columns of a
+        // block across vector lanes
+        const int block = 256;
+        const int blocks = (im.width + block - 1) / block;
+        const int size = dimension == 'y' ? im.height : im.frames;
+        const int other = dimension == 'y' ? im.frames : im.height;
+#ifdef _OPENMP
+        #pragma omp parallel
+#endif
+        {
+            vector<double> sum(block);
+#ifdef _OPENMP
+            #pragma omp for
+#endif
+            for (int i = 0; i < blocks * other * im.channels; i++) {
+                int x0 = (i % blocks) * block;
+                int o = (i / blocks) % other, c = i / (blocks * other);
+                int n = min(block, im.width - x0);
+                std::fill(sum.begin(), sum.end(), 0.0);
+                for (int k = 0; k < size; k++) {
+                    float *row = dimension == 'y' ? &im(x0, k, o, c) : &im(x0, o, k, c);
+                    for (int x = 0; x < n; x++) {
+                        sum[x] += row[x];
+                        row[x] = (float)sum[x];
+                    }
+                }
+            }
+        }
     } else {
         panic("Must integrate with respect to x, y, or t\n");
     }
+}
 
-    // walk forwards through the data, adding up as we go
-    for (int c = 0; c < im.channels; c++) {
-        for (int t = mint; t < im.frames; t++) {
-            for (int y = miny; y < im.height; y++) {
-                for (int x = minx; x < im.width; x++) {
-                    im(x, y, t, c) += im(x - dx, y - dy, t - dt, c);
-                }
-            }
+void SummedAreaTable::help() {
+    pprintf("-summedareatable replaces each pixel with the sum of all pixels above and"
+            " to the left of it, inclusive. With an argument, it sums along the"
+            " given dimensions instead, which may be any combination of x, y, and"
+            " t. It is the same as -integrate along those dimensions, so running"
+            " sums are accumulated in double precision, with many scanlines summed"
+            " at once across vector lanes and cores. The result can be used to"
+            " compute the sum over any box in constant time.\n"
+            "\n"
+            "Usage: ImageStack -load a.jpg -summedareatable -save sat.tmp\n"
+            "       ImageStack -loadframes f*.jpg -summedareatable xyt -save sat.tmp\n");
+}
+
+bool SummedAreaTable::test() {
+    Image a(123, 97, 3, 2);
+    Noise::apply(a, 0, 1);
+    Image b = a.copy();
+    SummedAreaTable::apply(b);
+
+    // The sum over a box comes from its four corners
+    double correct = 0;
+    for (int y = 10; y <= 50; y++) {
+        for (int x = 20; x <= 70; x++) {
+            correct += a(x, y, 1, 1);
         }
     }
+    double box = b(70, 50, 1, 1) - b(19, 50, 1, 1) - b(70, 9, 1, 1) + b(19, 9, 1, 1);
+    return fabs(box - correct) < 1e-2;
+}
 
+void SummedAreaTable::parse(vector<string> args) {
+    assert(args.size() < 2, "-summedareatable takes zero or one arguments\n");
+    if (args.size() == 0) {
+        apply(stack(0));
+    } else {
+        apply(stack(0), args[0]);
+    }
+}
+
+void SummedAreaTable::apply(Image im, string dimensions) {
+    Integrate::apply(im, dimensions);
 }
 
 
@@ -202,10 +296,16 @@ void Poisson::help() {
             " attempts to find the image which fits those gradients best in a least"
             " squares sense. It uses a preconditioned conjugate gradient descent"
             " method. It takes one argument, which is required RMS error of the"
-            " result. This defaults to 0.01 if not given.\n"
+            " result. This defaults to 0.01 if not given. An optional second"
+            " argument selects the solver: 'pcg' (the default) or 'multigrid'"
+            " (see -multigrid), which is usually much faster on large images. The"
+            " multigrid solver interprets the first argument differently: it is"
+            " the factor by which the residual must fall from that of the initial"
+            " zero image, as for -multigrid, so it does not bound the RMS error of"
+            " the result.\n"
             "\n"
             "Usage: ImageStack -load dx.tmp -load dy.tmp \n"
-            "                  -poisson 0.0001 -save out.jpg\n\n");
+            "                  -poisson 0.0001 multigrid -save out.jpg\n\n");
 }
 
 bool Poisson::test() {
@@ -216,20 +316,27 @@ bool Poisson::test() {
     Image dy = a.copy();
     Gradient::apply(dy, 'y');
     Image b = Poisson::apply(dx, dy, 0.00001);
+    if (!nearlyEqual(a, b)) { return false; }
+    b = Poisson::apply(dx, dy, 0.00001, true);
     return nearlyEqual(a, b);
 }
 
 void Poisson::parse(vector<string> args) {
-    assert(args.size() < 2, "-poisson requires one or fewer arguments\n");
+    assert(args.size() < 3, "-poisson requires two or fewer arguments\n");
     float rms = 0.01;
     if (args.size() > 0) {
         rms = readFloat(args[0]);
     }
+    bool multigrid = false;
+    if (args.size() > 1) {
+        multigrid = (args[1] == "multigrid");
+        assert(multigrid || args[1] == "pcg", "The solver must be pcg or multigrid\n");
+    }
 
-    push(apply(stack(1), stack(0), rms));
+    push(apply(stack(1), stack(0), rms, multigrid));
 }
 
-Image Poisson::apply(Image dx, Image dy, float rms) {
+Image Poisson::apply(Image dx, Image dy, float rms, bool multigrid) {
     assert(dx.width  == dy.width &&
            dx.height == dy.height &&
            dx.frames == dy.frames &&
@@ -241,6 +348,9 @@ Image Poisson::apply(Image dx, Image dy, float rms) {
     Image zeros1(dx.width, dx.height, dx.frames, 1);
     Image ones1(dx.width, dx.height, dx.frames, 1);
     ones1.set(1);
+    if (multigrid) {
+        return Multigrid::apply(zerosc, dx, dy, zeros1, ones1, ones1, 100, rms);
+    }
     return LAHBPCG::apply(zerosc, dx, dy, zeros1, ones1, ones1, 999999, rms);
 }
 
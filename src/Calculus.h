@@ -20,6 +20,14 @@ public:
     static void apply(Image im, char dimension);
 };
 
+class SummedAreaTable : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static void apply(Image im, string dimensions = "xy");
+};
+
 class GradMag : public Operation {
 public:
     void help();
@@ -33,7 +41,8 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image dx, Image dy, float termination = 0.01);
+    static Image apply(Image dx, Image dy, float termination = 0.01,
+                       bool multigrid = false);
 };
 
 }
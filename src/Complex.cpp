@@ -27,6 +27,22 @@ bool ComplexMultiply::test() {
     ComplexMultiply::apply(d, a, true);
     if (!nearlyEqual(c, d)) return false;
 
+    // A fused complex expression matches the same formula done one
+    // operation at a time
+    Image k(324, 243, 4, 2), g(324, 243, 4, 1);
+    Noise::apply(b, -1, 1);
+    Noise::apply(k, -1, 1);
+    Noise::apply(g, 1, 2);
+    Image fused(324, 243, 4, 2);
+    auto zb = Expr::complexChannel(b), zk = Expr::complexChannel(k);
+    Expr::setComplex(fused, zb * Expr::conj(zk) / (Expr::norm(zk) + g) - 2 * zk);
+    Image slow = b.selectChannels(0, 2).copy();
+    ComplexMultiply::apply(slow, k, true);
+    Image denom = RealComplex::apply(ComplexMagnitude::apply(k) * ComplexMagnitude::apply(k) + g);
+    ComplexDivide::apply(slow, denom);
+    slow -= 2 * k;
+    if (!nearlyEqual(fused, slow)) return false;
+
     return true;
 }
 
@@ -54,14 +70,11 @@ void ComplexMultiply::apply(Image a, Image b, bool conj) {
 
     if (a.channels == 2 && b.channels == 2) {
         // Scalar times scalar
-        Image a_real = a.channel(0), a_imag = a.channel(1);
-        Image b_real = b.channel(0), b_imag = b.channel(1);
+        auto za = Expr::complexChannel(a), zb = Expr::complexChannel(b);
         if (conj) {
-            a.setChannels(a_real*b_real + a_imag*b_imag,
-                          a_imag*b_real - a_real*b_imag);
+            Expr::setComplex(a, za * Expr::conj(zb));
         } else {
-            a.setChannels(a_real*b_real - a_imag*b_imag,
-                          a_imag*b_real + a_real*b_imag);
+            Expr::setComplex(a, za * zb);
         }
     } else if (b.channels == 2) {
         // Vector times scalar
@@ -131,15 +144,11 @@ void ComplexDivide::apply(Image a, Image b, bool conj) {
 
     if (a.channels == 2 && b.channels == 2) {
         // Scalar over scalar
-        Image a_real = a.channel(0), a_imag = a.channel(1);
-        Image b_real = b.channel(0), b_imag = b.channel(1);
-        auto denom = b_real*b_real + b_imag*b_imag;
+        auto za = Expr::complexChannel(a), zb = Expr::complexChannel(b);
         if (conj) {
-            a.setChannels((a_real * b_real - a_imag * b_imag) / denom,
-                          (a_imag * b_real + a_real * b_imag) / denom);
+            Expr::setComplex(a, za / Expr::conj(zb));
         } else {
-            a.setChannels((a_real * b_real + a_imag * b_imag) / denom,
-                          (a_imag * b_real - a_real * b_imag) / denom);
+            Expr::setComplex(a, za / zb);
         }
     } else if (b.channels == 2) {
         // Vector over scalar
@@ -297,9 +306,7 @@ Image ComplexMagnitude::apply(Image im) {
     Image out(im.width, im.height, im.frames, im.channels/2);
 
     for (int c = 0; c < out.channels; c++) {
-        Image real = im.channel(2*c);
-        Image imag = im.channel(2*c+1);
-        out.channel(c).set(sqrt(real*real + imag*imag));
+        out.channel(c).set(Expr::abs(Expr::complexChannel(im, c)));
     }
 
     return out;
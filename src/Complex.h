@@ -2,6 +2,154 @@
 #define IMAGESTACK_COMPLEX_H
 namespace ImageStack {
 
+namespace Expr {
+
+// A complex-valued expression, held as a pair of ordinary
+// expressions for its real and imaginary parts. Arithmetic on these
+// just builds bigger real expressions, so a whole Fourier-domain
+// formula like conj(k) * b / (norm(k) + g) becomes two expressions
+// that setComplex evaluates in a single fused, vectorized pass,
+// instead of one pass over the image per operation.
+template<typename R, typename I>
+struct Complex {
+    const R re;
+    const I im;
+    Complex(const R &re_, const I &im_) : re(re_), im(im_) {}
+};
+
+template<typename R, typename I>
+Complex<FloatExprType(R), FloatExprType(I)> complex(const R &re, const I &im) {
+    return Complex<FloatExprType(R), FloatExprType(I)>(re, im);
+}
+
+// Channels 2*c and 2*c+1 of a complex image
+inline Complex<Image, Image> complexChannel(Image im, int c = 0) {
+    return Complex<Image, Image>(im.channel(2*c), im.channel(2*c+1));
+}
+
+template<typename R, typename I>
+R real(const Complex<R, I> &z) {
+    return z.re;
+}
+
+template<typename R, typename I>
+I imag(const Complex<R, I> &z) {
+    return z.im;
+}
+
+template<typename R, typename I>
+auto conj(const Complex<R, I> &z) -> Complex<R, decltype(-z.im)> {
+    return complex(z.re, -z.im);
+}
+
+// The squared magnitude
+template<typename R, typename I>
+auto norm(const Complex<R, I> &z) -> decltype(z.re*z.re + z.im*z.im) {
+    return z.re*z.re + z.im*z.im;
+}
+
+template<typename R, typename I>
+auto abs(const Complex<R, I> &z) -> decltype(sqrt(norm(z))) {
+    return sqrt(norm(z));
+}
+
+// Evaluate a complex expression into a two-channel image. Every
+// value is computed before any is stored, so the expression may
+// refer to the image itself.
+template<typename R, typename I>
+void setComplex(Image out, const Complex<R, I> &z) {
+    assert(out.channels == 2, "A complex expression can only be assigned to a two-channel image\n");
+    out.setChannels(z.re, z.im);
+}
+
+}
+
+// Complex arithmetic. Either side may also be a real expression or
+// a number.
+template<typename R, typename I>
+auto operator-(const Expr::Complex<R, I> &a) -> Expr::Complex<decltype(-a.re), decltype(-a.im)> {
+    return Expr::complex(-a.re, -a.im);
+}
+
+template<typename R1, typename I1, typename R2, typename I2>
+auto operator+(const Expr::Complex<R1, I1> &a, const Expr::Complex<R2, I2> &b)
+-> Expr::Complex<decltype(a.re + b.re), decltype(a.im + b.im)> {
+    return Expr::complex(a.re + b.re, a.im + b.im);
+}
+
+template<typename A, typename R, typename I>
+auto operator+(const A &a, const Expr::Complex<R, I> &b)
+-> Expr::Complex<decltype(FloatExprType(A)(a) + b.re), I> {
+    return Expr::complex(FloatExprType(A)(a) + b.re, b.im);
+}
+
+template<typename R, typename I, typename B>
+auto operator+(const Expr::Complex<R, I> &a, const B &b)
+-> Expr::Complex<decltype(a.re + FloatExprType(B)(b)), I> {
+    return Expr::complex(a.re + FloatExprType(B)(b), a.im);
+}
+
+template<typename R1, typename I1, typename R2, typename I2>
+auto operator-(const Expr::Complex<R1, I1> &a, const Expr::Complex<R2, I2> &b)
+-> Expr::Complex<decltype(a.re - b.re), decltype(a.im - b.im)> {
+    return Expr::complex(a.re - b.re, a.im - b.im);
+}
+
+template<typename A, typename R, typename I>
+auto operator-(const A &a, const Expr::Complex<R, I> &b)
+-> Expr::Complex<decltype(FloatExprType(A)(a) - b.re), decltype(-b.im)> {
+    return Expr::complex(FloatExprType(A)(a) - b.re, -b.im);
+}
+
+template<typename R, typename I, typename B>
+auto operator-(const Expr::Complex<R, I> &a, const B &b)
+-> Expr::Complex<decltype(a.re - FloatExprType(B)(b)), I> {
+    return Expr::complex(a.re - FloatExprType(B)(b), a.im);
+}
+
+template<typename R1, typename I1, typename R2, typename I2>
+auto operator*(const Expr::Complex<R1, I1> &a, const Expr::Complex<R2, I2> &b)
+-> Expr::Complex<decltype(a.re*b.re - a.im*b.im), decltype(a.re*b.im + a.im*b.re)> {
+    return Expr::complex(a.re*b.re - a.im*b.im, a.re*b.im + a.im*b.re);
+}
+
+template<typename A, typename R, typename I>
+auto operator*(const A &a, const Expr::Complex<R, I> &b)
+-> Expr::Complex<decltype(FloatExprType(A)(a) * b.re), decltype(FloatExprType(A)(a) * b.im)> {
+    FloatExprType(A) s(a);
+    return Expr::complex(s * b.re, s * b.im);
+}
+
+template<typename R, typename I, typename B>
+auto operator*(const Expr::Complex<R, I> &a, const B &b)
+-> Expr::Complex<decltype(a.re * FloatExprType(B)(b)), decltype(a.im * FloatExprType(B)(b))> {
+    FloatExprType(B) s(b);
+    return Expr::complex(a.re * s, a.im * s);
+}
+
+template<typename R1, typename I1, typename R2, typename I2>
+auto operator/(const Expr::Complex<R1, I1> &a, const Expr::Complex<R2, I2> &b)
+-> Expr::Complex<decltype((a.re*b.re + a.im*b.im) / norm(b)),
+                 decltype((a.im*b.re - a.re*b.im) / norm(b))> {
+    return Expr::complex((a.re*b.re + a.im*b.im) / norm(b),
+                         (a.im*b.re - a.re*b.im) / norm(b));
+}
+
+template<typename A, typename R, typename I>
+auto operator/(const A &a, const Expr::Complex<R, I> &b)
+-> Expr::Complex<decltype(FloatExprType(A)(a) * b.re / norm(b)),
+                 decltype(-(FloatExprType(A)(a) * b.im) / norm(b))> {
+    FloatExprType(A) s(a);
+    return Expr::complex(s * b.re / norm(b), -(s * b.im) / norm(b));
+}
+
+template<typename R, typename I, typename B>
+auto operator/(const Expr::Complex<R, I> &a, const B &b)
+-> Expr::Complex<decltype(a.re / FloatExprType(B)(b)), decltype(a.im / FloatExprType(B)(b))> {
+    FloatExprType(B) s(b);
+    return Expr::complex(a.re / s, a.im / s);
+}
+
 class ComplexMultiply : public Operation {
 public:
     void help();
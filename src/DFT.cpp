@@ -10,8 +10,270 @@
 #include "Calculus.h"
 #include "File.h"
 #include <fftw3.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 namespace ImageStack {
 
+unsigned FFT::planningEffort = FFTW_ESTIMATE;
+int FFT::planningThreads = 1;
+string FFT::wisdomFile;
+
+namespace {
+
+// Making an FFTW plan is much slower than executing it, and plans
+// made with more effort than FFTW_ESTIMATE scribble over their arrays
+// while they're being made. So each plan is made once, for the first
+// image with a given layout, and kept. The new-array execute
+// functions then run it on any image with the same sizes, strides,
+// and alignment. The key holds everything that distinguishes one
+// plan from another. Once there are more than maxCachedPlans, the
+// least recently used are destroyed, but only outside of parallel
+// regions, where no other thread can be executing them.
+struct CachedPlan {
+    fftwf_plan plan;
+    size_t lastUsed;
+};
+map<vector<ptrdiff_t>, CachedPlan> planCache;
+size_t planCacheClock = 0;
+const size_t maxCachedPlans = 64;
+
+enum PlanKind {SplitDFTPlan = 0, DCTPlan, R2CPlan, C2RPlan};
+
+// Everything needed to make a plan. For the real-to-complex and
+// complex-to-real kinds, the input strides (is) are those of the
+// input image, the output strides (os) those of the output image, and
+// the last transformed dimension is the one the spectrum stores
+// halved. Pointers a kind doesn't use are NULL.
+struct PlanSpec {
+    PlanSpec(PlanKind k) : kind(k), in(NULL), inImag(NULL), out(NULL), outImag(NULL) {}
+    PlanKind kind;
+    vector<fftwf_iodim> fftDims, loopDims;
+    float *in, *inImag, *out, *outImag;
+};
+
+// Sort the t, y, and x dimensions into those to transform and those
+// to loop over. The transformed ones are listed in that order so
+// that x is the one halved by real transforms, if it's transformed.
+void addDims(PlanSpec &spec, int width, int height, int frames,
+             Image in, Image out,
+             bool transformX, bool transformY, bool transformT) {
+    fftwf_iodim t = {frames, in.tstride, out.tstride};
+    fftwf_iodim y = {height, in.ystride, out.ystride};
+    fftwf_iodim x = {width, 1, 1};
+    (transformT ? spec.fftDims : spec.loopDims).push_back(t);
+    (transformY ? spec.fftDims : spec.loopDims).push_back(y);
+    (transformX ? spec.fftDims : spec.loopDims).push_back(x);
+}
+
+// The alignment of a pointer, as far as any SIMD codelet could care
+ptrdiff_t alignmentOf(const float *ptr) {
+    return (ptrdiff_t)((size_t)ptr & 63);
+}
+
+vector<ptrdiff_t> planKey(const PlanSpec &spec) {
+    vector<ptrdiff_t> key;
+    key.push_back(spec.kind);
+    key.push_back(FFT::planningEffort);
+    key.push_back(FFT::planningThreads);
+    key.push_back(spec.fftDims.size());
+    for (size_t i = 0; i < spec.fftDims.size(); i++) {
+        key.push_back(spec.fftDims[i].n);
+        key.push_back(spec.fftDims[i].is);
+        key.push_back(spec.fftDims[i].os);
+    }
+    for (size_t i = 0; i < spec.loopDims.size(); i++) {
+        key.push_back(spec.loopDims[i].n);
+        key.push_back(spec.loopDims[i].is);
+        key.push_back(spec.loopDims[i].os);
+    }
+    key.push_back(alignmentOf(spec.in));
+    key.push_back(alignmentOf(spec.inImag));
+    key.push_back(alignmentOf(spec.out));
+    key.push_back(alignmentOf(spec.outImag));
+    key.push_back(spec.in == spec.out);
+    // The inverse complex transform swaps the real and imaginary
+    // parts, so this also captures the direction.
+    key.push_back(spec.inImag ? spec.inImag - spec.in : 0);
+    key.push_back(spec.outImag ? spec.outImag - spec.out : 0);
+    return key;
+}
+
+fftwf_plan makePlan(const PlanSpec &spec) {
+    int rank = (int)spec.fftDims.size();
+    int howmany = (int)spec.loopDims.size();
+    switch (spec.kind) {
+    case SplitDFTPlan:
+        return fftwf_plan_guru_split_dft(rank, &spec.fftDims[0], howmany, &spec.loopDims[0],
+                                         spec.in, spec.inImag, spec.out, spec.outImag,
+                                         FFT::planningEffort);
+    case DCTPlan: {
+        vector<fftw_r2r_kind> kinds(rank, FFTW_REDFT00);
+        return fftwf_plan_guru_r2r(rank, &spec.fftDims[0], howmany, &spec.loopDims[0],
+                                   spec.in, spec.out, &kinds[0], FFT::planningEffort);
+    }
+    case R2CPlan:
+        return fftwf_plan_guru_split_dft_r2c(rank, &spec.fftDims[0], howmany, &spec.loopDims[0],
+                                             spec.in, spec.out, spec.outImag,
+                                             FFT::planningEffort);
+    case C2RPlan:
+        return fftwf_plan_guru_split_dft_c2r(rank, &spec.fftDims[0], howmany, &spec.loopDims[0],
+                                             spec.in, spec.inImag, spec.out,
+                                             FFT::planningEffort);
+    }
+    return NULL;
+}
+
+// Must be called from within the planner critical section
+void prepareFFTW() {
+    #ifndef NO_FFTW_THREADS
+    static bool threadsInitialized = false;
+    if (!threadsInitialized) {
+        fftwf_init_threads();
+        threadsInitialized = true;
+    }
+    fftwf_plan_with_nthreads(FFT::planningThreads);
+    #endif
+}
+
+// Must be called from within the planner critical section
+void saveWisdom() {
+    if (FFT::wisdomFile.empty() || FFT::planningEffort == FFTW_ESTIMATE) { return; }
+    FILE *f = fopen(FFT::wisdomFile.c_str(), "w");
+    if (!f) { return; }
+    fftwf_export_wisdom_to_file(f);
+    fclose(f);
+}
+
+// Must be called from within the planner critical section
+void evictPlans() {
+    #ifdef _OPENMP
+    if (omp_in_parallel()) { return; }
+    #endif
+    while (planCache.size() > maxCachedPlans) {
+        map<vector<ptrdiff_t>, CachedPlan>::iterator oldest = planCache.begin();
+        for (map<vector<ptrdiff_t>, CachedPlan>::iterator iter = planCache.begin();
+             iter != planCache.end(); iter++) {
+            if (iter->second.lastUsed < oldest->second.lastUsed) { oldest = iter; }
+        }
+        fftwf_destroy_plan(oldest->second.plan);
+        planCache.erase(oldest);
+    }
+}
+
+// Get a plan from the cache, making it if necessary. The input image
+// is the one the plan reads from, which is preserved while planning.
+// The plan stays valid until the next call from outside a parallel
+// region.
+fftwf_plan cachedPlan(const PlanSpec &spec, Image input) {
+    vector<ptrdiff_t> key = planKey(spec);
+
+    fftwf_plan plan = NULL;
+    #ifdef _OPENMP
+    #pragma omp critical (fftw_planner)
+    #endif
+    {
+        map<vector<ptrdiff_t>, CachedPlan>::iterator iter = planCache.find(key);
+        if (iter != planCache.end()) {
+            plan = iter->second.plan;
+            iter->second.lastUsed = planCacheClock++;
+        } else {
+            prepareFFTW();
+            Image backup;
+            if (FFT::planningEffort != FFTW_ESTIMATE) { backup = input.copy(); }
+            plan = makePlan(spec);
+            if (backup.defined()) { input.set(backup); }
+            if (plan) {
+                CachedPlan entry = {plan, planCacheClock++};
+                planCache[key] = entry;
+                evictPlans();
+                saveWisdom();
+            }
+        }
+    }
+    assert(plan, "FFTW could not make a plan for this transform\n");
+    return plan;
+}
+
+// Get a plan for an in-place DCT-I (which is its own inverse, up to
+// scale) along the given dimensions of an image.
+fftwf_plan dctPlan(Image data, bool transformX, bool transformY, bool transformT) {
+    PlanSpec spec(DCTPlan);
+    addDims(spec, data.width, data.height, data.frames, data, data,
+            transformX, transformY, transformT);
+    fftwf_iodim c = {data.channels, data.cstride, data.cstride};
+    spec.loopDims.push_back(c);
+    spec.in = spec.out = data.baseAddress();
+    return cachedPlan(spec, data);
+}
+
+// Which of x, y, and t (0, 1, or 2) a real transform halves. Callers
+// have already turned off transforms along dimensions of size one.
+int halvedDimension(bool transformX, bool transformY) {
+    if (transformX) return 0;
+    if (transformY) return 1;
+    return 2;
+}
+
+// The sizes of the blocks used by one dimension of FFTConvolve's
+// overlap-save. Each block reads pad samples before the tile it
+// produces, and the tiles start step samples apart.
+struct BlockLayout {
+    int block, pad, step, count;
+};
+
+// The smallest size at least n of the form 2^a 3^b 5^c, which FFTW
+// transforms fastest.
+int fftFriendlySize(int n) {
+    for (;; n++) {
+        int m = n;
+        while (m % 2 == 0) m /= 2;
+        while (m % 3 == 0) m /= 3;
+        while (m % 5 == 0) m /= 5;
+        if (m == 1) return n;
+    }
+}
+
+BlockLayout blockLayout(int size, int radius, Convolve::BoundaryCondition b, int maxBlock) {
+    BlockLayout l;
+    // The block must be comfortably bigger than the filter, or most of
+    // it is margin.
+    if (maxBlock <= 0) maxBlock = max(256, radius*8);
+    maxBlock = max(maxBlock, radius*4 + 1);
+    if (b == Convolve::Wrap && size <= maxBlock) {
+        // A circular convolution of the whole dimension is exactly
+        // what we want.
+        l.block = l.step = size;
+        l.pad = 0;
+    } else if (size + radius*2 <= maxBlock) {
+        // Padding further than the filter radius is harmless, so we
+        // may as well pad to a faster size.
+        l.block = fftFriendlySize(size + radius*2);
+        l.pad = radius;
+        l.step = size;
+    } else {
+        l.block = fftFriendlySize(maxBlock);
+        l.pad = radius;
+        l.step = l.block - radius*2;
+    }
+    l.count = (size + l.step - 1) / l.step;
+    return l;
+}
+
+// Where a sample outside an image reads from under a boundary
+// condition, or -1 if it's zero.
+inline int boundaryIndex(int i, int size, Convolve::BoundaryCondition b) {
+    if (i >= 0 && i < size) return i;
+    if (b == Convolve::Clamp) return clamp(i, 0, size-1);
+    if (b == Convolve::Wrap) {
+        i %= size;
+        return i < 0 ? i + size : i;
+    }
+    return -1;
+}
+
+}
+
 void DCT::help() {
     pprintf("-dct performs a real discrete cosine transform on the current"
             " image, over the dimensions given in the argument. The signal is"
@@ -87,44 +349,8 @@ void DCT::apply(Image im, bool transformX, bool transformY, bool transformT) {
     // rank 0
     if (!transformX && !transformY && !transformT) { return; }
 
-    vector<fftwf_iodim> loop_dims;
-    vector<fftwf_iodim> fft_dims;
-
-    // X
-    {
-        fftwf_iodim d = {im.width, 1, 1};
-        if (transformX) fft_dims.push_back(d);
-        else loop_dims.push_back(d);
-    }
-
-    // Y
-    {
-        fftwf_iodim d = {im.height, im.ystride, im.ystride};
-        if (transformY) fft_dims.push_back(d);
-        else loop_dims.push_back(d);
-    }
-
-    // T
-    {
-        fftwf_iodim d = {im.frames, im.tstride, im.tstride};
-        if (transformT) fft_dims.push_back(d);
-        else loop_dims.push_back(d);
-    }
-
-    // C
-    {
-        fftwf_iodim d = {im.channels, im.cstride, im.cstride};
-        loop_dims.push_back(d);
-    }
-
-    vector<fftw_r2r_kind> kinds(fft_dims.size(), FFTW_REDFT00);
-
-    fftwf_plan plan = fftwf_plan_guru_r2r((int)fft_dims.size(), &fft_dims[0],
-                                          (int)loop_dims.size(), &loop_dims[0],
-                                          im.baseAddress(), im.baseAddress(),
-                                          &kinds[0], FFTW_ESTIMATE);
-    fftwf_execute(plan);
-    fftwf_destroy_plan(plan);
+    fftwf_plan plan = dctPlan(im, transformX, transformY, transformT);
+    fftwf_execute_r2r(plan, im.baseAddress(), im.baseAddress());
 
     float m = 1.0;
     if (transformX) m *= 2*(im.width-1);
@@ -138,9 +364,17 @@ void FFT::help() {
             " are interpreted as complex. The input is an image with 2*c channels,"
             " where channel 2*i is the real part of the i\'th channel, and channel"
             " 2*i+1 is the imaginary part of the i'th channel. The output image is"
-            " laid out the same way.\n"
+            " laid out the same way. The optional first argument restricts the"
+            " transform to some of the dimensions x, y, and t.\n"
             "\n"
-            "Usage: ImageStack -load a.tmp -fftcomplex -save freq.tmp\n\n");
+            "If the argument real is given, the input is instead treated as real,"
+            " with c channels. Its spectrum is conjugate symmetric, so only the"
+            " non-redundant half is computed and returned: the first transformed"
+            " dimension (usually x) shrinks from n to n/2+1. This takes about half"
+            " the time and memory of transforming the image as complex.\n"
+            "\n"
+            "Usage: ImageStack -load a.tmp -fftcomplex -save freq.tmp\n"
+            "       ImageStack -load a.jpg -fft xy real -save freq.tmp\n\n");
 
 }
 
@@ -164,6 +398,31 @@ bool FFT::test() {
     double d2 = Stats(b).sum();
     if (!nearlyEqual(d1, d2)) return false;
 
+    // Check the real transform gives half of the complex one, and
+    // inverts, with both odd and even halved dimensions
+    for (int w = 32; w <= 33; w++) {
+        Image r(w, 24, 5, 2);
+        Noise::apply(r, 0, 1);
+        Image full = RealComplex::apply(r);
+        FFT::apply(full);
+        Image half = FFT::applyReal(r);
+        if (half.width != w/2+1) return false;
+        if (!nearlyEqual(half, full.region(0, 0, 0, 0, half.width, half.height,
+                                           half.frames, half.channels))) return false;
+        if (!nearlyEqual(IFFT::applyReal(half, w, 24, 5), r)) return false;
+    }
+
+    // Check the plan cache stays bounded over many sizes, and that
+    // evicted plans are remade correctly
+    for (int w = 1; w <= (int)maxCachedPlans + 10; w++) {
+        Image s(w, 3, 1, 2);
+        Noise::apply(s, 0, 1);
+        Image t = s.copy();
+        FFT::apply(s, true, true, false);
+        IFFT::apply(s, true, true, false);
+        if (planCache.size() > maxCachedPlans || !nearlyEqual(s, t)) return false;
+    }
+
     // Check a single shifted curve creates a spike
     a.channel(0).set(cos(16 * M_PI * Expr::X() / 123.0 + M_PI/8));
     a.channel(1).set(sin(16 * M_PI * Expr::X() / 123.0 + M_PI/8));
@@ -184,13 +443,17 @@ bool FFT::test() {
 }
 
 void FFT::parse(vector<string> args) {
-    assert(args.size() < 2, "-fft takes zero or one argument\n");
+    assert(args.size() < 3, "-fft takes zero, one, or two arguments\n");
 
-    bool x = true, y = true, t = true;
-    if (args.size() == 1) {
+    bool x = true, y = true, t = true, real = false;
+    for (size_t a = 0; a < args.size(); a++) {
+        if (args[a] == "real") {
+            real = true;
+            continue;
+        }
         x = y = t = false;
-        for (size_t i = 0; i < args[0].size(); i++) {
-            switch (args[0][i]) {
+        for (size_t i = 0; i < args[a].size(); i++) {
+            switch (args[a][i]) {
             case 'x':
                 x = true;
                 break;
@@ -201,14 +464,19 @@ void FFT::parse(vector<string> args) {
                 t = true;
                 break;
             default:
-                panic("Unknown dimension: %c\n", args[0][i]);
+                panic("Unknown dimension: %c\n", args[a][i]);
                 break;
             }
         }
-
     }
 
-    apply(stack(0), x, y, t);
+    if (real) {
+        Image im = applyReal(stack(0), x, y, t);
+        pop();
+        push(im);
+    } else {
+        apply(stack(0), x, y, t);
+    }
 }
 
 void FFT::apply(Image im, bool transformX, bool transformY, bool transformT, bool inverse) {
@@ -221,48 +489,20 @@ void FFT::apply(Image im, bool transformX, bool transformY, bool transformT, boo
     // rank 0
     if (!transformX && !transformY && !transformT) { return; }
 
-    vector<fftwf_iodim> loop_dims;
-    vector<fftwf_iodim> fft_dims;
-
-    // X
-    {
-        fftwf_iodim d = {im.width, 1, 1};
-        if (transformX) fft_dims.push_back(d);
-        else loop_dims.push_back(d);
-    }
-
-    // Y
-    {
-        fftwf_iodim d = {im.height, im.ystride, im.ystride};
-        if (transformY) fft_dims.push_back(d);
-        else loop_dims.push_back(d);
-    }
-
-    // T
-    {
-        fftwf_iodim d = {im.frames, im.tstride, im.tstride};
-        if (transformT) fft_dims.push_back(d);
-        else loop_dims.push_back(d);
-    }
-
-    // C
-    {
-        fftwf_iodim d = {im.channels/2, im.cstride*2, im.cstride*2};
-        loop_dims.push_back(d);
-    }
-
     // An inverse fft can be done by swapping real and imaginary parts
     int real_c = inverse ? 1 : 0;
     int imag_c = inverse ? 0 : 1;
 
-    fftwf_plan plan = fftwf_plan_guru_split_dft((int)fft_dims.size(), &fft_dims[0],
-                                                (int)loop_dims.size(), &loop_dims[0],
-                                                &(im(0, 0, 0, real_c)), &(im(0, 0, 0, imag_c)),
-                                                &(im(0, 0, 0, real_c)), &(im(0, 0, 0, imag_c)),
-                                                FFTW_ESTIMATE);
-    fftwf_execute(plan);
-    fftwf_destroy_plan(plan);
+    PlanSpec spec(SplitDFTPlan);
+    addDims(spec, im.width, im.height, im.frames, im, im,
+            transformX, transformY, transformT);
+    fftwf_iodim c = {im.channels/2, im.cstride*2, im.cstride*2};
+    spec.loopDims.push_back(c);
+    spec.in = spec.out = &(im(0, 0, 0, real_c));
+    spec.inImag = spec.outImag = &(im(0, 0, 0, imag_c));
 
+    fftwf_plan plan = cachedPlan(spec, im);
+    fftwf_execute_split_dft(plan, spec.in, spec.inImag, spec.out, spec.outImag);
 
     if (inverse) {
         float m = 1.0;
@@ -273,14 +513,56 @@ void FFT::apply(Image im, bool transformX, bool transformY, bool transformT, boo
     }
 }
 
+Image FFT::applyReal(Image im, bool transformX, bool transformY, bool transformT) {
+    if (im.width == 1) { transformX = false; }
+    if (im.height == 1) { transformY = false; }
+    if (im.frames == 1) { transformT = false; }
+
+    int size[] = {im.width, im.height, im.frames};
+    if (transformX || transformY || transformT) {
+        int d = halvedDimension(transformX, transformY);
+        size[d] = size[d]/2 + 1;
+    }
+    Image out(size[0], size[1], size[2], im.channels*2);
+
+    // rank 0
+    if (!transformX && !transformY && !transformT) {
+        for (int c = 0; c < im.channels; c++) {
+            out.channel(c*2).set(im.channel(c));
+        }
+        return out;
+    }
+
+    PlanSpec spec(R2CPlan);
+    addDims(spec, im.width, im.height, im.frames, im, out,
+            transformX, transformY, transformT);
+    fftwf_iodim c = {im.channels, im.cstride, out.cstride*2};
+    spec.loopDims.push_back(c);
+    spec.in = im.baseAddress();
+    spec.out = &(out(0, 0, 0, 0));
+    spec.outImag = &(out(0, 0, 0, 1));
+
+    fftwf_plan plan = cachedPlan(spec, im);
+    fftwf_execute_split_dft_r2c(plan, spec.in, spec.out, spec.outImag);
+    return out;
+}
+
 
 void IFFT::help() {
     pprintf("-ifft performs an inverse dft on the current image, whose values are"
             " complex. The input and output are images with 2*c channels, where"
             " channel 2*i is the real part of the i\'th channel, and channel 2*i+1"
-            " is the imaginary part of the i'th channel.\n"
+            " is the imaginary part of the i'th channel. The optional first argument"
+            " restricts the transform to some of the dimensions x, y, and t.\n"
+            "\n"
+            "If the argument real is given, the input is taken to be the half"
+            " spectrum produced by -fft real, and the output is the real image with"
+            " c channels. The length of the halved dimension can't be recovered"
+            " from the spectrum, so it is assumed to be even unless given as an"
+            " additional argument.\n"
             "\n"
-            "Usage: ImageStack -load a.tga -fftcomplex -save freq.tga\n\n");
+            "Usage: ImageStack -load a.tga -fftcomplex -save freq.tga\n"
+            "       ImageStack -load a.jpg -fft real -ifft real 641 -save a2.jpg\n\n");
 }
 
 bool IFFT::test() {
@@ -289,13 +571,21 @@ bool IFFT::test() {
 }
 
 void IFFT::parse(vector<string> args) {
-    assert(args.size() < 2, "-ifft takes zero or one argument\n");
-
-    bool x = true, y = true, t = true;
-    if (args.size() == 1) {
+    assert(args.size() < 4, "-ifft takes at most three arguments\n");
+
+    bool x = true, y = true, t = true, real = false;
+    int size = 0;
+    for (size_t a = 0; a < args.size(); a++) {
+        if (args[a] == "real") {
+            real = true;
+            if (a + 1 < args.size()) {
+                size = readInt(args[++a]);
+            }
+            continue;
+        }
         x = y = t = false;
-        for (size_t i = 0; i < args[0].size(); i++) {
-            switch (args[0][i]) {
+        for (size_t i = 0; i < args[a].size(); i++) {
+            switch (args[a][i]) {
             case 'x':
                 x = true;
                 break;
@@ -306,13 +596,31 @@ void IFFT::parse(vector<string> args) {
                 t = true;
                 break;
             default:
-                panic("Unknown dimension: %c\n", args[0][i]);
+                panic("Unknown dimension: %c\n", args[a][i]);
                 break;
             }
         }
     }
 
-    apply(stack(0), x, y, t);
+    if (!real) {
+        apply(stack(0), x, y, t);
+        return;
+    }
+
+    // Work out the size of the real image. Only the halved dimension
+    // is ambiguous, and we assume it was even unless told otherwise.
+    Image im = stack(0);
+    int dims[] = {im.width, im.height, im.frames};
+    if (im.width == 1) { x = false; }
+    if (im.height == 1) { y = false; }
+    if (im.frames == 1) { t = false; }
+    if (x || y || t) {
+        int d = halvedDimension(x, y);
+        dims[d] = size ? size : (dims[d]-1)*2;
+    }
+    im = applyReal(im, dims[0], dims[1], dims[2], x, y, t);
+    pop();
+    push(im);
 }
 
 
@@ -320,6 +628,187 @@ void IFFT::apply(Image im, bool x, bool y, bool t) {
     FFT::apply(im, x, y, t, true);
 }
 
+Image IFFT::applyReal(Image im, int width, int height, int frames,
+                      bool transformX, bool transformY, bool transformT) {
+    assert(im.channels % 2 == 0, "-ifft requires an image with an even number of channels\n");
+
+    if (width == 1) { transformX = false; }
+    if (height == 1) { transformY = false; }
+    if (frames == 1) { transformT = false; }
+
+    int size[] = {width, height, frames};
+    int spectrumSize[] = {width, height, frames};
+    if (transformX || transformY || transformT) {
+        int d = halvedDimension(transformX, transformY);
+        spectrumSize[d] = size[d]/2 + 1;
+    }
+    assert(im.width == spectrumSize[0] &&
+           im.height == spectrumSize[1] &&
+           im.frames == spectrumSize[2],
+           "A %dx%dx%d spectrum can't be the transform of a real %dx%dx%d image\n",
+           im.width, im.height, im.frames, width, height, frames);
+
+    Image out(width, height, frames, im.channels/2);
+
+    // rank 0
+    if (!transformX && !transformY && !transformT) {
+        for (int c = 0; c < out.channels; c++) {
+            out.channel(c).set(im.channel(c*2));
+        }
+        return out;
+    }
+
+    PlanSpec spec(C2RPlan);
+    addDims(spec, width, height, frames, im, out,
+            transformX, transformY, transformT);
+    fftwf_iodim c = {out.channels, im.cstride*2, out.cstride};
+    spec.loopDims.push_back(c);
+    spec.in = &(im(0, 0, 0, 0));
+    spec.inImag = &(im(0, 0, 0, 1));
+    spec.out = out.baseAddress();
+
+    fftwf_plan plan = cachedPlan(spec, im);
+    fftwf_execute_split_dft_c2r(plan, spec.in, spec.inImag, spec.out);
+
+    float m = 1.0;
+    if (transformX) m *= width;
+    if (transformY) m *= height;
+    if (transformT) m *= frames;
+    out /= m;
+    return out;
+}
+
+void FFTWPlanning::help() {
+    pprintf("-fftwplanning sets how hard FFTW should work to find a fast way to"
+            " compute each transform used by -fft, -ifft, -dct, -fftconvolve,"
+            " -fftpoisson, -deconvolve, and related operations. The options are"
+            " estimate, measure, patient, and exhaustive. Plans are cached and"
+            " reused for every later transform with the same layout, so the more"
+            " careful settings pay off in long-running jobs that transform many"
+            " images of the same size. The default is estimate.\n"
+            "\n"
+            "Usage: ImageStack -fftwplanning measure -load a.jpg -load b.jpg\n"
+            "                  -fftconvolve zero -save out.jpg\n");
+}
+
+bool FFTWPlanning::test() {
+    Image a(96, 80, 2, 2);
+    Noise::apply(a, 0, 1);
+    Image b = a.copy();
+    unsigned oldEffort = FFT::planningEffort;
+
+    // A measured plan gives the same answer, and making it doesn't
+    // clobber the input.
+    FFT::apply(a);
+    FFT::planningEffort = FFTW_MEASURE;
+    FFT::apply(b);
+    FFT::planningEffort = oldEffort;
+    if (!nearlyEqual(a, b)) return false;
+
+    // Run the cached plans again
+    FFT::apply(a);
+    FFT::planningEffort = FFTW_MEASURE;
+    FFT::apply(b);
+    FFT::planningEffort = oldEffort;
+    return nearlyEqual(a, b);
+}
+
+void FFTWPlanning::parse(vector<string> args) {
+    assert(args.size() == 1, "-fftwplanning takes one argument\n");
+    if (args[0] == "estimate") {
+        FFT::planningEffort = FFTW_ESTIMATE;
+    } else if (args[0] == "measure") {
+        FFT::planningEffort = FFTW_MEASURE;
+    } else if (args[0] == "patient") {
+        FFT::planningEffort = FFTW_PATIENT;
+    } else if (args[0] == "exhaustive") {
+        FFT::planningEffort = FFTW_EXHAUSTIVE;
+    } else {
+        panic("Unknown planning effort: %s\n", args[0].c_str());
+    }
+}
+
+void FFTWThreads::help() {
+    pprintf("-fftwthreads sets how many threads each FFTW transform may use. This"
+            " only helps with large transforms, and only affects plans made after"
+            " it is set. The default is one, because several operations already"
+            " run many transforms at once on different threads.\n"
+            "\n"
+            "Usage: ImageStack -fftwthreads 4 -load a.jpg -fft -save freq.tmp\n");
+}
+
+bool FFTWThreads::test() {
+    Image a(128, 96, 1, 2);
+    Noise::apply(a, 0, 1);
+    Image b = a.copy();
+    int oldThreads = FFT::planningThreads;
+    FFT::apply(a);
+    FFT::planningThreads = 2;
+    FFT::apply(b);
+    FFT::planningThreads = oldThreads;
+    return nearlyEqual(a, b);
+}
+
+void FFTWThreads::parse(vector<string> args) {
+    assert(args.size() == 1, "-fftwthreads takes one argument\n");
+    int threads = readInt(args[0]);
+    assert(threads > 0, "-fftwthreads needs a positive number of threads\n");
+    #ifdef NO_FFTW_THREADS
+    if (threads > 1) {
+        printf("Warning: This version of ImageStack was compiled without threaded FFTW,"
+               " so each transform will use one thread.\n");
+    }
+    #else
+    FFT::planningThreads = threads;
+    #endif
+}
+
+void FFTWWisdom::help() {
+    pprintf("-fftwwisdom loads FFTW's accumulated knowledge of how best to"
+            " compute transforms from a file, if it exists, and saves it back to"
+            " the same file whenever a new plan is made with a planning effort"
+            " other than estimate. This lets the cost of -fftwplanning measure or"
+            " patient be paid once rather than on every run.\n"
+            "\n"
+            "Usage: ImageStack -fftwwisdom ~/.fftw_wisdom -fftwplanning patient\n"
+            "                  -load a.jpg -load b.jpg -fftconvolve zero -save out.jpg\n");
+}
+
+bool FFTWWisdom::test() {
+    string oldFile = FFT::wisdomFile;
+    unsigned oldEffort = FFT::planningEffort;
+    const char *filename = "fftwwisdom.tmp";
+    remove(filename);
+
+    FFT::wisdomFile = filename;
+    FFT::planningEffort = FFTW_MEASURE;
+    Image a(90, 70, 1, 2);
+    Noise::apply(a, 0, 1);
+    FFT::apply(a);
+    FFT::wisdomFile = oldFile;
+    FFT::planningEffort = oldEffort;
+
+    // The wisdom should have been saved, and should load again
+    FILE *f = fopen(filename, "r");
+    if (!f) return false;
+    int ok = fftwf_import_wisdom_from_file(f);
+    fclose(f);
+    remove(filename);
+    return ok != 0;
+}
+
+void FFTWWisdom::parse(vector<string> args) {
+    assert(args.size() == 1, "-fftwwisdom takes one argument\n");
+    FFT::wisdomFile = args[0];
+    FILE *f = fopen(args[0].c_str(), "r");
+    if (!f) { return; }
+    int ok = fftwf_import_wisdom_from_file(f);
+    fclose(f);
+    if (!ok) {
+        printf("Warning: Could not read FFTW wisdom from %s\n", args[0].c_str());
+    }
+}
+
 void FFTConvolve::help() {
     pprintf("-fftconvolve performs convolution in Fourier space. It is much faster"
             " than -convolve for large kernels. The two arguments are the boundary"
@@ -352,6 +841,62 @@ bool FFTConvolve::test() {
     return true;
 }
 
+int FFTConvolve::blockSize = 0;
+
+void FFTBlockSize::help() {
+    pprintf("-fftblocksize sets the size of the blocks -fftconvolve splits large"
+            " images into. Each block is padded by the filter radius, transformed,"
+            " and multiplied by the transform of the filter, which is only computed"
+            " once. Blocks are processed in parallel, so memory use depends on the"
+            " block size and the number of threads rather than the size of the"
+            " image. Sizes are rounded up to a product of powers of 2, 3, and 5,"
+            " to at least 16, and to at least four times the filter radius, so"
+            " blocks are always larger than the filter. A size larger than the"
+            " image transforms it in one piece. The default of zero picks a size"
+            " from the filter.\n"
+            "\n"
+            "Usage: ImageStack -fftblocksize 512 -load filter.tmp -load big.tif\n"
+            "                  -fftconvolve zero -save out.tif\n");
+}
+
+bool FFTBlockSize::test() {
+    Image im(61, 47, 3, 1);
+    Noise::apply(im, 0, 1);
+    int oldSize = FFTConvolve::blockSize;
+
+    // Try filters that do and don't reach across frames, with blocks
+    // that divide the image unevenly
+    for (int frames = 1; frames <= 3; frames += 2) {
+        Image kernel(5, 7, frames, 1);
+        Noise::apply(kernel, 0, 1);
+        kernel(0, 0, 0, 0) = 17;
+        Convolve::BoundaryCondition b[] = {Convolve::Clamp, Convolve::Wrap, Convolve::Zero, Convolve::Homogeneous};
+        for (int i = 0; i < 4; i++) {
+            Image a = Convolve::apply(im, kernel, b[i], Multiply::Outer);
+            // Sizes below the minimum are raised to it
+            int sizes[] = {16, 1};
+            for (int j = 0; j < 2; j++) {
+                FFTConvolve::blockSize = sizes[j];
+                Image fa = FFTConvolve::apply(im, kernel, b[i], Multiply::Outer);
+                FFTConvolve::blockSize = oldSize;
+                if (!nearlyEqual(a, fa)) return false;
+            }
+        }
+    }
+
+    // A filter that doesn't reach across frames should have them
+    // transformed one at a time
+    BlockLayout t = blockLayout(im.frames, 0, Convolve::Zero, 1);
+    return t.block == 1 && t.step == 1 && t.count == im.frames;
+}
+
+void FFTBlockSize::parse(vector<string> args) {
+    assert(args.size() == 1, "-fftblocksize takes one argument\n");
+    int size = readInt(args[0]);
+    assert(size >= 0, "-fftblocksize needs a positive size, or zero for automatic\n");
+    FFTConvolve::blockSize = size;
+}
+
 void FFTConvolve::parse(vector<string> args) {
     Multiply::Mode m = Multiply::Outer;
     Convolve::BoundaryCondition b = Convolve::Wrap;
@@ -447,73 +992,77 @@ void FFTConvolve::convolveSingle(Image im, Image filter, Image out, Convolve::Bo
            filter.frames % 2 == 1,
            "The filter must have odd dimensions\n");
 
-    int xPad = filter.width/2;
-    int yPad = filter.height/2;
-    int tPad = filter.frames/2;
-
-    if (b == Convolve::Wrap) {
-        xPad = yPad = tPad = 0;
-    }
-
-    Image weightT;
-
-    Image imT = Image(im.width+xPad*2, im.height+yPad*2, im.frames+tPad*2, 2);
-
-    //printf("1\n"); fflush(stdout);
-    // 1) Make the padded complex image
-    if (b == Convolve::Clamp) {
-        for (int t = 0; t < imT.frames; t++) {
-            int st = clamp(t-tPad, 0, im.frames-1);
-            for (int y = 0; y < imT.height; y++) {
-                int sy = clamp(y-yPad, 0, im.height-1);
-                for (int x = 0; x < imT.width; x++) {
-                    int sx = clamp(x-xPad, 0, im.width-1);
-                    imT(x, y, t, 0) = im(sx, sy, st, 0);
+    // We use overlap-save: the output is computed in tiles, each by a
+    // circular convolution of a block of the (virtually) padded input
+    // big enough that the wrap-around only corrupts its margins. Small
+    // images are a single tile. Frames are only tiled when the filter
+    // doesn't reach across them, and then one at a time. Blocks in x
+    // and y are kept from being so small that the per-block overhead
+    // dominates.
+    int size = blockSize > 0 ? max(blockSize, 16) : 0;
+    BlockLayout x = blockLayout(im.width, filter.width/2, b, size);
+    BlockLayout y = blockLayout(im.height, filter.height/2, b, size);
+    BlockLayout t = blockLayout(im.frames, filter.frames/2, b,
+                                filter.frames == 1 ? 1 : 0x7fffffff);
+
+    // 1) Make and transform a padded filter the size of one block. It's
+    // real, so we only need half the spectrum.
+    Image filterF;
+    {
+        Image filterT(x.block, y.block, t.block, 1);
+        for (int ft = 0; ft < filter.frames; ft++) {
+            int bt = ft - filter.frames/2;
+            if (bt < 0) bt += filterT.frames;
+            for (int fy = 0; fy < filter.height; fy++) {
+                int by = fy - filter.height/2;
+                if (by < 0) by += filterT.height;
+                for (int fx = 0; fx < filter.width; fx++) {
+                    int bx = fx - filter.width/2;
+                    if (bx < 0) bx += filterT.width;
+                    filterT(bx, by, bt, 0) = filter(fx, fy, ft, 0);
                 }
             }
         }
-    } else { // Zero or Wrap
-        imT.region(xPad, yPad, tPad, 0,
-                   im.width, im.height, im.frames, 1).set(im);
-    }
-
-    //printf("2\n"); fflush(stdout);
-    // 2) Transform the padded image
-    FFT::apply(imT);
-
-    //printf("3\n"); fflush(stdout);
-    // 3) Make a padded complex filter of the same size
-    Image filterT(imT.width, imT.height, imT.frames, 2);
-    for (int t = 0; t < filter.frames; t++) {
-        int ft = t - filter.frames/2;
-        if (ft < 0) ft += filterT.frames;
-        for (int y = 0; y < filter.height; y++) {
-            int fy = y - filter.height/2;
-            if (fy < 0) fy += filterT.height;
-            for (int x = 0; x < filter.width; x++) {
-                int fx = x - filter.width/2;
-                if (fx < 0) fx += filterT.width;
-                filterT(fx, fy, ft, 0) = filter(x, y, t, 0);
-            }
-        }
+        filterF = FFT::applyReal(filterT);
     }
 
-    //printf("4\n"); fflush(stdout);
-    // 4) Transform the padded filter
-    FFT::apply(filterT);
-
-    //printf("5\n"); fflush(stdout);
-    // 5) Multiply the two into a padded complex transformed result
-    ComplexMultiply::apply(imT, filterT);
+    // 2) Convolve each tile
+    int tiles = x.count * y.count * t.count;
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if (tiles > 1)
+    #endif
+    for (int i = 0; i < tiles; i++) {
+        int ox = (i % x.count) * x.step;
+        int oy = ((i / x.count) % y.count) * y.step;
+        int ot = (i / (x.count * y.count)) * t.step;
+
+        // Read the padded input for this block
+        Image block(x.block, y.block, t.block, 1);
+        for (int bt = 0; bt < block.frames; bt++) {
+            int st = boundaryIndex(ot - t.pad + bt, im.frames, b);
+            if (st < 0) continue;
+            for (int by = 0; by < block.height; by++) {
+                int sy = boundaryIndex(oy - y.pad + by, im.height, b);
+                if (sy < 0) continue;
+                for (int bx = 0; bx < block.width; bx++) {
+                    int sx = boundaryIndex(ox - x.pad + bx, im.width, b);
+                    if (sx < 0) continue;
+                    block(bx, by, bt, 0) = im(sx, sy, st, 0);
+                }
+            }
+        }
 
-    //printf("6\n"); fflush(stdout);
-    // 6) Inverse transorm the result
-    IFFT::apply(imT);
+        Image blockF = FFT::applyReal(block);
+        ComplexMultiply::apply(blockF, filterF);
+        block = IFFT::applyReal(blockF, block.width, block.height, block.frames);
 
-    //printf("7\n"); fflush(stdout);
-    // 7) Remove the padding, and convert back to real numbers
-    out += imT.region(xPad, yPad, tPad, 0,
-                      im.width, im.height, im.frames, 1);
+        // Keep the part untouched by the wrap-around
+        int w = min(x.step, im.width - ox);
+        int h = min(y.step, im.height - oy);
+        int f = min(t.step, im.frames - ot);
+        out.region(ox, oy, ot, 0, w, h, f, 1) +=
+            block.region(x.pad, y.pad, t.pad, 0, w, h, f, 1);
+    }
 }
 
 
@@ -594,11 +1143,8 @@ Image FFTPoisson::apply(Image dx, Image dy, Image target, float targetStrength)
         ftLapY(0, y) = -4.0f + (2.0f * cos((M_PI * y) / (dx.height - 1)));
     }
 
-    // Create a DCT-I plan, which is its own inverse.
-    fftwf_plan fftPlan;
-    fftPlan = fftwf_plan_r2r_2d(dx.height, dx.width,
-                                &fftBuff(0, 0), &fftBuff(0, 0),
-                                FFTW_REDFT00, FFTW_REDFT00, FFTW_ESTIMATE);
+    // Get a DCT-I plan, which is its own inverse.
+    fftwf_plan fftPlan = dctPlan(fftBuff, true, true, false);
 
     Image out(dx.width, dx.height, dx.frames, dx.channels);
 
@@ -656,7 +1202,7 @@ Image FFTPoisson::apply(Image dx, Image dy, Image target, float targetStrength)
             }
 
             // transform h_hat to H_hat by taking the DCT of h_hat
-            fftwf_execute(fftPlan);
+            fftwf_execute_r2r(fftPlan, &fftBuff(0, 0), &fftBuff(0, 0));
 
             // compute F_hat using H_hat (see equation 29 in the paper)
             for (int y = 0; y < dx.height; y++) {
@@ -669,7 +1215,7 @@ Image FFTPoisson::apply(Image dx, Image dy, Image target, float targetStrength)
             fftBuff(0, 0) = dcSum;
 
             // transform F_hat to f_hat by taking the inverse DCT of F_hat
-            fftwf_execute(fftPlan);
+            fftwf_execute_r2r(fftPlan, &fftBuff(0, 0), &fftBuff(0, 0));
 
             float fftMult = 1.0f / (4.0f * (dx.width-1) * (dx.height-1));
 
@@ -682,8 +1228,6 @@ Image FFTPoisson::apply(Image dx, Image dy, Image target, float targetStrength)
         }
     }
 
-    fftwf_destroy_plan(fftPlan);
-
     return out;
 
 }
@@ -20,6 +20,22 @@ public:
     bool test();
     void parse(vector<string> args);
     static void apply(Image im, bool x = true, bool y = true, bool t = true, bool inverse = false);
+
+    // Transform a real image, returning only the half of the spectrum
+    // that isn't redundant, laid out as complex channels like the
+    // output of apply. The first transformed dimension longer than one
+    // (usually x) is the one halved, to size/2+1.
+    static Image applyReal(Image im, bool x = true, bool y = true, bool t = true);
+
+    // The most recently used FFTW plans are cached and reused, so
+    // these only affect plans for layouts not seen lately. The
+    // effort is one of FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, or
+    // FFTW_EXHAUSTIVE. If wisdomFile is set, the wisdom is saved there
+    // whenever a new plan is measured. Set with -fftwplanning,
+    // -fftwthreads, and -fftwwisdom.
+    static unsigned planningEffort;
+    static int planningThreads;
+    static string wisdomFile;
 };
 
 class IFFT : public Operation {
@@ -28,6 +44,34 @@ public:
     bool test();
     void parse(vector<string> args);
     static void apply(Image im, bool x = true, bool y = true, bool t = true);
+
+    // The inverse of FFT::applyReal. The width, height, and frames
+    // are the size of the real image to produce, which tells us
+    // whether the halved dimension was odd or even. The spectrum is
+    // overwritten.
+    static Image applyReal(Image im, int width, int height, int frames,
+                           bool x = true, bool y = true, bool t = true);
+};
+
+class FFTWPlanning : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+class FFTWThreads : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+class FFTWWisdom : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
 };
 
 class FFTConvolve : public Operation {
@@ -36,10 +80,25 @@ public:
     bool test();
     void parse(vector<string> args);
     static Image apply(Image im, Image filter, Convolve::BoundaryCondition b, Multiply::Mode m);
+
+    // Large images are convolved in tiles, so that memory use is
+    // bounded and each transform fits in cache. This is the width and
+    // height of the blocks transformed, before rounding up to a size
+    // FFTW likes, and to at least 16 and four times the filter
+    // radius. Zero picks one from the filter size. Set with
+    // -fftblocksize.
+    static int blockSize;
 private:
     static void convolveSingle(Image im, Image filter, Image out, Convolve::BoundaryCondition b);
 };
 
+class FFTBlockSize : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
 class FFTPoisson : public Operation {
 public:
     void help();
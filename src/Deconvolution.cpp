@@ -25,6 +25,10 @@ void Deconvolve::help() {
             " \"levin\" takes an additional argument to specify the weight given to"
             " the prior.\n"
             "\n"
+            "Every frame of the image is deconvolved by the same kernel. Anything"
+            " that depends only on the kernel is computed once, and frames are"
+            " processed in parallel.\n"
+            "\n"
             "Usage: ImageStack -load blurred -load kernel -deconvolve cho\n");
 
 }
@@ -58,9 +62,24 @@ bool Deconvolve::test() {
            shanStats.mean(), shanStats.variance(),
            choStats.mean(), choStats.variance(),
            levinStats.mean(), levinStats.variance());
-    return (nearlyEqual(shanResult, input) &&
-            nearlyEqual(choResult, input) &&
-            nearlyEqual(levinResult, input));
+    if (!(nearlyEqual(shanResult, input) &&
+          nearlyEqual(choResult, input) &&
+          nearlyEqual(levinResult, input))) return false;
+
+    // Deconvolving a burst should match deconvolving each frame
+    Image burst(blurry.width, blurry.height, 3, blurry.channels);
+    for (int t = 0; t < burst.frames; t++) {
+        burst.frame(t).set(blurry * (t + 1));
+    }
+    Image choBurst = Deconvolve::applyCho2009(burst, kernel);
+    Image levinBurst = Deconvolve::applyLevin2007(burst, kernel, 0.02);
+    for (int t = 0; t < burst.frames; t++) {
+        if (!nearlyEqual(choBurst.frame(t), choResult * (t + 1))) return false;
+        if (!nearlyEqual(levinBurst.frame(t), Deconvolve::applyLevin2007(burst.frame(t), kernel, 0.02))) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Deconvolve::parse(vector<string> args) {
@@ -81,29 +100,93 @@ void Deconvolve::parse(vector<string> args) {
     }
 }
 
+// The Fourier-domain terms of Shan et al. that depend only on the
+// kernel and the padded size, shared by every channel and frame.
+struct Deconvolve::ShanSpectra {
+    Image FDeriv[6];       // F(deriv_i)^T
+    Image numeratorFilter; // sum w_i F(K)^T |F(deriv_i)|^2
+    Image denominatorBase; // sum w_i |F(K)|^2 |F(deriv_i)|^2
+
+    ShanSpectra(Image K, int width, int height) {
+        Image K_large = KernelEstimation::enlargeKernel(K, width, height);
+        FourierTransform(K_large); // K_large = F(K).
+
+        Image derivWeight(width, height, 1, 1);
+        for (int i = 0; i <= 5; i++) {
+            float w_i;
+            FDeriv[i] = Image(width, height, 1, 2);
+            switch (i) {
+            case 0: // Original
+                w_i = 50.f;
+                FDeriv[i](0, 0) = 1.f; break;
+            case 1: // dx
+                w_i = 25.f;
+                FDeriv[i](0, 0) = -1.f;
+                FDeriv[i](1, 0) = 1.f; break;
+            case 2: // dxx
+                w_i = 12.5f;
+                FDeriv[i](0, 0) = 1.f;
+                FDeriv[i](1, 0) = -2.f;
+                FDeriv[i](2, 0) = 1.f; break;
+            case 3: // dy
+                w_i = 25.f;
+                FDeriv[i](0, 0) = -1.f;
+                FDeriv[i](0, 1) = 1.f; break;
+            case 4: // dyy
+                w_i = 12.5f;
+                FDeriv[i](0, 0) = 1.f;
+                FDeriv[i](0, 1) = -2.f;
+                FDeriv[i](0, 2) = 1.f; break;
+            case 5: // dxy
+                w_i = 12.5f;
+                FDeriv[i](0, 0) = 1.f;
+                FDeriv[i](1, 0) = -1;
+                FDeriv[i](0, 1) = -1;
+                FDeriv[i](1, 1) = 1; break;
+            }
+            FourierTransform(FDeriv[i]);
+            ComplexConjugate::apply(FDeriv[i]); // FDeriv[i] = F(deriv_i)^T
+            derivWeight += w_i * Expr::norm(Expr::complexChannel(FDeriv[i]));
+        }
+
+        auto FK = Expr::complexChannel(K_large);
+        numeratorFilter = Image(width, height, 1, 2);
+        Expr::setComplex(numeratorFilter, Expr::conj(FK) * derivWeight);
+        denominatorBase = Expr::norm(FK) * derivWeight;
+    }
+};
+
 Image Deconvolve::applyShan2008(Image B, Image K) {
     assert(K.channels == 1 && K.frames == 1,
            "The kernel must have one channel and one frame\n");
     assert(K.width % 2 == 1 && K.height % 2 == 1,
            "The kernel dimensions must be odd.\n");
 
-    // Prepare constants and images.
-    if (B.channels > 1 || B.frames > 1) {
-        Image result(B.width, B.height, B.frames, B.channels);
-        for (int c = 0; c < B.channels; c++) {
-            for (int t = 0; t < B.frames; t++) {
-                Image tmp = applyShan2008(B.channel(c).frame(t), K);
-                result.channel(c).frame(t).set(tmp);
-            }
-        }
-        return result;
+    int alpha, x_padding, y_padding;
+    paddingFor(B.width, B.height, &alpha, &x_padding, &y_padding);
+    ShanSpectra spectra(K, B.width + x_padding, B.height + y_padding);
+
+    // Each channel of each frame is deconvolved independently, so
+    // run them concurrently. Only the planes in flight need scratch
+    // space.
+    Image result(B.width, B.height, B.frames, B.channels);
+    const int planes = B.channels * B.frames;
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if (planes > 1)
+    #endif
+    for (int p = 0; p < planes; p++) {
+        int c = p % B.channels, t = p / B.channels;
+        result.channel(c).frame(t).set(applyShan2008(B.channel(c).frame(t), K, spectra));
     }
+    return result;
+}
+
+Image Deconvolve::applyShan2008(Image B, Image K, const ShanSpectra &spectra) {
     Image B_large = applyPadding(B);
-    Image K_large = KernelEstimation::enlargeKernel(K, B_large.width, B_large.height);
     Image smoothness_map;
     const int x_padding = (B_large.width - B.width) / 2;
     const int y_padding = (B_large.height - B.height) / 2;
-
+    const Image *FDeriv = spectra.FDeriv;
 
     // Compute the smoothness map.
     {
@@ -114,14 +197,9 @@ Image Deconvolve::applyShan2008(Image B, Image K) {
         smoothness_map = mean*mean - variance;
         Threshold::apply(smoothness_map, -25.0f / (256.f * 256.f));
         smoothness_map = Crop::apply(smoothness_map, -x_padding, -y_padding, 0, B_large.width, B_large.height, 1);
-        Save::apply(smoothness_map, "smoothness_map.tmp");
     }
 
     // Prepare Fourier domain stuff.
-    FourierTransform(K_large); // K_large = F(K).
-    Image FK2 = K_large.copy(); // FK2 = F(K).
-    ComplexConjugate::apply(K_large); // K_large = F(K)^T.
-    ComplexMultiply::apply(FK2, K_large, false); // FK2 = |F(K)|^2.
     B_large = RealComplex::apply(B_large);
     FourierTransform(B_large);
 
@@ -132,55 +210,12 @@ Image Deconvolve::applyShan2008(Image B, Image K) {
     //   + lambda_1 | non-linear prior on Psi_x, Psi_y |
     float lambda_1 = 0.1f, lambda_2 = 15.f;
 
+    // The parts of N and D below that don't depend on L or Psi:
+    //   sum w_i F(K)^T |F(deriv_i)|^2 F(I), and sum w_i |F(K)|^2 |F(deriv_i)|^2
     Image numerator_base(B_large.width, B_large.height, 1, 2);
-    Image denominator_base(B_large.width, B_large.height, 1, 2);
-
-    Image FDeriv[6];
-    for (int i = 0; i <= 5; i++) {
-        float w_i;
-        FDeriv[i] = Image(B_large.width, B_large.height, 1, 2);
-        switch (i) {
-        case 0: // Original
-            w_i = 50.f;
-            FDeriv[i](0, 0) = 1.f; break;
-        case 1: // dx
-            w_i = 25.f;
-            FDeriv[i](0, 0) = -1.f;
-            FDeriv[i](1, 0) = 1.f; break;
-        case 2: // dxx
-            w_i = 12.5f;
-            FDeriv[i](0, 0) = 1.f;
-            FDeriv[i](1, 0) = -2.f;
-            FDeriv[i](2, 0) = 1.f; break;
-        case 3: // dy
-            w_i = 25.f;
-            FDeriv[i](0, 0) = -1.f;
-            FDeriv[i](0, 1) = 1.f; break;
-        case 4: // dyy
-            w_i = 12.5f;
-            FDeriv[i](0, 0) = 1.f;
-            FDeriv[i](0, 1) = -2.f;
-            FDeriv[i](0, 2) = 1.f; break;
-        case 5: // dxy
-            w_i = 12.5f;
-            FDeriv[i](0, 0) = 1.f;
-            FDeriv[i](1, 0) = -1;
-            FDeriv[i](0, 1) = -1;
-            FDeriv[i](1, 1) = 1; break;
-        }
-        FourierTransform(FDeriv[i]);
-        Image tmp = FDeriv[i].copy();
-        ComplexConjugate::apply(FDeriv[i]); // FDeriv[i] = F(deriv_i)^T
-        ComplexMultiply::apply(tmp, FDeriv[i], false); // tmp = |F(deriv_i)|^2
-        Image tmq = tmp.copy();
-        ComplexMultiply::apply(tmp, FK2, false); // tmp = |F(K)|^2 |F(deriv_i)|^2
-        ComplexMultiply::apply(tmq, K_large, false); // tmq = F(K)^T |F(deriv_i)|^2
-        ComplexMultiply::apply(tmq, B_large, false); // tmq = F(K)^T |F(deriv_i)|^2 F(I)
-        tmp *= w_i;
-        tmq *= w_i;
-        denominator_base += tmp;
-        numerator_base += tmq;
-    }
+    Expr::setComplex(numerator_base, Expr::complexChannel(spectra.numeratorFilter) *
+                     Expr::complexChannel(B_large));
+    Image denominator_base = spectra.denominatorBase;
 
     Image dIdx = Convolve::apply(B_large, Crop::apply(FDeriv[1], -1, 0, 3, 1), Convolve::Wrap);
     Image dIdy = Convolve::apply(B_large, Crop::apply(FDeriv[3], 0, -1, 1, 3), Convolve::Wrap);
@@ -363,23 +398,16 @@ Image Deconvolve::applyShan2008(Image B, Image K) {
         //   N = sum w_i F(K)^T |F(deriv_i)|^2 F(I) + gamma (F(deriv_x)^T F(Psi_x) +  ... )
         //   D = sum w_i |F(K)|^2 |F(deriv_i)|^2  + gamma |F(deriv_x)|^2 + |F(deriv_y)|^2
         // Note that the first term of N and D are independent of L or Psi or gamma.
-        Image denominator = denominator_base.copy();
-        Image numerator = numerator_base.copy();
-        // Append the variable terms.
-        for (int y = 0; y < B_large.height; y++)
-            for (int x = 0; x < B_large.width; x++) {
-                denominator(x, y) += gamma * (FDeriv[1](x, y, 0) * FDeriv[1](x, y, 0) +
-                                              FDeriv[1](x, y, 1) * FDeriv[1](x, y, 1));
-                denominator(x, y) += gamma * (FDeriv[3](x, y, 0) * FDeriv[3](x, y, 0) +
-                                              FDeriv[3](x, y, 1) * FDeriv[3](x, y, 1));
-                numerator(x, y) += gamma * (FDeriv[1](x, y, 0) * FPsi_x(x, y, 0) +
-                                            FDeriv[1](x, y, 1) * FPsi_x(x, y, 1));
-                numerator(x, y) += gamma * (FDeriv[3](x, y, 0) * FPsi_y(x, y, 0) +
-                                            FDeriv[3](x, y, 1) * FPsi_y(x, y, 1));
-            }
-        ComplexDivide::apply(numerator, denominator, false);
-        InverseFourierTransform(numerator);
-        L = ComplexReal::apply(numerator);
+        // Append the variable terms and divide, all in one pass.
+        auto FDx = Expr::complexChannel(FDeriv[1]), FDy = Expr::complexChannel(FDeriv[3]);
+        auto FPx = Expr::complexChannel(FPsi_x), FPy = Expr::complexChannel(FPsi_y);
+        Image FL(B_large.width, B_large.height, 1, 2);
+        Expr::setComplex(FL, (Expr::complexChannel(numerator_base) +
+                              gamma * (Expr::real(FDx * Expr::conj(FPx)) +
+                                       Expr::real(FDy * Expr::conj(FPy)))) /
+                         (denominator_base + gamma * (Expr::norm(FDx) + Expr::norm(FDy))));
+        InverseFourierTransform(FL);
+        L = ComplexReal::apply(FL);
 
         /*
         char filename_c[20];
@@ -402,15 +430,20 @@ Image Deconvolve::applyShan2008(Image B, Image K) {
  * A poor man's version of "Reducing Boundary Artifacts in Image Deconvolution" (ICCP 2008)
  * by Liu and Jia.
  */
+void Deconvolve::paddingFor(int width, int height, int *alpha, int *x_padding, int *y_padding) {
+    *alpha = 1;
+    if (width / 3 < *alpha) *alpha = width / 3;
+    if (height / 3 < *alpha) *alpha = height / 3;
+    *x_padding = width / 2;
+    *y_padding = height / 2;
+    if (*x_padding < *alpha * 3) *x_padding = *alpha * 3;
+    if (*y_padding < *alpha * 3) *y_padding = *alpha * 3;
+}
+
 Image Deconvolve::applyPadding(Image B) {
     // Calculate the margin size.
-    int alpha = 1;
-    if (B.width / 3 < alpha) alpha = B.width / 3;
-    if (B.height / 3 < alpha) alpha = B.height / 3;
-    int x_padding = B.width / 2;
-    int y_padding = B.height / 2;
-    if (x_padding < alpha * 3) x_padding = alpha * 3;
-    if (y_padding < alpha * 3) y_padding = alpha * 3;
+    int alpha, x_padding, y_padding;
+    paddingFor(B.width, B.height, &alpha, &x_padding, &y_padding);
 
     // Prepare the enlarged canvas.
     vector<float> prev(B.channels);
@@ -502,9 +535,8 @@ Image Deconvolve::applyPadding(Image B) {
 Image Deconvolve::applyCho2009(Image blurred, Image kernel) {
     assert(kernel.width % 2 == 1 && kernel.height % 2 ==1,
            "The kernel dimensions must be odd.\n");
-    assert(kernel.channels == 1 && kernel.frames == 1 && blurred.frames == 1,
-           "The kernel must be single-channel, and both the kernel and blurred\n"
-           "image must be single-framed.\n");
+    assert(kernel.channels == 1 && kernel.frames == 1,
+           "The kernel must be single-channel and single-framed.\n");
 
     // omega_* = 50 / (2^q) where q is the order of the derivative, alpha = 0.1
     // want to minimize w.r.t. L:
@@ -517,136 +549,146 @@ Image Deconvolve::applyCho2009(Image blurred, Image kernel) {
     // F(L) = F(K)^T F(B) sum_i w_i |F(deriv_i)|^2  divided by
     //          |F(K)|^2 sum_i w_i |F(deriv_i)|^2  + alpha (|F(dx)|^2+|F(dy)|^2)
 
-    Image B  = applyPadding(blurred);
-    //FileTMP::save(B, std::string("padded.tmp"), "float");
+    int alpha_padding, x_padding, y_padding;
+    paddingFor(blurred.width, blurred.height, &alpha_padding, &x_padding, &y_padding);
+    const int width = blurred.width + x_padding, height = blurred.height + y_padding;
 
     float alpha = 1.f; // TODO
-    Image FK = KernelEstimation::enlargeKernel(kernel, B.width, B.height);
-    Image FB = RealComplex::apply(Transpose::apply(B, 'c', 't'));
-    FFT::apply(FK, true, true, false);
-    FFT::apply(FB, true, true, false);
-    Image FK2 = FK.copy();
-    ComplexMultiply::apply(FK2, FK, true);
-    Image SumDeriv(B.width, B.height, 1, 2);
-    Image SumGrad(B.width, B.height, 1, 2);
+    // Everything here is real in the spatial domain, so we only
+    // need to work with half of each spectrum.
+    Image K = KernelEstimation::enlargeKernel(kernel, width, height).channel(0);
+    Image FK = FFT::applyReal(K, true, true, false);
+    Image SumDeriv(FK.width, FK.height, 1, 1);
+    Image SumGrad(FK.width, FK.height, 1, 1);
     for (int i = 0; i <= 5; i++) {
         float w_i;
-        Image FDeriv(B.width, B.height, 1, 2);
+        Image Deriv(width, height, 1, 1);
         switch (i) {
         case 0: // Original
             w_i = 50.f;
-            FDeriv(0, 0) = 1.f; break;
+            Deriv(0, 0) = 1.f; break;
         case 1: // dx
             w_i = 25.f;
-            FDeriv(0, 0) = -1.f;
-            FDeriv(1, 0) = 1.f; break;
+            Deriv(0, 0) = -1.f;
+            Deriv(1, 0) = 1.f; break;
         case 2: // dxx
             w_i = 12.5f;
-            FDeriv(0, 0) = 1.f;
-            FDeriv(1, 0) = -2.f;
-            FDeriv(2, 0) = 1.f; break;
+            Deriv(0, 0) = 1.f;
+            Deriv(1, 0) = -2.f;
+            Deriv(2, 0) = 1.f; break;
         case 3: // dy
             w_i = 25.f;
-            FDeriv(0, 0) = -1.f;
-            FDeriv(0, 1) = 1.f; break;
+            Deriv(0, 0) = -1.f;
+            Deriv(0, 1) = 1.f; break;
         case 4: // dyy
             w_i = 12.5f;
-            FDeriv(0, 0) = 1.f;
-            FDeriv(0, 1) = -2.f;
-            FDeriv(0, 2) = 1.f; break;
+            Deriv(0, 0) = 1.f;
+            Deriv(0, 1) = -2.f;
+            Deriv(0, 2) = 1.f; break;
         case 5: // dxy
             w_i = 12.5f;
-            FDeriv(0, 0) = 1.f;
-            FDeriv(1, 0) = -1;
-            FDeriv(0, 1) = -1;
-            FDeriv(1, 1) = 1; break;
+            Deriv(0, 0) = 1.f;
+            Deriv(1, 0) = -1;
+            Deriv(0, 1) = -1;
+            Deriv(1, 1) = 1; break;
         }
-        FFT::apply(FDeriv, true, true, false);
-        Image FDeriv2 = FDeriv.copy();
-        ComplexMultiply::apply(FDeriv2, FDeriv, true);
+        Image FDeriv2 = Expr::norm(Expr::complexChannel(FFT::applyReal(Deriv, true, true, false)));
         if (i == 1 || i == 3) {
             SumGrad += FDeriv2;
         }
-        FDeriv2 *= w_i;
-        SumDeriv += FDeriv2;
+        SumDeriv += w_i * FDeriv2;
     }
     SumGrad *= alpha;
     // Recall the following:
     // F(L) = F(K)^T F(B) sum_i w_i |F(deriv_i)|^2  divided by
     //          |F(K)|^2 sum_i w_i |F(deriv_i)|^2  + alpha (|F(dx)|^2+|F(dy)|^2)
     // In our diction, we have
-    // FK^T FB SumDeriv / (FK2 SumDeriv + SumGrad)
-    ComplexConjugate::apply(FK);
-    ComplexMultiply::apply(FK, SumDeriv, false);
-    ComplexMultiply::apply(FK2, SumDeriv, false);
-    FK2 += SumGrad;
-    ComplexDivide::apply(FK, FK2, false); // FK contains the running result.
-    for (int t = 0; t < B.channels; t++) {
-        for (int y = 0; y < B.height; y++) {
-            for (int x = 0; x < B.width; x++) {
-                float tmp = FB(x, y, t, 0) * FK(x, y, 0) - FB(x, y, t, 1) * FK(x, y, 1);
-                FB(x, y, t, 1) = FB(x, y, t, 0) * FK(x, y, 1) + FB(x, y, t, 1) * FK(x, y, 0);
-                FB(x, y, t, 0) = tmp;
-            }
+    // FK^T FB SumDeriv / (|FK|^2 SumDeriv + SumGrad)
+    auto zK = Expr::complexChannel(FK);
+    Image filter(FK.width, FK.height, 1, 2);
+    Expr::setComplex(filter, Expr::conj(zK) * SumDeriv / (Expr::norm(zK) * SumDeriv + SumGrad));
+
+    // The filter is shared by every frame, so only the frames in
+    // flight need scratch space.
+    Image result(blurred.width, blurred.height, blurred.frames, blurred.channels);
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if (blurred.frames > 1)
+    #endif
+    for (int t = 0; t < blurred.frames; t++) {
+        Image B = applyPadding(blurred.frame(t));
+        Image FB = FFT::applyReal(Transpose::apply(B, 'c', 't'), true, true, false);
+        for (int c = 0; c < FB.frames; c++) {
+            Image FBc = FB.frame(c);
+            Expr::setComplex(FBc, Expr::complexChannel(FBc) * Expr::complexChannel(filter));
         }
+        Image L = IFFT::applyReal(FB, B.width, B.height, B.channels, true, true, false);
+        result.frame(t).set(Transpose::apply(L, 'c', 't').region((B.width - blurred.width) / 2,
+                                                                 (B.height - blurred.height) / 2, 0, 0,
+                                                                 blurred.width, blurred.height,
+                                                                 1, blurred.channels));
     }
-    IFFT::apply(FB, true, true, false);
-    const int x_padding = (B.width - blurred.width) / 2;
-    const int y_padding = (B.height - blurred.height) / 2;
-    return Crop::apply(Transpose::apply(ComplexReal::apply(FB), 'c', 't'),
-                       x_padding, y_padding, 0, blurred.width, blurred.height, blurred.frames);
+    return result;
 }
 
 Image Deconvolve::applyLevin2007(Image blurred, Image kernel, float weight) {
     assert(kernel.width % 2 == 1 && kernel.height % 2 ==1,
            "The kernel dimensions must be odd.\n");
-    assert(kernel.channels == 1 && kernel.frames == 1 && blurred.frames == 1,
-           "The kernel must be single-channel, and both the kernel and blurred\n"
-           "image must be single-framed.\n");
+    assert(kernel.channels == 1 && kernel.frames == 1,
+           "The kernel must be single-channel and single-framed.\n");
 
-    Image padded = applyPadding(blurred);
+    int alpha, x_padding, y_padding;
+    paddingFor(blurred.width, blurred.height, &alpha, &x_padding, &y_padding);
+    const int width = blurred.width + x_padding, height = blurred.height + y_padding;
+
+    // Everything here is real in the spatial domain, so we only
+    // need to work with half of each spectrum.
 
     // sum of second derivatives filter
-    Image fft_g(padded.width, padded.height, 1, 2);
-    fft_g(0, 0) = weight;
-    fft_g(padded.width-1, 0) = -weight*0.25;
-    fft_g(0, padded.height-1) = -weight*0.25;
-    fft_g(1, 0) = -weight*0.25;
-    fft_g(0, 1) = -weight*0.25;
-    FFT::apply(fft_g);
-
-    Image fft_im = RealComplex::apply(padded);
-    FFT::apply(fft_im);
-
-    Image fft_kernel(padded.width, padded.height, 1, 2);
+    Image g(width, height, 1, 1);
+    g(0, 0) = weight;
+    g(width-1, 0) = -weight*0.25;
+    g(0, height-1) = -weight*0.25;
+    g(1, 0) = -weight*0.25;
+    g(0, 1) = -weight*0.25;
+    Image fft_g = FFT::applyReal(g);
+
+    Image padded_kernel(width, height, 1, 1);
     for (int y = 0; y < kernel.height; y++) {
         int fy = y - kernel.height/2;
-        if (fy < 0) { fy += fft_kernel.height; }
+        if (fy < 0) { fy += padded_kernel.height; }
         for (int x = 0; x < kernel.width; x++) {
             for (int c = 0; c < kernel.channels; c++) {
                 int fx = x - kernel.width/2;
-                if (fx < 0) { fx += fft_kernel.width; }
-                fft_kernel(fx, fy, 2*c) = kernel(x, y, c);
+                if (fx < 0) { fx += padded_kernel.width; }
+                padded_kernel(fx, fy, c) = kernel(x, y, c);
             }
         }
     }
-    FFT::apply(fft_kernel);
-
-    ComplexMultiply::apply(fft_im, fft_kernel, true);
-    ComplexMultiply::apply(fft_kernel, fft_kernel, true);
-
-    fft_kernel += fft_g;
-    ComplexDivide::apply(fft_im, fft_kernel, false);
-
-
-    const int x_pad = (padded.width - blurred.width)/2;
-    const int y_pad = (padded.height - blurred.height)/2;
-
-    IFFT::apply(fft_im);
-    fft_im = fft_im.region(x_pad, y_pad, 0, 0,
-                           blurred.width, blurred.height,
-                           blurred.frames, fft_im.channels);
-    return ComplexReal::apply(fft_im);
+    Image fft_kernel = FFT::applyReal(padded_kernel);
+
+    // conj(K) / (|K|^2 + G), shared by every frame and channel
+    auto K = Expr::complexChannel(fft_kernel), G = Expr::complexChannel(fft_g);
+    Image filter(fft_kernel.width, fft_kernel.height, 1, 2);
+    Expr::setComplex(filter, Expr::conj(K) / (Expr::norm(K) + G));
+
+    Image result(blurred.width, blurred.height, blurred.frames, blurred.channels);
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if (blurred.frames > 1)
+    #endif
+    for (int t = 0; t < blurred.frames; t++) {
+        Image padded = applyPadding(blurred.frame(t));
+        Image fft_im = FFT::applyReal(padded);
+        for (int c = 0; c < fft_im.channels; c += 2) {
+            Image F = fft_im.selectChannels(c, 2);
+            Expr::setComplex(F, Expr::complexChannel(F) * Expr::complexChannel(filter));
+        }
+        Image deconvolved = IFFT::applyReal(fft_im, padded.width, padded.height, padded.frames);
+        result.frame(t).set(deconvolved.region((padded.width - blurred.width)/2,
+                                               (padded.height - blurred.height)/2, 0, 0,
+                                               blurred.width, blurred.height,
+                                               1, deconvolved.channels));
+    }
+    return result;
 }
 
 }
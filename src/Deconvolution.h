@@ -8,10 +8,17 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+
+    // Each of these deconvolves every frame of im by the same
+    // kernel. The spectra that depend only on the kernel are computed
+    // once, and the frames are then processed concurrently.
     static Image applyCho2009(Image im, Image kernel);
     static Image applyShan2008(Image im, Image kernel);
     static Image applyLevin2007(Image im, Image kernel, float weight);
 private:
+    struct ShanSpectra;
+    static Image applyShan2008(Image im, Image kernel, const ShanSpectra &spectra);
+    static void paddingFor(int width, int height, int *alpha, int *x_padding, int *y_padding);
     static Image applyPadding(Image im);
 };
 
@@ -1,5 +1,8 @@
 #ifndef IMAGESTACK_DENSE_GRID_H
 #define IMAGESTACK_DENSE_GRID_H
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 namespace ImageStack {
 
 /******************************************************************
@@ -11,337 +14,374 @@ namespace ImageStack {
  * The implementation is by Andrew Adams, and uses multilinear    *
  * splatting instead of nearest neighbour, which is slightly      *
  * slower but produces more accurate results.                     *
+ *                                                                *
+ * Usage is preview(...), splat(...), blur(), then slice(...).    *
+ * Points are passed in via functors, which are called as         *
+ * f(i, ptr) to fill in (or consume) the position or value        *
+ * vector of point i. Each stage is parallelized, so the functors *
+ * may be called concurrently.                                    *
  ******************************************************************/
 
 class DenseGrid {
 public:
 
-    /*
-      static Image filter(Image im, Image ref, float accuracy, size_t *memory) {
-          int taps;
-          if (accuracy < 0.25) {
-              taps = 1;
-              // variance = 0
-          } else if (accuracy < 0.5) {
-              taps = 3;
-              // tent
-              // [1 2 1]/4
-              // variance = 0.5
-          } else if (accuracy < 0.75) {
-              taps = 5;
-              // quadratic
-              // [1 4 6 4 1]/16
-              // variance = 1
-          } else {
-              taps = 7;
-              // cubic
-              // [1 6 15 20 15 6 1]/64
-              // variance = 1.5
-          }
-
-          DenseGrid grid(ref.channels, im.channels+1, taps);
-
-          //printf("Allocating...\n");
-          float *refPtr = ref(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      grid.preview(refPtr);
-                      refPtr += ref.channels;
-                  }
-              }
-          }
-
-          //printf("Splatting...\n");
-
-          float *col = new float[im.channels+1];
-          col[im.channels] = 1;
-
-          float *imPtr = im(0, 0, 0);
-          refPtr = ref(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      for (int c = 0; c < im.channels; c++) {
-                          col[c] = *imPtr++;
-                      }
-                      grid.splat(refPtr, col);
-                      refPtr += ref.channels;
-                  }
-              }
-          }
-
-          //printf("Blurring...\n");
-
-          grid.blur();
-
-          //printf("Slicing...\n");
-          Image out = im.copy();
-
-          float *outPtr = out(0, 0, 0);
-          refPtr = ref(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      grid.slice(refPtr, col);
-                      float scale = 1.0f/col[im.channels];
-                      for (int c = 0; c < im.channels; c++) {
-                          *outPtr++ = col[c]*scale;
-                      }
-                      refPtr += ref.channels;
-                  }
-              }
-          }
-
-          *memory = grid.memoryUsed();
-
-          return out;
-      }
-    */
-
-    DenseGrid(int d_, int vd_, int taps_ = 3) : d(d_), vd(vd_), taps(taps_) {
-        scaleFactor = new float[d];
-        positionF = new float[d];
-        positionFInv = new float[d];
-        positionI = new int[d];
-        minPosition = NULL;
-        maxPosition = NULL;
-        stride = NULL;
-        sizes = NULL;
-        grid = NULL;
+    /* Constructor
+     *        d_ : dimensionality of position vectors
+     *       vd_ : dimensionality of value vectors
+     *     taps_ : the number of taps of the blur kernel (1, 3, 5, or 7)
+     * maxBytes_ : the most memory the grid may use. If the grid
+     *             would be larger, it is made coarser: first by using
+     *             fewer taps, and then if necessary by spacing its
+     *             vertices further apart than the blur requires,
+     *             which blurs more than was asked for. Zero means
+     *             no limit.
+     */
+    DenseGrid(int d_, int vd_, int taps_ = 3, size_t maxBytes_ = 0) :
+        d(d_), vd(vd_), taps(taps_), maxBytes(maxBytes_), previewed(false),
+        scaleFactor(d_), minPosition(d_, INF), maxPosition(d_, -INF),
+        stride(d_+1), sizes(d_) {
 
         for (int i = 0; i < d; i++) {
-            // The kernel for a single multi-linear interpolation is a
-            // cube convolved with itself. Therefore it's variance is
-            // twice the total variance of a d-dimensional unit cube.
-
-            // total variance of a cube = d/12
-            // total variance of splatting = d/6
-            // total variance of splatting + slicing = d/3
-
-            // total variance of the blur step is d(taps-1)/4
-
-            // so scale factor should be the std dev in each dimension
-            // = sqrt(total variance / d) = sqrt(1/3 + (taps-1)/4)
-
-            scaleFactor[i] = sqrtf(1.0/3 + (taps-1)*0.25);
+            scaleFactor[i] = scaleForTaps(taps);
         }
-
-    }
-
-    ~DenseGrid() {
-        delete[] scaleFactor;
-        delete[] positionF;
-        delete[] positionFInv;
-        delete[] positionI;
-        delete[] minPosition;
-        delete[] maxPosition;
-        delete[] stride;
-        delete[] sizes;
-        delete[] grid;
     }
 
-    void preview(float *position) {
-        if (!minPosition) {
-            minPosition = new float[d];
-            maxPosition = new float[d];
-            for (int i = 0; i < d; i++) {
-                minPosition[i] = position[i]*scaleFactor[i];
-                maxPosition[i] = position[i]*scaleFactor[i];
-            }
-        } else {
-            for (int i = 0; i < d; i++) {
-                if (position[i]*scaleFactor[i] < minPosition[i]) {
-                    minPosition[i] = position[i]*scaleFactor[i];
-                }
-                if (position[i]*scaleFactor[i] > maxPosition[i]) {
-                    maxPosition[i] = position[i]*scaleFactor[i];
+    // Expand the bounds of the grid to include n positions
+    template<typename P>
+    void preview(int n, const P &position) {
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<float> pos(d), mins(d, INF), maxs(d, -INF);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < n; i++) {
+                position(i, &pos[0]);
+                for (int j = 0; j < d; j++) {
+                    float p = pos[j]*scaleFactor[j];
+                    if (p < mins[j]) { mins[j] = p; }
+                    if (p > maxs[j]) { maxs[j] = p; }
                 }
             }
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            for (int j = 0; j < d; j++) {
+                minPosition[j] = std::min(minPosition[j], mins[j]);
+                maxPosition[j] = std::max(maxPosition[j], maxs[j]);
+            }
         }
+        previewed = true;
     }
 
-    void splat(float *position, float *value) {
-        if (!grid) {
-            stride = new int[d+1];
-            sizes = new int[d];
-            stride[0] = vd;
-            for (int i = 0; i < d; i++) {
-                sizes[i] = (int)(ceil(maxPosition[i] - minPosition[i])+1);
-                stride[i+1] = stride[i]*sizes[i];
-            }
-            grid = new float[stride[d]];
-            memset(grid, 0, sizeof(float)*stride[d]);
+    /* Splat n values into the grid, allocating it if necessary. The
+     * positions must be within the bounds given to preview.
+     *
+     * The points are bucketed into slabs along the longest axis of
+     * the grid. A point only touches the grid within its own slab
+     * and the next one, so every second slab can be splatted into
+     * concurrently, followed by the rest.
+     */
+    template<typename P, typename V>
+    void splat(int n, const P &position, const V &value) {
+        if (grid.empty()) { allocate(); }
+
+        // Pick the axis to cut into slabs
+        int axis = 0;
+        for (int j = 1; j < d; j++) {
+            if (sizes[j] > sizes[axis]) { axis = j; }
+        }
 
+        // Bucket the points by slab
+        vector<int> slab(n);
+        vector<int> slabStart(sizes[axis]+1, 0);
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<float> pos(d);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < n; i++) {
+                position(i, &pos[0]);
+                int s = (int)floorf(pos[axis]*scaleFactor[axis] - minPosition[axis]);
+                slab[i] = clamp(s, 0, sizes[axis]-1);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            slabStart[slab[i]+1]++;
+        }
+        for (int s = 0; s < sizes[axis]; s++) {
+            slabStart[s+1] += slabStart[s];
+        }
+        vector<int> order(n);
+        {
+            vector<int> next(slabStart.begin(), slabStart.end()-1);
+            for (int i = 0; i < n; i++) {
+                order[next[slab[i]]++] = i;
+            }
         }
 
-        query<true>(position, value);
+        for (int parity = 0; parity < 2; parity++) {
+            #ifdef _OPENMP
+            #pragma omp parallel
+            #endif
+            {
+                Query q(d);
+                vector<float> pos(d), val(vd);
+                #ifdef _OPENMP
+                #pragma omp for schedule(dynamic, 1)
+                #endif
+                for (int s = parity; s < sizes[axis]; s += 2) {
+                    for (int k = slabStart[s]; k < slabStart[s+1]; k++) {
+                        int i = order[k];
+                        position(i, &pos[0]);
+                        value(i, &val[0]);
+                        locate(&pos[0], q);
+                        for (int c = 0; c < (1 << d); c++) {
+                            float *v = &grid[0] + q.offset[c];
+                            float w = q.weight[c];
+                            for (int j = 0; j < vd; j++) {
+                                v[j] += w*val[j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
     }
 
     void blur() {
-        switch (taps) {
-        case 3:
-            blur_<3>();
-            return;
-        case 5:
-            blur_<5>();
-            return;
-        case 7:
-            blur_<7>();
-            return;
+        for (int j = 0; j < d; j++) {
+            blurAxis(j);
         }
     }
 
-    void slice(float *position, float *value) {
-        query<false>(position, value);
+    // Slice the grid at n positions
+    template<typename P, typename O>
+    void slice(int n, const P &position, const O &output) const {
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            Query q(d);
+            vector<float> pos(d), val(vd);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < n; i++) {
+                position(i, &pos[0]);
+                locate(&pos[0], q);
+                for (int j = 0; j < vd; j++) {
+                    val[j] = 0;
+                }
+                for (int c = 0; c < (1 << d); c++) {
+                    const float *v = &grid[0] + q.offset[c];
+                    float w = q.weight[c];
+                    for (int j = 0; j < vd; j++) {
+                        val[j] += w*v[j];
+                    }
+                }
+                output(i, &val[0]);
+            }
+        }
     }
 
-    size_t memoryUsed() {
-        return (sizeof(float)*stride[d]);
+    // Zero the grid so that it can be splatted into again. The
+    // bounds found by preview are kept.
+    void clear() {
+        std::fill(grid.begin(), grid.end(), 0.0f);
     }
 
-private:
-
-    template <int taps_>
-    void blur_() {
-        int *rowLocation = new int[d];
-        float *tmp1 = new float[vd];
-        float *tmp2 = new float[vd];
-
-        for (int j = 0; j < d; j++) {
-
-            for (int i = 0; i < d; i++) { rowLocation[i] = 0; }
-
-            //printf("Blurring in direction %d\n", j);
-            // iterate through every dimension except for j and the value dimension
-            for (int row = 0; row < stride[d]/(vd*sizes[j]); row++) {
-
-                float *startOfRow = grid;
-                for (int i = 0; i < d; i++) {
-                    startOfRow += rowLocation[i]*stride[i];
-                }
-
-                for (int iters = 0; iters < taps_/2; iters++) {
-                    float *rowPtr = startOfRow;
-
-                    // now walk along the row blurring
-                    int s = stride[j];
-
-                    for (int k = 0; k < vd; k++) {
-                        tmp1[k] = rowPtr[k]/2;
-                    }
+    size_t memoryUsed() const {
+        return sizeof(float)*grid.size();
+    }
 
-                    for (int i = 0; i < sizes[j]-1; i++) {
-                        // the average of previous + current is stored in tmp1
+private:
 
-                        // save the average of current + next into tmp2
-                        for (int k = 0; k < vd; k++) {
-                            tmp2[k] = 0.5*(rowPtr[k] + rowPtr[k+s]);
-                        }
+    // The spacing of grid vertices relative to the standard
+    // deviation of the blur, for a given number of taps.
+    static float scaleForTaps(int t) {
+        // The kernel for a single multi-linear interpolation is a
+        // cube convolved with itself. Therefore it's variance is
+        // twice the total variance of a d-dimensional unit cube.
 
-                        // then clobber current with the average of tmp1 and tmp2
-                        for (int k = 0; k < vd; k++) {
-                            rowPtr[k] = 0.5*(tmp1[k] + tmp2[k]);
-                        }
+        // total variance of a cube = d/12
+        // total variance of splatting = d/6
+        // total variance of splatting + slicing = d/3
 
-                        // switch tmp1 and tmp2
-                        float *tmp3 = tmp1;
-                        tmp1 = tmp2;
-                        tmp2 = tmp3;
+        // total variance of the blur step is d(taps-1)/4
 
-                        rowPtr += s;
-                    }
+        // so scale factor should be the std dev in each dimension
+        // = sqrt(total variance / d) = sqrt(1/3 + (taps-1)*0.25)
+        return sqrtf(1.0/3 + (t-1)*0.25);
+    }
 
-                    // write the last one
-                    for (int k = 0; k < vd; k++) {
-                        rowPtr[k] = 0.5*(tmp1[k] + 0.5*rowPtr[k]);
-                    }
-                }
+    // The number of floats the grid would need with the current
+    // bounds, each scaled by the given factor.
+    double gridSize(float k) const {
+        double size = vd;
+        for (int i = 0; i < d; i++) {
+            size *= floorf((maxPosition[i] - minPosition[i])*k) + 2;
+        }
+        return size;
+    }
 
-                // This is basically addition with ripple carry,
-                // ignoring the digit in the place of the current
-                // dimension (digit j)
-                int k = 0;
-                if (k == j) { k++; }
-                if (k >= d) { printf("PANIC!\n"); }
-                rowLocation[k]++;
+    // Rescale the grid coordinates by a factor
+    void rescale(float k) {
+        for (int i = 0; i < d; i++) {
+            scaleFactor[i] *= k;
+            minPosition[i] *= k;
+            maxPosition[i] *= k;
+        }
+    }
 
-                while (rowLocation[k] == sizes[k]) {
-                    rowLocation[k] = 0;
-                    k++;
-                    if (k == j) { k++; }
-                    if (k >= d) { break; }
-                    rowLocation[k]++;
-                }
+    void allocate() {
+        if (!previewed) {
+            panic("The bilateral grid must be previewed before splatting\n");
+        }
 
+        if (maxBytes) {
+            double limit = (double)maxBytes / sizeof(float);
+            double original = gridSize(1);
+            // First try fewer taps
+            while (taps > 1 && gridSize(1) > limit) {
+                float k = scaleForTaps(taps-2) / scaleForTaps(taps);
+                taps -= 2;
+                rescale(k);
+            }
+            // Then space the vertices out further. However coarse the
+            // grid is, it has two vertices along each axis.
+            if (gridSize(0) > limit) {
+                panic("The bilateral grid needs at least %.1f MB, which is more than the"
+                      " limit of %.1f MB set by -gridmemory\n",
+                      gridSize(0) * sizeof(float) / (1 << 20),
+                      (double)maxBytes / (1 << 20));
+            }
+            if (gridSize(1) > limit) {
+                float k = 1;
+                while (gridSize(k) > limit) { k *= 0.9f; }
+                rescale(k);
+            }
+            if (gridSize(1) < original) {
+                printf("Bilateral grid would use %.1f MB; coarsened to %.1f MB\n",
+                       original * sizeof(float) / (1 << 20),
+                       gridSize(1) * sizeof(float) / (1 << 20));
             }
         }
-        delete[] rowLocation;
-        delete[] tmp1;
-        delete[] tmp2;
-    }
-
-    template<bool splatting>
-    void query(float *position, float *value) {
 
-        // break the query into integral and floating point portions
+        // Each point touches the vertex above it in each dimension,
+        // so leave an extra one at the end.
+        stride[0] = vd;
         for (int i = 0; i < d; i++) {
-            float f = (position[i]*scaleFactor[i] - minPosition[i]);
-            positionI[i] = (short)floorf(f);
-            positionF[i] = f - positionI[i];
-            positionFInv[i] = 1 - positionF[i];
+            sizes[i] = (int)floorf(maxPosition[i] - minPosition[i]) + 2;
+            stride[i+1] = stride[i]*sizes[i];
         }
+        grid.assign(stride[d], 0.0f);
+    }
 
-        if (!splatting) {
-            for (int j = 0; j < vd; j++) {
-                value[j] = 0;
-            }
-        }
+    // The grid vertices surrounding a position, and their weights
+    struct Query {
+        Query(int d_) : offset(1 << d_), weight(1 << d_), positionI(d_), positionF(d_) {}
+        vector<size_t> offset;
+        vector<float> weight;
+        vector<int> positionI;
+        vector<float> positionF;
+    };
 
-        // find the position of the top left
-        float *topLeft = grid;
+    void locate(const float *position, Query &q) const {
+        // break the query into integral and floating point portions
+        size_t topLeft = 0;
         for (int i = 0; i < d; i++) {
-            topLeft += positionI[i]*stride[i];
+            float f = position[i]*scaleFactor[i] - minPosition[i];
+            f = clamp(f, 0.0f, (float)(sizes[i]-1));
+            int fi = std::min((int)f, sizes[i]-2);
+            q.positionI[i] = fi;
+            q.positionF[i] = f - fi;
+            topLeft += (size_t)fi*stride[i];
         }
 
         // iterate through the neighbours
-        for (int i = 0; i < (1<<d); i++) {
+        for (int c = 0; c < (1 << d); c++) {
             float weight = 1;
-            float *val = topLeft;
+            size_t offset = topLeft;
             for (int j = 0; j < d; j++) {
-                if (i & (1 << j)) {
-                    val += stride[j];
-                    weight *= positionF[j];
+                if (c & (1 << j)) {
+                    offset += stride[j];
+                    weight *= q.positionF[j];
                 } else {
-                    weight *= positionFInv[j];
+                    weight *= 1 - q.positionF[j];
                 }
             }
+            q.offset[c] = offset;
+            q.weight[c] = weight;
+        }
+    }
 
-            if (splatting) {
-                for (int j = 0; j < vd; j++) {
-                    val[j] += weight*value[j];
-                }
-            } else if (val) {
-                for (int j = 0; j < vd; j++) {
-                    value[j] += weight*val[j];
+    /* Blur with a [1 2 1]/4 kernel taps/2 times along one axis of the
+     * grid. Everything below that axis in memory (the values, and
+     * the axes before it) is contiguous, so the grid is processed as
+     * lines of contiguous vectors, which are blurred together. */
+    void blurAxis(int j) {
+        const int CHUNK = 256;
+        int rows = sizes[j];
+        size_t inner = stride[j];
+        size_t outer = stride[d] / stride[j+1];
+        size_t chunks = (inner + CHUNK - 1) / CHUNK;
+        float *base = &grid[0];
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (long long item = 0; item < (long long)(outer*chunks); item++) {
+            size_t o = item / chunks;
+            size_t c0 = (item % chunks) * CHUNK;
+            int len = (int)std::min((size_t)CHUNK, inner - c0);
+            float *start = base + o*stride[j+1] + c0;
+            float prev[CHUNK];
+
+            const Vec::type quarter = Vec::broadcast(0.25f);
+            const Vec::type half = Vec::broadcast(0.5f);
+            for (int iter = 0; iter < taps/2; iter++) {
+                for (int l = 0; l < len; l++) { prev[l] = 0; }
+                for (int r = 0; r < rows; r++) {
+                    float *cur = start + (size_t)r*inner;
+                    const float *next = cur + inner;
+                    bool last = r == rows-1;
+                    int l = 0;
+                    if (!last) {
+                        for (; l + Vec::width <= len; l += Vec::width) {
+                            Vec::type a = Vec::load(prev + l);
+                            Vec::type b = Vec::load(cur + l);
+                            Vec::type n = Vec::load(next + l);
+                            Vec::store(b, prev + l);
+                            Vec::type s = Vec::Mul::vec(quarter, Vec::Add::vec(a, n));
+                            Vec::store(Vec::Add::vec(s, Vec::Mul::vec(half, b)), cur + l);
+                        }
+                    }
+                    for (; l < len; l++) {
+                        float a = prev[l], b = cur[l];
+                        float n = last ? 0 : next[l];
+                        prev[l] = b;
+                        cur[l] = 0.25f*(a + n) + 0.5f*b;
+                    }
                 }
             }
         }
     }
 
-private:
-
     int d, vd, taps;
-    float *scaleFactor;
-    float *positionF, *positionFInv;
-    float *grid;
-    float *minPosition, *maxPosition;
-    int *positionI;
-    int *stride;
-    int *sizes;
+    size_t maxBytes;
+    bool previewed;
+    vector<float> scaleFactor;
+    vector<float> minPosition, maxPosition;
+    vector<size_t> stride;
+    vector<int> sizes;
+    vector<float> grid;
 };
 
 }
 #endif
-
-
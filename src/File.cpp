@@ -383,13 +383,6 @@ void SaveFrames::parse(vector<string> args) {
     }
 }
 
-// Microsoft has an underscore in front of snprintf for some reason
-#ifdef _MSC_VER
-#ifndef snprintf
-#define snprintf _snprintf
-#endif
-#endif
-
 void SaveFrames::apply(Image im, string pattern, string arg) {
     char filename[4096];
 
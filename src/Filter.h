@@ -38,7 +38,6 @@ private:
     static void blurX(Image im, int filterSize, int iterations = 1);
     static void blurY(Image im, int filterSize, int iterations = 1);
     static void blurT(Image im, int filterSize, int iterations = 1);
-    static void blurXCompletely(Image im);
 };
 
 
@@ -55,7 +54,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, int radius);
+    static Image apply(Image im, int radius, int radiusT = 0, int levels = 0);
 };
 
 class MinFilter : public Operation {
@@ -64,6 +63,7 @@ public:
     bool test();
     void parse(vector<string> args);
     static void apply(Image im, int radius);
+    static void apply(Image im, int radiusX, int radiusY, int radiusT);
 };
 
 class MaxFilter : public Operation {
@@ -72,6 +72,7 @@ public:
     bool test();
     void parse(vector<string> args);
     static void apply(Image im, int radius);
+    static void apply(Image im, int radiusX, int radiusY, int radiusT);
 };
 
 class PercentileFilter : public Operation {
@@ -79,7 +80,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, int radius, float percentile);
+    static Image apply(Image im, int radius, float percentile, int radiusT = 0, int levels = 0);
 };
 
 class CircularFilter : public Operation {
@@ -1,5 +1,8 @@
 #ifndef IMAGESTACK_GKDTREE_H
 #define IMAGESTACK_GKDTREE_H
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 namespace ImageStack {
 
 #include <limits>
@@ -7,8 +10,15 @@ namespace ImageStack {
 #include <stdlib.h>
 #include <string.h>
 
-float rand_float() {
-    return rand()/(RAND_MAX+1.0f);
+// A small random number generator whose state lives with the caller,
+// so that lookups can run concurrently and still be repeatable.
+inline float rand_float(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) * (1.0f/16777216);
 }
 
 inline float gCDF(float x) {
@@ -37,272 +47,148 @@ inline float gCDF(float x) {
     return 24;
 }
 
+/******************************************************************
+ * This is the Gaussian kd-tree from the paper:                   *
+ * Gaussian KD-Trees for Fast High-Dimensional Filtering          *
+ * Andrew Adams, Natasha Gelfand, Jennifer Dolson, Marc Levoy     *
+ *                                                                *
+ * The nodes are stored in one contiguous array, and the leaf     *
+ * positions in another. Construction builds the top of the tree  *
+ * serially and the subtrees below it in parallel. Lookups don't  *
+ * modify the tree, so may be made concurrently.                  *
+ ******************************************************************/
 class GKDTree {
 public:
-    /*
-      static Image filter(Image im, Image ref) {
-          Image out(im.width, im.height, im.frames, im.channels);
-
-          vector<float *> points(ref.width*ref.height*ref.frames);
-          int i = 0;
-          for (int t = 0; t < ref.frames; t++) {
-              for (int x = 0; x < ref.width; x++) {
-                  for (int y = 0; y < ref.height; y++) {
-                      points[i++] = ref(x, y, t);
-                  }
-              }
-          }
-
-          GKDTree tree(ref.channels, &points[0], points.size(), 2*0.707107);
-          tree.finalize();
-
-          vector<int> indices(64);
-          vector<float> weights(64);
-
-          Image leafValues(tree.getLeaves(), 1, 1, im.channels+1);
-
-          float *imPtr = im(0, 0, 0);
-          float *refPtr = ref(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      int results = tree.gaussianLookup(refPtr,
-                                                        &indices[0],
-                                                        &weights[0],
-                                                        4);
-                      for (int i = 0; i < results; i++) {
-                          float w = weights[i];
-                          float *vPtr = leafValues(indices[i], 0);
-                          for (int c = 0; c < im.channels; c++) {
-                              vPtr[c] += imPtr[c]*w;
-                          }
-                          vPtr[im.channels] += w;
-                      }
-                      refPtr += ref.channels;
-                      imPtr += im.channels;
-                  }
-              }
-          }
-
-          float *outPtr = out(0, 0, 0);
-          float *slicePtr = ref(0, 0, 0);
-
-          for (int t = 0; t < out.frames; t++) {
-              for (int y = 0; y < out.height; y++) {
-                  for (int x = 0; x < out.width; x++) {
-                      int results = tree.gaussianLookup(&slicePtr[0],
-                                                        &indices[0],
-                                                        &weights[0],
-                                                        64);
-                      float outW = 0;
-
-                      for (int i = 0; i < results; i++) {
-                          float w = weights[i];
-                          float *vPtr = leafValues(indices[i], 0);
-                          for (int c = 0; c < out.channels; c++) {
-                              outPtr[c] += vPtr[c]*w;
-                          }
-                          outW += w*vPtr[out.channels];
-                      }
-
-                      if (outW < 0.00000001) {
-                          for (int c = 0; c < out.channels; c++) {
-                              outPtr[c] = im(x, y, t)[c];
-                          }
-                      } else {
-                          float invOutW = 1.0f/outW;
-                          for (int c = 0; c < out.channels; c++) {
-                              outPtr[c] *= invOutW;
-                          }
-                      }
-
-                      slicePtr += ref.channels;
-                      outPtr += out.channels;
-                  }
-              }
-          }
-
-          return out;
-      }
-    */
 
     // Build a gkdtree using the supplied array of points to control
     // the sampling.  sizeBound specifies the maximum allowable side
     // length of a kdtree leaf.  At least one point from data lies in
-    // any given leaf.
-
-    GKDTree(int dims, float **data, int nData, float sBound) :
-        dimensions(dims), sizeBound(sBound), leaves(0) {
-
-        root = build(data, nData);
-    }
+    // any given leaf. The array of pointers is reordered, but the
+    // points themselves are not modified or retained. If maxLeaves
+    // is positive, the tree has at most that many leaves, and cells
+    // with too few leaves to go around are left larger than
+    // sizeBound.
+    GKDTree(int dims, float **data, int nData, float sBound, int maxLeaves = 0) :
+        dimensions(dims), sizeBound(sBound) {
+
+        int threads = 1;
+        #ifdef _OPENMP
+        threads = omp_get_max_threads();
+        #endif
+
+        // Build the top of the tree, stopping at subtrees small
+        // enough that there are several per thread.
+        int grain = threads > 1 ? std::max(1024, nData / (8*threads)) : nData + 1;
+        vector<Pending> pending;
+        int budget = (maxLeaves > 0 && maxLeaves < nData) ? maxLeaves : nData;
+        build(data, nData, budget, nodes, leafPositions, grain, &pending);
+
+        // Build the remaining subtrees in parallel
+        vector<vector<Node> > subNodes(pending.size());
+        vector<vector<float> > subLeaves(pending.size());
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (int i = 0; i < (int)pending.size(); i++) {
+            build(pending[i].data, pending[i].nData, pending[i].budget,
+                  subNodes[i], subLeaves[i], 0, NULL);
+        }
 
-    ~GKDTree() {
-        delete root;
+        // Splice them in, replacing the placeholder nodes with their
+        // roots and renumbering their nodes and leaves.
+        for (size_t i = 0; i < pending.size(); i++) {
+            int nodeOffset = (int)nodes.size() - 1;
+            int leafOffset = (int)(leafPositions.size() / dimensions);
+            vector<Node> &sub = subNodes[i];
+            for (size_t j = 0; j < sub.size(); j++) {
+                Node n = sub[j];
+                if (n.cut_dim < 0) {
+                    n.left += leafOffset;
+                } else {
+                    n.left += nodeOffset;
+                    n.right += nodeOffset;
+                }
+                if (j == 0) { nodes[pending[i].node] = n; }
+                else { nodes.push_back(n); }
+            }
+            leafPositions.insert(leafPositions.end(), subLeaves[i].begin(), subLeaves[i].end());
+            vector<Node>().swap(sub);
+            vector<float>().swap(subLeaves[i]);
+        }
     }
 
     void finalize() {
-        float *kdtreeMins = new float[dimensions];
-        float *kdtreeMaxs = new float[dimensions];
-
-        for (int i = 0; i < dimensions; i++) {
-            kdtreeMins[i] = -INF;
-            kdtreeMaxs[i] = +INF;
-        }
-
-        root->computeBounds(kdtreeMins, kdtreeMaxs);
+        vector<float> kdtreeMins(dimensions, -INF);
+        vector<float> kdtreeMaxs(dimensions, +INF);
+        computeBounds(0, &kdtreeMins[0], &kdtreeMaxs[0]);
+    }
 
-        delete[] kdtreeMins;
-        delete[] kdtreeMaxs;
+    int getLeaves() const {
+        return (int)(leafPositions.size() / dimensions);
     }
 
-    int getLeaves() {
-        return leaves;
+    // The memory used per leaf by a tree over points with the given
+    // number of dimensions, including the splits above it.
+    static size_t bytesPerLeaf(int dims) {
+        return dims * sizeof(float) + 2 * sizeof(Node);
     }
 
     // Compute a gaussian spread of kdtree leaves around the given
-    // point. This is the general case sampling strategy.
-    int gaussianLookup(float *value, int *ids, float *weights, int nSamples) {
-        return root->gaussianLookup(value, &ids, &weights, nSamples, 1);
+    // point. This is the general case sampling strategy. Some
+    // samples may be repeated. Returns how many entries in the ids
+    // and weights arrays were used. The seed determines the random
+    // choices made, so the same seed gives the same result.
+    int gaussianLookup(const float *value, int *ids, float *weights, int nSamples,
+                       unsigned seed = 0) const {
+        unsigned state = seed * 2654435761u + 0x9e3779b9u;
+        if (state == 0) { state = 1; }
+        return gaussianLookup(0, value, ids, weights, nSamples, 1, &state);
     }
 
 private:
 
-    class Node {
-    public:
-        virtual ~Node() {}
-
-        // Returns a list of samples from the kdtree distributed
-        // around value with std-dev sigma in all dimensions. Some
-        // samples may be repeated. Returns how many entries in the
-        // ids and weights arrays were used.
-        virtual int gaussianLookup(float *value, int **ids, float **weights, int nSamples, float p) = 0;
-
-        // special case optimization of the above where nsamples = 1
-        virtual int singleGaussianLookup(float *value, int **ids, float **weights, float p) = 0;
-
-        virtual void computeBounds(float *mins, float *maxs) = 0;
-
-    };
-
-    class Split : public Node {
-    public:
-        virtual ~Split() {
-            delete left;
-            delete right;
-        }
-
-
-        // for a given gaussian and a given value, the probability of splitting left at this node
-        inline float pLeft(float value) {
-            // Coarsely approximate the cumulative normal distribution
-            float val = gCDF(cut_val - value);
-            float minBound = gCDF(min_val - value);
-            float maxBound = gCDF(max_val - value);
-            return (val - minBound) / (maxBound - minBound);
-        }
-
-        int gaussianLookup(float *value, int **ids, float **weights, int nSamples, float p) {
-            // Calculate how much of a gaussian ball of radius sigma,
-            // that has been trimmed by all the cuts so far, lies on
-            // each side of the split
-
-            // compute the probability of a sample splitting left
-            float val = pLeft(value[cut_dim]);
-
-            // Send some samples to the left of the split
-            int leftSamples = (int)(val*nSamples);
-
-            // Send some samples to the right of the split
-            int rightSamples = (int)((1-val)*nSamples);
-
-            // There's probably one sample left over by the rounding
-            if (leftSamples + rightSamples != nSamples) {
-                float fval = val*nSamples - leftSamples;
-                // if val is high we send it left, if val is low we send it right
-                if (rand_float() < fval) {
-                    leftSamples++;
-                } else {
-                    rightSamples++;
-                }
-            }
-
-            int samplesFound = 0;
-            // Get the left samples
-            if (leftSamples > 0) {
-                if (leftSamples > 1) {
-                    samplesFound += left->gaussianLookup(value, ids, weights, leftSamples, p*val);
-                } else {
-                    samplesFound += left->singleGaussianLookup(value, ids, weights, p*val);
-                }
-            }
-
-            // Get the right samples
-            if (rightSamples > 0) {
-                if (rightSamples > 1) {
-                    samplesFound += right->gaussianLookup(value, ids, weights, rightSamples, p*(1-val));
-                } else {
-                    samplesFound += right->singleGaussianLookup(value, ids, weights, p*(1-val));
-                }
-            }
-
-            return samplesFound;
-        }
-
-        // a special case optimization of the above for when nSamples is 1
-        int singleGaussianLookup(float *value, int **ids, float **weights, float p) {
-            float val = pLeft(value[cut_dim]);
-            if (rand_float() < val) {
-                return left->singleGaussianLookup(value, ids, weights, p*val);
-            } else {
-                return right->singleGaussianLookup(value, ids, weights, p*(1-val));
-            }
-        }
-
-        void computeBounds(float *mins, float *maxs) {
-            min_val = mins[cut_dim];
-            max_val = maxs[cut_dim];
-
-            maxs[cut_dim] = cut_val;
-            left->computeBounds(mins, maxs);
-            maxs[cut_dim] = max_val;
-
-            mins[cut_dim] = cut_val;
-            right->computeBounds(mins, maxs);
-            mins[cut_dim] = min_val;
-        }
-
+    // A split has the dimension and value of its cut, the bounds of
+    // its cell in that dimension (computed by finalize), and the
+    // indices of its children in the nodes array. A leaf has cut_dim
+    // -1, and its id in left.
+    struct Node {
         int cut_dim;
         float cut_val, min_val, max_val;
-        Node *left, *right;
+        int left, right;
     };
 
-    class Leaf : public Node {
+    // A subtree left to be built in parallel
+    struct Pending {
+        int node;
+        float **data;
+        int nData, budget;
+    };
 
-    public:
-        Leaf(int id_, float **data, int nData, int dimensions_)
-            : id(id_), dimensions(dimensions_) {
-            position = new float[dimensions];
-            for (int i = 0; i < dimensions; i++) {
-                position[i] = 0;
-                for (int j = 0; j < nData; j++) {
-                    position[i] += data[j][i];
-                }
-                position[i] /= nData;
-            }
-        }
+    vector<Node> nodes;
+    vector<float> leafPositions;
+    int dimensions;
+    float sizeBound;
 
-        ~Leaf() {
-            delete[] position;
-        }
+    // for a given gaussian and a given value, the probability of splitting left at this node
+    inline float pLeft(const Node &n, float value) const {
+        // Coarsely approximate the cumulative normal distribution
+        float val = gCDF(n.cut_val - value);
+        float minBound = gCDF(n.min_val - value);
+        float maxBound = gCDF(n.max_val - value);
+        return (val - minBound) / (maxBound - minBound);
+    }
 
-        int gaussianLookup(float *query, int **ids, float **weights, int nSamples, float p) {
+    int gaussianLookup(int idx, const float *value, int *ids, float *weights,
+                       int nSamples, float p, unsigned *state) const {
+        const Node &n = nodes[idx];
+
+        if (n.cut_dim < 0) {
             // p is the probability with which one sample arrived here
             // calculate the correct probability, q
-
+            const float *position = &leafPositions[n.left*dimensions];
             float q = 0;
             for (int i = 0; i < dimensions; i++) {
-                float diff = query[i] - position[i];
+                float diff = value[i] - position[i];
                 diff *= diff;
                 q += diff;
             }
@@ -310,101 +196,202 @@ private:
             // Gaussian of variance 1/2
             q = expf(-q);
 
-            *(*ids)++ = id;
-            *(*weights)++ = nSamples * q / p;
+            *ids = n.left;
+            *weights = nSamples * q / p;
 
             return 1;
         }
 
-        int singleGaussianLookup(float *query, int **ids, float **weights, float p) {
-            return gaussianLookup(query, ids, weights, 1, p);
+        // Calculate how much of a gaussian ball of radius sigma,
+        // that has been trimmed by all the cuts so far, lies on
+        // each side of the split
+
+        // compute the probability of a sample splitting left
+        float val = pLeft(n, value[n.cut_dim]);
+
+        // Send some samples to the left of the split
+        int leftSamples = (int)(val*nSamples);
+
+        // Send some samples to the right of the split
+        int rightSamples = (int)((1-val)*nSamples);
+
+        // There's probably one sample left over by the rounding
+        if (leftSamples + rightSamples != nSamples) {
+            float fval = val*nSamples - leftSamples;
+            // if val is high we send it left, if val is low we send it right
+            if (rand_float(state) < fval) {
+                leftSamples++;
+            } else {
+                rightSamples++;
+            }
         }
 
-        void computeBounds(float *mins, float *maxs) {
+        int samplesFound = 0;
+        // Get the left samples
+        if (leftSamples > 0) {
+            samplesFound += gaussianLookup(n.left, value, ids, weights,
+                                           leftSamples, p*val, state);
         }
 
-    private:
-        int id, dimensions;
-        float *position;
-    };
+        // Get the right samples
+        if (rightSamples > 0) {
+            samplesFound += gaussianLookup(n.right, value, ids + samplesFound, weights + samplesFound,
+                                           rightSamples, p*(1-val), state);
+        }
 
-    Node *root;
-    int dimensions;
-    float sizeBound;
-    int leaves;
+        return samplesFound;
+    }
 
-    Node *build(float **data, int nData) {
+    void computeBounds(int idx, float *mins, float *maxs) {
+        Node &n = nodes[idx];
+        if (n.cut_dim < 0) { return; }
 
-        if (nData == 1) {
-            return new Leaf(leaves++, data, nData, dimensions);
-        } else {
+        n.min_val = mins[n.cut_dim];
+        n.max_val = maxs[n.cut_dim];
 
-            vector<float> mins(dimensions), maxs(dimensions);
+        maxs[n.cut_dim] = n.cut_val;
+        computeBounds(n.left, mins, maxs);
+        maxs[n.cut_dim] = n.max_val;
 
-            // calculate the data bounds in every dimension
-            for (int i = 0; i < dimensions; i++) {
-                mins[i] = maxs[i] = data[0][i];
+        mins[n.cut_dim] = n.cut_val;
+        computeBounds(n.right, mins, maxs);
+        mins[n.cut_dim] = n.min_val;
+    }
+
+    // Build the subtree over the given points with at most budget
+    // leaves, appending its nodes and leaves, and returning the index
+    // of its root. If pending is non-NULL, subtrees with fewer than
+    // grain points get a placeholder node and are added to it
+    // instead.
+    int build(float **data, int nData, int budget, vector<Node> &out, vector<float> &leaves,
+              int grain, vector<Pending> *pending) {
+
+        int idx = (int)out.size();
+        out.push_back(Node());
+
+        if (pending && nData < grain) {
+            Pending p = {idx, data, nData, budget};
+            pending->push_back(p);
+            return idx;
+        }
+
+        vector<float> mins(dimensions), maxs(dimensions);
+
+        // calculate the data bounds in every dimension
+        for (int i = 0; i < dimensions; i++) {
+            mins[i] = maxs[i] = data[0][i];
+        }
+        if (pending) {
+            // Near the top of the tree there are many points and
+            // only a few nodes, so split the work among threads.
+            #ifdef _OPENMP
+            #pragma omp parallel
+            #endif
+            {
+                vector<float> myMins(mins), myMaxs(maxs);
+                #ifdef _OPENMP
+                #pragma omp for
+                #endif
+                for (int j = 1; j < nData; j++) {
+                    for (int i = 0; i < dimensions; i++) {
+                        if (data[j][i] < myMins[i]) myMins[i] = data[j][i];
+                        if (data[j][i] > myMaxs[i]) myMaxs[i] = data[j][i];
+                    }
+                }
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                for (int i = 0; i < dimensions; i++) {
+                    mins[i] = std::min(mins[i], myMins[i]);
+                    maxs[i] = std::max(maxs[i], myMaxs[i]);
+                }
             }
-            for (int j = 1; j < nData; j ++) {
+        } else {
+            for (int j = 1; j < nData; j++) {
                 for (int i = 0; i < dimensions; i++) {
                     if (data[j][i] < mins[i]) mins[i] = data[j][i];
                     if (data[j][i] > maxs[i]) maxs[i] = data[j][i];
                 }
             }
+        }
 
-            // find the longest dimension
-            int longest = 0;
-            for (int i = 1; i < dimensions; i++) {
-                float delta = maxs[i] - mins[i];
-                if (delta > maxs[longest] - mins[longest])
-                    longest = i;
-            }
-
-            // if it's large enough, cut in that dimension
-            if (maxs[longest] - mins[longest] > sizeBound) {
-                Split *n = new Split;
-                n->cut_dim = longest;
-                n->cut_val = (maxs[longest] + mins[longest])/2;
-
-                // these get computed later
-                n->min_val = -INF;
-                n->max_val = INF;
-
-                // resort the input over the split
-                int pivot = 0;
-                for (int i = 0; i < nData; i++) {
-                    // The next value is larger than the pivot
-                    if (data[i][longest] >= n->cut_val) continue;
-
-                    // We haven't seen anything larger than the pivot yet
-                    if (i == pivot) {
-                        pivot++;
-                        continue;
-                    }
+        // find the longest dimension
+        int longest = 0;
+        for (int i = 1; i < dimensions; i++) {
+            float delta = maxs[i] - mins[i];
+            if (delta > maxs[longest] - mins[longest])
+                longest = i;
+        }
 
-                    // The current value is smaller than the pivot
-                    float *tmp = data[i];
-                    data[i] = data[pivot];
-                    data[pivot] = tmp;
+        // if it's large enough, cut in that dimension
+        if (nData > 1 && budget > 1 && maxs[longest] - mins[longest] > sizeBound) {
+            // Cut at the midpoint. A median cut would balance the
+            // subtrees, but it makes narrower cells where the points
+            // are dense, so there are more leaves, and both queries
+            // and the sampling in them get slower and less accurate.
+            // The subtrees are balanced across threads by building
+            // many small ones instead.
+            Node n;
+            n.cut_dim = longest;
+            n.cut_val = (maxs[longest] + mins[longest])/2;
+
+            // these get computed later
+            n.min_val = -INF;
+            n.max_val = INF;
+
+            // resort the input over the split
+            int pivot = 0;
+            for (int i = 0; i < nData; i++) {
+                // The next value is larger than the pivot
+                if (data[i][longest] >= n.cut_val) continue;
+
+                // We haven't seen anything larger than the pivot yet
+                if (i == pivot) {
                     pivot++;
+                    continue;
                 }
 
-                // Build the two subtrees
-                n->left = build(data, pivot);
+                // The current value is smaller than the pivot
+                float *tmp = data[i];
+                data[i] = data[pivot];
+                data[pivot] = tmp;
+                pivot++;
+            }
 
-                n->right = build(data+pivot, nData-pivot);
+            // Share the leaves between the two subtrees in proportion
+            // to their points. Both sides of the cut have at least
+            // one point, so each gets at least one leaf.
+            int leftBudget = (int)((int64_t)budget * pivot / nData);
+            leftBudget = std::max(1, std::min(budget - 1, leftBudget));
 
-                return n;
-            } else {
-                return new Leaf(leaves++, data, nData, dimensions);
+            // Build the two subtrees
+            n.left = build(data, pivot, leftBudget, out, leaves, grain, pending);
+            n.right = build(data+pivot, nData-pivot, budget - leftBudget, out, leaves, grain, pending);
+            out[idx] = n;
+        } else {
+            // Make a leaf at the mean of the points
+            Node n;
+            n.cut_dim = -1;
+            n.cut_val = n.min_val = n.max_val = 0;
+            n.left = (int)(leaves.size() / dimensions);
+            n.right = -1;
+            out[idx] = n;
+
+            size_t start = leaves.size();
+            leaves.resize(start + dimensions, 0.0f);
+            float *position = &leaves[start];
+            for (int i = 0; i < dimensions; i++) {
+                for (int j = 0; j < nData; j++) {
+                    position[i] += data[j][i];
+                }
+                position[i] /= nData;
             }
         }
-    };
-
 
+        return idx;
+    }
 };
 
-
 }
 
 #endif
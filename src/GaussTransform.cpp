@@ -10,6 +10,12 @@
 #include "Convolve.h"
 #include "File.h"
 #include "Filter.h"
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 namespace ImageStack {
 
 void GaussTransform::help() {
@@ -23,10 +29,17 @@ void GaussTransform::help() {
             " stack to indicate the standard deviation of the desired Gaussian in"
             " that dimension. Methods available are: exact (slow!); grid (the"
             " bilateral grid of Paris et al.); permutohedral (the permutohedral"
-            " lattice of Adams et al.); and gkdtree (the gaussian kdtree of Adams et"
-            " al.). If only one argument is given, the standard deviations used are"
+            " lattice of Adams et al.); gkdtree (the gaussian kdtree of Adams et"
+            " al.); ifgt (the improved fast Gauss transform of Yang et al., suited to"
+            " large standard deviations in moderately many dimensions, with an error"
+            " bound set by -ifgttolerance); and auto, which times the others the first time it sees a"
+            " problem of a given shape and remembers the fastest (see"
+            " -gausstransformtable). If only one argument is given, the standard deviations used are"
             " all one. If two arguments are given, the standard deviation is the"
-            " same in each dimension.\n"
+            " same in each dimension. Alternatively, -gausstransform can be given"
+            " the name of a Gauss transform stashed with -stashgausstransform, in"
+            " which case it replaces the top image on the stack with the result of"
+            " applying that transform to it.\n"
             "\n"
             "Usage: ImageStack -load pics/dog1.jpg -evalchannels [0] [1] [2] 1 \\\n"
             "                  -dup -evalchannels x y [0] [1] [2] -dup \\\n"
@@ -73,356 +86,1590 @@ bool GaussTransform::test() {
     out = out.channel(0) / out.channel(1);
     if (!nearlyEqual(out, correct)) return false;
 
+    printf("Testing improved fast Gauss transform\n");
+    out = GaussTransform::apply(slice, splat, values, sigma, IFGT);
+    out = out.channel(0) / out.channel(1);
+    if (!nearlyEqual(out, correct)) return false;
+
     return true;
 }
 
-void GaussTransform::parse(vector<string> args) {
-    Method m = EXACT;
-
-    assert(args.size() > 0, "-gausstransform takes at least one argument");
+namespace {
+// The names of the methods, indexed by GaussTransform::Method
+const char *methodNames[] = {"auto", "exact", "grid", "permutohedral", "gkdtree", "ifgt"};
+const int methodCount = sizeof(methodNames) / sizeof(methodNames[0]);
 
-    if (args[0] == "exact") {
-        m = EXACT;
-    } else if (args[0] == "grid") {
-        m = GRID;
-    } else if (args[0] == "permutohedral") {
-        m = PERMUTOHEDRAL;
-    } else if (args[0] == "gkdtree") {
-        m = GKDTREE;
-    } else {
-        panic("Unknown method %s\n", args[0].c_str());
+// Returns -1 if the name is not a method
+int methodFromName(const string &name) {
+    for (int i = 0; i < methodCount; i++) {
+        if (name == methodNames[i]) { return i; }
     }
+    return -1;
+}
 
-    vector<float> sigmas;
+// Parse the method and standard deviations given to -gausstransform
+// or -stashgausstransform, where the top image on the stack holds the
+// slice positions.
+void parseMethodAndSigmas(vector<string> args, const char *op,
+                          GaussTransform::Method *m, vector<float> *sigmas) {
+    assert(args.size() > 0, "%s takes at least one argument", op);
+
+    int method = methodFromName(args[0]);
+    assert(method >= 0, "Unknown method %s\n", args[0].c_str());
+    *m = (GaussTransform::Method)method;
+
+    sigmas->clear();
     if (args.size() == 1) {
-        sigmas = vector<float>(stack(0).channels, 1.0);
+        *sigmas = vector<float>(stack(0).channels, 1.0);
     } else if (args.size() == 2) {
-        sigmas = vector<float>(stack(0).channels, readFloat(args[1]));
+        *sigmas = vector<float>(stack(0).channels, readFloat(args[1]));
     } else if ((int)args.size() == 1 + stack(1).channels) {
         for (int i = 0; i < stack(0).channels; i++) {
-            sigmas.push_back(readFloat(args[i+1]));
+            sigmas->push_back(readFloat(args[i+1]));
         }
     } else {
-        panic("-gausstransform takes one argument, two arguments, or one plus the"
-              " number of channels in the second image on the stack arguments\n");
+        panic("%s takes one argument, two arguments, or one plus the"
+              " number of channels in the second image on the stack arguments\n", op);
+    }
+}
+}
+
+void GaussTransform::parse(vector<string> args) {
+    assert(args.size() > 0, "-gausstransform takes at least one argument");
+
+    map<string, GaussTransformContext>::iterator iter =
+        GaussTransformContext::stash.find(args[0]);
+    if (iter != GaussTransformContext::stash.end()) {
+        assert(args.size() == 1, "-gausstransform takes only one argument when"
+               " given the name of a stashed Gauss transform\n");
+        Image im = iter->second.apply(stack(0));
+        pop();
+        push(im);
+        return;
     }
 
+    Method m = EXACT;
+    vector<float> sigmas;
+    parseMethodAndSigmas(args, "-gausstransform", &m, &sigmas);
+
     Image im = apply(stack(0), stack(1), stack(2), sigmas, m);
     pop();
     push(im);
 }
 
+namespace {
+// Functors that read and write the vector at pixel i of an image, for
+// the lattice to call. Pixels are numbered in x, then y, then t
+// order. Vectors read can optionally be scaled per channel.
+struct PixelReader {
+    PixelReader(Image im_, const float *scale_ = NULL) : im(im_), scale(scale_) {}
+    void operator()(int i, float *vec) const {
+        int x = i % im.width, y = (i / im.width) % im.height;
+        int t = i / (im.width * im.height);
+        for (int c = 0; c < im.channels; c++) {
+            vec[c] = im(x, y, t, c);
+            if (scale) { vec[c] *= scale[c]; }
+        }
+    }
+    Image im;
+    const float *scale;
+};
+
+struct PixelWriter {
+    PixelWriter(Image im_) : im(im_) {}
+    void operator()(int i, const float *vec) const {
+        int x = i % im.width, y = (i / im.width) % im.height;
+        int t = i / (im.width * im.height);
+        for (int c = 0; c < im.channels; c++) {
+            im(x, y, t, c) = vec[c];
+        }
+    }
+    Image im;
+};
+}
+
 Image GaussTransform::apply(Image slice, Image splat, Image values,
                             vector<float> sigmas,
                             GaussTransform::Method method) {
-    assert(splat.width == values.width &&
-           splat.height == values.height &&
-           splat.frames == values.frames,
-           "Weights and locations of the Gaussians must be the same size\n");
-    assert(slice.channels == splat.channels,
-           "The evaluation locations and the locations of the Gaussians must have"
-           " the same number of channels.\n");
+    if (method == AUTO) {
+        method = chooseMethod(slice, splat, sigmas, values.channels);
+    }
+    return GaussTransformContext(slice, splat, sigmas, method).apply(values);
+}
+
+namespace {
+// A class of Gauss transform problem, for which one method is chosen
+struct TuningKey {
+    int posChannels, valueChannels, logPoints, logCells;
+    bool operator<(const TuningKey &other) const {
+        if (posChannels != other.posChannels) { return posChannels < other.posChannels; }
+        if (valueChannels != other.valueChannels) { return valueChannels < other.valueChannels; }
+        if (logPoints != other.logPoints) { return logPoints < other.logPoints; }
+        return logCells < other.logCells;
+    }
+};
+
+string hostName() {
+#ifdef WIN32
+    const char *name = getenv("COMPUTERNAME");
+    return name ? name : "unknown";
+#else
+    char name[256];
+    if (gethostname(name, sizeof(name)) != 0) { return "unknown"; }
+    name[sizeof(name)-1] = 0;
+    return name;
+#endif
+}
 
-    vector<float> invVar(sigmas.size());
-    vector<float> invSigma(sigmas.size());
+string defaultTuningFile() {
+    const char *home = getenv("HOME");
+    if (!home) { home = getenv("USERPROFILE"); }
+    if (!home) { return ""; }
+    return string(home) + "/.imagestack_gausstransform";
+}
 
-    for (size_t i = 0; i < sigmas.size(); i++) {
-        invVar[i] = 0.5f/(sigmas[i]*sigmas[i]);
-        invSigma[i] = 1.0f/sigmas[i];
+// The decisions made so far on this host, and the file they were
+// loaded from.
+map<TuningKey, GaussTransform::Method> tuningTable;
+string tuningTableFile;
+bool tuningTableLoaded = false;
+
+// Get the decision table, (re)loading it if the tuning file has
+// changed. Each line of the file is: host, position channels, value
+// channels, log2 points, log2 cells, method.
+map<TuningKey, GaussTransform::Method> &loadTuningTable() {
+    if (tuningTableLoaded && tuningTableFile == GaussTransform::tuningFile) {
+        return tuningTable;
+    }
+    tuningTable.clear();
+    tuningTableLoaded = true;
+    tuningTableFile = GaussTransform::tuningFile;
+    if (tuningTableFile.empty()) { return tuningTable; }
+
+    FILE *f = fopen(tuningTableFile.c_str(), "r");
+    if (!f) { return tuningTable; }
+    string me = hostName();
+    char host[256], method[64];
+    TuningKey k;
+    while (fscanf(f, "%255s %d %d %d %d %63s", host,
+                  &k.posChannels, &k.valueChannels, &k.logPoints, &k.logCells,
+                  method) == 6) {
+        int m = methodFromName(method);
+        if (me == host && m > 0) {
+            tuningTable[k] = (GaussTransform::Method)m;
+        }
     }
+    fclose(f);
+    return tuningTable;
+}
 
-    switch (method) {
-    case EXACT: {
-        Image out(slice.width, slice.height,
-                  slice.frames, values.channels);
-        for (int t1 = 0; t1 < slice.frames; t1++) {
-            for (int t2 = 0; t2 < splat.frames; t2++) {
-                for (int y1 = 0; y1 < slice.height; y1++) {
-                    for (int y2 = 0; y2 < splat.height; y2++) {
-                        for (int x1 = 0; x1 < slice.width; x1++) {
-                            for (int x2 = 0; x2 < splat.width; x2++) {
-                                float dist = 0;
-                                for (int c = 0; c < splat.channels; c++) {
-                                    float d = (slice(x1, y1, t1, c) -
-                                               splat(x2, y2, t2, c));
-                                    dist += d*d * invVar[c];
-                                }
-                                float weight = fastexp(-dist);
+void saveDecision(const TuningKey &k, GaussTransform::Method m) {
+    if (GaussTransform::tuningFile.empty()) { return; }
+    FILE *f = fopen(GaussTransform::tuningFile.c_str(), "a");
+    if (!f) {
+        printf("Could not record Gauss transform tuning in %s\n",
+               GaussTransform::tuningFile.c_str());
+        return;
+    }
+    fprintf(f, "%s %d %d %d %d %s\n", hostName().c_str(),
+            k.posChannels, k.valueChannels, k.logPoints, k.logCells,
+            methodNames[m]);
+    fclose(f);
+}
 
-                                for (int c = 0; c < values.channels; c++) {
-                                    out(x1, y1, t1, c) += weight * values(x2, y2, t2, c);
-                                }
-                            }
-                        }
-                    }
+// Widen the per-channel bounds to include some positions
+void updateBounds(Image im, vector<float> &lo, vector<float> &hi) {
+    for (int t = 0; t < im.frames; t++) {
+        for (int y = 0; y < im.height; y++) {
+            for (int x = 0; x < im.width; x++) {
+                for (int c = 0; c < im.channels; c++) {
+                    float v = im(x, y, t, c);
+                    lo[c] = min(lo[c], v);
+                    hi[c] = max(hi[c], v);
                 }
             }
         }
-        return out;
     }
-    case PERMUTOHEDRAL: {
-        // Create lattice
-        PermutohedralLattice lattice(splat.channels, values.channels,
-                                     values.width*values.height*values.frames);
+}
 
-        // Splat into the lattice
-        //printf("Splatting...\n");
+// A crop from the middle of some positions with at most n points
+Image centralCrop(Image im, int n) {
+    int w = min(im.width, 256);
+    int h = min(im.height, 256);
+    int f = clamp(n / (w * h), 1, im.frames);
+    return im.region((im.width - w)/2, (im.height - h)/2, (im.frames - f)/2, 0,
+                     w, h, f, im.channels);
+}
+}
 
-        vector<float> pos(splat.channels);
-        vector<float> val(values.channels);
-        for (int t = 0; t < splat.frames; t++) {
-            for (int y = 0; y < splat.height; y++) {
-                for (int x = 0; x < splat.width; x++) {
-                    for (int c = 0; c < splat.channels; c++) {
-                        pos[c] = splat(x, y, t, c) * invSigma[c];
-                    }
-                    for (int c = 0; c < values.channels; c++) {
-                        val[c] = values(x, y, t, c);
-                    }
-                    lattice.splat(&pos[0], &val[0]);
+string GaussTransform::tuningFile;
+
+GaussTransform::Method GaussTransform::chooseMethod(Image slice, Image splat,
+                                                    vector<float> sigmas,
+                                                    int valueChannels) {
+    double nSplat = (double)splat.width * splat.height * splat.frames;
+    double nSlice = (double)slice.width * slice.height * slice.frames;
+    bool same = (slice == splat);
+
+    TuningKey key;
+    key.posChannels = splat.channels;
+    key.valueChannels = valueChannels;
+    key.logPoints = (int)floor(log2(max(nSplat, nSlice)));
+
+    vector<float> lo(splat.channels, INF), hi(splat.channels, -INF);
+    updateBounds(splat, lo, hi);
+    if (!same) { updateBounds(slice, lo, hi); }
+    double logCells = 0;
+    for (int c = 0; c < splat.channels; c++) {
+        logCells += log2((hi[c] - lo[c]) / sigmas[c] + 1);
+    }
+    key.logCells = (int)floor(logCells);
+
+    map<TuningKey, Method> &table = loadTuningTable();
+    map<TuningKey, Method>::iterator iter = table.find(key);
+    if (iter != table.end()) { return iter->second; }
+
+    // Time each candidate on a crop of the problem
+    const int maxPoints = 1 << 16;
+    Image splatCrop = centralCrop(splat, maxPoints);
+    Image sliceCrop = same ? splatCrop : centralCrop(slice, maxPoints);
+    Image values(splatCrop.width, splatCrop.height, splatCrop.frames, valueChannels);
+    values.set(1.0f);
+
+    vector<Method> candidates;
+    if (nSplat * nSlice <= 1e8) { candidates.push_back(EXACT); }
+    double gridBytes = exp2(logCells) * valueChannels * sizeof(float);
+    if (splat.channels <= 5 && (gridMemoryLimit == 0 || gridBytes <= gridMemoryLimit)) {
+        candidates.push_back(GRID);
+    }
+    candidates.push_back(PERMUTOHEDRAL);
+    candidates.push_back(GKDTREE);
+    // The IFGT only pays off when the Gaussians are wide compared to
+    // the spread of the points.
+    if (logCells <= 2 * splat.channels) { candidates.push_back(IFGT); }
+
+    Method best = candidates[0];
+    float bestTime = INF;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        float start = currentTime();
+        GaussTransformContext(sliceCrop, splatCrop, sigmas, candidates[i]).apply(values);
+        float time = currentTime() - start;
+        if (time < bestTime) {
+            bestTime = time;
+            best = candidates[i];
+        }
+    }
+
+    table[key] = best;
+    saveDecision(key, best);
+    return best;
+}
+
+void GaussTransformTable::help() {
+    pprintf("-gausstransformtable prints the methods that have been chosen on this"
+            " machine for the automatic method of -gausstransform, -jointbilateral,"
+            " and related operations. The first time each class of problem is seen,"
+            " every suitable method is timed on a crop of it, and the fastest is"
+            " remembered until the program exits. Problems are classed by their"
+            " numbers of position and value channels, and by the log base two of"
+            " the number of points and of the number of Gaussian-sized cells they"
+            " span. Given the argument \"clear\", this machine's decisions are"
+            " forgotten instead.\n"
+            "\n"
+            "Given the argument \"file\", decisions are also kept between runs, in"
+            " the file $HOME/.imagestack_gausstransform, or in the file named by a"
+            " second argument. Each line of the file is tagged with the machine"
+            " it was made on. Given \"file\" and an empty filename, decisions are"
+            " no longer kept.\n"
+            "\n"
+            "Usage: ImageStack -load a.jpg -bilateral 0.1 4 -gausstransformtable\n"
+            "       ImageStack -gausstransformtable file -load a.jpg -bilateral 0.1 4\n");
+}
+
+bool GaussTransformTable::test() {
+    // Earlier automatic transforms may have filled the table, so set
+    // it aside and start empty
+    string oldFile = GaussTransform::tuningFile;
+    GaussTransform::tuningFile = "";
+    map<TuningKey, GaussTransform::Method> &table = loadTuningTable();
+    map<TuningKey, GaussTransform::Method> oldTable = table;
+    table.clear();
+
+    Image splat(40, 30, 1, 3), values(40, 30, 1, 2);
+    Noise::apply(splat, 0, 1);
+    Noise::apply(values, 0, 1);
+    values.channel(1).set(1.0f);
+    vector<float> sigmas(3, 0.3f);
+
+    // The first call should time the methods and record the winner
+    GaussTransform::Method m =
+        GaussTransform::chooseMethod(splat, splat, sigmas, values.channels);
+    bool ok = m > GaussTransform::AUTO && m < methodCount && table.size() == 1;
+
+    // The second should reuse it
+    ok = ok && GaussTransform::chooseMethod(splat, splat, sigmas, values.channels) == m;
+    ok = ok && table.size() == 1;
+
+    // And the automatic method should be correct in the homogeneous sense
+    Image correct = GaussTransform::apply(splat, splat, values, sigmas, GaussTransform::EXACT);
+    Image out = GaussTransform::apply(splat, splat, values, sigmas, GaussTransform::AUTO);
+    ok = ok && nearlyEqual(out.channel(0) / out.channel(1),
+                           correct.channel(0) / correct.channel(1));
+
+    // Decisions kept in a file should load again
+    const char *tmpDir = getenv("TMPDIR");
+    if (!tmpDir) { tmpDir = getenv("TEMP"); }
+    if (!tmpDir) { tmpDir = "/tmp"; }
+    string filename = string(tmpDir) + "/imagestack_gausstransformtable.tmp";
+    remove(filename.c_str());
+    GaussTransform::tuningFile = filename;
+    m = GaussTransform::chooseMethod(splat, splat, sigmas, values.channels);
+    GaussTransform::tuningFile = "";
+    loadTuningTable();
+    GaussTransform::tuningFile = filename;
+    map<TuningKey, GaussTransform::Method> &reloaded = loadTuningTable();
+    ok = ok && reloaded.size() == 1 && reloaded.begin()->second == m;
+    remove(filename.c_str());
+
+    GaussTransform::tuningFile = "";
+    loadTuningTable() = oldTable;
+    GaussTransform::tuningFile = oldFile;
+    loadTuningTable();
+    return ok;
+}
+
+void GaussTransformTable::parse(vector<string> args) {
+    if (args.size() > 0 && args[0] == "file") {
+        assert(args.size() <= 2, "-gausstransformtable file takes at most one filename\n");
+        GaussTransform::tuningFile = args.size() == 2 ? args[1] : defaultTuningFile();
+        assert(args.size() == 2 || !GaussTransform::tuningFile.empty(),
+               "Could not find a home directory for the tuning file\n");
+        return;
+    }
+
+    map<TuningKey, GaussTransform::Method> &table = loadTuningTable();
+
+    if (args.size() == 1 && args[0] == "clear") {
+        table.clear();
+        if (GaussTransform::tuningFile.empty()) { return; }
+
+        // Rewrite the file without this host's lines
+        vector<string> keep;
+        string me = hostName();
+        FILE *f = fopen(GaussTransform::tuningFile.c_str(), "r");
+        if (f) {
+            char line[1024], host[256];
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "%255s", host) == 1 && me != host) {
+                    keep.push_back(line);
                 }
             }
+            fclose(f);
         }
+        f = fopen(GaussTransform::tuningFile.c_str(), "w");
+        assert(f, "Could not write to %s\n", GaussTransform::tuningFile.c_str());
+        for (size_t i = 0; i < keep.size(); i++) {
+            fputs(keep[i].c_str(), f);
+        }
+        fclose(f);
+        return;
+    }
 
-        // Blur the lattice
-        //printf("Blurring...\n");
-        lattice.blur();
+    assert(args.size() == 0, "-gausstransformtable takes zero, one, or two arguments\n");
 
-        // Slice from the lattice
-        //printf("Slicing...\n");
+    printf("Gauss transform methods chosen on %s:\n", hostName().c_str());
+    printf("positions  values  log2 points  log2 cells  method\n");
+    for (map<TuningKey, GaussTransform::Method>::iterator iter = table.begin();
+         iter != table.end(); iter++) {
+        printf("%9d  %6d  %11d  %10d  %s\n",
+               iter->first.posChannels, iter->first.valueChannels,
+               iter->first.logPoints, iter->first.logCells,
+               methodNames[iter->second]);
+    }
+}
 
-        Image out(slice.width, slice.height, slice.frames, values.channels);
+size_t GaussTransform::gridMemoryLimit = (size_t)1 << 30;
 
-        if (slice == splat) {
-            lattice.beginSlice();
-            for (int t = 0; t < slice.frames; t++) {
-                for (int y = 0; y < slice.height; y++) {
-                    for (int x = 0; x < slice.width; x++) {
-                        lattice.slice(&val[0]);
-                        for (int c = 0; c < out.channels; c++) {
-                            out(x, y, t, c) = val[c];
-                        }
-                    }
-                }
+void GridMemory::help() {
+    pprintf("-gridmemory sets the most memory, in megabytes, that the bilateral"
+            " grid method of -gausstransform, -jointbilateral, and related"
+            " operations may use. Larger grids are made coarser to fit, at first"
+            " by blurring with fewer taps, and then by spacing the grid vertices"
+            " further apart than requested, which blurs more than was asked"
+            " for. The Gaussian kd-tree method is held to the same limit by giving"
+            " it fewer, larger leaves. The default is 1024.\n"
+            "\n"
+            "Usage: ImageStack -gridmemory 256 -load a.jpg -bilateral 0.1 4 4 0 grid\n");
+}
+
+bool GridMemory::test() {
+    Image im(200, 150, 1, 1);
+    Noise::apply(im, 0, 1);
+    size_t oldLimit = GaussTransform::gridMemoryLimit;
+
+    // Without a limit, the grid is as requested.
+    GaussTransform::gridMemoryLimit = 0;
+    Image fine = im.copy();
+    Bilateral::apply(fine, 2, 2, 0, 0.1, GaussTransform::GRID);
+
+    // A limit that's only slightly too small drops to fewer taps,
+    // which approximates the same filter.
+    GaussTransform::gridMemoryLimit = 256*1024;
+    Image coarse = im.copy();
+    Bilateral::apply(coarse, 2, 2, 0, 0.1, GaussTransform::GRID);
+    GaussTransform::gridMemoryLimit = oldLimit;
+    if (!nearlyEqual(fine, coarse)) return false;
+
+    // A tiny limit still produces something reasonable
+    GaussTransform::gridMemoryLimit = 1024;
+    coarse = im.copy();
+    Bilateral::apply(coarse, 2, 2, 0, 0.1, GaussTransform::GRID);
+    GaussTransform::gridMemoryLimit = oldLimit;
+    Stats s(coarse);
+    if (s.minimum() < 0 || s.maximum() > 1) return false;
+
+    // A kd-tree with a limited number of leaves stays within it
+    vector<float> data(5000*3);
+    vector<float *> points(5000);
+    for (int i = 0; i < 5000; i++) {
+        points[i] = &data[i*3];
+        for (int j = 0; j < 3; j++) data[i*3+j] = randomFloat(0, 10);
+    }
+    GKDTree unbounded(3, &points[0], 5000, 0.5f);
+    GKDTree bounded(3, &points[0], 5000, 0.5f, 100);
+    return unbounded.getLeaves() > 100 && bounded.getLeaves() <= 100 && bounded.getLeaves() > 50;
+}
+
+void GridMemory::parse(vector<string> args) {
+    assert(args.size() == 1, "-gridmemory takes one argument\n");
+    int megabytes = readInt(args[0]);
+    assert(megabytes > 0, "-gridmemory must be positive\n");
+    GaussTransform::gridMemoryLimit = (size_t)megabytes << 20;
+}
+
+float GaussTransform::ifgtTolerance = 1e-3f;
+
+void IFGTTolerance::help() {
+    pprintf("-ifgttolerance sets the error tolerance of the ifgt method of"
+            " -gausstransform and related operations, relative to the total"
+            " weight of the Gaussians. Smaller tolerances use more terms of the"
+            " Taylor expansion, and more clusters. The default is 0.001.\n"
+            "\n"
+            "Usage: ImageStack -ifgttolerance 0.0001 ... -gausstransform ifgt 4\n");
+}
+
+bool IFGTTolerance::test() {
+    Image splat(40, 30, 1, 4), values(40, 30, 1, 1);
+    Noise::apply(splat, 0, 1);
+    Noise::apply(values, 0, 1);
+    vector<float> sigmas(4, 0.5f);
+    Image correct = GaussTransform::apply(splat, splat, values, sigmas, GaussTransform::EXACT);
+    float total = 0;
+    for (int y = 0; y < values.height; y++) {
+        for (int x = 0; x < values.width; x++) {
+            total += values(x, y);
+        }
+    }
+
+    // The error should be within the tolerance at each setting
+    float oldTolerance = GaussTransform::ifgtTolerance;
+    bool ok = true;
+    for (float tol = 1e-2f; tol > 1e-5f; tol *= 0.1f) {
+        GaussTransform::ifgtTolerance = tol;
+        Image out = GaussTransform::apply(splat, splat, values, sigmas, GaussTransform::IFGT);
+        Stats s(out - correct);
+        float err = max(fabs(s.minimum()), fabs(s.maximum()));
+        ok = ok && err <= tol * total;
+    }
+    GaussTransform::ifgtTolerance = oldTolerance;
+    return ok;
+}
+
+void IFGTTolerance::parse(vector<string> args) {
+    assert(args.size() == 1, "-ifgttolerance takes one argument\n");
+    GaussTransform::ifgtTolerance = readFloat(args[0]);
+    assert(GaussTransform::ifgtTolerance > 0 && GaussTransform::ifgtTolerance < 1,
+           "The tolerance must be between zero and one\n");
+}
+
+float GaussTransform::exactTruncation = 0;
+
+void ExactTruncation::help() {
+    pprintf("-exacttruncation makes the exact method of -gausstransform and related"
+            " operations ignore Gaussians further than the given number of standard"
+            " deviations from each position, which makes it much faster for large"
+            " images with small standard deviations. The error this introduces"
+            " is at most exp(-k*k/2) relative to the largest weight. Zero, the"
+            " default, means no truncation.\n"
+            "\n"
+            "Usage: ImageStack -exacttruncation 4 -load a.jpg -bilateral 0.1 4 4 0 exact\n");
+}
+
+bool ExactTruncation::test() {
+    Image splat(70, 50, 1, 3), slice(60, 40, 1, 3), values(70, 50, 1, 2);
+    Noise::apply(splat, 0, 1);
+    Noise::apply(slice, 0, 1);
+    Noise::apply(values, 0, 1);
+    splat.channel(0).set(Expr::X() * 0.1f);
+    slice.channel(0).set(Expr::X() * 0.1f + 0.05f);
+    vector<float> sigmas(3, 0.2f);
+
+    float oldTruncation = GaussTransform::exactTruncation;
+    GaussTransform::exactTruncation = 0;
+    Image full = GaussTransform::apply(slice, splat, values, sigmas, GaussTransform::EXACT);
+    GaussTransform::exactTruncation = 5;
+    Image truncated = GaussTransform::apply(slice, splat, values, sigmas, GaussTransform::EXACT);
+    GaussTransform::exactTruncation = oldTruncation;
+
+    // Check one output directly
+    double sum = 0;
+    for (int y = 0; y < splat.height; y++) {
+        for (int x = 0; x < splat.width; x++) {
+            double dist = 0;
+            for (int c = 0; c < 3; c++) {
+                double diff = (slice(7, 9, c) - splat(x, y, c)) / sigmas[c];
+                dist += diff * diff;
             }
+            sum += exp(-dist/2) * values(x, y, 0);
+        }
+    }
+    if (fabs(sum - full(7, 9, 0)) > 1e-3 * (1 + fabs(sum))) { return false; }
+
+    Stats s(full - truncated);
+    return fabs(s.minimum()) < 1e-3 && fabs(s.maximum()) < 1e-3;
+}
+
+void ExactTruncation::parse(vector<string> args) {
+    assert(args.size() == 1, "-exacttruncation takes one argument\n");
+    GaussTransform::exactTruncation = readFloat(args[0]);
+}
+
+// The work a context does for a particular method. Subclasses do
+// everything that depends only on the positions in their
+// constructors.
+struct GaussTransformContext::Impl {
+    Impl(Image slice_, Image splat_, vector<float> sigmas) :
+        slice(slice_), splat(splat_), invVar(sigmas.size()), invSigma(sigmas.size()) {
+        for (size_t i = 0; i < sigmas.size(); i++) {
+            invVar[i] = 0.5f/(sigmas[i]*sigmas[i]);
+            invSigma[i] = 1.0f/sigmas[i];
+        }
+    }
+    virtual ~Impl() {}
+    virtual Image apply(Image values) = 0;
+
+    Image slice, splat;
+    vector<float> invVar, invSigma;
+};
+
+namespace {
+// Read the positions in an image, a point at a time, scaling each
+// channel.
+void readScaled(Image im, const vector<float> &scale, vector<float> &q) {
+    int n = im.width*im.height*im.frames;
+    int d = im.channels;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int i = 0; i < n; i++) {
+        int x = i % im.width, y = (i / im.width) % im.height;
+        int t = i / (im.width * im.height);
+        for (int c = 0; c < d; c++) {
+            q[(size_t)i*d + c] = im(x, y, t, c) * scale[c];
+        }
+    }
+}
+
+struct ExactContext : public GaussTransformContext::Impl {
+    // Slice points are handled in blocks, one block per task, against
+    // tiles of splat points small enough to stay in cache.
+    static const int SLICE_BLOCK = 64;
+    static const int SPLAT_TILE = 256;
+
+    ExactContext(Image slice_, Image splat_, vector<float> sigmas) :
+        GaussTransformContext::Impl(slice_, splat_, sigmas) {
+        d = splat.channels;
+        nSplat = splat.width*splat.height*splat.frames;
+        nSlice = slice.width*slice.height*slice.frames;
+        nPad = ((nSplat + Vec::width - 1) / Vec::width) * Vec::width;
+
+        // Positions are scaled so that the weight between two
+        // points is exp(-squared distance), and the truncation radius
+        // becomes the square root of half the cutoff squared.
+        vector<float> scale(d);
+        for (int c = 0; c < d; c++) { scale[c] = sqrtf(invVar[c]); }
+        float cutoff = GaussTransform::exactTruncation;
+        maxDist = cutoff > 0 ? 0.5f*cutoff*cutoff : INF;
+
+        vector<float> splatQ(nSplat*d), sliceQ(nSlice*d);
+        readScaled(splat, scale, splatQ);
+        if (slice == splat) {
+            sliceQ = splatQ;
         } else {
-            for (int t = 0; t < slice.frames; t++) {
-                for (int y = 0; y < slice.height; y++) {
-                    for (int x = 0; x < slice.width; x++) {
-                        for (int c = 0; c < slice.channels; c++) {
-                            pos[c] = slice(x, y, t, c) * invSigma[c];
+            readScaled(slice, scale, sliceQ);
+        }
+
+        splatOrder.resize(nSplat);
+        sliceOrder.resize(nSlice);
+        for (int i = 0; i < nSplat; i++) { splatOrder[i] = i; }
+        for (int i = 0; i < nSlice; i++) { sliceOrder[i] = i; }
+
+        if (cutoff > 0) {
+            buildCells(splatQ, sliceQ, sqrtf(maxDist));
+        }
+
+        // Splat positions are stored a channel at a time in cell
+        // order so that Vec::width of them can be loaded at once. The
+        // padding has zero value so contributes nothing.
+        splatPos.assign((size_t)d*nPad, 0.0f);
+        for (int j = 0; j < nSplat; j++) {
+            for (int c = 0; c < d; c++) {
+                splatPos[(size_t)c*nPad + j] = splatQ[(size_t)splatOrder[j]*d + c];
+            }
+        }
+        slicePos.resize((size_t)nSlice*d);
+        for (int i = 0; i < nSlice; i++) {
+            for (int c = 0; c < d; c++) {
+                slicePos[(size_t)i*d + c] = sliceQ[(size_t)sliceOrder[i]*d + c];
+            }
+        }
+    }
+
+    Image apply(Image values) {
+        int vc = values.channels;
+        Image out(slice.width, slice.height, slice.frames, vc);
+
+        // Pack the values in the same order as the splat positions
+        vector<float> vals((size_t)vc*nPad, 0.0f);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int j = 0; j < nSplat; j++) {
+            int i = splatOrder[j];
+            int x = i % splat.width, y = (i / splat.width) % splat.height;
+            int t = i / (splat.width * splat.height);
+            for (int c = 0; c < vc; c++) {
+                vals[(size_t)c*nPad + j] = values(x, y, t, c);
+            }
+        }
+
+        int blocks = (nSlice + SLICE_BLOCK - 1) / SLICE_BLOCK;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (int b = 0; b < blocks; b++) {
+            int i0 = b * SLICE_BLOCK;
+            int i1 = min(nSlice, i0 + SLICE_BLOCK);
+            vector<pair<int, int> > runs;
+            splatRuns(i0, i1, runs);
+
+            vector<float> acc((size_t)(i1 - i0) * vc * Vec::width, 0.0f);
+            float weight[SPLAT_TILE];
+            const Vec::type zero = Vec::zero();
+
+            for (size_t r = 0; r < runs.size(); r++) {
+                for (int j0 = runs[r].first; j0 < runs[r].second; j0 += SPLAT_TILE) {
+                    int len = min(SPLAT_TILE, runs[r].second - j0);
+                    for (int i = i0; i < i1; i++) {
+                        // Squared distances to the tile
+                        const float *q = &slicePos[(size_t)i*d];
+                        for (int k = 0; k < len; k += Vec::width) {
+                            Vec::type dist = zero;
+                            for (int c = 0; c < d; c++) {
+                                Vec::type diff = Vec::Sub::vec(Vec::load(&splatPos[(size_t)c*nPad + j0 + k]),
+                                                               Vec::broadcast(q[c]));
+                                dist = Vec::Add::vec(dist, Vec::Mul::vec(diff, diff));
+                            }
+                            Vec::store(dist, weight + k);
                         }
-                        lattice.slice(&pos[0], &val[0]);
-                        for (int c = 0; c < out.channels; c++) {
-                            out(x, y, t, c) = val[c];
+                        // The vectorized expf falls back to a slow path
+                        // when the result would underflow, so clamp first.
+                        for (int k = 0; k < len; k++) {
+                            weight[k] = weight[k] > maxDist ? 0.0f : expf(-min(weight[k], 80.0f));
+                        }
+
+                        // Accumulate the weighted values
+                        float *a = &acc[(size_t)(i - i0) * vc * Vec::width];
+                        for (int c = 0; c < vc; c++) {
+                            const float *v = &vals[(size_t)c*nPad + j0];
+                            Vec::type sum = Vec::load(a + c*Vec::width);
+                            for (int k = 0; k < len; k += Vec::width) {
+                                sum = Vec::Add::vec(sum, Vec::Mul::vec(Vec::load(weight + k),
+                                                                       Vec::load(v + k)));
+                            }
+                            Vec::store(sum, a + c*Vec::width);
                         }
                     }
                 }
             }
-        }
 
+            for (int i = i0; i < i1; i++) {
+                int o = sliceOrder[i];
+                int x = o % slice.width, y = (o / slice.width) % slice.height;
+                int t = o / (slice.width * slice.height);
+                const float *a = &acc[(size_t)(i - i0) * vc * Vec::width];
+                for (int c = 0; c < vc; c++) {
+                    float sum = 0;
+                    for (int k = 0; k < Vec::width; k++) { sum += a[c*Vec::width + k]; }
+                    out(x, y, t, c) = sum;
+                }
+            }
+        }
 
         return out;
     }
-    case GRID: {
-        // Create grid
-        DenseGrid grid(splat.channels, values.channels, 5);
 
-        // Splat into the grid
+private:
+    // The cell along grid dimension g that a scaled position lies in
+    int cellCoord(const float *q, int g) const {
+        int k = (int)((q[gridDims[g]] - gridMin[g]) / cellSize);
+        return clamp(k, 0, gridSize[g]-1);
+    }
 
-        vector<float> pos(splat.channels);
-        vector<float> val(values.channels);
+    int cellIndex(const float *q) const {
+        int idx = 0;
+        for (int g = (int)gridDims.size()-1; g >= 0; g--) {
+            idx = idx * gridSize[g] + cellCoord(q, g);
+        }
+        return idx;
+    }
 
-        //printf("Allocating...\n");
-        for (int t = 0; t < splat.frames; t++) {
-            for (int y = 0; y < splat.height; y++) {
-                for (int x = 0; x < splat.width; x++) {
-                    for (int c = 0; c < splat.channels; c++) {
-                        pos[c] = splat(x, y, t, c) * invSigma[c];
-                    }
-                    grid.preview(&pos[0]);
-                }
+    // Bin both sets of points into a grid over the (up to) three
+    // dimensions in which they're most spread out, with cells as
+    // wide as the truncation radius, and sort them by cell. Then
+    // a block of consecutive slice points only needs the splat
+    // points in the cells surrounding it.
+    void buildCells(const vector<float> &splatQ, const vector<float> &sliceQ, float radius) {
+        vector<float> lo(d, INF), hi(d, -INF);
+        for (int i = 0; i < nSplat; i++) {
+            for (int c = 0; c < d; c++) {
+                lo[c] = min(lo[c], splatQ[(size_t)i*d + c]);
+                hi[c] = max(hi[c], splatQ[(size_t)i*d + c]);
             }
         }
-        if (splat != slice) {
-            for (int t = 0; t < slice.frames; t++) {
-                for (int y = 0; y < slice.height; y++) {
-                    for (int x = 0; x < slice.width; x++) {
-                        for (int c = 0; c < slice.channels; c++) {
-                            pos[c] = slice(x, y, t, c) * invSigma[c];
-                        }
-                        grid.preview(&pos[0]);
-                    }
-                }
+
+        vector<pair<float, int> > extent(d);
+        for (int c = 0; c < d; c++) { extent[c] = make_pair(hi[c] - lo[c], c); }
+        std::sort(extent.rbegin(), extent.rend());
+
+        // Don't make more cells than there are points
+        cellSize = radius;
+        for (int g = 0; g < min(d, 3); g++) {
+            if (extent[g].first < cellSize) { break; }
+            gridDims.push_back(extent[g].second);
+        }
+        for (;;) {
+            double cells = 1;
+            for (size_t g = 0; g < gridDims.size(); g++) {
+                cells *= floorf(extent[g].first / cellSize) + 1;
             }
+            if (cells <= nSplat) { break; }
+            cellSize *= 1.25f;
+        }
+        for (size_t g = 0; g < gridDims.size(); g++) {
+            gridMin.push_back(lo[gridDims[g]]);
+            gridSize.push_back((int)floorf(extent[g].first / cellSize) + 1);
         }
+        cellReach = (int)ceilf(radius / cellSize);
 
-        //printf("Splatting...\n");
-        for (int t = 0; t < splat.frames; t++) {
-            for (int y = 0; y < splat.height; y++) {
-                for (int x = 0; x < splat.width; x++) {
-                    for (int c = 0; c < splat.channels; c++) {
-                        pos[c] = splat(x, y, t, c) * invSigma[c];
-                    }
-                    for (int c = 0; c < values.channels; c++) {
-                        val[c] = values(x, y, t, c);
-                    }
-                    grid.splat(&pos[0], &val[0]);
-                }
-            }
+        int cells = 1;
+        for (size_t g = 0; g < gridSize.size(); g++) { cells *= gridSize[g]; }
+
+        // Counting sort of the splat points by cell
+        vector<int> splatCell(nSplat);
+        cellStart.assign(cells + 1, 0);
+        for (int i = 0; i < nSplat; i++) {
+            splatCell[i] = cellIndex(&splatQ[(size_t)i*d]);
+            cellStart[splatCell[i] + 1]++;
+        }
+        for (int c = 0; c < cells; c++) { cellStart[c+1] += cellStart[c]; }
+        vector<int> next(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < nSplat; i++) {
+            splatOrder[next[splatCell[i]]++] = i;
         }
 
-        // Blur the grid
-        grid.blur();
+        // Sort the slice points the same way, so that blocks of them
+        // are compact
+        vector<pair<int, int> > sliceCell(nSlice);
+        for (int i = 0; i < nSlice; i++) {
+            sliceCell[i] = make_pair(cellIndex(&sliceQ[(size_t)i*d]), i);
+        }
+        std::sort(sliceCell.begin(), sliceCell.end());
+        for (int i = 0; i < nSlice; i++) { sliceOrder[i] = sliceCell[i].second; }
+    }
 
-        // Slice from the grid
-        //printf("Slicing...\n");
+    // The ranges of splat points that may be within the truncation
+    // radius of slice points i0 to i1, rounded out to whole vectors
+    // and merged.
+    void splatRuns(int i0, int i1, vector<pair<int, int> > &runs) const {
+        if (gridDims.empty()) {
+            runs.push_back(make_pair(0, nPad));
+            return;
+        }
 
-        Image out(slice.width, slice.height, slice.frames, values.channels);
+        int gd = (int)gridDims.size();
+        int cLo[3], cHi[3];
+        for (int g = 0; g < gd; g++) {
+            cLo[g] = gridSize[g];
+            cHi[g] = -1;
+        }
+        for (int i = i0; i < i1; i++) {
+            for (int g = 0; g < gd; g++) {
+                int k = cellCoord(&slicePos[(size_t)i*d], g);
+                cLo[g] = min(cLo[g], k);
+                cHi[g] = max(cHi[g], k);
+            }
+        }
+        for (int g = 0; g < gd; g++) {
+            cLo[g] = max(0, cLo[g] - cellReach);
+            cHi[g] = min(gridSize[g]-1, cHi[g] + cellReach);
+        }
 
-        for (int t = 0; t < slice.frames; t++) {
-            for (int y = 0; y < slice.height; y++) {
-                for (int x = 0; x < slice.width; x++) {
-                    for (int c = 0; c < slice.channels; c++) {
-                        pos[c] = slice(x, y, t, c) * invSigma[c];
-                    }
-                    grid.slice(&pos[0], &val[0]);
-                    for (int c = 0; c < out.channels; c++) {
-                        out(x, y, t, c) = val[c];
-                    }
-                }
+        // Each row of cells along the first grid dimension is
+        // contiguous in the sorted order.
+        int rows[2] = {1, 1};
+        for (int g = 1; g < gd; g++) { rows[g-1] = cHi[g] - cLo[g] + 1; }
+        vector<pair<int, int> > raw;
+        for (int r2 = 0; r2 < rows[1]; r2++) {
+            for (int r1 = 0; r1 < rows[0]; r1++) {
+                int idx = 0;
+                if (gd > 2) { idx = cLo[2] + r2; }
+                if (gd > 1) { idx = idx * gridSize[1] + cLo[1] + r1; }
+                int first = idx * gridSize[0] + cLo[0];
+                int last = idx * gridSize[0] + cHi[0];
+                int a = cellStart[first], e = cellStart[last + 1];
+                if (a == e) { continue; }
+                raw.push_back(make_pair((a / Vec::width) * Vec::width,
+                                        ((e + Vec::width - 1) / Vec::width) * Vec::width));
+            }
+        }
+        std::sort(raw.begin(), raw.end());
+        for (size_t r = 0; r < raw.size(); r++) {
+            if (!runs.empty() && raw[r].first <= runs.back().second) {
+                runs.back().second = max(runs.back().second, raw[r].second);
+            } else {
+                runs.push_back(raw[r]);
             }
         }
+    }
+
+    int d, nSplat, nSlice, nPad;
+    float maxDist;
+
+    // Scaled positions. Splat positions are in cell order, a channel
+    // at a time, padded to a whole number of vectors. Slice positions
+    // are in cell order, a point at a time.
+    vector<float> splatPos, slicePos;
+    vector<int> splatOrder, sliceOrder;
 
+    // The culling grid, if truncating
+    vector<int> gridDims, gridSize, cellStart;
+    vector<float> gridMin;
+    float cellSize;
+    int cellReach;
+};
+
+struct PermutohedralContext : public GaussTransformContext::Impl {
+    PermutohedralContext(Image slice_, Image splat_, vector<float> sigmas) :
+        GaussTransformContext::Impl(slice_, splat_, sigmas),
+        lattice(splat.channels, 1, splat.width*splat.height*splat.frames) {
+        // Find where each position lands in the lattice
+        lattice.build(PixelReader(splat, &invSigma[0]));
+        if (slice != splat) {
+            lattice.prepareSlice(slice.width*slice.height*slice.frames,
+                                 PixelReader(slice, &invSigma[0]));
+        }
+    }
+
+    Image apply(Image values) {
+        if (lattice.valueDimensions() != values.channels) {
+            lattice.setValueDimensions(values.channels);
+        }
+
+        // Splat into the lattice
+        //printf("Splatting...\n");
+        lattice.splat(PixelReader(values));
+
+        // Blur the lattice
+        //printf("Blurring...\n");
+        lattice.blur();
+
+        // Slice from the lattice
+        //printf("Slicing...\n");
+        Image out(slice.width, slice.height, slice.frames, values.channels);
+        lattice.slice(PixelWriter(out));
         return out;
     }
-    case GKDTREE: {
-        printf("Building...\n");
 
-        // The gkdtree requires channels to be densely packed
-        vector<float> ref(splat.channels*splat.width*splat.height*splat.frames);
-        vector<float *> points(splat.width*splat.height*splat.frames);
-        {
-            int i = 0;
-            for (int t = 0; t < splat.frames; t++) {
-                for (int y = 0; y < splat.height; y++) {
-                    for (int x = 0; x < splat.width; x++) {
-                        float *ptr = &ref[i*splat.channels];
-                        for (int c = 0; c < splat.channels; c++) {
-                            ptr[c] = invSigma[c] * splat(x, y, t, c);
-                        }
-                        points[i] = ptr;
-                        i++;
-                    }
-                }
+    PermutohedralLattice lattice;
+};
+
+struct GridContext : public GaussTransformContext::Impl {
+    GridContext(Image slice_, Image splat_, vector<float> sigmas) :
+        GaussTransformContext::Impl(slice_, splat_, sigmas), valueChannels(0) {}
+
+    Image apply(Image values) {
+        int nSplat = splat.width*splat.height*splat.frames;
+        int nSlice = slice.width*slice.height*slice.frames;
+
+        if (!grid || valueChannels != values.channels) {
+            // Create grid
+            grid.reset(new DenseGrid(splat.channels, values.channels, 5,
+                                     GaussTransform::gridMemoryLimit));
+            valueChannels = values.channels;
+
+            //printf("Allocating...\n");
+            grid->preview(nSplat, PixelReader(splat, &invSigma[0]));
+            if (splat != slice) {
+                grid->preview(nSlice, PixelReader(slice, &invSigma[0]));
             }
+        } else {
+            grid->clear();
         }
 
-        GKDTree tree(splat.channels, &points[0], points.size(), 2*0.707107);
+        //printf("Splatting...\n");
+        grid->splat(nSplat, PixelReader(splat, &invSigma[0]), PixelReader(values));
+
+        // Blur the grid
+        grid->blur();
+
+        // Slice from the grid
+        //printf("Slicing...\n");
+        Image out(slice.width, slice.height, slice.frames, values.channels);
+        grid->slice(nSlice, PixelReader(slice, &invSigma[0]), PixelWriter(out));
 
-        tree.finalize();
+        return out;
+    }
+
+    // The grid's layout depends on the number of value channels, so
+    // it's created by the first application.
+    shared_ptr<DenseGrid> grid;
+    int valueChannels;
+};
+
+struct GKDTreeContext : public GaussTransformContext::Impl {
+    static const int SPLAT_ACCURACY = 4;
+    static const int SLICE_ACCURACY = 64;
+
+    GKDTreeContext(Image slice_, Image splat_, vector<float> sigmas) :
+        GaussTransformContext::Impl(slice_, splat_, sigmas) {
+        //printf("Building...\n");
+
+        // The gkdtree requires channels to be densely packed
+        int n = splat.width*splat.height*splat.frames;
+        vector<float> ref((size_t)splat.channels*n);
+        vector<float *> points(n);
+        PixelReader reader(splat, &invSigma[0]);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int i = 0; i < n; i++) {
+            points[i] = &ref[(size_t)i*splat.channels];
+            reader(i, points[i]);
+        }
 
-        printf("%d leaves.\n", tree.getLeaves());
-        printf("Splatting...");
+        // Keep the tree and the values at its leaves within the
+        // memory limit, assuming four value channels.
+        int maxLeaves = 0;
+        if (GaussTransform::gridMemoryLimit) {
+            size_t perLeaf = GKDTree::bytesPerLeaf(splat.channels) + 4*sizeof(double);
+            maxLeaves = (int)std::max((size_t)1, std::min((size_t)n, GaussTransform::gridMemoryLimit / perLeaf));
+        }
+        tree.reset(new GKDTree(splat.channels, &points[0], points.size(), 2*0.707107, maxLeaves));
 
-        int SPLAT_ACCURACY = 4;
-        int SLICE_ACCURACY = 64;
+        tree->finalize();
 
-        vector<int> indices(max(SPLAT_ACCURACY, SLICE_ACCURACY));
-        vector<float> weights(max(SPLAT_ACCURACY, SLICE_ACCURACY));
-        vector<double> leafValues(tree.getLeaves()*values.channels);
+        //printf("%d leaves.\n", tree->getLeaves());
 
         // Compute expected number of samples to arrive at each leaf
         // and divide by it to keep values at leaves within sane
         // bounds.
-        float leafScale = tree.getLeaves();
+        float leafScale = tree->getLeaves();
         leafScale /= SPLAT_ACCURACY;
         leafScale /= splat.frames;
         leafScale /= splat.channels;
         leafScale /= splat.height;
-        printf("Multiplying all weights by %f\n", leafScale);
-
-        float *refPtr = &ref[0];
-
-        for (int t = 0; t < values.frames; t++) {
-            printf(".");
-            fflush(stdout);
-            for (int y = 0; y < values.height; y++) {
-                for (int x = 0; x < values.width; x++) {
-                    int results = tree.gaussianLookup(refPtr,
-                                                      &indices[0],
-                                                      &weights[0],
-                                                      SPLAT_ACCURACY);
-                    refPtr += splat.channels;
-                    for (int i = 0; i < results; i++) {
-                        double w = weights[i];
-
-                        // For numerical stability, disallow huge weights
-                        if (w > 1e6) w = 1e6;
-                        // Don't corrupt the tree with nans
-                        if (!isfinite(w)) continue;
-
-                        w *= leafScale;
-
-                        double *vPtr = &leafValues[indices[i]*values.channels];
-                        for (int c = 0; c < values.channels; c++) {
-                            vPtr[c] += values(x, y, t, c)*w;
-                        }
+        //printf("Multiplying all weights by %f\n", leafScale);
+
+        // Find the leaves each point splats to. Lookups that find
+        // fewer than SPLAT_ACCURACY leaves are padded with zero
+        // weights. Each point seeds its own lookup, so the result
+        // doesn't depend on the number of threads.
+        vector<int> splatIndices((size_t)n*SPLAT_ACCURACY);
+        vector<float> splatWeights((size_t)n*SPLAT_ACCURACY);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int i = 0; i < n; i++) {
+            int *indices = &splatIndices[(size_t)i*SPLAT_ACCURACY];
+            float *weights = &splatWeights[(size_t)i*SPLAT_ACCURACY];
+            int results = tree->gaussianLookup(&ref[(size_t)i*splat.channels],
+                                               indices, weights,
+                                               SPLAT_ACCURACY, i);
+            for (int j = 0; j < results; j++) {
+                double w = weights[j];
+
+                // For numerical stability, disallow huge weights
+                if (w > 1e6) w = 1e6;
+                // Don't corrupt the tree with nans
+                if (!isfinite(w)) w = 0;
+
+                weights[j] = (float)(w * leafScale);
+            }
+            for (int j = results; j < SPLAT_ACCURACY; j++) {
+                indices[j] = 0;
+                weights[j] = 0;
+            }
+        }
+
+        // Invert the lookups, sorting them by leaf, so that splatting
+        // can gather into each leaf independently.
+        int leaves = tree->getLeaves();
+        leafStart.assign(leaves+1, 0);
+        for (size_t j = 0; j < splatIndices.size(); j++) {
+            leafStart[splatIndices[j]+1]++;
+        }
+        for (int l = 0; l < leaves; l++) {
+            leafStart[l+1] += leafStart[l];
+        }
+        leafPoints.resize(splatIndices.size());
+        leafWeights.resize(splatIndices.size());
+        {
+            vector<int> next(leafStart.begin(), leafStart.end()-1);
+            for (size_t j = 0; j < splatIndices.size(); j++) {
+                int k = next[splatIndices[j]]++;
+                leafPoints[k] = (int)(j / SPLAT_ACCURACY);
+                leafWeights[k] = splatWeights[j];
+            }
+        }
+    }
+
+    Image apply(Image values) {
+        int n = values.width*values.height*values.frames;
+        int vc = values.channels;
+
+        // Pack the values densely
+        vector<float> packed((size_t)n*vc);
+        PixelReader reader(values);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int i = 0; i < n; i++) {
+            reader(i, &packed[(size_t)i*vc]);
+        }
+
+        //printf("Splatting...\n");
+        int leaves = tree->getLeaves();
+        vector<double> leafValues((size_t)leaves*vc);
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 256)
+        #endif
+        for (int l = 0; l < leaves; l++) {
+            double *vPtr = &leafValues[(size_t)l*vc];
+            for (int k = leafStart[l]; k < leafStart[l+1]; k++) {
+                double w = leafWeights[k];
+                const float *val = &packed[(size_t)leafPoints[k]*vc];
+                for (int c = 0; c < vc; c++) {
+                    vPtr[c] += val[c]*w;
+                }
+            }
+        }
+
+        Image out(slice.width, slice.height, slice.frames, vc);
+
+        //printf("Slicing...\n");
+        int m = out.width*out.height*out.frames;
+        PixelReader sliceReader(slice, &invSigma[0]);
+        PixelWriter writer(out);
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<int> indices(SLICE_ACCURACY);
+            vector<float> weights(SLICE_ACCURACY);
+            vector<float> pos(slice.channels);
+            vector<double> outDbl(vc);
+            vector<float> outVec(vc);
+
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 256)
+            #endif
+            for (int i = 0; i < m; i++) {
+                sliceReader(i, &pos[0]);
+                // Seed the slice lookups differently to the splat lookups
+                int results = tree->gaussianLookup(&pos[0],
+                                                   &indices[0],
+                                                   &weights[0],
+                                                   SLICE_ACCURACY, ~i);
+                for (int c = 0; c < vc; c++) {
+                    outDbl[c] = 0;
+                }
+                for (int j = 0; j < results; j++) {
+                    double w = weights[j];
+                    // For numerical stability, disallow huge weights
+                    if (w > 1e6) w = 1e6;
+                    // Don't corrupt the output with nans
+                    if (!isfinite(w)) continue;
+
+                    const double *vPtr = &leafValues[(size_t)indices[j]*vc];
+                    for (int c = 0; c < vc; c++) {
+                        outDbl[c] += vPtr[c]*w;
                     }
                 }
+
+                for (int c = 0; c < vc; c++) {
+                    outVec[c] = (float)outDbl[c];
+                }
+                writer(i, &outVec[0]);
             }
         }
-        printf("\n");
 
-        Image out(slice.width, slice.height, slice.frames, values.channels);
+        return out;
+    }
+
+    shared_ptr<GKDTree> tree;
 
-        vector<float> pos(slice.channels);
-        vector<double> outDbl(out.channels);
-
-        printf("Slicing...");
-        for (int t = 0; t < out.frames; t++) {
-            printf(".");
-            fflush(stdout);
-            for (int y = 0; y < out.height; y++) {
-                for (int x = 0; x < out.width; x++) {
-                    for (int c = 0; c < slice.channels; c++) {
-                        pos[c] = slice(x, y, t, c) * invSigma[c];
+    // The points that splat to each leaf and their weights, sorted
+    // by leaf. Those for leaf l start at leafStart[l].
+    vector<int> leafStart, leafPoints;
+    vector<float> leafWeights;
+};
+
+// The improved fast Gauss transform of Yang et al. The splat points
+// are grouped by farthest-point clustering, and the Gaussians in each
+// cluster are approximated by a truncated Taylor expansion about its
+// center. The number of clusters and the order of the expansion are
+// chosen to meet GaussTransform::ifgtTolerance for the least work.
+struct IFGTContext : public GaussTransformContext::Impl {
+    static const int MAX_CLUSTERS = 256;
+    static const int MAX_TERMS = 4096;
+
+    IFGTContext(Image slice_, Image splat_, vector<float> sigmas) :
+        GaussTransformContext::Impl(slice_, splat_, sigmas) {
+        d = splat.channels;
+        nSplat = splat.width*splat.height*splat.frames;
+        nSlice = slice.width*slice.height*slice.frames;
+
+        // As for the exact method, scale so that weights are
+        // exp(-squared distance).
+        vector<float> scale(d);
+        for (int c = 0; c < d; c++) { scale[c] = sqrtf(invVar[c]); }
+        splatQ.resize((size_t)nSplat*d);
+        readScaled(splat, scale, splatQ);
+        if (slice == splat) {
+            sliceQ = splatQ;
+        } else {
+            sliceQ.resize((size_t)nSlice*d);
+            readScaled(slice, scale, sliceQ);
+        }
+
+        // Gaussians further than this from a slice point contribute
+        // less than the tolerance
+        float eps = GaussTransform::ifgtTolerance;
+        cutoff = sqrtf(logf(1.0f/eps));
+
+        vector<int> centerIndex;
+        vector<float> radius;
+        farthestPoints(min(MAX_CLUSTERS, (int)ceilf(sqrtf((float)nSplat))),
+                       centerIndex, radius);
+
+        // The fraction of the bounding box a slice point can reach,
+        // for estimating how many clusters each must visit.
+        vector<float> lo(d, INF), hi(d, -INF);
+        for (int i = 0; i < nSplat; i++) {
+            for (int c = 0; c < d; c++) {
+                lo[c] = min(lo[c], splatQ[(size_t)i*d + c]);
+                hi[c] = max(hi[c], splatQ[(size_t)i*d + c]);
+            }
+        }
+
+        // Pick the number of clusters and order with the least work
+        int K = 0;
+        p = 0;
+        double bestCost = INF;
+        for (int k = 1; k <= (int)radius.size(); k++) {
+            int order = orderFor(radius[k-1], eps);
+            if (order < 0) { continue; }
+            double reach = 2*(radius[k-1] + cutoff), frac = 1;
+            for (int c = 0; c < d; c++) {
+                if (hi[c] - lo[c] > reach) { frac *= reach / (hi[c] - lo[c]); }
+            }
+            double cost = termCount(order) * (nSplat + nSlice * max(1.0, k*frac)) +
+                          (double)nSlice * k * d;
+            if (cost < bestCost) {
+                bestCost = cost;
+                K = k;
+                p = order;
+            }
+        }
+        if (K == 0) {
+            K = (int)radius.size();
+            p = 1;
+            while (termCount(p+1) <= MAX_TERMS) { p++; }
+            printf("Warning: The IFGT cannot meet a tolerance of %g with these standard"
+                   " deviations. Using %d clusters and order %d.\n", eps, K, p);
+        }
+
+        // Assign each point to the nearest of the chosen centers, and
+        // sort the points by cluster
+        centers.resize((size_t)K*d);
+        for (int k = 0; k < K; k++) {
+            for (int c = 0; c < d; c++) {
+                centers[(size_t)k*d + c] = splatQ[(size_t)centerIndex[k]*d + c];
+            }
+        }
+        vector<int> assign(nSplat);
+        vector<float> dist(nSplat);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int i = 0; i < nSplat; i++) {
+            float best = INF;
+            for (int k = 0; k < K; k++) {
+                float d2 = distance2(&splatQ[(size_t)i*d], &centers[(size_t)k*d]);
+                if (d2 < best) {
+                    best = d2;
+                    assign[i] = k;
+                }
+            }
+            dist[i] = best;
+        }
+        clusterStart.assign(K+1, 0);
+        clusterRadius.assign(K, 0.0f);
+        for (int i = 0; i < nSplat; i++) {
+            clusterStart[assign[i]+1]++;
+            clusterRadius[assign[i]] = max(clusterRadius[assign[i]], sqrtf(dist[i]));
+        }
+        for (int k = 0; k < K; k++) { clusterStart[k+1] += clusterStart[k]; }
+        members.resize(nSplat);
+        vector<int> next(clusterStart.begin(), clusterStart.end() - 1);
+        for (int i = 0; i < nSplat; i++) { members[next[assign[i]]++] = i; }
+
+        // The constant 2^|a|/a! for each multi-index a, in the same
+        // order as monomials() produces them
+        terms = (int)termCount(p);
+        constants.resize(terms);
+        vector<int> alpha((size_t)terms*d, 0), heads(d, 0);
+        constants[0] = 1;
+        int t = 1;
+        for (int k = 1; k < p; k++) {
+            int tail = t;
+            for (int c = 0; c < d; c++) {
+                int head = heads[c];
+                heads[c] = t;
+                for (int j = head; j < tail; j++, t++) {
+                    for (int e = 0; e < d; e++) { alpha[(size_t)t*d + e] = alpha[(size_t)j*d + e]; }
+                    alpha[(size_t)t*d + c]++;
+                    constants[t] = constants[j] * 2 / alpha[(size_t)t*d + c];
+                }
+            }
+        }
+    }
+
+    Image apply(Image values) {
+        int vc = values.channels;
+        int K = (int)clusterRadius.size();
+
+        // Accumulate the expansion coefficients of each cluster, a
+        // channel at a time
+        vector<double> coeffs((size_t)K*terms*vc, 0.0);
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (int k = 0; k < K; k++) {
+            vector<double> dx(d), mono(terms);
+            vector<int> heads(d);
+            double *C = &coeffs[(size_t)k*terms*vc];
+            for (int m = clusterStart[k]; m < clusterStart[k+1]; m++) {
+                int i = members[m];
+                double d2 = 0;
+                for (int c = 0; c < d; c++) {
+                    dx[c] = splatQ[(size_t)i*d + c] - centers[(size_t)k*d + c];
+                    d2 += dx[c]*dx[c];
+                }
+                double e = exp(-d2);
+                monomials(&dx[0], &mono[0], &heads[0]);
+                int x = i % splat.width, y = (i / splat.width) % splat.height;
+                int t = i / (splat.width * splat.height);
+                for (int v = 0; v < vc; v++) {
+                    double q = e * values(x, y, t, v);
+                    double *Cv = C + (size_t)v*terms;
+                    for (int a = 0; a < terms; a++) {
+                        Cv[a] += q * mono[a];
                     }
-                    int results = tree.gaussianLookup(&pos[0],
-                                                      &indices[0],
-                                                      &weights[0],
-                                                      SLICE_ACCURACY);
-                    for (int c = 0; c < out.channels; c++) {
-                        outDbl[c] = 0;
+                }
+            }
+            for (int v = 0; v < vc; v++) {
+                double *Cv = C + (size_t)v*terms;
+                for (int a = 0; a < terms; a++) {
+                    Cv[a] *= constants[a];
+                }
+            }
+        }
+
+        // Evaluate the expansions of nearby clusters at each slice
+        // point. Scratch space is allocated once per thread.
+        Image out(slice.width, slice.height, slice.frames, vc);
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<double> dy(d), mono(terms), acc(vc);
+            vector<int> heads(d);
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 64)
+            #endif
+            for (int i = 0; i < nSlice; i++) {
+                std::fill(acc.begin(), acc.end(), 0.0);
+                for (int k = 0; k < K; k++) {
+                    double d2 = 0;
+                    for (int c = 0; c < d; c++) {
+                        dy[c] = sliceQ[(size_t)i*d + c] - centers[(size_t)k*d + c];
+                        d2 += dy[c]*dy[c];
                     }
-                    for (int i = 0; i < results; i++) {
-                        double w = weights[i];
-                        // For numerical stability, disallow huge weights
-                        if (w > 1e6) w = 1e6;
-                        // Don't corrupt the output with nans
-                        if (!isfinite(w)) continue;
-
-                        double *vPtr = &leafValues[indices[i]*values.channels];
-                        for (int c = 0; c < out.channels; c++) {
-                            outDbl[c] += vPtr[c]*w;
+                    float reach = clusterRadius[k] + cutoff;
+                    if (d2 > reach*reach) { continue; }
+                    double e = exp(-d2);
+                    monomials(&dy[0], &mono[0], &heads[0]);
+                    const double *C = &coeffs[(size_t)k*terms*vc];
+                    for (int v = 0; v < vc; v++) {
+                        const double *Cv = C + (size_t)v*terms;
+                        double sum = 0;
+                        for (int a = 0; a < terms; a++) {
+                            sum += mono[a] * Cv[a];
                         }
+                        acc[v] += e * sum;
                     }
+                }
+                int x = i % slice.width, y = (i / slice.width) % slice.height;
+                int t = i / (slice.width * slice.height);
+                for (int v = 0; v < vc; v++) {
+                    out(x, y, t, v) = (float)acc[v];
+                }
+            }
+        }
 
-                    for (int c = 0; c < out.channels; c++) {
-                        out(x, y, t, c) = (float)outDbl[c];
+        return out;
+    }
+
+private:
+    float distance2(const float *a, const float *b) const {
+        float d2 = 0;
+        for (int c = 0; c < d; c++) {
+            float diff = a[c] - b[c];
+            d2 += diff*diff;
+        }
+        return d2;
+    }
+
+    // The number of multi-indices in d dimensions of degree less
+    // than the order, which is (order-1+d choose d)
+    double termCount(int order) const {
+        double n = 1;
+        for (int c = 1; c <= d; c++) {
+            n = n * (order - 1 + c) / c;
+        }
+        return n;
+    }
+
+    // The lowest order at which the truncation error for a cluster of
+    // the given radius is within the tolerance, or -1 if it would take
+    // too many terms. The bound is that of Raykar et al., maximized
+    // over the distance from the slice point to the center.
+    int orderFor(float rx, float eps) const {
+        if (rx == 0) { return 1; }
+        for (int order = 1; termCount(order) <= MAX_TERMS; order++) {
+            double ry = min(rx + cutoff, 0.5f*(rx + sqrtf(rx*rx + 2*order)));
+            double logErr = order * log(2 * rx * ry) - lgamma(order + 1.0) -
+                            (rx - ry)*(rx - ry);
+            if (logErr <= log(eps)) { return order; }
+        }
+        return -1;
+    }
+
+    // All the monomials dx^a with |a| < p, in graded order
+    void monomials(const double *dx, double *mono, int *heads) const {
+        mono[0] = 1;
+        for (int c = 0; c < d; c++) { heads[c] = 0; }
+        int t = 1;
+        for (int k = 1; k < p; k++) {
+            int tail = t;
+            for (int c = 0; c < d; c++) {
+                int head = heads[c];
+                heads[c] = t;
+                for (int j = head; j < tail; j++) {
+                    mono[t++] = dx[c] * mono[j];
+                }
+            }
+        }
+    }
+
+    // Choose up to k centers, each the splat point furthest from
+    // those already chosen. radius[j] is the furthest any point is
+    // from the first j+1 centers.
+    void farthestPoints(int k, vector<int> &centerIndex, vector<float> &radius) {
+        vector<float> nearest(nSplat, INF);
+        int next = 0;
+        for (int j = 0; j < k; j++) {
+            centerIndex.push_back(next);
+            const float *cq = &splatQ[(size_t)next*d];
+            float furthest = -1;
+            int furthestIndex = 0;
+            #ifdef _OPENMP
+            #pragma omp parallel
+            #endif
+            {
+                float localFurthest = -1;
+                int localIndex = 0;
+                #ifdef _OPENMP
+                #pragma omp for nowait
+                #endif
+                for (int i = 0; i < nSplat; i++) {
+                    nearest[i] = min(nearest[i], distance2(&splatQ[(size_t)i*d], cq));
+                    if (nearest[i] > localFurthest) {
+                        localFurthest = nearest[i];
+                        localIndex = i;
+                    }
+                }
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                {
+                    if (localFurthest > furthest ||
+                        (localFurthest == furthest && localIndex < furthestIndex)) {
+                        furthest = localFurthest;
+                        furthestIndex = localIndex;
                     }
                 }
             }
+            radius.push_back(sqrtf(furthest));
+            next = furthestIndex;
+            if (furthest == 0) { break; }
         }
-        printf("\n");
+    }
 
-        return out;
+    int d, nSplat, nSlice, p, terms;
+    float cutoff;
+
+    // Scaled positions, a point at a time
+    vector<float> splatQ, sliceQ;
+
+    // The cluster centers, and the splat points in each cluster
+    vector<float> centers, clusterRadius;
+    vector<int> clusterStart, members;
+    vector<double> constants;
+};
+}
+
+map<string, GaussTransformContext> GaussTransformContext::stash;
+
+GaussTransformContext::GaussTransformContext(Image slice, Image splat,
+                                             vector<float> sigmas,
+                                             GaussTransform::Method method) {
+    assert(slice.channels == splat.channels,
+           "The evaluation locations and the locations of the Gaussians must have"
+           " the same number of channels.\n");
+    assert((int)sigmas.size() == splat.channels,
+           "There must be one standard deviation per channel of the positions\n");
+
+    if (method == GaussTransform::AUTO) {
+        method = GaussTransform::chooseMethod(slice, splat, sigmas, 4);
     }
-    default: {
+
+    switch (method) {
+    case GaussTransform::EXACT:
+        impl.reset(new ExactContext(slice, splat, sigmas));
+        break;
+    case GaussTransform::PERMUTOHEDRAL:
+        impl.reset(new PermutohedralContext(slice, splat, sigmas));
+        break;
+    case GaussTransform::GRID:
+        impl.reset(new GridContext(slice, splat, sigmas));
+        break;
+    case GaussTransform::GKDTREE:
+        impl.reset(new GKDTreeContext(slice, splat, sigmas));
+        break;
+    case GaussTransform::IFGT:
+        impl.reset(new IFGTContext(slice, splat, sigmas));
+        break;
+    default:
         panic("This Gauss transform method not yet implemented\n");
-        return Image();
     }
+}
+
+Image GaussTransformContext::apply(Image values) {
+    assert(defined(), "Applying an empty Gauss transform context\n");
+    assert(impl->splat.width == values.width &&
+           impl->splat.height == values.height &&
+           impl->splat.frames == values.frames,
+           "Weights and locations of the Gaussians must be the same size\n");
+    return impl->apply(values);
+}
+
+void StashGaussTransform::help() {
+    pprintf("-stashgausstransform prepares a Gauss transform (see -gausstransform)"
+            " for repeated use and stashes it under the given name. It removes the"
+            " top two images from the stack, which give the positions at which to"
+            " evaluate the transform and the locations of the Gaussians"
+            " respectively. The remaining arguments are as for -gausstransform."
+            " Applying the stashed transform with -gausstransform or"
+            " -jointbilateral then only needs to splat, blur, and slice the"
+            " weights, which is much cheaper than starting from scratch.\n"
+            "\n"
+            "Usage: ImageStack -load ref.jpg -evalchannels x/4 y/4 [0]/0.1 [1]/0.1 [2]/0.1 \\\n"
+            "                  -dup -stashgausstransform ref permutohedral \\\n"
+            "                  -load a.jpg -jointbilateral ref -save a_filtered.jpg \\\n"
+            "                  -load b.jpg -jointbilateral ref -save b_filtered.jpg\n");
+}
+
+bool StashGaussTransform::test() {
+    Image splat(56, 34, 2, 3);
+    Image slice(56, 34, 2, 3);
+    Noise::apply(splat, 0, 1);
+    Noise::apply(slice, 0, 1);
+    vector<float> sigma(3, 0.3f);
+
+    // Reuse each kind of context with a differing number of channels
+    // of weights, and check the results against the exact
+    // solution. As in the test for -gausstransform, only the
+    // homogeneous result is meaningful.
+    GaussTransform::Method methods[] = {GaussTransform::GRID,
+                                        GaussTransform::PERMUTOHEDRAL,
+                                        GaussTransform::GKDTREE,
+                                        GaussTransform::IFGT
+                                       };
+    for (int i = 0; i < 4; i++) {
+        GaussTransformContext context(slice, splat, sigma, methods[i]);
+        for (int channels = 2; channels <= 3; channels++) {
+            Image values(56, 34, 2, channels);
+            Noise::apply(values, 0, 1);
+            values.channel(channels-1).set(1.0f);
+            Image correct = GaussTransform::apply(slice, splat, values, sigma,
+                                                  GaussTransform::EXACT);
+            Image out = context.apply(values);
+            for (int c = 0; c < channels-1; c++) {
+                if (!nearlyEqual(out.channel(c) / out.channel(channels-1),
+                                 correct.channel(c) / correct.channel(channels-1))) {
+                    return false;
+                }
+            }
+        }
     }
+
+    return true;
+}
+
+void StashGaussTransform::parse(vector<string> args) {
+    assert(args.size() > 1, "-stashgausstransform takes at least two arguments\n");
+    GaussTransform::Method m = GaussTransform::EXACT;
+    vector<float> sigmas;
+    parseMethodAndSigmas(vector<string>(args.begin()+1, args.end()),
+                         "-stashgausstransform", &m, &sigmas);
+    GaussTransformContext::stash[args[0]] =
+        GaussTransformContext(stack(0), stack(1), sigmas, m);
+    pop();
+    pop();
 }
 
 
@@ -434,7 +1681,9 @@ void JointBilateral::help() {
             " -gausstransform for a description of the methods). If the method is"
             " omitted it automatically chooses an appropriate one. Temporal standard"
             " deviation defaults to zero, and standard deviation in height defaults"
-            " to the same as the standard deviation in width\n"
+            " to the same as the standard deviation in width. Alternatively, given"
+            " the name of a filter stashed with -stashjointbilateral or"
+            " -stashgausstransform, it filters the top image on the stack with that.\n"
             "\n"
             "Usage: ImageStack -load ref.jpg -load im.jpg -jointbilateral 0.1 4\n");
 }
@@ -474,8 +1723,17 @@ void JointBilateral::parse(vector<string> args) {
     float colorSigma, filterWidth, filterHeight, filterFrames = 0;
     GaussTransform::Method m = GaussTransform::AUTO;
 
+    if (args.size() == 1) {
+        map<string, GaussTransformContext>::iterator iter =
+            GaussTransformContext::stash.find(args[0]);
+        assert(iter != GaussTransformContext::stash.end(),
+               "No joint bilateral filter with name %s was stashed\n", args[0].c_str());
+        apply(stack(0), iter->second);
+        return;
+    }
+
     if (args.size() < 2 || args.size() > 5) {
-        panic("-jointbilateral takes from two to five arguments\n");
+        panic("-jointbilateral takes one argument, or from two to five arguments\n");
         return;
     }
 
@@ -485,17 +1743,9 @@ void JointBilateral::parse(vector<string> args) {
     if (args.size() > 2) { filterHeight = readFloat(args[2]); }
     if (args.size() > 3) { filterFrames = readFloat(args[3]); }
     if (args.size() > 4) {
-        if (args[4] == "exact") {
-            m = GaussTransform::EXACT;
-        } else if (args[4] == "grid") {
-            m = GaussTransform::GRID;
-        } else if (args[4] == "permutohedral") {
-            m = GaussTransform::PERMUTOHEDRAL;
-        } else if (args[4] == "gkdtree") {
-            m = GaussTransform::GKDTREE;
-        } else {
-            panic("Unknown method %s\n", args[4].c_str());
-        }
+        int method = methodFromName(args[4]);
+        assert(method >= 0, "Unknown method %s\n", args[4].c_str());
+        m = (GaussTransform::Method)method;
     }
 
     apply(stack(0), stack(1), filterWidth, filterHeight, filterFrames, colorSigma, m);
@@ -550,17 +1800,11 @@ void JointBilateral::apply(Image im, Image ref,
     int filterSizeY = filterY ? ((int)(filterHeight * 6 + 1) | 1) : 1;
     int filterSizeT = filterT ? ((int)(filterFrames * 6 + 1) | 1) : 1;
 
-    if (method == GaussTransform::AUTO) {
-        // This is approximately the selection procedure given by
-        // figure 7 in "Fast High-Dimensional Gaussian Filtering using
-        // the Permutohedral Lattice"
-        if (filterSizeT * filterSizeX * filterSizeY < 16) {
-            method = GaussTransform::EXACT;
-        } else {
-            if (posChannels <= 4) { method = GaussTransform::GRID; }
-            else if (posChannels <= 10) { method = GaussTransform::PERMUTOHEDRAL; }
-            else { method = GaussTransform::GKDTREE; }
-        }
+    // Small filters are best done directly. Otherwise the context
+    // picks the fastest method for this machine.
+    if (method == GaussTransform::AUTO &&
+        filterSizeT * filterSizeX * filterSizeY < 16) {
+        method = GaussTransform::EXACT;
     }
 
     if (method == GaussTransform::EXACT) {
@@ -637,46 +1881,131 @@ void JointBilateral::apply(Image im, Image ref,
         im.set(out);
 
     } else {
+        apply(im, context(ref, filterWidth, filterHeight, filterFrames, colorSigma, method));
+    }
+}
 
-        // Convert the problem to a gauss transform.  We could
-        // theoretically be faster by calling the various Gauss transform
-        // methods directly, but it would involve copy pasting large
-        // amounts of code with minor tweaks.
+GaussTransformContext JointBilateral::context(Image ref,
+                                              float filterWidth, float filterHeight,
+                                              float filterFrames, float colorSigma,
+                                              GaussTransform::Method method) {
+    assert((ref.width == 1 || filterWidth > 0) &&
+           (ref.height == 1 || filterHeight > 0) &&
+           (ref.frames == 1 || filterFrames > 0),
+           "A reusable joint bilateral filter must have a non-zero standard"
+           " deviation in each dimension in which the reference is larger than one\n");
 
-        Image splat(im.width, im.height, im.frames, posChannels);
-        Image values(im.width, im.height, im.frames, im.channels+1);
+    int posChannels = ref.channels;
+    bool filterX = ref.width > 1 && filterWidth < 10*ref.width;
+    bool filterY = ref.height > 1 && filterHeight < 10*ref.height;
+    bool filterT = ref.frames > 1 && filterFrames < 10*ref.frames;
+    if (filterX) posChannels++;
+    if (filterY) posChannels++;
+    if (filterT) posChannels++;
 
-        // Add a homogeneous channel
-        values.selectChannels(0, im.channels).set(im);
-        values.channel(im.channels).set(1.0f);
+    // Convert the problem to a gauss transform.  We could
+    // theoretically be faster by calling the various Gauss transform
+    // methods directly, but it would involve copy pasting large
+    // amounts of code with minor tweaks.
 
-        // Compute the splat positions. First add the color terms
-        splat.selectChannels(0, ref.channels).set(ref / colorSigma);
-        {
-            // Then the spatial terms
-            int c = ref.channels;
-            if (filterX) {
-                splat.channel(c++).set(Expr::X() / filterWidth);
-            }
-            if (filterY) {
-                splat.channel(c++).set(Expr::Y() / filterHeight);
-            }
-            if (filterT) {
-                splat.channel(c++).set(Expr::T() / filterFrames);
-            }
+    Image splat(ref.width, ref.height, ref.frames, posChannels);
+
+    // Compute the splat positions. First add the color terms
+    splat.selectChannels(0, ref.channels).set(ref / colorSigma);
+    {
+        // Then the spatial terms
+        int c = ref.channels;
+        if (filterX) {
+            splat.channel(c++).set(Expr::X() / filterWidth);
+        }
+        if (filterY) {
+            splat.channel(c++).set(Expr::Y() / filterHeight);
+        }
+        if (filterT) {
+            splat.channel(c++).set(Expr::T() / filterFrames);
         }
+    }
 
-        // Do the Gauss transform
-        vector<float> sigmas(splat.channels, 1);
-        values = GaussTransform::apply(splat, splat, values, sigmas, method);
+    vector<float> sigmas(splat.channels, 1);
+    return GaussTransformContext(splat, splat, sigmas, method);
+}
 
-        // Normalize
-        for (int c = 0; c < im.channels; c++) {
-            im.channel(c).set(values.channel(c) / values.channel(im.channels));
+void JointBilateral::apply(Image im, GaussTransformContext context) {
+    Image values(im.width, im.height, im.frames, im.channels+1);
+
+    // Add a homogeneous channel
+    values.selectChannels(0, im.channels).set(im);
+    values.channel(im.channels).set(1.0f);
+
+    // Do the Gauss transform
+    values = context.apply(values);
+
+    // Normalize
+    for (int c = 0; c < im.channels; c++) {
+        im.channel(c).set(values.channel(c) / values.channel(im.channels));
+    }
+}
+
+void StashJointBilateral::help() {
+    pprintf("-stashjointbilateral prepares a joint bilateral filter against the"
+            " top image on the stack for repeated use, removes that image, and"
+            " stashes the filter under the given name. The remaining arguments are"
+            " as for -jointbilateral, except that the standard deviations must be"
+            " non-zero. Each subsequent -jointbilateral with that name then filters"
+            " the top image on the stack with it, which is much cheaper than"
+            " starting from scratch.\n"
+            "\n"
+            "Usage: ImageStack -load ref.jpg -stashjointbilateral ref 0.1 4 \\\n"
+            "                  -load a.jpg -jointbilateral ref -save a_filtered.jpg \\\n"
+            "                  -load b.jpg -jointbilateral ref -save b_filtered.jpg\n");
+}
+
+bool StashJointBilateral::test() {
+    Image ref(60, 50, 3, 3);
+    Noise::apply(ref, 0, 1);
+
+    GaussTransform::Method methods[] = {GaussTransform::GRID,
+                                        GaussTransform::PERMUTOHEDRAL,
+                                        GaussTransform::GKDTREE
+                                       };
+    for (int i = 0; i < 3; i++) {
+        GaussTransformContext context =
+            JointBilateral::context(ref, 3, 4, 1, 0.25, methods[i]);
+        for (int j = 0; j < 2; j++) {
+            Image im(ref.width, ref.height, ref.frames, 2+j);
+            Noise::apply(im, 0, 1);
+            Image correct = im.copy(), out = im.copy();
+            JointBilateral::apply(correct, ref, 3, 4, 1, 0.25, methods[i]);
+            JointBilateral::apply(out, context);
+            if (!nearlyEqual(out, correct)) return false;
         }
     }
+
+    return true;
 }
 
+void StashJointBilateral::parse(vector<string> args) {
+    GaussTransform::Method m = GaussTransform::AUTO;
+
+    if (args.size() < 3 || args.size() > 6) {
+        panic("-stashjointbilateral takes from three to six arguments\n");
+        return;
+    }
+
+    float colorSigma = readFloat(args[1]);
+    float filterWidth = readFloat(args[2]), filterHeight = filterWidth, filterFrames = 0;
+    if (args.size() > 3) { filterHeight = readFloat(args[3]); }
+    if (args.size() > 4) { filterFrames = readFloat(args[4]); }
+    if (args.size() > 5) {
+        int method = methodFromName(args[5]);
+        assert(method >= 0, "Unknown method %s\n", args[5].c_str());
+        m = (GaussTransform::Method)method;
+    }
+
+    GaussTransformContext::stash[args[0]] =
+        JointBilateral::context(stack(0), filterWidth, filterHeight, filterFrames, colorSigma, m);
+    pop();
+}
 
 void Bilateral::help() {
     pprintf("-bilateral blurs the top image in the second without crossing"
@@ -692,7 +2021,27 @@ void Bilateral::help() {
 }
 
 bool Bilateral::test() {
-    // Bilateral just blindly calls joint bilateral
+    // Bilateral just calls joint bilateral, which tests the
+    // methods. Check here that the grid gives the same result
+    // regardless of the number of threads.
+    #ifdef _OPENMP
+    Image im(300, 300, 1, 1);
+    for (int y = 0; y < im.height; y++) {
+        for (int x = 0; x < im.width; x++) {
+            im(x, y) = (x + y) / 600.0f;
+        }
+    }
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    Image serial = im.copy();
+    Bilateral::apply(serial, 4, 4, 0, 0.1, GaussTransform::GRID);
+    omp_set_num_threads(4);
+    Image parallel = im.copy();
+    Bilateral::apply(parallel, 4, 4, 0, 0.1, GaussTransform::GRID);
+    omp_set_num_threads(threads);
+    Stats s(serial - parallel);
+    if (std::max(fabs(s.minimum()), fabs(s.maximum())) > 1e-4) return false;
+    #endif
     return true;
 }
 
@@ -711,17 +2060,9 @@ void Bilateral::parse(vector<string> args) {
     if (args.size() > 2) { filterHeight = readFloat(args[2]); }
     if (args.size() > 3) { filterFrames = readFloat(args[3]); }
     if (args.size() > 4) {
-        if (args[4] == "exact") {
-            m = GaussTransform::EXACT;
-        } else if (args[4] == "grid") {
-            m = GaussTransform::GRID;
-        } else if (args[4] == "permutohedral") {
-            m = GaussTransform::PERMUTOHEDRAL;
-        } else if (args[4] == "gkdtree") {
-            m = GaussTransform::GKDTREE;
-        } else {
-            panic("Unknown method %s\n", args[4].c_str());
-        }
+        int method = methodFromName(args[4]);
+        assert(method >= 0, "Unknown method %s\n", args[4].c_str());
+        m = (GaussTransform::Method)method;
     }
 
     apply(stack(0), filterWidth, filterHeight, filterFrames, colorSigma, m);
@@ -847,17 +2188,9 @@ void NLMeans::parse(vector<string> args) {
 
     GaussTransform::Method m = GaussTransform::AUTO;
     if (args.size() > 4) {
-        if (args[4] == "exact") {
-            m = GaussTransform::EXACT;
-        } else if (args[4] == "grid") {
-            m = GaussTransform::GRID;
-        } else if (args[4] == "permutohedral") {
-            m = GaussTransform::PERMUTOHEDRAL;
-        } else if (args[4] == "gkdtree") {
-            m = GaussTransform::GKDTREE;
-        } else {
-            panic("Unknown method %s\n", args[4].c_str());
-        }
+        int method = methodFromName(args[4]);
+        assert(method >= 0, "Unknown method %s\n", args[4].c_str());
+        m = (GaussTransform::Method)method;
     }
 
     apply(stack(0), patchSize, dimensions, spatialSigma, patchSigma, m);
@@ -914,17 +2247,9 @@ void NLMeans3D::parse(vector<string> args) {
 
     GaussTransform::Method m = GaussTransform::AUTO;
     if (args.size() > 4) {
-        if (args[4] == "exact") {
-            m = GaussTransform::EXACT;
-        } else if (args[4] == "grid") {
-            m = GaussTransform::GRID;
-        } else if (args[4] == "permutohedral") {
-            m = GaussTransform::PERMUTOHEDRAL;
-        } else if (args[4] == "gkdtree") {
-            m = GaussTransform::GKDTREE;
-        } else {
-            panic("Unknown method %s\n", args[4].c_str());
-        }
+        int method = methodFromName(args[4]);
+        assert(method >= 0, "Unknown method %s\n", args[4].c_str());
+        m = (GaussTransform::Method)method;
     }
 
     apply(stack(0), patchSize, dimensions, spatialSigma, patchSigma, m);
@@ -944,9 +2269,16 @@ void NLMeans3D::apply(Image image, float patchSize, int dimensions,
 void FastNLMeans::help() {
     pprintf("-fastnlmeans is a variant of non-local means that is fast for small"
             " spatial search sizes. The three arguments are the patch size, the"
-            " spatial standard deviation, and the patch-space standard deviation.\n"
+            " spatial standard deviation, and the patch-space standard deviation."
+            " An optional fourth argument gives a standard deviation across frames,"
+            " in which case patches are also compared to those in nearby frames,"
+            " which is useful for video.\n"
             "\n"
-            "Usage: ImageStack -load noisy.jpg -fastnlmeans 2 3 0.1 -save denoised.jpg");
+            "The image is processed in tiles of rows in parallel, each of which"
+            " searches every offset and accumulates into a tile-sized buffer.\n"
+            "\n"
+            "Usage: ImageStack -load noisy.jpg -fastnlmeans 2 3 0.1 -save denoised.jpg\n"
+            "       ImageStack -loadframes noisy*.png -fastnlmeans 2 3 0.1 1 -saveframes out%%03d.png\n");
 }
 
 bool FastNLMeans::test() {
@@ -961,78 +2293,225 @@ bool FastNLMeans::test() {
     // For noisy/2 to not be nearly equal dog/2, but noisy to be
     // nearly equal to dog, a substantial improvement must have been
     // made.
-    return nearlyEqual(out, dog);
+    if (!nearlyEqual(out, dog)) { return false; }
+
+    // Denoise a still video with independent noise in each frame,
+    // searching across frames
+    Image video(dog.width, dog.height, 3, dog.channels);
+    for (int t = 0; t < video.frames; t++) {
+        video.frame(t).set(dog);
+    }
+    Noise::apply(video, -0.4, 0.4);
+    out = FastNLMeans::apply(video, 1, 2, 0.1, 1);
+    for (int t = 0; t < video.frames; t++) {
+        if (!nearlyEqual(out.frame(t), dog)) { return false; }
+    }
+    return true;
 }
 
 void FastNLMeans::parse(vector<string> args) {
-    assert(args.size() == 3, "-fastnlmeans takes three arguments\n");
-    Image out = apply(stack(0), readFloat(args[0]), readFloat(args[1]), readFloat(args[2]));
+    assert(args.size() == 3 || args.size() == 4, "-fastnlmeans takes three or four arguments\n");
+    float frameSigma = 0;
+    if (args.size() > 3) { frameSigma = readFloat(args[3]); }
+    Image out = apply(stack(0), readFloat(args[0]), readFloat(args[1]), readFloat(args[2]),
+                      frameSigma);
     pop();
     push(out);
 }
 
-Image FastNLMeans::apply(Image im, float patchSize, float spatialSigma, float patchSigma) {
-    Image out = im.copy();
-    Image weight(im.width, im.height, im.frames, 1);
-    weight.set(1);
+namespace {
+// An offset searched by -fastnlmeans, and its spatial weight
+struct NLMOffset {
+    int dx, dy, dt;
+    float weight;
+};
 
-    // Iterate over all offsets
-    int radius = (int)(ceilf(spatialSigma*4));
-    for (int dy = -radius; dy <= radius; dy++) {
-        for (int dx = -radius; dx <= radius; dx++) {
-            if (dx == 0 && dy == 0) {
-                // Already taken care of in the initialization of out and weight
-                continue;
+// Compare an image to itself shifted by an offset, and add the
+// resulting patch weights into acc, which holds rows y0 onwards of
+// frame t0 of the output, and whose last channel holds the total
+// weight. The patch distance is the box-filtered difference summed
+// over channels. Rows are box filtered horizontally as they are
+// reached, and kept in a ring buffer holding just the rows that the
+// vertical running sum adds and removes.
+void fastNLMeansOffset(Image im, Image acc, int y0, int t0,
+                       NLMOffset o, int r, float invPatchVar) {
+    // Pixel (x, y, t) of the overlap is (x+ax, y+ay, t+at) in one
+    // copy of the image, and (x+bx, y+by, t+bt) in the other.
+    const int w = im.width - abs(o.dx);
+    const int h = im.height - abs(o.dy);
+    const int f = im.frames - abs(o.dt);
+    const int ax = max(o.dx, 0), ay = max(o.dy, 0), at = max(o.dt, 0);
+    const int bx = max(-o.dx, 0), by = max(-o.dy, 0), bt = max(-o.dt, 0);
+    const int wc = im.channels;
+    const int ring = 2*r + 2;
+    const int y1 = y0 + acc.height;
+
+    // The overlap frames and rows which land in the tile on either
+    // side. If both sides are in the same frame they share one pass,
+    // which also covers the rows in between.
+    struct Pass {
+        int t, lo, hi;
+        bool a, b;
+    } passes[2];
+    int numPasses = 0;
+    int ta = t0 - at, tb = t0 - bt;
+    if (ta == tb) {
+        Pass p = {ta, min(y0 - ay, y0 - by), max(y1 - ay, y1 - by), true, true};
+        passes[numPasses++] = p;
+    } else {
+        Pass pa = {ta, y0 - ay, y1 - ay, true, false};
+        Pass pb = {tb, y0 - by, y1 - by, false, true};
+        passes[numPasses++] = pa;
+        passes[numPasses++] = pb;
+    }
+
+    vector<float> diff(w), rows((size_t)ring * w), weight(w), invCount(w);
+    vector<double> colSum(w);
+    for (int x = 0; x < w; x++) {
+        invCount[x] = 1.0f / (min(x + r, w - 1) - max(x - r, 0) + 1);
+    }
+
+    for (int i = 0; i < numPasses; i++) {
+        const int t = passes[i].t;
+        const int lo = max(passes[i].lo, 0), hi = min(passes[i].hi, h);
+        if (t < 0 || t >= f || lo >= hi) { continue; }
+
+        std::fill(colSum.begin(), colSum.end(), 0.0);
+        for (int y = lo - 2*r; y < hi; y++) {
+            // Box filter the differences of row y + r horizontally,
+            // and add it to the running sum
+            int yn = y + r;
+            if (yn >= 0 && yn < h) {
+                std::fill(diff.begin(), diff.end(), 0.0f);
+                for (int c = 0; c < wc; c++) {
+                    const float *pa = &im(ax, yn + ay, t + at, c);
+                    const float *pb = &im(bx, yn + by, t + bt, c);
+                    for (int x = 0; x < w; x++) {
+                        diff[x] += pa[x] - pb[x];
+                    }
+                }
+                float *row = &rows[(size_t)(yn % ring) * w];
+                float sum = 0;
+                for (int x = 0; x < min(r, w); x++) { sum += diff[x]; }
+                for (int x = 0; x < w; x++) {
+                    if (x + r < w) { sum += diff[x + r]; }
+                    if (x - r > 0) { sum -= diff[x - r - 1]; }
+                    row[x] = sum * invCount[x];
+                    colSum[x] += row[x];
+                }
             }
-            if (dx < 0 || (dx == 0 && dy < 0)) {
-                // We take care of these cases using symmetry
-                continue;
+            if (y < lo) { continue; }
+
+            // Drop row y - r - 1, which has left the box
+            int yo = y - r - 1;
+            if (yo >= max(lo - r, 0)) {
+                const float *row = &rows[(size_t)(yo % ring) * w];
+                for (int x = 0; x < w; x++) {
+                    colSum[x] -= row[x];
+                }
             }
 
-            float spatialWeight = expf(-(dx*dx + dy*dy)/(2*spatialSigma*spatialSigma));
-            if (spatialWeight < 0.05) continue;
-
-            // 1) Compare image to shifted version of itself
-            // size of overlap region
-            const int w = im.width - abs(dx);
-            const int h = im.height - abs(dy);
-            const int f = im.frames;
-            // Subtract
-            Image delta =
-                im.region(max(dx, 0), max(dy, 0), 0, 0, w, h, f, im.channels) -
-                im.region(max(-dx, 0), max(-dy, 0), 0, 0, w, h, f, im.channels);
-
-            // 2) blur the square difference to get the patch-space distance
-            FastBlur::apply(delta, patchSize, patchSize, 0);
-            // Sum over color channels
-            for (int c = 1; c < delta.channels; c++) {
-                delta.channel(0) += delta.channel(c);
+            // Turn the distances into weights. The -0.1 and the max
+            // make this Gaussian-like function truncate at 3
+            // standard deviations.
+            float invRows = 1.0f / (min(h - 1, y + r) - max(0, y - r) + 1);
+            for (int x = 0; x < w; x++) {
+                float d = (float)colSum[x] * invRows;
+                weight[x] = o.weight * max(0.0f, 1.1f/(d*d*invPatchVar + 1) - 0.1f);
             }
-            delta = delta.channel(0);
-
-            // 3) Pass the patch-space distance into a
-            // cheap-to-compute Gaussian-like function to get the
-            // patch weight. The -0.1 and the max makes it truncate at
-            // 3 standard deviations.
-            delta.set(spatialWeight * max(0, 1.1f/((delta*delta)/(patchSigma*patchSigma) + 1) - 0.1));
-
-            // 4) Accumulate into the output.
-            // We transfer energy in the +dx, +dy and the -dx, -dy directions using the same weights
-            weight.region(max(dx, 0), max(dy, 0), 0, 0, w, h, f, 1) += delta;
-            weight.region(max(-dx, 0), max(-dy, 0), 0, 0, w, h, f, 1) += delta;
-            for (int c = 0; c < im.channels; c++) {
-                out.region(max(dx, 0), max(dy, 0), 0, c, w, h, f, 1) += delta *
-                    im.region(max(-dx, 0), max(-dy, 0), 0, c, w, h, f, 1);
-                out.region(max(-dx, 0), max(-dy, 0), 0, c, w, h, f, 1) += delta *
-                    im.region(max(dx, 0), max(dy, 0), 0, c, w, h, f, 1);
+
+            // Transfer energy in both directions using the same
+            // weights, to whichever sides are in the tile
+            if (passes[i].a && y + ay >= y0 && y + ay < y1) {
+                float *wa = &acc(ax, y + ay - y0, 0, wc);
+                for (int x = 0; x < w; x++) {
+                    wa[x] += weight[x];
+                }
+                for (int c = 0; c < wc; c++) {
+                    const float *pb = &im(bx, y + by, t + bt, c);
+                    float *oa = &acc(ax, y + ay - y0, 0, c);
+                    for (int x = 0; x < w; x++) {
+                        oa[x] += weight[x] * pb[x];
+                    }
+                }
+            }
+            if (passes[i].b && y + by >= y0 && y + by < y1) {
+                float *wb = &acc(bx, y + by - y0, 0, wc);
+                for (int x = 0; x < w; x++) {
+                    wb[x] += weight[x];
+                }
+                for (int c = 0; c < wc; c++) {
+                    const float *pa = &im(ax, y + ay, t + at, c);
+                    float *ob = &acc(bx, y + by - y0, 0, c);
+                    for (int x = 0; x < w; x++) {
+                        ob[x] += weight[x] * pa[x];
+                    }
+                }
             }
         }
     }
+}
+}
 
-    // Normalize
-    weight.set(1.0f/weight);
-    for (int c = 0; c < out.channels; c++) {
-        out.channel(c) *= weight;
+Image FastNLMeans::apply(Image im, float patchSize, float spatialSigma, float patchSigma,
+                         float frameSigma) {
+    // Use a box filter with the same variance as a Gaussian with
+    // standard deviation patchSize to compare patches.
+    int r = (int)floorf((sqrtf(1 + 12*patchSize*patchSize) - 1) / 2 + 0.5f);
+
+    // Gather the offsets to search. Each offset and its opposite are
+    // handled together, using symmetry.
+    vector<NLMOffset> offsets;
+    int radius = (int)(ceilf(spatialSigma*4));
+    int tRadius = frameSigma > 0 ? min(im.frames - 1, (int)(ceilf(frameSigma*4))) : 0;
+    for (int dt = 0; dt <= tRadius; dt++) {
+        for (int dy = -radius; dy <= radius; dy++) {
+            for (int dx = -radius; dx <= radius; dx++) {
+                if (dt == 0 && (dx < 0 || (dx == 0 && dy <= 0))) { continue; }
+                if (abs(dx) >= im.width || abs(dy) >= im.height) { continue; }
+                float d2 = (dx*dx + dy*dy)/(2*spatialSigma*spatialSigma);
+                if (dt) { d2 += (dt*dt)/(2*frameSigma*frameSigma); }
+                NLMOffset o = {dx, dy, dt, expf(-d2)};
+                if (o.weight < 0.05) { continue; }
+                offsets.push_back(o);
+            }
+        }
+    }
+
+    // The output is divided into tiles of rows of one frame, which
+    // are processed in parallel. Each tile visits every offset and
+    // accumulates into its own small buffer, so memory use doesn't
+    // grow with the number of threads. An offset's weights are
+    // computed for the rows that land in the tile on either side,
+    // which repeats the rows near the tile edges.
+    const int tileRows = 64;
+    const int bands = (im.height + tileRows - 1) / tileRows;
+    const float invPatchVar = 1.0f/(patchSigma*patchSigma);
+    Image out(im.width, im.height, im.frames, im.channels);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+    #endif
+    for (int i = 0; i < bands * im.frames; i++) {
+        int t = i / bands;
+        int y0 = (i % bands) * tileRows;
+        Image acc(im.width, min(tileRows, im.height - y0), 1, im.channels + 1);
+        for (size_t j = 0; j < offsets.size(); j++) {
+            fastNLMeansOffset(im, acc, y0, t, offsets[j], r, invPatchVar);
+        }
+
+        // Each pixel matches itself with weight one. Normalize.
+        for (int y = 0; y < acc.height; y++) {
+            const float *wt = &acc(0, y, 0, im.channels);
+            for (int c = 0; c < im.channels; c++) {
+                const float *in = &im(0, y0 + y, t, c);
+                const float *sum = &acc(0, y, 0, c);
+                float *o = &out(0, y0 + y, t, c);
+                for (int x = 0; x < im.width; x++) {
+                    o[x] = (in[x] + sum[x]) / (1 + wt[x]);
+                }
+            }
+        }
     }
     return out;
 }
@@ -5,13 +5,106 @@ namespace ImageStack {
 
 class GaussTransform : public Operation {
 public:
-    enum Method {AUTO = 0, EXACT, GRID, PERMUTOHEDRAL, GKDTREE};
+    enum Method {AUTO = 0, EXACT, GRID, PERMUTOHEDRAL, GKDTREE, IFGT};
 
     void help();
     bool test();
     void parse(vector<string> args);
     static Image apply(Image slicePositions, Image splatPositions, Image values,
                        vector<float> sigmas, Method m = AUTO);
+
+    // The most memory in bytes the bilateral grid may use before it
+    // is made coarser. Set with -gridmemory.
+    static size_t gridMemoryLimit;
+
+    // Gaussians further than this many standard deviations away are
+    // ignored by the exact method. Zero means none are. Set with
+    // -exacttruncation.
+    static float exactTruncation;
+
+    // The largest error the IFGT method may make, relative to the
+    // total weight of the Gaussians. Set with -ifgttolerance.
+    static float ifgtTolerance;
+
+    // Pick the fastest method for a problem like this one on this
+    // machine. The first time a class of problem is seen, each
+    // candidate method is timed on a crop of it, and the winner is
+    // remembered. Problems are classed by their numbers of position
+    // and value channels, and by the rough number of points and of
+    // Gaussian-sized cells they span.
+    static Method chooseMethod(Image slicePositions, Image splatPositions,
+                               vector<float> sigmas, int valueChannels);
+
+    // The file in which the decisions made by chooseMethod persist
+    // between runs, keyed by host name. Empty by default, in which
+    // case decisions are only remembered until the program exits.
+    // Set with -gausstransformtable file.
+    static string tuningFile;
+};
+
+class IFGTTolerance : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+class ExactTruncation : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+class GaussTransformTable : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+class GridMemory : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+// A Gauss transform with fixed slice and splat positions, which can
+// then be applied to many different sets of values. Constructing one
+// does all the work that depends only on the positions (building the
+// acceleration structure and finding where each position lands in
+// it), so each application only has to splat, blur, and slice the
+// values. Copies share the same underlying structure.
+class GaussTransformContext {
+public:
+    GaussTransformContext() {}
+
+    // If the method is AUTO, it's chosen assuming the values will
+    // have four channels (e.g. RGB plus a homogeneous channel).
+    GaussTransformContext(Image slicePositions, Image splatPositions,
+                          vector<float> sigmas,
+                          GaussTransform::Method m = GaussTransform::AUTO);
+
+    // Values must be the same size as the splat positions. The
+    // result is the same size as the slice positions.
+    Image apply(Image values);
+
+    bool defined() const {return impl.get() != NULL;}
+
+    // Contexts stashed by -stashgausstransform and -stashjointbilateral
+    static map<string, GaussTransformContext> stash;
+
+    struct Impl;
+private:
+    shared_ptr<Impl> impl;
+};
+
+class StashGaussTransform : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
 };
 
 
@@ -23,6 +116,21 @@ public:
     static void apply(Image image, Image reference,
                       float filterWidth, float filterHeight, float filterFrames, float colorSigma,
                       GaussTransform::Method m = GaussTransform::AUTO);
+
+    // Build a reusable context for joint bilateral filtering against
+    // the given reference. The filter sizes must be non-zero.
+    static GaussTransformContext context(Image reference,
+                                         float filterWidth, float filterHeight, float filterFrames,
+                                         float colorSigma,
+                                         GaussTransform::Method m = GaussTransform::AUTO);
+    static void apply(Image image, GaussTransformContext context);
+};
+
+class StashJointBilateral : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
 };
 
 class Bilateral : public Operation {
@@ -69,7 +177,8 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image image, float patchSize, float spatialSigma, float patchSigma);
+    static Image apply(Image image, float patchSize, float spatialSigma, float patchSigma,
+                       float frameSigma = 0);
 };
 
 class NLMeans3D : public Operation {
@@ -3,6 +3,7 @@
 #include "Stack.h"
 #include "Arithmetic.h"
 #include "Statistics.h"
+#include "File.h"
 namespace ImageStack {
 
 void Upsample::help() {
@@ -161,7 +162,12 @@ void Resample::help() {
            " given three arguments, it produces a new volume of the given width,"
            " height, and frames. When given two arguments, it produces a new volume"
            " of the given width and height, with the same number of frames.\n\n"
-           "Usage: ImageStack -loadframes f*.tga -resample 20 50 50 -saveframes f%%03d.tga\n\n");
+           "An optional last argument selects a different filter: box (an average"
+           " over the area of each output pixel), triangle, catmullrom, mitchell,"
+           " lanczos2, lanczos3, or lanczos4. Box is the cheapest way to shrink an"
+           " image, and is fastest when the sizes divide evenly.\n\n"
+           "Usage: ImageStack -loadframes f*.tga -resample 20 50 50 -saveframes f%%03d.tga\n"
+           "       ImageStack -load big.jpg -resample 400 300 box -save small.jpg\n\n");
 }
 
 bool Resample::test() {
@@ -184,95 +190,330 @@ bool Resample::test() {
             }
         }
     }
-    return true;
+
+    // Resampling in x and in y should agree, including at sizes that
+    // aren't a multiple of the vector width
+    Image c = Resample::apply(b, 37, 23);
+    Image d = Transpose::apply(Resample::apply(Transpose::apply(b, 'x', 'y'), 23, 37), 'x', 'y');
+    if (!nearlyEqual(c, d)) return false;
+    c = Resample::apply(b, 37, b.height);
+    d = Transpose::apply(Resample::apply(Transpose::apply(b, 'x', 'y'), b.height, 37), 'x', 'y');
+    if (!nearlyEqual(c, d)) return false;
+
+    // Every filter should preserve a constant image
+    Kernel kernels[] = {Box, Triangle, CatmullRom, Mitchell, Lanczos2, Lanczos3, Lanczos4};
+    Image flat(60, 40, 2, 1);
+    flat.set(1);
+    for (int i = 0; i < 7; i++) {
+        Stats up(Resample::apply(flat, 97, 53, 3, kernels[i]));
+        Stats down(Resample::apply(flat, 23, 17, 1, kernels[i]));
+        if (fabs(up.minimum() - 1) > 1e-4 || fabs(up.maximum() - 1) > 1e-4) return false;
+        if (fabs(down.minimum() - 1) > 1e-4 || fabs(down.maximum() - 1) > 1e-4) return false;
+    }
+
+    // An integer-ratio box resample averages blocks of pixels
+    c = Resample::apply(b, 75, 35, Box);
+    for (int t = 0; t < c.frames; t++) {
+        for (int y = 0; y < c.height; y++) {
+            for (int x = 0; x < c.width; x++) {
+                float sum = 0;
+                for (int dy = 0; dy < 5; dy++) {
+                    for (int dx = 0; dx < 3; dx++) {
+                        sum += b(x*3 + dx, y*5 + dy, t, 1);
+                    }
+                }
+                if (fabs(c(x, y, t, 1) - sum / 15) > 1e-4) return false;
+            }
+        }
+    }
+
+    // A last argument is only a filter if it names one. Otherwise
+    // it's a size, which may be an expression.
+    Resample op;
+    vector<string> args;
+    args.push_back("width/3");
+    args.push_back("height/5");
+    args.push_back("frames");
+    push(b);
+    op.parse(args);
+    c = stack(0);
+    pop();
+    if (c.width != 75 || c.height != 35 || c.frames != b.frames) return false;
+    args[2] = "box";
+    push(b);
+    op.parse(args);
+    d = stack(0);
+    pop();
+    return d.width == 75 && d.height == 35 && nearlyEqual(d, Resample::apply(b, 75, 35, Box));
 }
 
 void Resample::parse(vector<string> args) {
+    Kernel kernel = Lanczos3;
+    if (args.size() > 2 && findKernel(args.back(), &kernel)) {
+        args.pop_back();
+    }
 
     if (args.size() == 2) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]));
+        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]), kernel);
         pop();
         push(im);
     } else if (args.size() == 3) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]), readInt(args[2]));
+        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]), readInt(args[2]), kernel);
         pop();
         push(im);
     } else {
-        panic("-resample takes two or three arguments\n");
+        panic("-resample takes two or three arguments, plus an optional filter\n");
     }
 
 }
 
-Image Resample::apply(Image im, int width, int height) {
-    if (height != im.height && width != im.width) {
-        Image tmp = resampleY(im, height);
-        return resampleX(tmp, width);
-    } else if (width != im.width) {
-        return resampleX(im, width);
-    } else if (height != im.height) {
-        return resampleY(im, height);
+bool Resample::findKernel(string name, Kernel *kernel) {
+    if (name == "box") { *kernel = Box; }
+    else if (name == "triangle") { *kernel = Triangle; }
+    else if (name == "catmullrom") { *kernel = CatmullRom; }
+    else if (name == "mitchell") { *kernel = Mitchell; }
+    else if (name == "lanczos2") { *kernel = Lanczos2; }
+    else if (name == "lanczos3") { *kernel = Lanczos3; }
+    else if (name == "lanczos4") { *kernel = Lanczos4; }
+    else { return false; }
+    return true;
+}
+
+Resample::Kernel Resample::parseKernel(string name) {
+    Kernel kernel = Lanczos3;
+    if (!findKernel(name, &kernel)) {
+        panic("Unknown resampling filter: %s\n", name.c_str());
     }
-    return im;
+    return kernel;
 }
 
-Image Resample::apply(Image im, int width, int height, int frames) {
+Image Resample::apply(Image im, int width, int height, Kernel kernel) {
+    if (width == im.width && height == im.height) return im;
+    if (kernel == Box && width <= im.width && height <= im.height &&
+        im.width % width == 0 && im.height % height == 0) {
+        return areaDownsample(im, im.width / width, im.height / height);
+    }
+    return resampleXY(im, width, height, kernel);
+}
+
+Image Resample::apply(Image im, int width, int height, int frames, Kernel kernel) {
     if (frames != im.frames) {
-        Image tmp = resampleT(im, frames);
-        return apply(tmp, width, height);
+        Image tmp = resampleT(im, frames, kernel);
+        return apply(tmp, width, height, kernel);
     } else {
-        return apply(im, width, height);
+        return apply(im, width, height, kernel);
+    }
+}
+
+namespace {
+// The reconstruction filters, as a function of the distance in
+// input samples (scaled by the filter width when downsampling).
+float resampleFilter(Resample::Kernel kernel, float x) {
+    x = fabsf(x);
+    float B, C;
+    switch (kernel) {
+    case Resample::Triangle:
+        return max(0.0f, 1 - x);
+    case Resample::CatmullRom:
+        B = 0; C = 0.5f;
+        break;
+    case Resample::Mitchell:
+        B = C = 1.0f/3;
+        break;
+    case Resample::Lanczos2:
+        return lanczos_2(x);
+    case Resample::Lanczos4:
+        return lanczos_4(x);
+    default:
+        return lanczos_3(x);
     }
+    // Mitchell-Netravali cubics
+    if (x < 1) {
+        return ((12 - 9*B - 6*C) * x*x*x + (-18 + 12*B + 6*C) * x*x + (6 - 2*B)) / 6;
+    } else if (x < 2) {
+        return ((-B - 6*C) * x*x*x + (6*B + 30*C) * x*x + (-12*B - 48*C) * x + (8*B + 24*C)) / 6;
+    }
+    return 0;
+}
+
+float resampleRadius(Resample::Kernel kernel) {
+    switch (kernel) {
+    case Resample::Triangle: return 1;
+    case Resample::CatmullRom: case Resample::Mitchell: case Resample::Lanczos2: return 2;
+    case Resample::Lanczos4: return 4;
+    default: return 3;
+    }
+}
 }
 
-void Resample::computeWeights(int oldSize, int newSize, vector<vector<pair<int, float> > > &matrix) {
+void Resample::computeWeights(int oldSize, int newSize, Kernel kernel, Weights &weights) {
     assert(newSize > 0, "Can only resample to positive sizes");
 
     float filterWidth = max(1.0f, (float)oldSize / newSize);
+    float scale = (float)oldSize / newSize;
+    float radius = resampleRadius(kernel);
 
-    matrix.resize(newSize);
+    // Every output gets the same number of taps, enough for the
+    // widest filter, so that the table is dense.
+    if (kernel == Box) {
+        weights.taps = min(oldSize, (int)ceilf(scale) + 1);
+    } else {
+        weights.taps = min(oldSize, (int)floorf(filterWidth*radius*2) + 1);
+    }
+    weights.start.resize(newSize);
+    weights.weight.assign(newSize * weights.taps, 0.0f);
+
+    if (kernel == Box) {
+        // Weight each input sample by how much of the output
+        // sample's footprint it covers.
+        for (int x = 0; x < newSize; x++) {
+            float a = x * scale, b = (x + 1) * scale;
+            int minX = clamp((int)floorf(a), 0, oldSize-1);
+            int maxX = clamp((int)ceilf(b) - 1, minX, oldSize-1);
+            int start = min(minX, oldSize - weights.taps);
+            weights.start[x] = start;
+            float *w = &weights.weight[x * weights.taps];
+            float totalWeight = 0;
+            for (int i = minX; i <= maxX; i++) {
+                w[i - start] = max(0.0f, min(b, i + 1.0f) - max(a, (float)i));
+                totalWeight += w[i - start];
+            }
+            for (int i = 0; i < weights.taps; i++) {
+                w[i] /= totalWeight;
+            }
+        }
+        return;
+    }
 
     for (int x = 0; x < newSize; x++) {
         // This x in the output corresponds to which x in the input?
         float inX = (x + 0.5f) / newSize * oldSize - 0.5f;
 
         // Now compute a filter surrounding said x in the input
-        int minX = ceilf(inX - filterWidth*3);
-        int maxX = floorf(inX + filterWidth*3);
+        int minX = ceilf(inX - filterWidth*radius);
+        int maxX = floorf(inX + filterWidth*radius);
         minX = clamp(minX, 0, oldSize-1);
         maxX = clamp(maxX, 0, oldSize-1);
 
-        assert(minX < maxX, "Wha?");
+        assert(minX <= maxX, "Wha?");
 
-        // Compute a row of the sparse matrix
-        matrix[x].resize(maxX - minX + 1);
+        // Place the filter in a window of taps samples that stays
+        // inside the input. Taps outside the filter get zero weight.
+        int start = min(minX, oldSize - weights.taps);
+        weights.start[x] = start;
+        float *w = &weights.weight[x * weights.taps];
         float totalWeight = 0;
         for (int i = minX; i <= maxX; i++) {
             float delta = i - inX;
-            float w = lanczos_3(delta/filterWidth);
-            matrix[x][i - minX] = make_pair(i, w);
-            totalWeight += w;
+            w[i - start] = resampleFilter(kernel, delta/filterWidth);
+            totalWeight += w[i - start];
         }
-        for (int i = 0; i <= maxX - minX; i++) {
-            matrix[x][i].second /= totalWeight;
+        for (int i = 0; i < weights.taps; i++) {
+            w[i] /= totalWeight;
         }
     }
 }
 
-Image Resample::resampleX(Image im, int width) {
-    vector<vector<pair<int, float> > > matrix;
-    computeWeights(im.width, width, matrix);
+namespace {
+// dst[x] = sum_k w[k] * src[k][x], with SIMD across x
+void blendRows(const float *const *src, const float *w, int taps, float *dst, int n) {
+    int x = 0;
+    for (; x + Vec::width <= n; x += Vec::width) {
+        Vec::type acc = Vec::zero();
+        for (int k = 0; k < taps; k++) {
+            acc = Vec::Add::vec(acc, Vec::Mul::vec(Vec::broadcast(w[k]), Vec::load(src[k] + x)));
+        }
+        Vec::store(acc, dst + x);
+    }
+    for (; x < n; x++) {
+        float acc = 0;
+        for (int k = 0; k < taps; k++) {
+            acc += w[k] * src[k][x];
+        }
+        dst[x] = acc;
+    }
+}
 
-    Image out(width, im.height, im.frames, im.channels);
+// Resamples Vec::width rows at once, with SIMD across the rows. The
+// rows are interleaved, so in[x*Vec::width + r] is sample x of row
+// r, and likewise for out.
+void resampleInterleaved(const float *in, const int *start, const float *weight, int taps,
+                         float *out, int n) {
+    for (int x = 0; x < n; x++) {
+        const float *src = in + start[x] * Vec::width;
+        const float *w = weight + x * taps;
+        Vec::type acc = Vec::zero();
+        for (int k = 0; k < taps; k++) {
+            acc = Vec::Add::vec(acc, Vec::Mul::vec(Vec::broadcast(w[k]), Vec::load(src + k * Vec::width)));
+        }
+        Vec::store(acc, out + x * Vec::width);
+    }
+}
+}
 
-    for (int c = 0; c < out.channels; c++) {
-        for (int t = 0; t < out.frames; t++) {
-            for (int y = 0; y < out.height; y++) {
-                for (int x = 0; x < out.width; x++) {
-                    float val = 0;
-                    for (size_t i = 0; i < matrix[x].size(); i++) {
-                        val += matrix[x][i].second * im(matrix[x][i].first, y, t, c);
-                    }
-                    out(x, y, t, c) = val;
+Image Resample::resampleXY(Image im, int width, int height, Kernel kernel) {
+    Weights wx, wy;
+    computeWeights(im.width, width, kernel, wx);
+    computeWeights(im.height, height, kernel, wy);
+
+    Image out(width, height, im.frames, im.channels);
+
+    // Output rows are produced Vec::width at a time. Each block is
+    // resampled vertically into scratch, and then horizontally
+    // straight into the output, so the intermediate stays in cache.
+    const int rows = Vec::width;
+    const int yBlocks = (height + rows - 1) / rows;
+    const int blocks = yBlocks * im.frames * im.channels;
+    const bool resizeX = width != im.width, resizeY = height != im.height;
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<float> vertical(resizeY ? rows * im.width : 0);
+        vector<float> in(resizeX ? rows * im.width : 0), mid(resizeX ? rows * width : 0);
+        vector<const float *> src(wy.taps), rowPtr(rows);
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int b = 0; b < blocks; b++) {
+            int y0 = (b % yBlocks) * rows;
+            int t = (b / yBlocks) % im.frames, c = b / (yBlocks * im.frames);
+            int n = min(rows, height - y0);
+
+            // Vertical pass
+            for (int r = 0; r < n; r++) {
+                int y = y0 + r;
+                if (!resizeY) {
+                    rowPtr[r] = &im(0, y, t, c);
+                    continue;
+                }
+                for (int k = 0; k < wy.taps; k++) {
+                    src[k] = &im(0, wy.start[y] + k, t, c);
+                }
+                float *dst = &vertical[r * im.width];
+                blendRows(&src[0], &wy.weight[y * wy.taps], wy.taps, dst, im.width);
+                rowPtr[r] = dst;
+            }
+
+            // Horizontal pass
+            if (!resizeX) {
+                for (int r = 0; r < n; r++) {
+                    memcpy(&out(0, y0 + r, t, c), rowPtr[r], width * sizeof(float));
+                }
+                continue;
+            }
+            for (int r = 0; r < n; r++) {
+                const float *row = rowPtr[r];
+                for (int x = 0; x < im.width; x++) {
+                    in[x * rows + r] = row[x];
+                }
+            }
+            resampleInterleaved(&in[0], &wx.start[0], &wx.weight[0], wx.taps, &mid[0], width);
+            for (int r = 0; r < n; r++) {
+                float *row = &out(0, y0 + r, t, c);
+                for (int x = 0; x < width; x++) {
+                    row[x] = mid[x * rows + r];
                 }
             }
         }
@@ -281,22 +522,65 @@ Image Resample::resampleX(Image im, int width) {
     return out;
 }
 
-Image Resample::resampleY(Image im, int height) {
-    vector<vector<pair<int, float> > > matrix;
-    computeWeights(im.height, height, matrix);
+Image Resample::resampleT(Image im, int frames, Kernel kernel) {
+    Weights wt;
+    computeWeights(im.frames, frames, kernel, wt);
 
-    Image out(im.width, height, im.frames, im.channels);
+    Image out(im.width, im.height, frames, im.channels);
 
-    for (int c = 0; c < out.channels; c++) {
-        for (int t = 0; t < out.frames; t++) {
-            for (int y = 0; y < out.height; y++) {
-                for (int x = 0; x < out.width; x++) {
-                    float val = 0;
-                    for (size_t i = 0; i < matrix[y].size(); i++) {
-                        val += matrix[y][i].second * im(x, matrix[y][i].first, t, c);
-                    }
-                    out(x, y, t, c) = val;
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<const float *> src(wt.taps);
+        #ifdef _OPENMP
+        #pragma omp for
+        #endif
+        for (int i = 0; i < out.height * out.frames * out.channels; i++) {
+            int y = i % out.height, t = (i / out.height) % out.frames, c = i / (out.height * out.frames);
+            for (int k = 0; k < wt.taps; k++) {
+                src[k] = &im(0, y, wt.start[t] + k, c);
+            }
+            blendRows(&src[0], &wt.weight[t * wt.taps], wt.taps, &out(0, y, t, c), out.width);
+        }
+    }
+
+    return out;
+}
+
+// Box resampling by integer factors. Each output pixel is the mean
+// of an fx x fy block, which needs one pass over the input.
+Image Resample::areaDownsample(Image im, int fx, int fy) {
+    Image out(im.width / fx, im.height / fy, im.frames, im.channels);
+    vector<float> w(fy, 1.0f / (fx * fy));
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<const float *> src(fy);
+        vector<float> sum(im.width);
+        #ifdef _OPENMP
+        #pragma omp for
+        #endif
+        for (int i = 0; i < out.height * out.frames * out.channels; i++) {
+            int y = i % out.height, t = (i / out.height) % out.frames, c = i / (out.height * out.frames);
+            for (int k = 0; k < fy; k++) {
+                src[k] = &im(0, y * fy + k, t, c);
+            }
+            float *row = &out(0, y, t, c);
+            if (fx == 1) {
+                blendRows(&src[0], &w[0], fy, row, out.width);
+                continue;
+            }
+            blendRows(&src[0], &w[0], fy, &sum[0], out.width * fx);
+            for (int x = 0; x < out.width; x++) {
+                const float *s = &sum[x * fx];
+                float v = 0;
+                for (int j = 0; j < fx; j++) {
+                    v += s[j];
                 }
+                row[x] = v;
             }
         }
     }
@@ -304,25 +588,137 @@ Image Resample::resampleY(Image im, int height) {
     return out;
 }
 
-Image Resample::resampleT(Image im, int frames) {
-    vector<vector<pair<int, float> > > matrix;
-    computeWeights(im.frames, frames, matrix);
+void Thumbnails::help() {
+    pprintf("-thumbnails resamples the current image to several sizes at once. Each"
+            " argument is either a width and height of the form WxH, or a single"
+            " number giving the length of the longer side, in which case the aspect"
+            " ratio is preserved. Each output is made from the smallest output or"
+            " intermediate already computed that is at least twice as large, so the"
+            " full resolution image is only resampled once. An optional filter"
+            " argument selects the filter as for -resample.\n\n"
+            "If one of the arguments is a printf style filename pattern, the results"
+            " are saved using it and the index of each size, as with -saveframes, and"
+            " any argument following the pattern is passed on to -save. Otherwise the"
+            " results are pushed on the stack in order, so the last size ends up on"
+            " top.\n\n"
+            "Usage: ImageStack -load big.jpg -thumbnails 1024 512 128x128 thumb%%d.jpg 90\n"
+            "       ImageStack -load big.jpg -thumbnails 640x480 64x48 mitchell -save small.png\n\n");
+}
+
+bool Thumbnails::test() {
+    Image a(12, 8, 1, 3);
+    Noise::apply(a, 0, 1);
+    a = Resample::apply(a, 600, 400);
+
+    vector<pair<int, int> > sizes;
+    sizes.push_back(make_pair(40, 27));
+    sizes.push_back(make_pair(300, 200));
+    sizes.push_back(make_pair(97, 65));
+    vector<Image> thumbs = Thumbnails::apply(a, sizes);
+    if (thumbs.size() != sizes.size()) return false;
+
+    // Each output should be close to resampling the input directly
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (thumbs[i].width != sizes[i].first ||
+            thumbs[i].height != sizes[i].second ||
+            thumbs[i].frames != a.frames ||
+            thumbs[i].channels != a.channels) return false;
+        Image direct = Resample::apply(a, sizes[i].first, sizes[i].second);
+        Stats s(thumbs[i] - direct), d(direct);
+        if (fabs(s.mean()) > 1e-3) return false;
+        if (s.variance() > 1e-3 * d.variance()) return false;
+    }
 
-    Image out(im.width, im.height, frames, im.channels);
+    return true;
+}
 
-    for (int c = 0; c < out.channels; c++) {
-        for (int t = 0; t < out.frames; t++) {
-            for (int y = 0; y < out.height; y++) {
-                for (int x = 0; x < out.width; x++) {
-                    float val = 0;
-                    for (size_t i = 0; i < matrix[t].size(); i++) {
-                        val += matrix[t][i].second * im(x, y, matrix[t][i].first, c);
-                    }
-                    out(x, y, t, c) = val;
+void Thumbnails::parse(vector<string> args) {
+    Resample::Kernel kernel = Resample::Lanczos3;
+    string pattern, arg;
+    vector<pair<int, int> > sizes;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i].find('%') != string::npos) {
+            pattern = args[i];
+            assert(args.size() - i <= 2,
+                   "-thumbnails only takes one argument after the filename pattern\n");
+            if (i + 1 < args.size()) arg = args[i+1];
+            break;
+        } else if (isdigit(args[i][0])) {
+            size_t x = args[i].find('x');
+            if (x == string::npos) {
+                int n = readInt(args[i]);
+                Image im = stack(0);
+                if (im.width >= im.height) {
+                    sizes.push_back(make_pair(n, max(1, (int)(n * (float)im.height / im.width + 0.5f))));
+                } else {
+                    sizes.push_back(make_pair(max(1, (int)(n * (float)im.width / im.height + 0.5f)), n));
                 }
+            } else {
+                sizes.push_back(make_pair(readInt(args[i].substr(0, x)),
+                                          readInt(args[i].substr(x+1))));
             }
+            assert(sizes.back().first > 0 && sizes.back().second > 0,
+                   "-thumbnails sizes must be positive\n");
+        } else {
+            kernel = Resample::parseKernel(args[i]);
+        }
+    }
+    assert(sizes.size() > 0, "-thumbnails takes at least one size\n");
+
+    vector<Image> thumbs = apply(stack(0), sizes, kernel);
+    if (pattern.size()) {
+        char filename[4096];
+        for (size_t i = 0; i < thumbs.size(); i++) {
+            snprintf(filename, 4096, pattern.c_str(), (int)i);
+            Save::apply(thumbs[i], filename, arg);
+        }
+    } else {
+        for (size_t i = 0; i < thumbs.size(); i++) {
+            push(thumbs[i]);
         }
     }
+}
+
+vector<Image> Thumbnails::apply(Image im, const vector<pair<int, int> > &sizes,
+                                Resample::Kernel kernel) {
+    // Make the largest sizes first, so the smaller ones can be made
+    // from them
+    vector<pair<int64_t, int> > order(sizes.size());
+    for (size_t i = 0; i < sizes.size(); i++) {
+        order[i] = make_pair((int64_t)sizes[i].first * sizes[i].second, (int)i);
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    vector<Image> out(sizes.size());
+    vector<Image> sources(1, im);
+    for (size_t i = 0; i < order.size(); i++) {
+        int width = sizes[order[i].second].first, height = sizes[order[i].second].second;
+
+        // Start from the smallest image that is still at least twice
+        // the target size, which has plenty of detail to filter down
+        // from but is cheap to read.
+        Image src = im;
+        for (size_t j = 1; j < sources.size(); j++) {
+            const Image &s = sources[j];
+            if (s.width >= 2*width && s.height >= 2*height &&
+                (int64_t)s.width * s.height < (int64_t)src.width * src.height) {
+                src = s;
+            }
+        }
+
+        // If that is still much larger, shrink it by an integer
+        // factor with a box filter first. This leaves it at least
+        // twice the target size, so the final filter still removes
+        // what the box filter aliases.
+        int f = min(src.width / (2*width), src.height / (2*height));
+        if (f >= 2) {
+            src = Resample::apply(src, src.width / f, src.height / f, Resample::Box);
+            sources.push_back(src);
+        }
+
+        out[order[i].second] = Resample::apply(src, width, height, kernel);
+        sources.push_back(out[order[i].second]);
+    }
 
     return out;
 }
@@ -554,11 +950,200 @@ void Deinterleave::apply(Image im, int rx, int ry, int rt) {
 }
 
 
+namespace {
+// Warps are computed in square tiles of the output, so the input read
+// by a tile stays in cache even when the warp rotates the scan
+// direction.
+const int warpTile = 64;
+
+// The separable filter taps for a run of n output pixels, computed
+// once and shared by all channels. Output pixel i is the sum of the
+// taps x taps block of the input with top left corner (x0[i], y0[i]),
+// weighted by wx[k*n + i] * wy[j*n + i].
+struct WarpTaps {
+    int n, taps;
+    vector<int> x0, y0;
+    vector<float> wx, wy;
+};
+
+float triangle(float x) { return resampleFilter(Resample::Triangle, x); }
+float catmullRom(float x) { return resampleFilter(Resample::CatmullRom, x); }
+float mitchell(float x) { return resampleFilter(Resample::Mitchell, x); }
+
+// Computes normalized weights of the given filter for the coordinates
+// f[i] to f[n-1]. The filter is a template argument so that it is
+// inlined into the loop.
+template<float (*filter)(float)>
+void warpWeights(const float *f, int i, int n, int taps, int *start, float *w) {
+    for (; i < n; i++) {
+        start[i] = (int)floorf(f[i]) - taps/2 + 1;
+        float total = 0;
+        for (int k = 0; k < taps; k++) {
+            float v = filter(f[i] - (start[i] + k));
+            w[k*n + i] = v;
+            total += v;
+        }
+        total = 1.0f / total;
+        for (int k = 0; k < taps; k++) {
+            w[k*n + i] *= total;
+        }
+    }
+}
+
+// Computes the taps along one axis for the coordinates f[0] to f[n-1].
+void warpWeights(Resample::Kernel kernel, const float *f, int n, int taps, int *start, float *w) {
+    int i = 0;
+    if (kernel == Resample::Box) {
+        for (; i < n; i++) {
+            start[i] = (int)floorf(f[i] + 0.5f);
+            w[i] = 1;
+        }
+        return;
+    }
+
+    if (kernel == Resample::Triangle || kernel == Resample::CatmullRom) {
+        // These weights are polynomials in the fractional part of the
+        // coordinate, so compute them Vec::width pixels at a time
+        const Vec::type one = Vec::broadcast(1), half = Vec::broadcast(0.5f);
+        const Vec::type c15 = Vec::broadcast(1.5f), c2 = Vec::broadcast(2), c25 = Vec::broadcast(2.5f);
+        float whole[Vec::width];
+        for (; i + Vec::width <= n; i += Vec::width) {
+            Vec::type v = Vec::load(f + i);
+            Vec::type fl = Vec::Floor::vec(v);
+            Vec::type x = Vec::Sub::vec(v, fl);
+            Vec::store(fl, whole);
+            if (kernel == Resample::Triangle) {
+                for (int k = 0; k < Vec::width; k++) {
+                    start[i+k] = (int)whole[k];
+                }
+                Vec::store(Vec::Sub::vec(one, x), w + i);
+                Vec::store(x, w + n + i);
+            } else {
+                for (int k = 0; k < Vec::width; k++) {
+                    start[i+k] = (int)whole[k] - 1;
+                }
+                Vec::type x2 = Vec::Mul::vec(x, x);
+                // ((1 - x/2) x - 1/2) x
+                Vec::type w0 = Vec::Mul::vec(Vec::Sub::vec(Vec::Mul::vec(Vec::Sub::vec(one, Vec::Mul::vec(half, x)), x), half), x);
+                // (3/2 x - 5/2) x^2 + 1
+                Vec::type w1 = Vec::Add::vec(Vec::Mul::vec(Vec::Sub::vec(Vec::Mul::vec(c15, x), c25), x2), one);
+                // ((2 - 3/2 x) x + 1/2) x
+                Vec::type w2 = Vec::Mul::vec(Vec::Add::vec(Vec::Mul::vec(Vec::Sub::vec(c2, Vec::Mul::vec(c15, x)), x), half), x);
+                // (x - 1) x^2 / 2
+                Vec::type w3 = Vec::Mul::vec(Vec::Mul::vec(Vec::Sub::vec(x, one), x2), half);
+                Vec::store(w0, w + i);
+                Vec::store(w1, w + n + i);
+                Vec::store(w2, w + 2*n + i);
+                Vec::store(w3, w + 3*n + i);
+            }
+        }
+    }
+
+    // Everything else, and the remainder of the run
+    switch (kernel) {
+    case Resample::Lanczos2:
+        warpWeights<lanczos_2>(f, i, n, taps, start, w);
+        break;
+    case Resample::Lanczos3:
+        warpWeights<lanczos_3>(f, i, n, taps, start, w);
+        break;
+    case Resample::Lanczos4:
+        warpWeights<lanczos_4>(f, i, n, taps, start, w);
+        break;
+    case Resample::Mitchell:
+        warpWeights<mitchell>(f, i, n, taps, start, w);
+        break;
+    case Resample::CatmullRom:
+        warpWeights<catmullRom>(f, i, n, taps, start, w);
+        break;
+    default:
+        warpWeights<triangle>(f, i, n, taps, start, w);
+    }
+}
+
+int warpTapCount(Resample::Kernel kernel) {
+    if (kernel == Resample::Box) return 1;
+    return 2 * (int)resampleRadius(kernel);
+}
+
+// Computes the taps for n output pixels at the input locations (fx[i], fy[i]).
+void warpTaps(Resample::Kernel kernel, const float *fx, const float *fy, int n, WarpTaps &w) {
+    w.n = n;
+    w.taps = warpTapCount(kernel);
+    w.x0.resize(n);
+    w.y0.resize(n);
+    w.wx.resize(n * w.taps);
+    w.wy.resize(n * w.taps);
+    warpWeights(kernel, fx, n, w.taps, &w.x0[0], &w.wx[0]);
+    warpWeights(kernel, fy, n, w.taps, &w.y0[0], &w.wy[0]);
+}
+
+// Filters frame t of im with the given taps, writing channel c of
+// output pixel i to out[c][i]. Taps outside the image read as zero.
+template<int taps>
+void warpSample(const Image &im, int t, const WarpTaps &w, float *const *out) {
+    const int n = w.n;
+    for (int i = 0; i < n; i++) {
+        int x0 = w.x0[i], y0 = w.y0[i];
+        float wx[taps], wy[taps];
+        for (int k = 0; k < taps; k++) {
+            wx[k] = w.wx[k*n + i];
+            wy[k] = w.wy[k*n + i];
+        }
+
+        if (x0 >= 0 && y0 >= 0 && x0 + taps <= im.width && y0 + taps <= im.height) {
+            for (int c = 0; c < im.channels; c++) {
+                const float *src = &im(x0, y0, t, c);
+                float sum = 0;
+                for (int j = 0; j < taps; j++, src += im.ystride) {
+                    float row = 0;
+                    for (int k = 0; k < taps; k++) {
+                        row += wx[k] * src[k];
+                    }
+                    sum += wy[j] * row;
+                }
+                out[c][i] = sum;
+            }
+        } else {
+            int minK = max(0, -x0), maxK = min(taps, im.width - x0);
+            int minJ = max(0, -y0), maxJ = min(taps, im.height - y0);
+            for (int c = 0; c < im.channels; c++) {
+                float sum = 0;
+                for (int j = minJ; j < maxJ; j++) {
+                    const float *src = &im(x0, y0 + j, t, c);
+                    float row = 0;
+                    for (int k = minK; k < maxK; k++) {
+                        row += wx[k] * src[k];
+                    }
+                    sum += wy[j] * row;
+                }
+                out[c][i] = sum;
+            }
+        }
+    }
+}
+
+void warpSample(const Image &im, int t, const WarpTaps &w, float *const *out) {
+    switch (w.taps) {
+    case 1: warpSample<1>(im, t, w, out); break;
+    case 2: warpSample<2>(im, t, w, out); break;
+    case 4: warpSample<4>(im, t, w, out); break;
+    case 6: warpSample<6>(im, t, w, out); break;
+    case 8: warpSample<8>(im, t, w, out); break;
+    default: panic("Unsupported warp filter size: %d\n", w.taps);
+    }
+}
+}
+
 void Rotate::help() {
     printf("\n-rotate takes a number of degrees, and rotates every frame of the current image\n"
            "clockwise by that angle. The rotation preserves the image size, filling empty\n"
-           " areas with zeros, and throwing away data which will not fit in the bounds.\n\n"
-           "Usage: ImageStack -load a.tga -rotate 45 -save b.tga\n\n");
+           " areas with zeros, and throwing away data which will not fit in the bounds.\n"
+           "An optional second argument selects the interpolation filter, as for -resample.\n"
+           "The default is lanczos3. Box gives nearest neighbor interpolation, and\n"
+           "triangle gives bilinear interpolation.\n\n"
+           "Usage: ImageStack -load a.tga -rotate 45 -save b.tga\n"
+           "       ImageStack -load a.tga -rotate 30 catmullrom -save b.tga\n\n");
 }
 
 bool Rotate::test() {
@@ -585,14 +1170,16 @@ bool Rotate::test() {
 
 
 void Rotate::parse(vector<string> args) {
-    assert(args.size() == 1, "-rotate takes one argument\n");
-    Image im = apply(stack(0), readFloat(args[0]));
+    assert(args.size() == 1 || args.size() == 2, "-rotate takes one or two arguments\n");
+    Resample::Kernel kernel = Resample::Lanczos3;
+    if (args.size() == 2) kernel = Resample::parseKernel(args[1]);
+    Image im = apply(stack(0), readFloat(args[0]), kernel);
     pop();
     push(im);
 }
 
 
-Image Rotate::apply(Image im, float degrees) {
+Image Rotate::apply(Image im, float degrees, Resample::Kernel kernel) {
 
     // figure out the rotation matrix
     float radians = degrees * M_PI / 180;
@@ -605,55 +1192,158 @@ Image Rotate::apply(Image im, float degrees) {
     vector<float> matrix(6);
     matrix[0] = cosine; matrix[1] = sine; matrix[2] = xorigin - (cosine * xorigin + sine * yorigin);
     matrix[3] = -sine; matrix[4] = cosine; matrix[5] = yorigin - (-sine * xorigin + cosine * yorigin);
-    return AffineWarp::apply(im, matrix);
+    return AffineWarp::apply(im, matrix, kernel);
 }
 
 
 void AffineWarp::help() {
     printf("\n-affinewarp takes a 2x3 matrix in row major order, and performs that affine warp\n"
-           "on the image.\n\n"
+           "on the image. An optional seventh argument selects the interpolation filter, as\n"
+           "for -rotate.\n\n"
            "Usage: ImageStack -load a.jpg -affinewarp 0.9 0.1 0 0.1 0.9 0 -save out.jpg\n\n");
 }
 
 bool AffineWarp::test() {
-    // already tested by rotate
+    // Rotate tests the default filter. Here we check each filter
+    // against sampling the input directly.
+    Image a(16, 12, 2, 3);
+    Noise::apply(a, 0, 1);
+    a = Resample::apply(a, 85, 67);
+    float matrix[] = {0.813f, 0.291f, -5.3713f, -0.236f, 0.927f, 14.2137f};
+
+    Image lanczos = AffineWarp::apply(a, matrix);
+    Image linear = AffineWarp::apply(a, matrix, Resample::Triangle);
+    Image nearest = AffineWarp::apply(a, matrix, Resample::Box);
+    vector<float> sample(a.channels);
+    for (int t = 0; t < a.frames; t++) {
+        for (int y = 0; y < a.height; y++) {
+            for (int x = 0; x < a.width; x++) {
+                float fx = matrix[0] * x + matrix[1] * y + matrix[2];
+                float fy = matrix[3] * x + matrix[4] * y + matrix[5];
+                // Right at the edge of the clipped region, rounding
+                // error decides which side a sample falls on
+                if (fabs(fx) < 1e-3 || fabs(fx - a.width) < 1e-3 ||
+                    fabs(fy) < 1e-3 || fabs(fy - a.height) < 1e-3) continue;
+                if (fx < 0 || fx > a.width || fy < 0 || fy > a.height) {
+                    for (int c = 0; c < a.channels; c++) {
+                        if (lanczos(x, y, t, c) != 0) return false;
+                    }
+                    continue;
+                }
+                // The Lanczos weights come from a table with 1024 entries
+                // per pixel, so allow for a slightly different lookup
+                a.sample2D(fx, fy, t, sample);
+                for (int c = 0; c < a.channels; c++) {
+                    if (fabs(lanczos(x, y, t, c) - sample[c]) > 2e-3) return false;
+                }
+                if (fx >= a.width-1 || fy >= a.height-1) continue;
+                a.sample2DLinear(fx, fy, t, sample);
+                for (int c = 0; c < a.channels; c++) {
+                    if (fabs(linear(x, y, t, c) - sample[c]) > 1e-4) return false;
+                    if (nearest(x, y, t, c) != a((int)(fx + 0.5f), (int)(fy + 0.5f), t, c)) return false;
+                }
+            }
+        }
+    }
+
+    // Catmull-Rom reproduces a linear ramp away from the edges, and
+    // Lanczos comes close
+    Image ramp(85, 67, 1, 1);
+    for (int y = 0; y < ramp.height; y++) {
+        for (int x = 0; x < ramp.width; x++) {
+            ramp(x, y) = x + 2*y;
+        }
+    }
+    Resample::Kernel kernels[] = {Resample::CatmullRom, Resample::Lanczos2, Resample::Lanczos4};
+    float tolerance[] = {1e-3f, 0.1f, 0.1f};
+    for (int i = 0; i < 3; i++) {
+        Image b = AffineWarp::apply(ramp, matrix, kernels[i]);
+        for (int y = 0; y < b.height; y++) {
+            for (int x = 0; x < b.width; x++) {
+                float fx = matrix[0] * x + matrix[1] * y + matrix[2];
+                float fy = matrix[3] * x + matrix[4] * y + matrix[5];
+                if (fx < 4 || fx > ramp.width-5 || fy < 4 || fy > ramp.height-5) continue;
+                if (fabs(b(x, y) - (fx + 2*fy)) > tolerance[i]) return false;
+            }
+        }
+    }
+
     return true;
 }
 
 void AffineWarp::parse(vector<string> args) {
-    assert(args.size() == 6, "-affinewarp takes six arguments\n");
+    assert(args.size() == 6 || args.size() == 7, "-affinewarp takes six or seven arguments\n");
     vector<float> matrix(6);
     for (int i = 0; i < 6; i++) { matrix[i] = readFloat(args[i]); }
-    Image im = apply(stack(0), matrix);
+    Resample::Kernel kernel = Resample::Lanczos3;
+    if (args.size() == 7) kernel = Resample::parseKernel(args[6]);
+    Image im = apply(stack(0), matrix, kernel);
     pop();
     push(im);
 }
 
-Image AffineWarp::apply(Image im, vector<float> matrix) {
+Image AffineWarp::apply(Image im, vector<float> matrix, Resample::Kernel kernel) {
 
     assert(matrix.size() == 6, "An affine warp requires a vector with 6 entries\n");
-    return apply(im, &matrix[0]);
+    return apply(im, &matrix[0], kernel);
 }
 
-Image AffineWarp::apply(Image im, float *matrix) {
+Image AffineWarp::apply(Image im, float *matrix, Resample::Kernel kernel) {
     Image out(im.width, im.height, im.frames, im.channels);
 
-    vector<float> sample(im.channels);
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                // figure out the sample location
-                float fx = matrix[0] * x + matrix[1] * y + matrix[2];
-                float fy = matrix[3] * x + matrix[4] * y + matrix[5];
+    const int tilesX = (im.width + warpTile - 1) / warpTile;
+    const int tilesY = (im.height + warpTile - 1) / warpTile;
+    const int tiles = tilesX * tilesY * im.frames;
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        // The coordinate buffers are padded to a whole number of vectors
+        const int padded = (warpTile + Vec::width - 1) / Vec::width * Vec::width;
+        vector<float> fx(padded), fy(padded);
+        vector<float *> rows(im.channels);
+        WarpTaps w;
+
+        float ramp[Vec::width];
+        for (int k = 0; k < Vec::width; k++) ramp[k] = k;
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int tile = 0; tile < tiles; tile++) {
+            int tx = (tile % tilesX) * warpTile;
+            int ty = ((tile / tilesX) % tilesY) * warpTile;
+            int t = tile / (tilesX * tilesY);
+            int n = min(warpTile, im.width - tx);
+            for (int y = ty; y < min(ty + warpTile, im.height); y++) {
+                // Step the sample location along the row, starting
+                // from its position at the left edge of the tile
+                Vec::type vx = Vec::Add::vec(Vec::broadcast(matrix[0] * tx + matrix[1] * y + matrix[2]),
+                                             Vec::Mul::vec(Vec::broadcast(matrix[0]), Vec::load(ramp)));
+                Vec::type vy = Vec::Add::vec(Vec::broadcast(matrix[3] * tx + matrix[4] * y + matrix[5]),
+                                             Vec::Mul::vec(Vec::broadcast(matrix[3]), Vec::load(ramp)));
+                const Vec::type dx = Vec::broadcast(matrix[0] * Vec::width);
+                const Vec::type dy = Vec::broadcast(matrix[3] * Vec::width);
+                for (int i = 0; i < n; i += Vec::width) {
+                    Vec::store(vx, &fx[i]);
+                    Vec::store(vy, &fy[i]);
+                    vx = Vec::Add::vec(vx, dx);
+                    vy = Vec::Add::vec(vy, dy);
+                }
+
+                warpTaps(kernel, &fx[0], &fy[0], n, w);
+
                 // don't sample outside the image
-                if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) {
-                    for (int c = 0; c < im.channels; c++)
-                        out(x, y, t, c) = 0;
-                } else {
-                    im.sample2D(fx, fy, t, sample);
-                    for (int c = 0; c < im.channels; c++)
-                        out(x, y, t, c) = sample[c];
+                for (int i = 0; i < n; i++) {
+                    if (fx[i] < 0 || fx[i] > im.width || fy[i] < 0 || fy[i] > im.height) {
+                        w.x0[i] = im.width;
+                    }
+                }
+
+                for (int c = 0; c < im.channels; c++) {
+                    rows[c] = &out(tx, y, t, c);
                 }
+                warpSample(im, t, w, &rows[0]);
             }
         }
     }
@@ -1695,6 +2385,9 @@ void Warp::help() {
             " arguments. The number of channels in the top image is the"
             " dimensionality of the warp, and should be three or less.\n"
             "\n"
+            "A two dimensional warp takes an optional argument selecting the"
+            " interpolation filter, as for -rotate.\n"
+            "\n"
             "Usage: ImageStack -load in.jpg -push -evalchannels \"x+y\" \"y\" -warp -save out.jpg\n\n");
 }
 
@@ -1718,21 +2411,32 @@ bool Warp::test() {
 }
 
 void Warp::parse(vector<string> args) {
-    assert(args.size() == 0, "warp takes no arguments\n");
-    Image im = apply(stack(0), stack(1));
+    assert(args.size() < 2, "-warp takes zero or one arguments\n");
+    Resample::Kernel kernel = Resample::Lanczos3;
+    if (args.size() == 1) kernel = Resample::parseKernel(args[0]);
+    Image im = apply(stack(0), stack(1), kernel);
     pop();
     pop();
     push(im);
 }
 
-Image Warp::apply(Image coords, Image source) {
+Image Warp::apply(Image coords, Image source, Resample::Kernel kernel) {
 
     Image out(coords.width, coords.height, coords.frames, source.channels);
 
-    vector<float> sample(out.channels);
     if (coords.channels == 3) {
-        for (int t = 0; t < coords.frames; t++) {
-            for (int y = 0; y < coords.height; y++) {
+        assert(kernel == Resample::Lanczos3,
+               "Three dimensional warps only support lanczos3 interpolation\n");
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<float> sample(out.channels);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < coords.height * coords.frames; i++) {
+                int y = i % coords.height, t = i / coords.height;
                 for (int x = 0; x < coords.width; x++) {
                     source.sample3D(coords(x, y, t, 0),
                                     coords(x, y, t, 1),
@@ -1744,14 +2448,29 @@ Image Warp::apply(Image coords, Image source) {
             }
         }
     } else if (coords.channels == 2) {
-        for (int t = 0; t < coords.frames; t++) {
-            for (int y = 0; y < coords.height; y++) {
-                for (int x = 0; x < coords.width; x++) {
-                    source.sample2D(coords(x, y, t, 0),
-                                    coords(x, y, t, 1),
-                                    t, sample);
-                    for (int c = 0; c < out.channels; c++)
-                        out(x, y, t, c) = sample[c];
+        const int tilesX = (coords.width + warpTile - 1) / warpTile;
+        const int tilesY = (coords.height + warpTile - 1) / warpTile;
+        const int tiles = tilesX * tilesY * coords.frames;
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<float *> rows(out.channels);
+            WarpTaps w;
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+            #endif
+            for (int tile = 0; tile < tiles; tile++) {
+                int tx = (tile % tilesX) * warpTile;
+                int ty = ((tile / tilesX) % tilesY) * warpTile;
+                int t = tile / (tilesX * tilesY);
+                int n = min(warpTile, coords.width - tx);
+                for (int y = ty; y < min(ty + warpTile, coords.height); y++) {
+                    warpTaps(kernel, &coords(tx, y, t, 0), &coords(tx, y, t, 1), n, w);
+                    for (int c = 0; c < out.channels; c++) {
+                        rows[c] = &out(tx, y, t, c);
+                    }
+                    warpSample(source, t, w, &rows[0]);
                 }
             }
         }
@@ -51,13 +51,44 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, int width, int height);
-    static Image apply(Image im, int width, int height, int frames);
+
+    // The reconstruction filter. Box averages the input over the
+    // area of each output sample. The bicubic filters are
+    // Catmull-Rom, and Mitchell-Netravali with B = C = 1/3.
+    enum Kernel {Box = 0, Triangle, CatmullRom, Mitchell, Lanczos2, Lanczos3, Lanczos4};
+    static Kernel parseKernel(string name);
+    // Like parseKernel, but returns false rather than panicking if
+    // name isn't a filter.
+    static bool findKernel(string name, Kernel *kernel);
+
+    static Image apply(Image im, int width, int height, Kernel kernel = Lanczos3);
+    static Image apply(Image im, int width, int height, int frames, Kernel kernel = Lanczos3);
 private:
-    static void computeWeights(int oldSize, int newSize, vector<vector<pair<int, float> > > &matrix);
-    static Image resampleT(Image im, int frames);
-    static Image resampleX(Image im, int width);
-    static Image resampleY(Image im, int height);
+    // A resampling filter as a dense table. Output sample i is the
+    // dot product of the taps weights at weight[i*taps] with the
+    // input samples starting at start[i].
+    struct Weights {
+        int taps;
+        vector<int> start;
+        vector<float> weight;
+    };
+    static void computeWeights(int oldSize, int newSize, Kernel kernel, Weights &weights);
+    static Image resampleT(Image im, int frames, Kernel kernel);
+    static Image resampleXY(Image im, int width, int height, Kernel kernel);
+    static Image areaDownsample(Image im, int fx, int fy);
+};
+
+class Thumbnails : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+
+    // Resamples im to each of the given sizes. Each output is made
+    // from the smallest image already produced that is at least
+    // twice its size, so large inputs are only read once.
+    static vector<Image> apply(Image im, const vector<pair<int, int> > &sizes,
+                               Resample::Kernel kernel = Resample::Lanczos3);
 };
 
 class Rotate : public Operation {
@@ -65,7 +96,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, float degrees);
+    static Image apply(Image im, float degrees, Resample::Kernel kernel = Resample::Lanczos3);
 };
 
 class AffineWarp : public Operation {
@@ -73,8 +104,8 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, vector<float> warp);
-    static Image apply(Image im, float *warp);
+    static Image apply(Image im, vector<float> warp, Resample::Kernel kernel = Resample::Lanczos3);
+    static Image apply(Image im, float *warp, Resample::Kernel kernel = Resample::Lanczos3);
 };
 
 class Crop : public Operation {
@@ -171,7 +202,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image coords, Image source);
+    static Image apply(Image coords, Image source, Resample::Kernel kernel = Resample::Lanczos3);
 };
 
 class Reshape : public Operation {
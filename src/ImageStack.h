@@ -47,6 +47,7 @@
 #include "KernelEstimation.h"
 #include "LAHBPCG.h"
 #include "LightField.h"
+#include "Multigrid.h"
 #include "Arithmetic.h"
 #include "Network.h"
 #include "NetworkOps.h"
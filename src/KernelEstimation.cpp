@@ -20,6 +20,12 @@ void KernelEstimation::help() {
     pprintf("-kernelestimation will compute an estimated blur kernel from a blurry"
             " image using the algorithm described in Cho and Lee, 2009. It takes an"
             " optional argument that specifies the kernel size. The default is 25.\n"
+            "\n"
+            "The kernel is estimated coarse-to-fine from the square region of the"
+            " image with the most gradient energy. A second optional argument sets"
+            " the side of this region. The default depends on the kernel size. To"
+            " use the whole image, pass a size at least as large as the image.\n"
+            "\n"
             "Usage: ImageStack -load blurred -kernelestimation 25 -deconvolve cho\n");
 }
 
@@ -38,14 +44,23 @@ bool KernelEstimation::test() {
     Image blurry = Convolve::apply(dog, kernel);
     Image estimate = KernelEstimation::apply(blurry, kernel.width);
 
-    return nearlyEqual(estimate*20, kernel*20);
+    if (!nearlyEqual(estimate*20, kernel*20)) return false;
 
+    // The selected region should avoid the flat half of an image
+    Image half(200, 100, 1, 1);
+    Noise::apply(half.region(120, 0, 0, 0, 80, 100, 1, 1), 0, 1);
+    Image region = selectRegion(half, 64, 64);
+    Stats stats(region);
+    if (region.width != 64 || region.height != 64 || stats.minimum() <= 0) return false;
+
+    return true;
 }
 
 void KernelEstimation::parse(vector<string> args) {
-    assert(args.size() <= 1, "-kernelestimation takes at most one argument.\n");
-    int kernelSize = args.size() == 1 ? readInt(args[0]) : 25;
-    Image im = apply(stack(0), kernelSize);
+    assert(args.size() <= 2, "-kernelestimation takes at most two arguments.\n");
+    int kernelSize = args.size() >= 1 ? readInt(args[0]) : 25;
+    int regionSize = args.size() == 2 ? readInt(args[1]) : 0;
+    Image im = apply(stack(0), kernelSize, regionSize);
     push(im);
 }
 
@@ -97,6 +112,9 @@ Image KernelEstimation::contractKernel(Image im, int size) {
 void KernelEstimation::shockFilterIteration(Image im, float dt) {
     Image input = im.copy();
     for (int t = 0; t < im.frames; t++) {
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
         for (int y = 1; y < im.height - 1; y++) {
             for (int x = 1; x < im.width - 1; x++) {
                 for (int c = 0; c < im.channels; c++) {
@@ -131,6 +149,9 @@ void KernelEstimation::bilateralFilterIteration(Image im, float sigmaR) {
     float rangeSigmaMult = -1 / (2.0f * sigmaR * sigmaR);
     for (int c = 0; c < im.channels; c++) {
         for (int t = 0; t < im.frames; t++) {
+            #ifdef _OPENMP
+            #pragma omp parallel for
+            #endif
             for (int y = 0; y < im.height; y++) {
                 for (int x = 0; x < im.width; x++) {
                     float totalWeight = 0.0f, pixel = 0.0f;
@@ -189,7 +210,76 @@ Image KernelEstimation::bilinearResample(Image im, int w, int h) {
     return ret;
 }
 
-Image KernelEstimation::apply(Image B, int kernelSize) {
+/*
+ * Returns the width x height window of a single-channel image with
+ * the most gradient energy. Blur is only observable near strong
+ * edges, so a well-chosen window estimates the kernel about as well
+ * as the whole image at a fraction of the cost.
+ */
+Image KernelEstimation::selectRegion(Image im, int width, int height) {
+    assert(im.channels == 1 && im.frames == 1,
+           "Can only select a region from a single-channel single-frame image\n");
+    width = min(width, im.width);
+    height = min(height, im.height);
+    if (width == im.width && height == im.height) return im;
+
+    // Sum the gradient energy over blocks, and choose among windows
+    // aligned to the blocks.
+    const int block = 16;
+    int bw = max(1, (im.width - 1) / block), bh = max(1, (im.height - 1) / block);
+    Image energy(bw, bh, 1, 1);
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int by = 0; by < bh; by++) {
+        for (int y = by * block; y < min((by + 1) * block, im.height - 1); y++) {
+            for (int x = 0; x < min(bw * block, im.width - 1); x++) {
+                float dx = im(x+1, y) - im(x, y);
+                float dy = im(x, y+1) - im(x, y);
+                energy(x / block, by) += dx*dx + dy*dy;
+            }
+        }
+    }
+
+    // Summed area table over the blocks.
+    vector<double> sat((bw + 1) * (bh + 1), 0.0);
+    for (int by = 0; by < bh; by++) {
+        double row = 0;
+        for (int bx = 0; bx < bw; bx++) {
+            row += energy(bx, by);
+            sat[(by + 1) * (bw + 1) + bx + 1] = sat[by * (bw + 1) + bx + 1] + row;
+        }
+    }
+
+    int wb = max(1, min(bw, width / block)), hb = max(1, min(bh, height / block));
+    int bestX = 0, bestY = 0;
+    double best = -1;
+    for (int by = 0; by + hb <= bh; by++) {
+        for (int bx = 0; bx + wb <= bw; bx++) {
+            double e = (sat[(by + hb) * (bw + 1) + bx + wb] - sat[by * (bw + 1) + bx + wb] -
+                        sat[(by + hb) * (bw + 1) + bx] + sat[by * (bw + 1) + bx]);
+            if (e > best) {
+                best = e; bestX = bx; bestY = by;
+            }
+        }
+    }
+
+    int x = min(bestX * block, im.width - width);
+    int y = min(bestY * block, im.height - height);
+    return im.region(x, y, 0, 0, width, height, 1, 1).copy();
+}
+
+/*
+ * Applies the convolution whose spectrum F{A} is real (and given on
+ * half the frequency plane) to a real image: A x = F^-1{F{A} .* F{x}}.
+ */
+Image KernelEstimation::applyCoefficients(Image x, Image FA) {
+    Image Fx = FFT::applyReal(x, true, true, false);
+    Expr::setComplex(Fx, Expr::complexChannel(Fx) * FA);
+    return IFFT::applyReal(Fx, x.width, x.height, 1, true, true, false);
+}
+
+Image KernelEstimation::apply(Image B, int kernelSize, int regionSize) {
 
     /******************************* Parameter check */
 
@@ -218,6 +308,8 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
 
     /******************************* Declare Local Variables */
     Image Bgray = (B.channels == 3) ? ColorConvert::apply(B, "rgb", "y") : B.copy();
+    if (regionSize <= 0) regionSize = max(512, 16 * kernelSize);
+    Bgray = selectRegion(Bgray, regionSize, regionSize);
     Image Blurry;
     Image guess;
     Image K(3, 3, 1, 1);
@@ -229,8 +321,8 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
     for (unsigned int iteration = 1; iteration <= kernelScale.size(); iteration++) {
         // Setup.
         int m = kernelScale[kernelScale.size()-iteration];
-        int newwidth = ((float)m) / kernelSize * B.width;
-        int newheight = ((float)m) / kernelSize * B.height;
+        int newwidth = ((float)m) / kernelSize * Bgray.width;
+        int newheight = ((float)m) / kernelSize * Bgray.height;
         int paddedWidth = 0, paddedHeight = 0;
         for (int i = 0; i < 4; i++) {
             int s;
@@ -300,12 +392,15 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
             gradientThreshold *= 0.9f * 0.9f;
         }
         // Generate the gradient channels.
-        Image Px(paddedWidth, paddedHeight, 1, 2);
-        Image Py(paddedWidth, paddedHeight, 1, 2);
-        Image Bx(paddedWidth, paddedHeight, 1, 2);
-        Image By(paddedWidth, paddedHeight, 1, 2);
+        Image Px(paddedWidth, paddedHeight, 1, 1);
+        Image Py(paddedWidth, paddedHeight, 1, 1);
+        Image Bx(paddedWidth, paddedHeight, 1, 1);
+        Image By(paddedWidth, paddedHeight, 1, 1);
         int xoffset = (paddedWidth - newwidth) / 2;
         int yoffset = (paddedHeight - newheight) / 2;
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
         for (int y = 0; y < newheight - 1; y++) {
             for (int x = 0; x < newwidth - 1; x++) {
                 float dx = guess(x+1, y) - guess(x, y);
@@ -331,12 +426,15 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
         /**************************************************************/
         // Build the gradient images.
         float beta = 1.f;
-        Image dxPx(paddedWidth, paddedHeight, 1, 2);
-        Image dyPy(paddedWidth, paddedHeight, 1, 2);
-        Image dxyPxy(paddedWidth, paddedHeight, 1, 2);
-        Image dxBx(paddedWidth, paddedHeight, 1, 2);
-        Image dyBy(paddedWidth, paddedHeight, 1, 2);
-        Image dxyBxy(paddedWidth, paddedHeight, 1, 2);
+        Image dxPx(paddedWidth, paddedHeight, 1, 1);
+        Image dyPy(paddedWidth, paddedHeight, 1, 1);
+        Image dxyPxy(paddedWidth, paddedHeight, 1, 1);
+        Image dxBx(paddedWidth, paddedHeight, 1, 1);
+        Image dyBy(paddedWidth, paddedHeight, 1, 1);
+        Image dxyBxy(paddedWidth, paddedHeight, 1, 1);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
         for (int y = yoffset; y < newheight - 2 + yoffset; y++) {
             for (int x = xoffset; x < newwidth - 2 + xoffset; x++) {
                 dxPx(x, y) = Px(x+1, y) - Px(x, y);
@@ -347,10 +445,17 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
                 dxyBxy(x, y) = (Bx(x, y+1) - Bx(x, y) + By(x+1, y) - By(x, y)) * 0.5f;
             }
         }
-        FourierTransform(Px); FourierTransform(Py);
-        FourierTransform(dxPx); FourierTransform(dyPy); FourierTransform(dxyPxy);
-        FourierTransform(Bx); FourierTransform(By);
-        FourierTransform(dxBx); FourierTransform(dyBy); FourierTransform(dxyBxy);
+        // All of these are real, so only half of each spectrum is
+        // needed. The transforms are independent, so run them
+        // concurrently.
+        Image *gradients[] = {&Px, &Py, &dxPx, &dyPy, &dxyPxy,
+                              &Bx, &By, &dxBx, &dyBy, &dxyBxy};
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+        #endif
+        for (int i = 0; i < 10; i++) {
+            *gradients[i] = FFT::applyReal(*gradients[i], true, true, false);
+        }
         // Need to write conjugate gradient minimizing the following objective:
         // f(K) = sum_i w_i|A_iK-B_i|^2 + beta |K|^2
         //   where B_i is the i-th derivative of blurry image
@@ -365,41 +470,32 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
         // This requires us to precompute, among other things,
         // "CoeffA" = 2.0 * sum_i w_i F{A_i^T} .* F{A_i}) + F{beta} /// in fourier domain!
         // "CoeffB" = 2.0 * sum_i w_i F^{-1} { F{A_i^T} F{B_i} }
-        Image CoeffA(paddedWidth, paddedHeight, 1, 2);
-        Image CoeffB(paddedWidth, paddedHeight, 1, 2);
+        // F{CoeffA} is real, so it is stored as a single channel.
         Image Ri[CG_ITERATIONS], Di;
         float alpha = 0.f;
         Image CoeffADi;
 
         // Compute CoeffB:
-        ComplexMultiply::apply(Bx, Px, true);
-        ComplexMultiply::apply(By, Py, true);
-        ComplexMultiply::apply(dxBx, dxPx, true);
-        ComplexMultiply::apply(dyBy, dyPy, true);
-        ComplexMultiply::apply(dxyBxy, dxyPxy, true);
-        for (int c = 0; c < 2; c++)
-            for (int y = 0; y < paddedHeight; y++)
-                for (int x = 0; x < paddedWidth; x++)
-                    CoeffB(x, y, c) = (50.0f * (Bx(x, y, c) + By(x, y, c)) +
-                                       25.0f * (dxBx(x, y, c) + dyBy(x, y, c)) +
-                                       12.5f * (dxyBxy(x, y, c)));
-        InverseFourierTransform(CoeffB);
+        auto FPx = Expr::complexChannel(Px), FPy = Expr::complexChannel(Py);
+        auto FdxPx = Expr::complexChannel(dxPx), FdyPy = Expr::complexChannel(dyPy);
+        auto FdxyPxy = Expr::complexChannel(dxyPxy);
+        Image FCoeffB(Px.width, Px.height, 1, 2);
+        Expr::setComplex(FCoeffB,
+                         50.0f * (Expr::complexChannel(Bx) * Expr::conj(FPx) +
+                                  Expr::complexChannel(By) * Expr::conj(FPy)) +
+                         25.0f * (Expr::complexChannel(dxBx) * Expr::conj(FdxPx) +
+                                  Expr::complexChannel(dyBy) * Expr::conj(FdyPy)) +
+                         12.5f * (Expr::complexChannel(dxyBxy) * Expr::conj(FdxyPxy)));
+        Image CoeffB = IFFT::applyReal(FCoeffB, paddedWidth, paddedHeight, 1, true, true, false);
 
         // Compute CoeffA
-        ComplexMultiply::apply(Px, Px, true);
-        ComplexMultiply::apply(Py, Py, true);
-        ComplexMultiply::apply(dxPx, dxPx, true);
-        ComplexMultiply::apply(dyPy, dyPy, true);
-        ComplexMultiply::apply(dxyPxy, dxyPxy, true);
-        for (int y = 0; y < paddedHeight; y++)
-            for (int x = 0; x < paddedWidth; x++)
-                CoeffA(x, y) = (50.0f * (Px(x, y) + Py(x, y)) +
-                                25.0f * (dxPx(x, y) + dyPy(x, y)) +
-                                12.5f * (dxyPxy(x, y)) +
-                                2.0f * beta);
+        Image CoeffA = (50.0f * (Expr::norm(FPx) + Expr::norm(FPy)) +
+                        25.0f * (Expr::norm(FdxPx) + Expr::norm(FdyPy)) +
+                        12.5f * Expr::norm(FdxyPxy) +
+                        2.0f * beta);
 
         // Enlarge the kernel
-        K = enlargeKernel(K, paddedWidth, paddedHeight);
+        K = enlargeKernel(K, paddedWidth, paddedHeight).channel(0);
         toc = currentTime(); printf(" CG Setup  : %.3f sec\n", toc - tic); tic = toc;
 
         // Actual conjugate gradient iterations.
@@ -429,10 +525,7 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
             // In subsequent iterations, Ri = CoeffB - CoeffA * (K{i-1} + delta) = R{i-1} - CoeffA * Di * coeff
             Ri[i] = Image(paddedWidth, paddedHeight, 1, 1);
             if (i == 0) {
-                Image tmp = K.copy();
-                FourierTransform(tmp);  // tmp = F{K}
-                ComplexMultiply::apply(tmp, CoeffA, false); // tmp =  F{CoeffA} F{K}
-                InverseFourierTransform(tmp); // tmp = CoeffA * K
+                Image tmp = applyCoefficients(K, CoeffA); // tmp = CoeffA * K
                 for (int y = 0; y < m; y++) {
                     int yOld = (y - (m / 2) + paddedHeight) % paddedHeight;
                     int xOld = (- (m / 2) + paddedWidth) % paddedWidth;
@@ -485,10 +578,7 @@ Image KernelEstimation::apply(Image B, int kernelSize) {
             // It is given by coeff = di^T Ri[0] / di^T CoeffA di
             // Wiki says the numerator should be Ri[i]^T Ri[i]. Those are empirically equal.
             {
-                CoeffADi = RealComplex::apply(Di); //  = Di
-                FourierTransform(CoeffADi); //  = F{Di}
-                ComplexMultiply::apply(CoeffADi, CoeffA, false); //  = F{CoeffA} .* F{Di}
-                InverseFourierTransform(CoeffADi); //  = CoeffA Di
+                CoeffADi = applyCoefficients(Di, CoeffA); //  = CoeffA Di
                 float numerator = 0.f;
                 float denominator = 0.f;
                 for (int y = 0; y < m; y++) {
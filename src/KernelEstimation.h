@@ -8,17 +8,22 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, int kernelSize = 25);
+    // Estimates the kernel from the regionSize x regionSize window
+    // of im with the most gradient energy. Zero picks a region size
+    // from the kernel size.
+    static Image apply(Image im, int kernelSize = 25, int regionSize = 0);
 
     // Helpers
     static void normalizeSum(Image im);
     static Image enlargeKernel(Image im, int w, int h);
     static Image contractKernel(Image im, int size);
     static Image bilinearResample(Image im, int w, int h);
+    static Image selectRegion(Image im, int width, int height);
 
 private:
     static void shockFilterIteration(Image im, float dt = 1.0f);
     static void bilateralFilterIteration(Image im, float sigmaR);
+    static Image applyCoefficients(Image x, Image FA);
 };
 
 }
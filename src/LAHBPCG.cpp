@@ -97,10 +97,13 @@ public:
                 }
             }
         }
+        // keep the diagonal of A itself, as the preconditioner modifies AD
+        A0 = AD.copy();
         // set up indices
         RBBmaps();
         // compute preconditioner...
         constructPreconditioner();
+        packWeights();
     }
 
     void solve(Image guess, int max_iter, float tol);
@@ -112,6 +115,7 @@ private:
 
     void RBBmaps();
     void constructPreconditioner();
+    void packWeights();
     void ind2xy(const unsigned int index, int &x, int &y);
 
     inline unsigned int varIndices(const int x, const int y) {
@@ -138,6 +142,13 @@ private:
     Image f; // current iterate storate....
     Image hbRes;
 
+    Image A0; // diagonal of A
+
+    // The S weights (SS, SE, SN, SW) of each pixel, stored at that
+    // pixel, and the number of levels of the hierarchy
+    Image SW;
+    int levels;
+
     Image AD; // diagonalized A matrix
     const unsigned int max_length;
 
@@ -512,146 +523,80 @@ void PCG::constructPreconditioner() {
 // assumes gradient images taken from ImageStack's gradient operator
 // (i.e. backward differences) if not, results could be bogus!
 Image PCG::Ax(Image im) {
-    float a1,a2,a3;
-
-    // (Ax + w)* x
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            int x = 0;
-
-            a1 = 0;
-            a2 = sx(x,y,t,0) + sx(x+1,y,t,0)+ w(x,y,t,0);
-            a3 = -sx(x+1,y,t,0);
-            for (int c = 0; c < im.channels; c++) {
-                f(x,y,t,c) = a2*im(x,y,t,c) + a3*im(x+1,y,t,c);
-            }
-
-            for (x = 1; x < im.width-1; x++) {
-                a1 = -sx(x,y,t,0);
-                a2 = sx(x,y,t,0) + sx(x+1,y,t,0) + w(x,y,t,0); // a_(ij)x_(ij) + w_(ij)*x_(ij)
-                a3 = -sx(x+1,y,t,0); // AW
-                for (int c = 0; c < im.channels; c++) {
-                    f(x,y,t,c) = a1*im(x-1,y,t,c) + a2*im(x,y,t,c) + a3*im(x+1,y,t,c);
-                }
-            }
-
-            x = im.width-1;
-            a1 = -sx(x,y,t,0);
-            a2 = sx(x,y,t,0) + w(x,y,t,0);
-            a3 = 0; //AW
-            for (int c = 0; c < im.channels; c++) {
-                f(x,y,t,c) = a1*im(x-1,y,t,c) + a2*im(x,y,t,c);
-            }
-        }
+    using namespace Expr;
+    for (int c = 0; c < im.channels; c++) {
+        Image u = im.channel(c);
+        f.channel(c).set(A0 * u
+                         - sx * shiftX(zeroBoundary(u), 1)
+                         - shiftX(zeroBoundary(sx * u), -1)
+                         - sy * shiftY(zeroBoundary(u), 1)
+                         - shiftY(zeroBoundary(sy * u), -1));
     }
+    return f;
+}
 
-    // Ay*x + (Ax + w)*x
-    for (int t = 0; t < im.frames; t++) {
-        // for cache coherency
-        for (int x1 = 0; x1 < im.width; x1+= 8) {
-
-            int y = 0;
-            for (int x = x1; (x < x1 + 8) && (x < im.width); x++) {
-                a1 = 0;
-                a2 = sy(x,y,t,0) + sy(x,y+1,t,0);
-                a3 = -sy(x,y+1,t,0); //AN
-                for (int c = 0; c < im.channels; c++) {
-                    f(x,y,t,c) += a2*im(x,y,t,c) + a3*im(x,y+1,t,c);
-                }
-            }
-
-            for (y = 1; y < im.height-1; y++) {
-                for (int x = x1; (x < x1 + 8) && (x < im.width); x++) {
-
-                    a1 = -sy(x,y,t,0);
-                    a2 = sy(x,y,t,0) + sy(x,y+1,t,0);
-                    a3 = -sy(x,y+1,t,0);
-                    for (int c = 0; c < im.channels; c++) {
-                        f(x,y,t,c) += a1*im(x,y-1,t,c) + a2*im(x,y,t,c) + a3*im(x,y+1,t,c);
-                    }
-                }
-            }
-
-            y = im.height-1;
-            for (int x = x1; (x < x1 + 8) && (x < im.width); x++) {
-                a1 = -sy(x,y,t,0);
-                a2 = sy(x,y,t,0);
-                a3 = 0; //AN
-                for (int c = 0; c < im.channels; c++) {
-                    f(x,y,t,c) += a1*im(x,y-1,t,c) + a2*im(x,y,t,c);
-                }
-            }
+// Store the S weights in an image, so that the preconditioner can
+// visit the pixels of each level in scanline order. The pixels
+// eliminated at level k form a regular lattice with spacing
+// s = 1 << (k/2): for even k those with x/s + y/s odd, and for odd k
+// those with both x/s and y/s odd.
+void PCG::packWeights() {
+    SW = Image(f.width, f.height, 1, 4);
+    int x, y;
+    for (int k = 0; k < (int) index_map.size(); k++) {
+        for (size_t i = 0; i < index_map[k].size(); i++) {
+            ind2xy(index_map[k][i], x, y);
+            SW(x, y, 0, 0) = S[k][i].SS;
+            SW(x, y, 0, 1) = S[k][i].SE;
+            SW(x, y, 0, 2) = S[k][i].SN;
+            SW(x, y, 0, 3) = S[k][i].SW;
         }
     }
+    levels = (int) index_map.size();
 
-    return f;
+    // The index lists are no longer needed
+    vector< vector<unsigned int> >().swap(index_map);
+    vector< vector< S_elems > >().swap(S);
 }
 
 // apply the preconditioner to the residual r
 Image PCG::hbPrecondition(Image r) {
-    // wonder if there's a way to apply the preconditioner in a cache coherent manner....
-    hbRes = r.copy(); // ugh.. another deep copy... (no way around it...)
-    int x,y,x1,y1;
-    for (int k = 0; k < (int) index_map.size(); k ++) {
-        //int i = 0;
-        // turns out that recomputing these numbers is
-        // faster than accessing it in memory because of the misses
-        bool oddLevel = (k+1) % 2;
-        int stride = 1 << (k/2);
-        //printf("stride: %d\n", stride);
-
-        unsigned int dn1, dn2;
-        if (oddLevel) {
-            dn1 = stride; dn2 = stride*f.height;
-        } else {
-            dn1 = stride*(f.height - 1);
-            dn2 = stride*(f.height + 1);
-        }
-
-        int i = 0;
-        // S'*d
-        for (vector<unsigned int>::iterator idx = index_map[k].begin();
-             idx != index_map[k].end(); ++idx) {
-            // since this is S'*d, the index map represents "column" now
-            //int x, y, x1, y1, x2, y2;
-            S_elems elems = S[k][i];
-
-            ind2xy(*idx, x, y);
-
-            if (*idx + dn1 < max_length) {
-                //elems.SS = 0;
-                ind2xy((*idx + dn1) % max_length, x1, y1);
-                //y1 %= sy.height; x1 %= sy.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x1, y1, c) += hbRes(x, y, c)*elems.SS;
-                }
-            }
-
-            if (*idx + dn2 < max_length) {
-                ind2xy((*idx + dn2) % max_length, x1, y1);
-                //y1 %= sx.height; x1 %= sx.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x1, y1, c) += hbRes(x, y, c)*elems.SE;
-                }
-            }
-
-            if (*idx >= dn1) { // *idx - dn1 >= 0
-                ind2xy((*idx - dn1) % max_length, x1, y1);
-                //y1 %= sy.height; x1 %= sy.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x1, y1, c) += hbRes(x, y, c)*elems.SN;
-                }
-            }
-
-            if (*idx >= dn2) { // *idx - dn2 >= 0
-                ind2xy((*idx - dn2) % max_length, x1, y1);
-                //y1 %= sx.height; x1 %= sx.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x1, y1, c) += hbRes(x, y, c)*elems.SW;
+    hbRes = r.copy();
+    const int width = hbRes.width, height = hbRes.height;
+
+    // S'*d. Each pixel of a level scatters to the coarser pixels beside
+    // it. Done as a gather by those pixels instead, rows are
+    // independent and visited in memory order.
+    for (int k = 0; k < levels; k++) {
+        const int s = 1 << (k/2);
+        const bool oddLevel = (k+1) % 2;
+        // The coarser pixels are the rest of the lattice of spacing s
+        // for even k, and the lattice of spacing 2s for odd k
+        const int step = oddLevel ? s : 2*s;
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int y = 0; y < height; y += step) {
+            const int x0 = (oddLevel && ((y / s) & 1)) ? s : 0;
+            const bool up = y >= s, down = y + s < height;
+            for (int c = 0; c < hbRes.channels; c++) {
+                for (int x = x0; x < width; x += 2*s) {
+                    const bool left = x >= s, right = x + s < width;
+                    float v = 0;
+                    if (oddLevel) {
+                        if (up) { v += hbRes(x, y-s, c) * SW(x, y-s, 0, 0); }
+                        if (left) { v += hbRes(x-s, y, c) * SW(x-s, y, 0, 1); }
+                        if (down) { v += hbRes(x, y+s, c) * SW(x, y+s, 0, 2); }
+                        if (right) { v += hbRes(x+s, y, c) * SW(x+s, y, 0, 3); }
+                    } else {
+                        if (left && down) { v += hbRes(x-s, y+s, c) * SW(x-s, y+s, 0, 0); }
+                        if (left && up) { v += hbRes(x-s, y-s, c) * SW(x-s, y-s, 0, 1); }
+                        if (right && up) { v += hbRes(x+s, y-s, c) * SW(x+s, y-s, 0, 2); }
+                        if (right && down) { v += hbRes(x+s, y+s, c) * SW(x+s, y+s, 0, 3); }
+                    }
+                    hbRes(x, y, c) += v;
                 }
             }
-
-            i++;
         }
     }
 
@@ -660,67 +605,37 @@ Image PCG::hbPrecondition(Image r) {
         hbRes.channel(c) /= AD;
     }
 
-    // lowest level is identity matrix so it's ignored (not even stored in index_map)
-    for (int k = (int) index_map.size() - 1; k >= 0; k--) {
-        //int i = index_map.size() - 1;
-        bool oddLevel = (k+1) % 2;
-        int stride = 1 << (k/2);
-        //printf("stride: %d\n", stride);
-
-        unsigned int dn1, dn2;
-        if (oddLevel) {
-            dn1 = stride;
-            dn2 = stride*f.height;
-        } else {
-            dn1 = stride*(f.height - 1);
-            dn2 = stride*(f.height + 1);
-        }
-
-        int i = 0;
-        //S*d
-        for (vector<unsigned int>::iterator idx = index_map[k].begin();
-             idx != index_map[k].end(); ++idx) {
-            // since this is S*d, the index map represents "row" now
-            //int x, y, x1, y1, x2, y2;
-            S_elems elems = S[k][i];
-
-            ind2xy(*idx, x, y);
-
-            if (*idx + dn1 < max_length) {
-                ind2xy((*idx + dn1) % max_length, x1, y1);
-                //y1 %= sy.height; x1 %= sy.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x, y, c) += hbRes(x1, y1, c)*elems.SS;
-                }
-            }
-
-            if (*idx + dn2 < max_length) {
-                ind2xy((*idx + dn2) % max_length, x1, y1);
-                //y1 %= sx.height; x1 %= sx.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x, y, c) += hbRes(x1, y1, c)*elems.SE;
-                }
-            }
-
-            if (*idx >= dn1) { // *idx - dn1 >= 0
-                ind2xy((*idx - dn1) % max_length, x1, y1);
-                //y1 %= sy.height; x1 %= sy.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x, y, c) += hbRes(x1, y1, c)*elems.SN;
-                }
-            }
-
-            if (*idx >= dn2) { // *idx - dn2 >= 0
-                ind2xy((*idx - dn2) % max_length, x1, y1);
-                //y1 %= sx.height; x1 %= sx.width;
-                for (int c = 0; c < hbRes.channels; c++) {
-                    hbRes(x, y, c) += hbRes(x1, y1, c)*elems.SW;
+    // S*d. Each pixel of a level gathers from the coarser pixels beside
+    // it. Lowest level is identity matrix so it's ignored.
+    for (int k = levels - 1; k >= 0; k--) {
+        const int s = 1 << (k/2);
+        const bool oddLevel = (k+1) % 2;
+        const int step = oddLevel ? s : 2*s;
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int y = oddLevel ? 0 : s; y < height; y += step) {
+            const int x0 = (oddLevel && ((y / s) & 1)) ? 0 : s;
+            const bool up = y >= s, down = y + s < height;
+            for (int c = 0; c < hbRes.channels; c++) {
+                for (int x = x0; x < width; x += 2*s) {
+                    const bool left = x >= s, right = x + s < width;
+                    float v = 0;
+                    if (oddLevel) {
+                        if (down) { v += hbRes(x, y+s, c) * SW(x, y, 0, 0); }
+                        if (right) { v += hbRes(x+s, y, c) * SW(x, y, 0, 1); }
+                        if (up) { v += hbRes(x, y-s, c) * SW(x, y, 0, 2); }
+                        if (left) { v += hbRes(x-s, y, c) * SW(x, y, 0, 3); }
+                    } else {
+                        if (right && up) { v += hbRes(x+s, y-s, c) * SW(x, y, 0, 0); }
+                        if (right && down) { v += hbRes(x+s, y+s, c) * SW(x, y, 0, 1); }
+                        if (left && down) { v += hbRes(x-s, y+s, c) * SW(x, y, 0, 2); }
+                        if (left && up) { v += hbRes(x-s, y-s, c) * SW(x, y, 0, 3); }
+                    }
+                    hbRes(x, y, c) += v;
                 }
             }
-
-            i++;
         }
-        //i--;
     }
 
     return hbRes;
@@ -757,7 +672,7 @@ void PCG::solve(Image guess, int max_iter, float tol) {
         float delta_old = delta;
         delta = Reduce::sum(r*s);
 
-        dr = s + dr * (delta / delta_old);
+        dr.set(s + dr * (delta / delta_old));
     }
 
 }
@@ -779,7 +694,11 @@ void LAHBPCG::help() {
             "\n"
             "This operator takes two arguments. The first specifies the maximum"
             " number of iterations, and the second specifies the error required for"
-            " convergence\n"
+            " convergence. If the optional third argument 'guess' is given, a"
+            " seventh image on the top of the stack is used as the starting point of"
+            " the solve, which saves iterations when a good approximation is known"
+            " (for example the solution of a similar problem). Frames are solved"
+            " independently, and in parallel.\n"
             "\n"
             "The following example takes a sparse labelling of an image im.jpg, and"
             " expands it to be dense in a manner that respects the boundaries of"
@@ -823,15 +742,26 @@ bool LAHBPCG::test() {
     imMask.set(1-imMask);
 
     Image result = LAHBPCG::apply(im, dx, dy, imMask, dxMask, dyMask, 10, 0.01);
-    return nearlyEqual(result, clean);
+    if (!nearlyEqual(result, clean)) { return false; }
+
+    // Starting from the answer, it should stay there
+    Image again = LAHBPCG::apply(im, dx, dy, imMask, dxMask, dyMask, 10, 0.01, result);
+    return nearlyEqual(result, again);
 }
 
 void LAHBPCG::parse(vector<string> args) {
-    assert(args.size() == 2, "-lahbpcg takes two arguments\n");
+    assert(args.size() == 2 || args.size() == 3, "-lahbpcg takes two or three arguments\n");
 
     Image result;
 
-    result = apply(stack(5), stack(4), stack(3), stack(2), stack(1), stack(0), readInt(args[0]), readFloat(args[1]));
+    if (args.size() == 3) {
+        assert(args[2] == "guess", "The optional third argument to -lahbpcg must be 'guess'\n");
+        result = apply(stack(6), stack(5), stack(4), stack(3), stack(2), stack(1),
+                       readInt(args[0]), readFloat(args[1]), stack(0));
+        pop();
+    } else {
+        result = apply(stack(5), stack(4), stack(3), stack(2), stack(1), stack(0), readInt(args[0]), readFloat(args[1]));
+    }
 
     for (int i = 0; i < 5; i ++) {
         pop();
@@ -839,7 +769,7 @@ void LAHBPCG::parse(vector<string> args) {
     push(result);
 }
 
-Image LAHBPCG::apply(Image d, Image gx, Image gy, Image w, Image sx, Image sy, int max_iter, float tol) {
+Image LAHBPCG::apply(Image d, Image gx, Image gy, Image w, Image sx, Image sy, int max_iter, float tol, Image guess) {
     // check to make sure have same # of frames and same # of channels
     // assumes gradient images computed using ImageStack's gradient, which is
     // slightly different from the standard convolution gradient
@@ -874,7 +804,18 @@ Image LAHBPCG::apply(Image d, Image gx, Image gy, Image w, Image sx, Image sy, i
 
     Image out(d.width, d.height, d.frames, d.channels);
 
-    // solves frames independently
+    if (guess.defined()) {
+        assert(guess.width == d.width && guess.height == d.height &&
+               guess.frames == d.frames && guess.channels == d.channels,
+               "The initial guess must be the same size as the target\n");
+        out.set(guess);
+    }
+
+    // solves frames independently, in parallel if there's more than
+    // one, and otherwise with parallelism within the solve
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if (d.frames > 1)
+    #endif
     for (int t = 0; t < d.frames; t++) {
         printf("Computing preconditioner...\n");
         PCG solver(d.frame(t), gx.frame(t), gy.frame(t),
@@ -8,8 +8,10 @@ public:
     bool test();
     void parse(vector<string> args);
 
+    // If a guess is given, the solve starts from it instead of zero.
     static Image apply(Image d, Image gx, Image gy,
-                       Image w, Image sx, Image sy, int max_iter, float tol);
+                       Image w, Image sx, Image sy, int max_iter, float tol,
+                       Image guess = Image());
 private:
 };
 
@@ -45,109 +45,507 @@ void LocalLaplacian::help() {
             " tone-mapper because it amplifies contrast at fine scales and reduces"
             " it at coarse scales.\n"
             "\n"
-            "Usage: ImageStack -load input.jpg -locallaplacian 1 0 -save boosted.jpg\n");
+            "The optional third and fourth arguments give the number of intensity"
+            " levels and the number of pyramid levels to use. Both default to"
+            " eight. There must be at least two pyramid levels. An optional fifth"
+            " argument gives a tile size, in which case the image is processed in"
+            " overlapping tiles of about that size in parallel. Tiles are rounded"
+            " up to a multiple of 2^(levels-1) pixels and padded by twice that on"
+            " each side, which gives the same result as without tiling. Without"
+            " tiling the filter needs about three times the memory of the input;"
+            " with tiles much larger than the padding it needs a little over"
+            " twice.\n"
+            "\n"
+            "Usage: ImageStack -load input.jpg -locallaplacian 1 0 -save boosted.jpg\n"
+            "       ImageStack -load pano.tif -locallaplacian 1 2 8 8 1024 -save tonemapped.tif\n");
 }
 
 bool LocalLaplacian::test() {
     Image im = Downsample::apply(Load::apply("pics/dog1.jpg"), 2, 2, 1);
     Stats si(im);
     si.variance();
+    Image tiled = im.copy();
     LocalLaplacian::apply(im, 1.2, 0.2);
     Stats se(im);
-    return (se.minimum() < si.minimum() &&
-            se.maximum() > si.maximum() &&
-            se.variance() > si.variance());
+    if (!(se.minimum() < si.minimum() &&
+          se.maximum() > si.maximum() &&
+          se.variance() > si.variance())) {
+        return false;
+    }
+
+    // Tiling should make no difference beyond rounding error
+    Image untiled = tiled.copy();
+    LocalLaplacian::apply(untiled, 1, 2, 8, 8);
+    LocalLaplacian::apply(tiled, 1, 2, 8, 8, 40);
+    Stats sd(tiled - untiled);
+    return fabs(sd.minimum()) < 1e-5 && fabs(sd.maximum()) < 1e-5;
 }
 
 void LocalLaplacian::parse(vector<string> args) {
-    assert(args.size() == 2, "-locallaplacian takes two arguments");
-    Image im = stack(0);
-    apply(stack(0), readFloat(args[0]), readFloat(args[1]));
+    assert(args.size() >= 2 && args.size() <= 5, "-locallaplacian takes from two to five arguments\n");
+    int K = 8, J = 8, tileSize = 0;
+    if (args.size() > 2) { K = readInt(args[2]); }
+    if (args.size() > 3) { J = readInt(args[3]); }
+    if (args.size() > 4) { tileSize = readInt(args[4]); }
+    apply(stack(0), readFloat(args[0]), readFloat(args[1]), K, J, tileSize);
 }
 
-void LocalLaplacian::apply(Image im, float alpha, float beta) {
-    const int K = 8, J = 8;
+namespace {
+// A region of one frame processed at once
+struct LaplacianTile {
+    int t, x, y, w, h;
+};
 
-    assert(im.channels == 3, "-locallaplacian only works on three-channel images\n");
+// The tone-mapped luminance of a grayscale image. Rather than
+// building all K remapped pyramids at once, each is built in turn and
+// its contribution added into the output pyramid, so memory use does
+// not depend on K.
+Image localLaplacianLuminance(Image gray, Image remap, float minIntensity,
+                              float intensityDelta, float beta, int K, int J) {
+    Expr::X x; Expr::Y y;
+
+    // Compute a Gaussian and Laplacian pyramid for the input
+    vector<Image> imPyramid(J), output(J);
+    imPyramid[0] = gray;
+    for (int j = 1; j < J; j++) {
+        imPyramid[j] = pyramidDown(imPyramid[j-1]);
+    }
 
-    // For multi-frame images, process each frame independently
-    if (im.frames > 1) {
-        for (int t = 0; t < im.frames; t++) {
-            apply(im.frame(t), alpha, beta);
+    // The output pyramid starts as the input's Laplacian pyramid,
+    // weighted by how much of it to keep at each scale
+    vector<float> scale(J);
+    for (int j = 0; j < J; j++) {
+        if (beta < 0) {
+            scale[j] = ((float)j/(J-1))*(-beta) + 1-(-beta);
+        } else {
+            scale[j] = (1.0f - ((float)j/(J-1)))*beta + 1-beta;
+        }
+        if (j < J-1) {
+            output[j] = (1-scale[j]) * (imPyramid[j] - zeroBoundary(pyramidUp(imPyramid[j+1])));
+        } else {
+            output[j] = (1-scale[j]) * imPyramid[j];
         }
-        return;
     }
 
-    // Compute a discretized set of K intensities that span the values in the image
-    Stats s = Stats(im);
-    float minIntensity = s.minimum();
-    float intensityDelta = (s.maximum() - s.minimum()) / (K-1);
-    alpha /= (K-1);
+    // Add in each processed image's Laplacian pyramid, weighted by
+    // how near its intensity is to that found in the Gaussian pyramid
+    for (int k = 0; k < K; k++) {
+        Image level = imPyramid[0];
+        auto diff = (level(x, y) - minIntensity) / intensityDelta;
+        auto idx = clamp(toInt(diff * 256) - k*256 + remap.width/2, 0, remap.width-1);
+        Image processed(level.width, level.height, 1, 1);
+        processed.set(level(x, y) + remap(idx));
 
-    // Convert to grayscale and add a boundary condition
-    Image gray = (im.channel(0) + im.channel(1) + im.channel(2))/3;
+        for (int j = 0; j < J; j++) {
+            auto pos = (imPyramid[j] - minIntensity)/intensityDelta;
+            auto intLevel = toFloat(clamp(toInt(pos), 0, K-2));
+            auto interp = pos - intLevel;
+            auto weight = Select(intLevel == (float)k, 1 - interp,
+                                 Select(intLevel == (float)(k-1), interp, 0.0f));
+            if (j < J-1) {
+                Image next = pyramidDown(processed);
+                output[j] += scale[j] * weight * (processed - zeroBoundary(pyramidUp(next)));
+                processed = next;
+            } else {
+                output[j] += scale[j] * weight * processed;
+            }
+        }
+    }
 
-    // Compute a Gaussian and Laplacian pyramid for the input
-    Image imPyramid[J];
-    Image imLPyramid[J];
-    imPyramid[0] = gray;
-    for (int j = 1; j < J; j++) {
-        imPyramid[j] = pyramidDown(imPyramid[j-1]);
-        imLPyramid[j-1] = imPyramid[j-1] - zeroBoundary(pyramidUp(imPyramid[j]));
+    // Collapse the output pyramid, releasing each level once used
+    imPyramid.clear();
+    Image result = output[J-1];
+    output[J-1] = Image();
+    for (int j = J-2; j >= 0; j--) {
+        result = zeroBoundary(pyramidUp(result)) + output[j];
+        output[j] = Image();
     }
-    imLPyramid[J-1] = imPyramid[J-1];
+    return result;
+}
+}
+
+void LocalLaplacian::apply(Image im, float alpha, float beta, int K, int J, int tileSize) {
+    assert(im.channels == 3, "-locallaplacian only works on three-channel images\n");
+    assert(K >= 2, "-locallaplacian needs at least two intensity levels\n");
+    assert(J >= 2, "-locallaplacian needs at least two pyramid levels\n");
 
     // Make a lookup table for remapping
     // It's the derivative of a Gaussian centered at 1024 with std.dev 256
     Image remap(16*256, 1, 1, 1);
     auto fx = (Expr::X()-8*256) / 256.0f;
-    remap.set(alpha*fx*exp(-fx*fx/2.0f));
-    
-    // Make a set of K processed images
-    Image pyramid[J];
-    pyramid[0] = Image(gray.width, gray.height, 1, K);
-    Expr::X x; Expr::Y y; Expr::C c;
-    auto diff = (gray(x, y) - minIntensity) / intensityDelta;
-    auto idx = clamp(toInt(diff * 256) - c*256 + remap.width/2, 0, remap.width-1);        
-    pyramid[0].set(gray(x, y) + remap(idx));
-
-    // Compute a J-level Laplacian pyramid of the processed images
-    for (int j = 1; j < J; j++) {
-        pyramid[j] = pyramidDown(pyramid[j-1]);
-        pyramid[j-1] = pyramid[j-1] - zeroBoundary(pyramidUp(pyramid[j]));
+    remap.set((alpha/(K-1))*fx*exp(-fx*fx/2.0f));
+
+    // Tiles are aligned to the coarsest pyramid level, and padded by
+    // two pixels of that level, which covers the reach of the pyramid
+    // filters at every level.
+    int align = 1 << (J-1);
+    int halo = 2 * align;
+    if (tileSize > 0) {
+        tileSize = ((tileSize + align - 1) / align) * align;
     }
 
-    // Now construct output laplacian pyramid by looking up the
-    // Laplacian pyramids as a function of intensity found in the
-    // Gaussian pyramid
-    Image output;
-    for (int j = J-1; j >= 0; j--) {
+    // Convert to grayscale. Tiles read from this rather than from the
+    // image, which they modify.
+    Image gray = (im.channel(0) + im.channel(1) + im.channel(2))/3;
 
-        float scale;
-        if (beta < 0) {
-            scale = ((float)j/(J-1))*(-beta) + 1-(-beta);
-        } else {
-            scale = (1.0f - ((float)j/(J-1)))*beta + 1-beta;
-        }
-
-        auto level = (imPyramid[j] - minIntensity)/intensityDelta;
-        auto intLevel = clamp(toInt(level), 0, K-2);
-        auto interp = level - toFloat(intLevel);
-        // Add in the next pyramid level        
-        auto modified = 
-            interp * pyramid[j](x, y, intLevel+1) + 
-            (1 - interp) * pyramid[j](x, y, intLevel);
-        auto newVal = (1-scale) * imLPyramid[j] + scale * modified;
-        if (j == J-1) {
-            output = newVal;
+    vector<LaplacianTile> tiles;
+    vector<float> minIntensity(im.frames), intensityDelta(im.frames);
+    for (int t = 0; t < im.frames; t++) {
+        // Compute a discretized set of K intensities that span the
+        // values in each frame
+        Stats s = Stats(im.frame(t));
+        minIntensity[t] = s.minimum();
+        intensityDelta[t] = (s.maximum() - s.minimum()) / (K-1);
+
+        int tw = tileSize > 0 ? tileSize : im.width;
+        int th = tileSize > 0 ? tileSize : im.height;
+        for (int y = 0; y < im.height; y += th) {
+            for (int x = 0; x < im.width; x += tw) {
+                LaplacianTile tile = {t, x, y, min(tw, im.width - x), min(th, im.height - y)};
+                tiles.push_back(tile);
+            }
+        }
+    }
+
+    // Frames and tiles are processed in parallel
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+    #endif
+    for (int i = 0; i < (int)tiles.size(); i++) {
+        const LaplacianTile &tile = tiles[i];
+        int x0 = tile.x, y0 = tile.y, x1 = tile.x + tile.w, y1 = tile.y + tile.h;
+        if (tileSize > 0) {
+            x0 = max(0, ((x0 - halo) / align) * align);
+            y0 = max(0, ((y0 - halo) / align) * align);
+            x1 = min(im.width, x1 + halo);
+            y1 = min(im.height, y1 + halo);
+        }
+        Image region = gray.region(x0, y0, tile.t, 0, x1 - x0, y1 - y0, 1, 1);
+        Image output = localLaplacianLuminance(region, remap, minIntensity[tile.t],
+                                               intensityDelta[tile.t], beta, K, J);
+
+        // Reintroduce color in the interior of the tile
+        int ox = tile.x - x0, oy = tile.y - y0;
+        Image after = output.region(ox, oy, 0, 0, tile.w, tile.h, 1, 1);
+        Image before = region.region(ox, oy, 0, 0, tile.w, tile.h, 1, 1);
+        Image core = im.region(tile.x, tile.y, tile.t, 0, tile.w, tile.h, 1, 3);
+        Expr::X x; Expr::Y y;
+        core *= after(x, y, 0) / before(x, y, 0);
+    }
+}
+
+
+namespace {
+// The 5-tap binomial filter [1 4 6 4 1]/16 of Burt and Adelson,
+// separable and fused with decimation or upsampling. Edges are
+// clamped. Each works on one channel of one frame, in parallel over
+// rows.
+
+// Filter and decimate an in.width x in.height plane of in into the
+// top-left corner of out.
+void pyramidDownPlane(Image in, int w, int h, Image out) {
+    int ow = (w + 1) / 2, oh = (h + 1) / 2;
+
+    const Vec::type four = Vec::broadcast(4.0f);
+    const Vec::type six = Vec::broadcast(6.0f);
+    const Vec::type norm = Vec::broadcast(1.0f/256);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int y = 0; y < oh; y++) {
+        // Rows are padded by two on each side, and by enough more at
+        // the end for the even and odd samples to be read in whole
+        // vectors.
+        vector<float> tmp(w + 6 + 2*Vec::width);
+        vector<float> even(ow + 2 + Vec::width), odd(ow + 2 + Vec::width);
+        const float *r[5];
+        for (int k = 0; k < 5; k++) {
+            r[k] = &in(0, clamp(2*y + k - 2, 0, h-1), 0, 0);
+        }
+
+        // Vertical pass
+        float *t = &tmp[2];
+        int x = 0;
+        for (; x + Vec::width <= w; x += Vec::width) {
+            Vec::type v = Vec::Add::vec(Vec::load(r[0] + x), Vec::load(r[4] + x));
+            v = Vec::Add::vec(v, Vec::Mul::vec(four, Vec::Add::vec(Vec::load(r[1] + x),
+                                                                   Vec::load(r[3] + x))));
+            v = Vec::Add::vec(v, Vec::Mul::vec(six, Vec::load(r[2] + x)));
+            Vec::store(v, t + x);
+        }
+        for (; x < w; x++) {
+            t[x] = r[0][x] + r[4][x] + 4*(r[1][x] + r[3][x]) + 6*r[2][x];
+        }
+        tmp[0] = tmp[1] = t[0];
+        for (size_t i = w + 2; i < tmp.size(); i++) { tmp[i] = t[w-1]; }
+
+        // Split into even and odd samples, then the horizontal pass
+        for (int m = 0; m < ow + 2; m++) {
+            even[m] = tmp[2*m];
+            odd[m] = tmp[2*m+1];
+        }
+        float *o = &out(0, y, 0, 0);
+        x = 0;
+        for (; x + Vec::width <= ow; x += Vec::width) {
+            Vec::type v = Vec::Add::vec(Vec::load(&even[x]), Vec::load(&even[x+2]));
+            v = Vec::Add::vec(v, Vec::Mul::vec(four, Vec::Add::vec(Vec::load(&odd[x]),
+                                                                   Vec::load(&odd[x+1]))));
+            v = Vec::Add::vec(v, Vec::Mul::vec(six, Vec::load(&even[x+1])));
+            Vec::store(Vec::Mul::vec(v, norm), o + x);
+        }
+        for (; x < ow; x++) {
+            o[x] = (even[x] + even[x+2] + 4*(odd[x] + odd[x+1]) + 6*even[x+1]) / 256;
+        }
+    }
+}
+
+// Upsample the top-left (w+1)/2 x (h+1)/2 corner of coarse to w x h,
+// and store base plus sign times the result in out. base and out
+// may be the same.
+void pyramidUpPlane(Image coarse, int w, int h, Image base, float sign, Image out) {
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+    const Vec::type six = Vec::broadcast(6.0f);
+    const Vec::type four = Vec::broadcast(4.0f);
+    const Vec::type norm = Vec::broadcast(sign/64);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int y = 0; y < h; y++) {
+        vector<float> tmp(cw + 2 + Vec::width);
+        vector<float> even(cw + Vec::width), odd(cw + Vec::width);
+        float *t = &tmp[1];
+
+        // Vertical pass. Even rows are (1 6 1) of the coarse rows
+        // around them, and odd rows are (4 4) of those either side.
+        int m = y / 2;
+        int x = 0;
+        if (y % 2 == 0) {
+            const float *r0 = &coarse(0, max(m-1, 0), 0, 0);
+            const float *r1 = &coarse(0, m, 0, 0);
+            const float *r2 = &coarse(0, min(m+1, ch-1), 0, 0);
+            for (; x + Vec::width <= cw; x += Vec::width) {
+                Vec::type v = Vec::Add::vec(Vec::load(r0 + x), Vec::load(r2 + x));
+                v = Vec::Add::vec(v, Vec::Mul::vec(six, Vec::load(r1 + x)));
+                Vec::store(v, t + x);
+            }
+            for (; x < cw; x++) {
+                t[x] = r0[x] + r2[x] + 6*r1[x];
+            }
         } else {
-            output = zeroBoundary(pyramidUp(output)) + newVal;
+            const float *r0 = &coarse(0, m, 0, 0);
+            const float *r1 = &coarse(0, min(m+1, ch-1), 0, 0);
+            for (; x + Vec::width <= cw; x += Vec::width) {
+                Vec::type v = Vec::Add::vec(Vec::load(r0 + x), Vec::load(r1 + x));
+                Vec::store(Vec::Mul::vec(four, v), t + x);
+            }
+            for (; x < cw; x++) {
+                t[x] = 4*(r0[x] + r1[x]);
+            }
+        }
+        tmp[0] = t[0];
+        for (size_t i = cw + 1; i < tmp.size(); i++) { tmp[i] = t[cw-1]; }
+
+        // Horizontal pass, likewise for even and odd columns
+        x = 0;
+        for (; x + Vec::width <= cw; x += Vec::width) {
+            Vec::type e = Vec::Add::vec(Vec::load(&tmp[x]), Vec::load(&tmp[x+2]));
+            e = Vec::Add::vec(e, Vec::Mul::vec(six, Vec::load(&tmp[x+1])));
+            Vec::store(Vec::Mul::vec(e, norm), &even[x]);
+            Vec::type o = Vec::Add::vec(Vec::load(&tmp[x+1]), Vec::load(&tmp[x+2]));
+            Vec::store(Vec::Mul::vec(Vec::Mul::vec(four, o), norm), &odd[x]);
+        }
+        for (; x < cw; x++) {
+            even[x] = (tmp[x] + tmp[x+2] + 6*tmp[x+1]) * (sign/64);
+            odd[x] = 4*(tmp[x+1] + tmp[x+2]) * (sign/64);
+        }
+
+        const float *b = &base(0, y, 0, 0);
+        float *o = &out(0, y, 0, 0);
+        for (x = 0; x < w; x++) {
+            o[x] = b[x] + ((x & 1) ? odd[x/2] : even[x/2]);
+        }
+    }
+}
+
+// The size of each level of a pyramid
+void pyramidSizes(int w, int h, int levels, vector<int> &widths, vector<int> &heights) {
+    widths.resize(levels);
+    heights.resize(levels);
+    for (int j = 0; j < levels; j++) {
+        widths[j] = w;
+        heights[j] = h;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+}
+}
+
+void GaussianPyramid::help() {
+    pprintf("-gaussianpyramid replaces the top image on the stack with its Gaussian"
+            " pyramid, using the 5-tap binomial filter of Burt and Adelson. The"
+            " argument gives the number of levels. The levels are packed into"
+            " one image with one level per frame. Level j is in the top-left corner"
+            " of frame j, and is half the size of level j-1 rounded up. The input"
+            " must have a single frame. Use -crop to extract a level.\n"
+            "\n"
+            "Usage: ImageStack -load a.jpg -gaussianpyramid 4 \\\n"
+            "                  -crop 0 0 2 width/4 height/4 1 -save quarter.jpg\n");
+}
+
+bool GaussianPyramid::test() {
+    Image im(101, 77, 1, 2);
+    Noise::apply(im, 0, 1);
+    Image pyramid = GaussianPyramid::apply(im, 4);
+    if (pyramid.frames != 4 || !nearlyEqual(pyramid.frame(0), im)) { return false; }
+
+    // Check a sample of level one against the filter done directly
+    float k[] = {1, 4, 6, 4, 1};
+    for (int y = 0; y < 39; y += 7) {
+        for (int x = 0; x < 51; x += 5) {
+            for (int c = 0; c < 2; c++) {
+                float correct = 0;
+                for (int dy = 0; dy < 5; dy++) {
+                    for (int dx = 0; dx < 5; dx++) {
+                        correct += k[dx] * k[dy] * im(clamp(2*x + dx - 2, 0, im.width-1),
+                                                      clamp(2*y + dy - 2, 0, im.height-1), c);
+                    }
+                }
+                correct /= 256;
+                if (fabs(pyramid(x, y, 1, c) - correct) > 1e-5) { return false; }
+            }
+        }
+    }
+
+    // Outside the level it should be zero
+    return pyramid(51, 0, 1, 0) == 0 && pyramid(0, 39, 1, 0) == 0 &&
+           pyramid(13, 10, 3, 0) == 0;
+}
+
+void GaussianPyramid::parse(vector<string> args) {
+    assert(args.size() == 1, "-gaussianpyramid takes one argument\n");
+    Image im = apply(stack(0), readInt(args[0]));
+    pop();
+    push(im);
+}
+
+Image GaussianPyramid::apply(Image im, int levels) {
+    assert(im.frames == 1, "-gaussianpyramid only works on single-frame images\n");
+    assert(levels > 0, "A pyramid must have at least one level\n");
+
+    vector<int> widths, heights;
+    pyramidSizes(im.width, im.height, levels, widths, heights);
+
+    Image pyramid(im.width, im.height, levels, im.channels);
+    pyramid.frame(0).set(im);
+    for (int j = 1; j < levels; j++) {
+        for (int c = 0; c < im.channels; c++) {
+            pyramidDownPlane(pyramid.frame(j-1).channel(c), widths[j-1], heights[j-1],
+                             pyramid.frame(j).channel(c));
         }
     }
+    return pyramid;
+}
+
+void LaplacianPyramid::help() {
+    pprintf("-laplacianpyramid replaces the top image on the stack with its"
+            " Laplacian pyramid. The argument gives the number of levels. Each"
+            " level is the difference between that level of the Gaussian pyramid"
+            " (see -gaussianpyramid) and the next level upsampled, except the last,"
+            " which is the last level of the Gaussian pyramid. The levels are"
+            " packed in frames as for -gaussianpyramid. -collapsepyramid inverts"
+            " it.\n"
+            "\n"
+            "Usage: ImageStack -load a.jpg -laplacianpyramid 6 \\\n"
+            "                  -eval \"val*(1+0.5*(t==1))\" -collapsepyramid -save sharper.jpg\n");
+}
+
+bool LaplacianPyramid::test() {
+    Image im(123, 65, 1, 3);
+    Noise::apply(im, 0, 1);
+    Image pyramid = LaplacianPyramid::apply(im, 5);
+    if (pyramid.frames != 5) { return false; }
+
+    // The finest level of a smooth image should be nearly zero
+    Image smooth(123, 65, 1, 1);
+    smooth.set(Expr::X()*0.01f + Expr::Y()*0.02f);
+    Image flat = LaplacianPyramid::apply(smooth, 3);
+    Stats s(flat.frame(0).region(6, 6, 0, 0, 111, 53, 1, 1));
+    if (fabs(s.minimum()) > 1e-4 || fabs(s.maximum()) > 1e-4) { return false; }
 
-    // Reintroduce color
-    output /= gray;
-    im *= output(x, y, 0);
+    // The last level is that of the Gaussian pyramid
+    Image gaussian = GaussianPyramid::apply(im, 5);
+    return nearlyEqual(pyramid.frame(4), gaussian.frame(4));
+}
+
+void LaplacianPyramid::parse(vector<string> args) {
+    assert(args.size() == 1, "-laplacianpyramid takes one argument\n");
+    Image im = apply(stack(0), readInt(args[0]));
+    pop();
+    push(im);
+}
+
+Image LaplacianPyramid::apply(Image im, int levels) {
+    Image pyramid = GaussianPyramid::apply(im, levels);
+
+    vector<int> widths, heights;
+    pyramidSizes(im.width, im.height, levels, widths, heights);
+
+    // Subtract each level's upsampled successor, finest first, so
+    // that the successor is still the Gaussian level.
+    for (int j = 0; j < levels-1; j++) {
+        for (int c = 0; c < im.channels; c++) {
+            Image level = pyramid.frame(j).channel(c);
+            pyramidUpPlane(pyramid.frame(j+1).channel(c), widths[j], heights[j],
+                           level, -1, level);
+        }
+    }
+    return pyramid;
+}
+
+void CollapsePyramid::help() {
+    pprintf("-collapsepyramid replaces the Laplacian pyramid on the top of the"
+            " stack, packed as made by -laplacianpyramid, with the image it"
+            " represents.\n"
+            "\n"
+            "Usage: ImageStack -load a.jpg -laplacianpyramid 6 -collapsepyramid -save a2.jpg\n");
+}
+
+bool CollapsePyramid::test() {
+    Image im(97, 130, 1, 3);
+    Noise::apply(im, 0, 1);
+    Image out = CollapsePyramid::apply(LaplacianPyramid::apply(im, 6));
+    Stats s(out - im);
+    return fabs(s.minimum()) < 1e-5 && fabs(s.maximum()) < 1e-5;
+}
+
+void CollapsePyramid::parse(vector<string> args) {
+    assert(args.size() == 0, "-collapsepyramid takes no arguments\n");
+    Image im = apply(stack(0));
+    pop();
+    push(im);
+}
+
+Image CollapsePyramid::apply(Image pyramid) {
+    int levels = pyramid.frames;
+    vector<int> widths, heights;
+    pyramidSizes(pyramid.width, pyramid.height, levels, widths, heights);
+
+    // Work from coarse to fine in a copy of all but the finest level,
+    // then write the finest level into the output.
+    Image work = pyramid.copy();
+    Image out(pyramid.width, pyramid.height, 1, pyramid.channels);
+    for (int j = levels-2; j >= 0; j--) {
+        for (int c = 0; c < pyramid.channels; c++) {
+            Image dst = (j == 0) ? out.channel(c) : work.frame(j).channel(c);
+            pyramidUpPlane(work.frame(j+1).channel(c), widths[j], heights[j],
+                           work.frame(j).channel(c), 1, dst);
+        }
+    }
+    if (levels == 1) { out.set(pyramid); }
+    return out;
 }
 
 }
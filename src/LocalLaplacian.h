@@ -7,9 +7,40 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static void apply(Image im, float alpha, float beta);
+    // K is the number of intensity levels, and J the number of
+    // pyramid levels. If tileSize is non-zero, the image is processed
+    // in overlapping tiles of about that size, in parallel.
+    static void apply(Image im, float alpha, float beta,
+                      int K = 8, int J = 8, int tileSize = 0);
 };
 
 
+// Pyramids are packed into a single image with one level per frame.
+// Level j occupies the top-left corner of frame j, and is half the
+// size of level j-1, rounded up. The rest of each frame is zero.
+class GaussianPyramid : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static Image apply(Image im, int levels);
+};
+
+class LaplacianPyramid : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static Image apply(Image im, int levels);
+};
+
+class CollapsePyramid : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static Image apply(Image pyramid);
+};
+
 }
 #endif
@@ -0,0 +1,475 @@
+#include "main.h"
+#include "Multigrid.h"
+#include "Calculus.h"
+#include "Statistics.h"
+#include "Reduction.h"
+namespace ImageStack {
+
+namespace {
+
+// One level of a cell-centered multigrid hierarchy. The system at
+// each level is
+//
+//   mass*x + sum over the four edges of weight*(x - neighbor) = b
+//
+// where ex(x, y) is the weight of the edge between (x-1, y) and (x, y),
+// and ey(x, y) that of the edge between (x, y-1) and (x, y). The
+// edges at x = 0 and y = 0 connect to a fixed value of zero, as in
+// LAHBPCG.
+struct MultigridLevel {
+    int width, height;
+    Image mass, ex, ey;
+    Image diag, invDiag;
+    Image x, b, r;
+};
+
+class MultigridSolver {
+public:
+    MultigridSolver(Image d, Image gx, Image gy, Image w, Image sx, Image sy);
+
+    void solve(Image guess, int maxCycles, float tol, bool wCycle);
+
+private:
+    void neighborSum(MultigridLevel &l, int y, int c, float *out);
+    void relax(MultigridLevel &l, int parity);
+    float residual(MultigridLevel &l);
+    void restrictResidual(MultigridLevel &fine, MultigridLevel &coarse);
+    void prolongAndAdd(MultigridLevel &coarse, MultigridLevel &fine);
+    void setDiagonal(MultigridLevel &l);
+    void cycle(size_t level, int gamma);
+
+    vector<MultigridLevel> levels;
+    vector<float> zeros;
+    int channels;
+};
+
+MultigridSolver::MultigridSolver(Image d, Image gx, Image gy, Image w, Image sx, Image sy) :
+    zeros(d.width + Vec::width), channels(d.channels) {
+
+    MultigridLevel fine;
+    fine.width = d.width;
+    fine.height = d.height;
+    fine.mass = w;
+    fine.ex = sx;
+    fine.ey = sy;
+    fine.b = Image(d.width, d.height, 1, d.channels);
+    fine.r = Image(d.width, d.height, 1, d.channels);
+    setDiagonal(fine);
+
+    // The right-hand side of the normal equations of the energy
+    // minimized by LAHBPCG
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int y = 0; y < d.height; y++) {
+        for (int c = 0; c < d.channels; c++) {
+            for (int x = 0; x < d.width; x++) {
+                float v = (gx(x, y, 0, c) * sx(x, y, 0, 0) +
+                           gy(x, y, 0, c) * sy(x, y, 0, 0) +
+                           d(x, y, 0, c) * w(x, y, 0, 0));
+                if (x < d.width-1) {
+                    v -= gx(x+1, y, 0, c) * sx(x+1, y, 0, 0);
+                }
+                if (y < d.height-1) {
+                    v -= gy(x, y+1, 0, c) * sy(x, y+1, 0, 0);
+                }
+                fine.b(x, y, 0, c) = v;
+            }
+        }
+    }
+    levels.push_back(fine);
+
+    // Coarsen by two in each dimension. The mass of a coarse cell is
+    // the sum of the mass of its children. The edge weights are
+    // halved sums of the fine edges they cover, so that a smooth
+    // function sees the same operator at each scale. The edges to the
+    // fixed zero beyond x = 0 and y = 0 are also scaled by how much
+    // nearer the boundary value is to the coarse cell centers, in
+    // units of their size.
+    float ghostDistance = 1;
+    while (min(levels.back().width, levels.back().height) > 3) {
+        MultigridLevel &f = levels.back();
+        float scale = 1 << levels.size();
+        float coarseGhostDistance = (scale + 1) / (2 * scale);
+        float ghostFactor = ghostDistance / coarseGhostDistance;
+        ghostDistance = coarseGhostDistance;
+        MultigridLevel c;
+        c.width = (f.width + 1) / 2;
+        c.height = (f.height + 1) / 2;
+        c.mass = Image(c.width, c.height, 1, 1);
+        c.ex = Image(c.width, c.height, 1, 1);
+        c.ey = Image(c.width, c.height, 1, 1);
+        for (int y = 0; y < c.height; y++) {
+            int y1 = min(2*y+1, f.height-1);
+            for (int x = 0; x < c.width; x++) {
+                int x1 = min(2*x+1, f.width-1);
+                float m = f.mass(2*x, 2*y, 0, 0);
+                float ex = f.ex(2*x, 2*y, 0, 0);
+                float ey = f.ey(2*x, 2*y, 0, 0);
+                if (x1 != 2*x) {
+                    m += f.mass(x1, 2*y, 0, 0);
+                    ey += f.ey(x1, 2*y, 0, 0);
+                }
+                if (y1 != 2*y) {
+                    m += f.mass(2*x, y1, 0, 0);
+                    ex += f.ex(2*x, y1, 0, 0);
+                }
+                if (x1 != 2*x && y1 != 2*y) {
+                    m += f.mass(x1, y1, 0, 0);
+                }
+                c.mass(x, y, 0, 0) = m;
+                c.ex(x, y, 0, 0) = ex * (x == 0 ? 0.5f * ghostFactor : 0.5f);
+                c.ey(x, y, 0, 0) = ey * (y == 0 ? 0.5f * ghostFactor : 0.5f);
+            }
+        }
+        setDiagonal(c);
+        c.x = Image(c.width, c.height, 1, channels);
+        c.b = Image(c.width, c.height, 1, channels);
+        c.r = Image(c.width, c.height, 1, channels);
+        levels.push_back(c);
+    }
+}
+
+void MultigridSolver::setDiagonal(MultigridLevel &l) {
+    l.diag = Image(l.width, l.height, 1, 1);
+    l.invDiag = Image(l.width, l.height, 1, 1);
+    for (int y = 0; y < l.height; y++) {
+        for (int x = 0; x < l.width; x++) {
+            float v = l.mass(x, y, 0, 0) + l.ex(x, y, 0, 0) + l.ey(x, y, 0, 0);
+            if (x < l.width-1) { v += l.ex(x+1, y, 0, 0); }
+            if (y < l.height-1) { v += l.ey(x, y+1, 0, 0); }
+            l.diag(x, y, 0, 0) = v;
+            l.invDiag(x, y, 0, 0) = v > 0 ? 1.0f/v : 0;
+        }
+    }
+}
+
+// Compute b plus the weighted sum of the neighbors of each pixel in
+// row y of channel c.
+void MultigridSolver::neighborSum(MultigridLevel &l, int y, int c, float *out) {
+    const int w = l.width, h = l.height;
+    const float *xr = &l.x(0, y, 0, c);
+    const float *xu = y > 0 ? &l.x(0, y-1, 0, c) : &zeros[0];
+    const float *xd = y < h-1 ? &l.x(0, y+1, 0, c) : &zeros[0];
+    const float *eu = &l.ey(0, y, 0, 0);
+    const float *ed = y < h-1 ? &l.ey(0, y+1, 0, 0) : &zeros[0];
+    const float *el = &l.ex(0, y, 0, 0);
+    const float *br = &l.b(0, y, 0, c);
+
+    out[0] = br[0] + eu[0]*xu[0] + ed[0]*xd[0] + (w > 1 ? el[1]*xr[1] : 0);
+    int x = 1;
+    for (; x + Vec::width < w; x += Vec::width) {
+        Vec::type v = Vec::load(br + x);
+        v = Vec::Add::vec(v, Vec::Mul::vec(Vec::load(eu + x), Vec::load(xu + x)));
+        v = Vec::Add::vec(v, Vec::Mul::vec(Vec::load(ed + x), Vec::load(xd + x)));
+        v = Vec::Add::vec(v, Vec::Mul::vec(Vec::load(el + x), Vec::load(xr + x - 1)));
+        v = Vec::Add::vec(v, Vec::Mul::vec(Vec::load(el + x + 1), Vec::load(xr + x + 1)));
+        Vec::store(v, out + x);
+    }
+    for (; x < w; x++) {
+        float v = br[x] + eu[x]*xu[x] + ed[x]*xd[x] + el[x]*xr[x-1];
+        if (x < w-1) { v += el[x+1]*xr[x+1]; }
+        out[x] = v;
+    }
+}
+
+// A red-black Gauss-Seidel half-sweep, updating the pixels with x + y
+// of the given parity. Their neighbors all have the other parity, so
+// rows are independent, and each row computes the update for every
+// pixel with vector math and then keeps every other one. That reads
+// whole rows above and below, so even and odd rows are done in turn,
+// and no thread reads a row another thread is writing.
+void MultigridSolver::relax(MultigridLevel &l, int parity) {
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<float> tmp(l.width);
+        for (int rowParity = 0; rowParity < 2; rowParity++) {
+            int rows = (l.height - rowParity + 1) / 2;
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < rows * channels; i++) {
+                int y = 2*(i % rows) + rowParity, c = i / rows;
+                neighborSum(l, y, c, &tmp[0]);
+                float *xr = &l.x(0, y, 0, c);
+                const float *id = &l.invDiag(0, y, 0, 0);
+                for (int x = (y + parity) & 1; x < l.width; x += 2) {
+                    xr[x] = tmp[x] * id[x];
+                }
+            }
+        }
+    }
+}
+
+// Compute r = b - Ax, and return the norm of r.
+float MultigridSolver::residual(MultigridLevel &l) {
+    double sum = 0;
+    #ifdef _OPENMP
+    #pragma omp parallel reduction(+:sum)
+    #endif
+    {
+        #ifdef _OPENMP
+        #pragma omp for
+        #endif
+        for (int i = 0; i < l.height * channels; i++) {
+            int y = i % l.height, c = i / l.height;
+            float *rr = &l.r(0, y, 0, c);
+            neighborSum(l, y, c, rr);
+            const float *xr = &l.x(0, y, 0, c);
+            const float *dr = &l.diag(0, y, 0, 0);
+            float rowSum = 0;
+            for (int x = 0; x < l.width; x++) {
+                rr[x] -= dr[x] * xr[x];
+                rowSum += rr[x] * rr[x];
+            }
+            sum += rowSum;
+        }
+    }
+    return sqrtf(sum);
+}
+
+// The coarse right-hand side is the sum of the fine residuals in each
+// cell.
+void MultigridSolver::restrictResidual(MultigridLevel &fine, MultigridLevel &coarse) {
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int i = 0; i < coarse.height * channels; i++) {
+        int y = i % coarse.height, c = i / coarse.height;
+        const float *r0 = &fine.r(0, 2*y, 0, c);
+        const float *r1 = 2*y+1 < fine.height ? &fine.r(0, 2*y+1, 0, c) : &zeros[0];
+        float *br = &coarse.b(0, y, 0, c);
+        for (int x = 0; x < fine.width/2; x++) {
+            br[x] = r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1];
+        }
+        if (fine.width & 1) {
+            br[coarse.width-1] = r0[fine.width-1] + r1[fine.width-1];
+        }
+    }
+}
+
+// Add the bilinear interpolation of the coarse correction to the fine
+// solution. Each fine cell takes 3/4 of its parent and 1/4 of the
+// parent's neighbor on its side, in each dimension.
+void MultigridSolver::prolongAndAdd(MultigridLevel &coarse, MultigridLevel &fine) {
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<float> tmp(coarse.width);
+        #ifdef _OPENMP
+        #pragma omp for
+        #endif
+        for (int i = 0; i < fine.height * channels; i++) {
+            int y = i % fine.height, c = i / fine.height;
+            int cy = y / 2;
+            int ny = (y & 1) ? min(cy+1, coarse.height-1) : max(cy-1, 0);
+            const float *e0 = &coarse.x(0, cy, 0, c);
+            const float *e1 = &coarse.x(0, ny, 0, c);
+            for (int x = 0; x < coarse.width; x++) {
+                tmp[x] = 0.75f * e0[x] + 0.25f * e1[x];
+            }
+            float *xr = &fine.x(0, y, 0, c);
+            const int cw = coarse.width;
+            for (int x = 0; x < fine.width; x++) {
+                int cx = x / 2;
+                int nx = (x & 1) ? min(cx+1, cw-1) : max(cx-1, 0);
+                xr[x] += 0.75f * tmp[cx] + 0.25f * tmp[nx];
+            }
+        }
+    }
+}
+
+void MultigridSolver::cycle(size_t level, int gamma) {
+    MultigridLevel &l = levels[level];
+
+    if (level == levels.size()-1) {
+        // The coarsest level is only a few pixels in one dimension,
+        // so plain relaxation solves it.
+        for (int i = 0; i < l.width + l.height; i++) {
+            relax(l, 0);
+            relax(l, 1);
+        }
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        relax(l, 0);
+        relax(l, 1);
+    }
+
+    MultigridLevel &coarse = levels[level+1];
+    residual(l);
+    restrictResidual(l, coarse);
+    coarse.x.set(0);
+    for (int i = 0; i < gamma; i++) {
+        cycle(level+1, gamma);
+    }
+    prolongAndAdd(coarse, l);
+
+    for (int i = 0; i < 2; i++) {
+        relax(l, 1);
+        relax(l, 0);
+    }
+}
+
+// Cycles alone converge slowly when the weights vary over orders of
+// magnitude, so each cycle is used as the preconditioner of a flexible
+// conjugate gradient solve instead.
+void MultigridSolver::solve(Image guess, int maxCycles, float tol, bool wCycle) {
+    MultigridLevel &l = levels[0];
+    const int gamma = wCycle ? 2 : 1;
+    Image rhs = l.b, scratch = l.r;
+    Image zero(l.width, l.height, 1, channels);
+    Image r(l.width, l.height, 1, channels);
+    Image z(l.width, l.height, 1, channels);
+    Image p(l.width, l.height, 1, channels);
+    Image q(l.width, l.height, 1, channels);
+
+    l.x = guess;
+    l.b = rhs;
+    l.r = r;
+    float initial = residual(l);
+
+    // z is one cycle applied to r, starting from zero
+    l.x = z;
+    l.b = r;
+    l.r = scratch;
+    cycle(0, gamma);
+    p.set(z);
+    double rz = Reduce::sum(r*z);
+
+    float res = initial, best = initial;
+    int sinceBest = 0;
+    for (int i = 1; i <= maxCycles && res > tol * initial; i++) {
+        // The residual of p with a zero right-hand side is -Ap
+        l.x = p;
+        l.b = zero;
+        l.r = q;
+        residual(l);
+        float alpha = -rz / Reduce::sum(p*q);
+        guess += p * alpha;
+        r += q * alpha;
+
+        res = sqrtf(Reduce::sum(r*r));
+        // Stop if we've hit the limits of floating point precision
+        if (res < best) {
+            best = res;
+            sinceBest = 0;
+        } else if (++sinceBest == 3) {
+            break;
+        }
+
+        double rzOld = Reduce::sum(r*z);
+        z.set(0);
+        l.x = z;
+        l.b = r;
+        l.r = scratch;
+        cycle(0, gamma);
+        double rzNew = Reduce::sum(r*z);
+        float beta = (rzNew - rzOld) / rz;
+        rz = rzNew;
+        p.set(z + p*beta);
+    }
+}
+
+}
+
+void Multigrid::help() {
+    pprintf("-multigrid takes six images from the stack, like -lahbpcg, and treats"
+            " them as a target output, x gradient, and y gradient, and then the"
+            " respective weights for each term. The weights must have one channel."
+            " It solves for the image which best achieves that target output and"
+            " those target gradients in the weighted-least-squares sense, using"
+            " geometric multigrid with red-black Gauss-Seidel smoothing, with each"
+            " cycle acting as the preconditioner of a conjugate gradient step. This"
+            " covers Poisson problems (zero target weight), screened Poisson"
+            " problems (small constant target weight), and masked problems (a large"
+            " target weight pins pixels, and zero gradient weights cut edges).\n"
+            "\n"
+            "The first argument is the maximum number of cycles, and the second is"
+            " the factor by which the residual must fall for convergence. The"
+            " optional third argument is 'v' (the default) for V-cycles or 'w' for"
+            " W-cycles, which cost more but are more robust when the weights vary"
+            " greatly.\n"
+            "\n"
+            "Usage: ImageStack -load target.tmp -load dx.tmp -load dy.tmp \\\n"
+            "                  -load w.tmp -load sx.tmp -load sy.tmp \\\n"
+            "                  -multigrid 20 0.0001 -save out.tmp\n");
+}
+
+bool Multigrid::test() {
+    // A screened Poisson problem whose solution is known
+    Image a(157, 103, 1, 3);
+    Noise::apply(a, 0, 1);
+    Image dx = a.copy();
+    Gradient::apply(dx, 'x');
+    Image dy = a.copy();
+    Gradient::apply(dy, 'y');
+    Image w(a.width, a.height, 1, 1), sx(a.width, a.height, 1, 1), sy(a.width, a.height, 1, 1);
+    Noise::apply(w, 0, 0.01);
+    Noise::apply(sx, 0.1, 1);
+    Noise::apply(sy, 0.1, 1);
+
+    Image v = Multigrid::apply(a, dx, dy, w, sx, sy, 50, 1e-5);
+    if (!nearlyEqual(a, v)) { return false; }
+    Image wc = Multigrid::apply(a, dx, dy, w, sx, sy, 50, 1e-5, true);
+    return nearlyEqual(a, wc);
+}
+
+void Multigrid::parse(vector<string> args) {
+    assert(args.size() == 2 || args.size() == 3, "-multigrid takes two or three arguments\n");
+
+    bool wCycle = false;
+    if (args.size() == 3) {
+        if (args[2] == "w") {
+            wCycle = true;
+        } else {
+            assert(args[2] == "v", "The cycle type must be v or w\n");
+        }
+    }
+
+    Image result = apply(stack(5), stack(4), stack(3), stack(2), stack(1), stack(0),
+                         readInt(args[0]), readFloat(args[1]), wCycle);
+
+    for (int i = 0; i < 5; i++) {
+        pop();
+    }
+    push(result);
+}
+
+Image Multigrid::apply(Image d, Image gx, Image gy, Image w, Image sx, Image sy,
+                       int maxCycles, float tol, bool wCycle) {
+    assert(maxCycles >= 0, "maximum number of cycles should be nonnegative\n");
+    assert(tol < 1, "tolerance should be less than 1\n");
+
+    assert(d.frames == gx.frames && d.frames == gy.frames && d.frames == w.frames &&
+           d.frames == sx.frames && d.frames == sy.frames,
+           "requires input images to have same number of frames\n");
+
+    assert(d.width == gx.width && d.width == gy.width && d.width == w.width &&
+           d.width == sx.width && d.width == sy.width,
+           "requires input images to have same width\n");
+
+    assert(d.height == gx.height && d.height == gy.height && d.height == w.height &&
+           d.height == sx.height && d.height == sy.height,
+           "requires input images to have same height\n");
+
+    assert(d.channels == gx.channels && d.channels == gy.channels &&
+           w.channels == 1 && sx.channels == 1 && sy.channels == 1,
+           "Image and gradients must have a matching number of channels. Weight terms must have one channel.\n");
+
+    Image out(d.width, d.height, d.frames, d.channels);
+
+    for (int t = 0; t < d.frames; t++) {
+        MultigridSolver solver(d.frame(t), gx.frame(t), gy.frame(t),
+                               w.frame(t), sx.frame(t), sy.frame(t));
+        solver.solve(out.frame(t), maxCycles, tol, wCycle);
+    }
+
+    return out;
+}
+
+}
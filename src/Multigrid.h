@@ -0,0 +1,21 @@
+#ifndef IMAGESTACK_MULTIGRID_H
+#define IMAGESTACK_MULTIGRID_H
+namespace ImageStack {
+
+class Multigrid : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+
+    // Minimizes the same weighted least squares energy as LAHBPCG,
+    // using conjugate gradients preconditioned by a V-cycle, or a
+    // W-cycle if wCycle is true. Stops after maxCycles, or when the
+    // residual has fallen by a factor of tol.
+    static Image apply(Image d, Image gx, Image gy,
+                       Image w, Image sx, Image sy,
+                       int maxCycles, float tol, bool wCycle = false);
+};
+
+}
+#endif
@@ -36,6 +36,7 @@
 #include "WLS.h"
 #include "Plugin.h"
 #include "LocalLaplacian.h"
+#include "Multigrid.h"
 namespace ImageStack {
 
 
@@ -111,6 +112,7 @@ void loadOperations() {
 
     // geometry
     operationMap["-resample"] = new Resample();
+    operationMap["-thumbnails"] = new Thumbnails();
     operationMap["-crop"] = new Crop();
     operationMap["-flip"] = new Flip();
     operationMap["-adjoin"] = new Adjoin();
@@ -145,6 +147,7 @@ void loadOperations() {
     // calculus
     operationMap["-gradient"] = new Gradient();
     operationMap["-integrate"] = new Integrate();
+    operationMap["-summedareatable"] = new SummedAreaTable();
     operationMap["-gradmag"] = new GradMag();
     operationMap["-poisson"] = new Poisson();
 
@@ -164,7 +167,11 @@ void loadOperations() {
     operationMap["-dct"] = new DCT();
     operationMap["-fft"] = new FFT();
     operationMap["-ifft"] = new IFFT();
+    operationMap["-fftwplanning"] = new FFTWPlanning();
+    operationMap["-fftwthreads"] = new FFTWThreads();
+    operationMap["-fftwwisdom"] = new FFTWWisdom();
     operationMap["-fftconvolve"] = new FFTConvolve();
+    operationMap["-fftblocksize"] = new FFTBlockSize();
     operationMap["-fftpoisson"] = new FFTPoisson();
     operationMap["-deconvolve"] = new Deconvolve();
     operationMap["-kernelestimation"] = new KernelEstimation();
@@ -210,12 +217,17 @@ void loadOperations() {
     operationMap["-maxfilter"] = new MaxFilter();
     operationMap["-envelope"] = new Envelope();
     operationMap["-hotpixelsuppression"] = new HotPixelSuppression();
-    //    operationMap["-laplacianpyramid"] = new LaplacianFilter();
 
     // Filters that use a Gauss transform
     operationMap["-gausstransform"] = new GaussTransform();
+    operationMap["-stashgausstransform"] = new StashGaussTransform();
+    operationMap["-gridmemory"] = new GridMemory();
+    operationMap["-exacttruncation"] = new ExactTruncation();
+    operationMap["-ifgttolerance"] = new IFGTTolerance();
+    operationMap["-gausstransformtable"] = new GaussTransformTable();
     operationMap["-bilateral"] = new Bilateral();
     operationMap["-jointbilateral"] = new JointBilateral();
+    operationMap["-stashjointbilateral"] = new StashJointBilateral();
     operationMap["-bilateralsharpen"] = new BilateralSharpen();
     operationMap["-chromablur"] = new ChromaBlur();
     operationMap["-nlmeans"] = new NLMeans();
@@ -225,10 +237,16 @@ void loadOperations() {
     // Locally Adaptive Hierachical Basis Preconditioned Conjugate Gradients
     operationMap["-lahbpcg"] = new LAHBPCG();
 
+    // Geometric multigrid for the same problems
+    operationMap["-multigrid"] = new Multigrid();
+
     // Weighted-Least-Squares filtering
     operationMap["-wls"] = new WLS();
 
     operationMap["-locallaplacian"] = new LocalLaplacian();
+    operationMap["-gaussianpyramid"] = new GaussianPyramid();
+    operationMap["-laplacianpyramid"] = new LaplacianPyramid();
+    operationMap["-collapsepyramid"] = new CollapsePyramid();
 
     // HDR stuff
     operationMap["-assemblehdr"] = new AssembleHDR();
@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace ImageStack {
 
@@ -20,145 +23,143 @@ public:
     /* Constructor
      *  kd_: the dimensionality of the position vectors on the hyperplane.
      *  vd_: the dimensionality of the value vectors
+     *  expected: an estimate of the number of vectors that will be
+     *            stored. The table is sized so that this many vectors
+     *            fit without rehashing.
      */
-    HashTablePermutohedral(int kd_, int vd_) : kd(kd_), vd(vd_) {
+    HashTablePermutohedral(int kd_, int vd_, size_t expected = 0) : kd(kd_), vd(vd_) {
         capacity = 1 << 15;
+        while (capacity/2 <= expected+1) { capacity *= 2; }
         filled = 0;
-        entries = new Entry[capacity];
-        keys = new short[kd*capacity/2];
-        values = new float[vd*capacity/2];
-        memset(values, 0, sizeof(float)*vd*capacity/2);
-    }
-
-    ~HashTablePermutohedral() {
-        delete[] entries;
-        delete[] keys;
-        delete[] values;
+        entries.assign(capacity, -1);
+        keys.resize(kd*capacity/2);
+        values.assign(vd*capacity/2, 0.0f);
     }
 
     // Returns the number of vectors stored.
-    int size() { return filled; }
+    int size() const { return (int)filled; }
 
-    // Returns a pointer to the keys array.
-    short *getKeys() { return keys; }
+    // Returns a pointer to the keys array. The keys of vector i are
+    // stored contiguously starting at getKeys()[i*kd].
+    short *getKeys() { return &keys[0]; }
+    const short *getKeys() const { return &keys[0]; }
 
-    // Returns a pointer to the values array.
-    float *getValues() { return values; }
+    // Returns a pointer to the values array. The values of vector i
+    // are stored contiguously starting at getValues()[i*vd].
+    float *getValues() { return &values[0]; }
+    const float *getValues() const { return &values[0]; }
 
-    /* Returns the index into the hash table for a given key.
+    /* Returns the index of the vector with a given key, or -1 if it
+     * is not present and create is false. Lookups with create set to
+     * false do not modify the table, so may be made concurrently.
      *     key: a pointer to the position vector.
-     *       h: hash of the position vector.
      *  create: a flag specifying whether an entry should be created,
      *          should an entry with the given key not found.
      */
-    int lookupOffset(short *key, size_t h, bool create = true) {
-
+    int lookupIndex(const short *key, bool create = true) {
         // Double hash table size if necessary
         if (create && filled >= (capacity/2)-1) {
             grow();
-            h = hash(key) % capacity;
         }
+        return find(key, create);
+    }
+
+    int lookupIndex(const short *key) const {
+        return const_cast<HashTablePermutohedral *>(this)->find(key, false);
+    }
+
+    /* Looks up the value vector associated with a given key vector.
+     *        k : pointer to the key vector to be looked up.
+     *   create : true if a non-existing key should be created.
+     */
+    float *lookup(const short *k, bool create = true) {
+        int idx = lookupIndex(k, create);
+        if (idx < 0) { return NULL; }
+        else { return &values[idx*vd]; }
+    };
+
+    const float *lookup(const short *k) const {
+        int idx = lookupIndex(k);
+        if (idx < 0) { return NULL; }
+        else { return &values[idx*vd]; }
+    };
+
+    // Changes the dimensionality of the value vectors. All values
+    // are reset to zero.
+    void setValueDimensions(int vd_) {
+        vd = vd_;
+        values.assign(vd*capacity/2, 0.0f);
+    }
 
-        // Find the entry with the given key
+    /* Hash function used in this implementation. A simple base conversion. */
+    size_t hash(const short *key) const {
+        size_t k = 0;
+        for (int i = 0; i < kd; i++) {
+            k += key[i];
+            k *= 2531011;
+        }
+        return k;
+    }
+
+private:
+    // Linear probing for a key. Assumes there is room for one more
+    // vector if create is true.
+    int find(const short *key, bool create) {
+        size_t h = hash(key) & (capacity-1);
         while (1) {
-            Entry e = entries[h];
+            int idx = entries[h];
             // check if the cell is empty
-            if (e.keyIdx == -1) {
+            if (idx == -1) {
                 if (!create) { return -1; } // Return not found.
                 // need to create an entry. Store the given key.
+                idx = (int)filled++;
                 for (int i = 0; i < kd; i++) {
-                    keys[filled *kd+i] = key[i];
+                    keys[idx*kd+i] = key[i];
                 }
-                e.keyIdx = filled*kd;
-                e.valueIdx = filled*vd;
-                entries[h] = e;
-                filled++;
-                return e.valueIdx;
+                entries[h] = idx;
+                return idx;
             }
 
             // check if the cell has a matching key
+            const short *k = &keys[idx*kd];
             bool match = true;
             for (int i = 0; i < kd && match; i++) {
-                match = keys[e.keyIdx+i] == key[i];
+                match = k[i] == key[i];
             }
             if (match) {
-                return e.valueIdx;
+                return idx;
             }
 
             // increment the bucket with wraparound
-            h++;
-            if (h == capacity) { h = 0; }
+            h = (h+1) & (capacity-1);
         }
     }
 
-    /* Looks up the value vector associated with a given key vector.
-     *        k : pointer to the key vector to be looked up.
-     *   create : true if a non-existing key should be created.
-     */
-    float *lookup(short *k, bool create = true) {
-        size_t h = hash(k) % capacity;
-        int offset = lookupOffset(k, h, create);
-        if (offset < 0) { return NULL; }
-        else { return values + offset; }
-    };
-
-    /* Hash function used in this implementation. A simple base conversion. */
-    size_t hash(const short *key) {
-        size_t k = 0;
-        for (int i = 0; i < kd; i++) {
-            k += key[i];
-            k *= 2531011;
-        }
-        return k;
-    }
-
-private:
     /* Grows the size of the hash table */
     void grow() {
-        //printf("Resizing hash table\n");
-
-        size_t oldCapacity = capacity;
         capacity *= 2;
 
-        // Migrate the value vectors.
-        float *newValues = new float[vd*capacity/2];
-        memset(newValues, 0, sizeof(float)*vd*capacity/2);
-        memcpy(newValues, values, sizeof(float)*vd*filled);
-        delete[] values;
-        values = newValues;
-
-        // Migrate the key vectors.
-        short *newKeys = new short[kd*capacity/2];
-        memcpy(newKeys, keys, sizeof(short)*kd*filled);
-        delete[] keys;
-        keys = newKeys;
-
-        Entry *newEntries = new Entry[capacity];
-
-        // Migrate the table of indices.
-        for (size_t i = 0; i < oldCapacity; i++) {
-            if (entries[i].keyIdx == -1) { continue; }
-            size_t h = hash(keys + entries[i].keyIdx) % capacity;
-            while (newEntries[h].keyIdx != -1) {
-                h++;
-                if (h == capacity) { h = 0; }
+        // The key and value vectors stay where they are.
+        keys.resize(kd*capacity/2);
+        values.resize(vd*capacity/2, 0.0f);
+
+        // Rebuild the table of indices.
+        entries.assign(capacity, -1);
+        for (size_t i = 0; i < filled; i++) {
+            size_t h = hash(&keys[i*kd]) & (capacity-1);
+            while (entries[h] != -1) {
+                h = (h+1) & (capacity-1);
             }
-            newEntries[h] = entries[i];
+            entries[h] = (int)i;
         }
-        delete[] entries;
-        entries = newEntries;
     }
 
-    // Private struct for the hash table entries.
-    struct Entry {
-        Entry() : keyIdx(-1), valueIdx(-1) {}
-        int keyIdx;
-        int valueIdx;
-    };
-
-    short *keys;
-    float *values;
-    Entry *entries;
+    // Keys and values are stored as structures of arrays, indexed by
+    // the order in which they were inserted. The table itself just
+    // holds those indices, with -1 marking an empty cell.
+    vector<short> keys;
+    vector<float> values;
+    vector<int> entries;
     size_t capacity, filled;
     int kd, vd;
 };
@@ -166,80 +167,27 @@ private:
 /******************************************************************
  * The algorithm class that performs the filter                   *
  *                                                                *
- * PermutohedralLattice::filter(...) does all the work.           *
+ * Usage is build(...), then splat(...), blur(), and slice(...).  *
+ * Points are passed in via functors, which are called as         *
+ * f(i, ptr) to fill in (or consume) the position or value        *
+ * vector of point i. Each stage is parallelized over points or   *
+ * lattice vertices, so the functors may be called concurrently.  *
  *                                                                *
  ******************************************************************/
 class PermutohedralLattice {
 public:
 
-    /* Filters given image against a reference image.
-     *   im : image to be filtered.
-     *  ref : reference image whose edges are to be respected.
-     */
-    /*
-      static Image filter(Image im, Image ref) {
-
-
-          // Create lattice
-          PermutohedralLattice lattice(ref.channels, im.channels+1, im.width*im.height*im.frames);
-          // Splat into the lattice
-          //printf("Splatting...\n");
-
-          float *imPtr = im(0, 0, 0);
-          float *refPtr = ref(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      lattice.splat(refPtr, imPtr);
-                      refPtr += ref.channels;
-                      imPtr += im.channels;
-                  }
-              }
-          }
-
-          // Blur the lattice
-          //printf("Blurring...\n");
-          lattice.blur();
-
-          // Slice from the lattice
-          //printf("Slicing...\n");
-
-          Image out(im.width, im.height, im.frames, im.channels);
-
-          lattice.beginSlice();
-          float *outPtr = out(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      lattice.slice(outPtr);
-                      outPtr += out.channels;
-                  }
-              }
-          }
-
-          return out;
-      }
-    */
-
     /* Constructor
      *     d_ : dimensionality of key vectors
      *    vd_ : dimensionality of value vectors
      * nData_ : number of points in the input
      */
     PermutohedralLattice(int d_, int vd_, int nData_) :
-        d(d_), vd(vd_), nData(nData_), hashTable(d_, vd_) {
+        d(d_), vd(vd_), nData(nData_), blocks(0), hashTable(d_, vd_) {
 
-        // Allocate storage for various arrays
-        elevated = new float[d+1];
-        scaleFactor = new float[d];
-
-        greedy = new short[d+1];
-        rank = new char[d+1];
-        barycentric = new float[d+2];
-        replay = new ReplayEntry[nData*(d+1)];
-        nReplay = 0;
-        canonical = new short[(d+1)*(d+1)];
-        key = new short[d+1];
+        replay.resize((size_t)nData*(d+1));
+        canonical.resize((d+1)*(d+1));
+        scaleFactor.resize(d);
 
         // compute the coordinates of the canonical simplex, in which
         // the difference between a contained point and the zero
@@ -274,20 +222,301 @@ public:
         }
     }
 
+    /* Finds the simplex containing each of the nData points, creating
+     * the lattice vertices they touch and recording their barycentric
+     * weights. This depends only on the positions, so once it's done
+     * the lattice can splat, blur, and slice many different sets of
+     * values.
+     *
+     * The points are divided into one contiguous block per thread,
+     * and each thread inserts its block into a private hash table.
+     * The private tables are then merged into the first one.
+     */
+    template<typename P>
+    void build(const P &position) {
+        blocks = 1;
+        #ifdef _OPENMP
+        blocks = omp_get_max_threads();
+        #endif
+        // Don't bother splitting small inputs
+        blocks = std::max(1, std::min(blocks, nData / 1024));
+
+        blockStart.resize(blocks+1);
+        for (int b = 0; b <= blocks; b++) {
+            blockStart[b] = (int)(((long long)nData * b) / blocks);
+        }
+
+        vector<HashTablePermutohedral *> tables(blocks);
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+        #endif
+        for (int b = 0; b < blocks; b++) {
+            int start = blockStart[b], end = blockStart[b+1];
+            // The first block inserts straight into the final
+            // table. A lattice vertex is typically shared by many
+            // points, so the tables start at a fraction of the number
+            // of points.
+            HashTablePermutohedral *table;
+            if (b == 0) {
+                hashTable = HashTablePermutohedral(d, vd, (end - start)/8);
+                table = &hashTable;
+            } else {
+                table = new HashTablePermutohedral(d, 0, (end - start)/8);
+            }
+            Simplex s(d);
+            vector<float> pos(d);
+            for (int i = start; i < end; i++) {
+                position(i, &pos[0]);
+                locate(&pos[0], s);
+                size_t j = (size_t)i*(d+1);
+                for (int remainder = 0; remainder <= d; remainder++, j++) {
+                    int idx = table->lookupIndex(s.key(remainder), true);
+                    replay[j].vertex = idx;
+                    replay[j].weight = s.barycentric[remainder];
+                }
+            }
+            tables[b] = table;
+        }
+
+        // Merge the other private tables into the first
+        remap.clear();
+        remap.resize(blocks);
+        for (int b = 1; b < blocks; b++) {
+            HashTablePermutohedral *table = tables[b];
+            remap[b].resize(table->size());
+            for (int i = 0; i < table->size(); i++) {
+                remap[b][i] = hashTable.lookupIndex(table->getKeys() + i*d, true);
+            }
+            delete table;
+        }
+
+        // Point the replay entries at the merged table
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+        #endif
+        for (int b = 0; b < blocks; b++) {
+            size_t start = (size_t)blockStart[b] * (d+1);
+            size_t end = (size_t)blockStart[b+1] * (d+1);
+            if (b == 0) { continue; }
+            const int *m = &remap[b][0];
+            for (size_t i = start; i < end; i++) {
+                replay[i].vertex = m[replay[i].vertex];
+            }
+        }
+    }
+
+    /* Splats a value vector for each of the nData points into the
+     * lattice, using the weights computed by build. Any values
+     * previously in the lattice are discarded. Each thread splats its
+     * block into a private buffer indexed like its private table,
+     * found by inverting remap, and the buffers are then summed into
+     * the lattice.
+     */
+    template<typename V>
+    void splat(const V &value) {
+        float *base = hashTable.getValues();
+        memset(base, 0, (size_t)hashTable.size()*vd*sizeof(float));
+
+        vector<vector<float> > partial(blocks);
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+        #endif
+        for (int b = 0; b < blocks; b++) {
+            float *dst = base;
+            vector<int> local;
+            if (b > 0) {
+                partial[b].assign(remap[b].size()*vd, 0.0f);
+                dst = &partial[b][0];
+                local.resize(hashTable.size());
+                for (size_t i = 0; i < remap[b].size(); i++) {
+                    local[remap[b][i]] = (int)i;
+                }
+            }
+            vector<float> val(vd);
+            for (int i = blockStart[b]; i < blockStart[b+1]; i++) {
+                value(i, &val[0]);
+                size_t j = (size_t)i*(d+1);
+                for (int remainder = 0; remainder <= d; remainder++, j++) {
+                    int vertex = replay[j].vertex;
+                    float *v = dst + (b > 0 ? local[vertex] : vertex)*vd;
+                    float w = replay[j].weight;
+                    for (int k = 0; k < vd; k++) {
+                        v[k] += w*val[k];
+                    }
+                }
+            }
+        }
+
+        for (int b = 1; b < blocks; b++) {
+            const float *src = &partial[b][0];
+            for (size_t i = 0; i < remap[b].size(); i++) {
+                float *v = base + remap[b][i]*vd;
+                for (int k = 0; k < vd; k++) {
+                    v[k] += src[i*vd+k];
+                }
+            }
+        }
+    }
+
+    /* Finds the simplex containing each of n new positions at which
+     * the lattice will be sliced, and records its barycentric
+     * weights, so that slice(output) produces values at those
+     * positions rather than at the positions that were splatted.
+     */
+    template<typename P>
+    void prepareSlice(int n, const P &position) {
+        sliceReplay.resize((size_t)n*(d+1));
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            Simplex s(d);
+            vector<float> pos(d);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < n; i++) {
+                position(i, &pos[0]);
+                locate(&pos[0], s);
+                ReplayEntry *r = &sliceReplay[(size_t)i*(d+1)];
+                for (int remainder = 0; remainder <= d; remainder++) {
+                    // Vertices that were never splatted to hold zero
+                    int idx = hashTable.lookupIndex(s.key(remainder));
+                    r[remainder].vertex = idx < 0 ? 0 : idx;
+                    r[remainder].weight = idx < 0 ? 0 : s.barycentric[remainder];
+                }
+            }
+        }
+    }
+
+    /* Performs slicing, reusing the barycentric weights and simplices
+     * found by build (or by prepareSlice, if it was called). (See
+     * pg. 6 in paper.)
+     */
+    template<typename O>
+    void slice(const O &output) const {
+        const float *base = hashTable.getValues();
+        const vector<ReplayEntry> &r = sliceReplay.empty() ? replay : sliceReplay;
+        int n = (int)(r.size() / (d+1));
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            vector<float> col(vd);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < n; i++) {
+                for (int j = 0; j < vd; j++) { col[j] = 0; }
+                const ReplayEntry *e = &r[(size_t)i*(d+1)];
+                for (int k = 0; k <= d; k++) {
+                    const float *v = base + e[k].vertex*vd;
+                    for (int j = 0; j < vd; j++) {
+                        col[j] += e[k].weight*v[j];
+                    }
+                }
+                output(i, &col[0]);
+            }
+        }
+    }
 
-    ~PermutohedralLattice() {
-        delete[] scaleFactor;
-        delete[] elevated;
-        delete[] greedy;
-        delete[] rank;
-        delete[] barycentric;
-        delete[] replay;
-        delete[] canonical;
-        delete[] key;
+    // Changes the dimensionality of the value vectors to be
+    // splatted. This doesn't invalidate the work done by build.
+    void setValueDimensions(int vd_) {
+        vd = vd_;
+        hashTable.setValueDimensions(vd);
     }
 
+    int valueDimensions() const {return vd;}
+
+    /* Performs a Gaussian blur along each projected axis in the hyperplane. */
+    void blur() {
+        // Prepare arrays
+        int n = hashTable.size();
+        vector<float> buffer((size_t)vd*n);
+        float *newValue = &buffer[0];
+        float *oldValue = hashTable.getValues();
+        float *hashTableBase = oldValue;
+        const short *keys = hashTable.getKeys();
+        const HashTablePermutohedral &table = hashTable;
+
+        vector<float> zeros(vd, 0.0f);
+        const float *zero = &zeros[0];
 
-    void splat_or_slice(float *position, float *value, bool splatting, bool record) {
+        // For each of d+1 axes,
+        for (int j = 0; j <= d; j++) {
+            #ifdef _OPENMP
+            #pragma omp parallel
+            #endif
+            {
+                vector<short> neighbor1(d+1), neighbor2(d+1);
+                // For each vertex in the lattice,
+                #ifdef _OPENMP
+                #pragma omp for
+                #endif
+                for (int i = 0; i < n; i++) { // blur point i in dimension j
+                    const short *currentKey = keys + i*d; // keys to current vertex
+                    for (int k = 0; k < d; k++) {
+                        neighbor1[k] = currentKey[k] + 1;
+                        neighbor2[k] = currentKey[k] - 1;
+                    }
+                    neighbor1[j] = currentKey[j] - d;
+                    neighbor2[j] = currentKey[j] + d; // keys to the neighbors along the given axis.
+
+                    const float *oldVal = oldValue + i*vd;
+                    float *newVal = newValue + i*vd;
+
+                    const float *vm1, *vp1;
+
+                    int idx = table.lookupIndex(&neighbor1[0]); // look up first neighbor
+                    vm1 = idx < 0 ? zero : oldValue + idx*vd;
+
+                    idx = table.lookupIndex(&neighbor2[0]); // look up second neighbor
+                    vp1 = idx < 0 ? zero : oldValue + idx*vd;
+
+                    // Mix values of the three vertices
+                    for (int k = 0; k < vd; k++) {
+                        newVal[k] = (0.25f*vm1[k] + 0.5f*oldVal[k] + 0.25f*vp1[k]);
+                    }
+                }
+            }
+            std::swap(newValue, oldValue);
+            // the freshest data is now in oldValue, and newValue is ready to be written over
+        }
+
+        // depending where we ended up, we may have to copy data
+        if (oldValue != hashTableBase) {
+            memcpy(hashTableBase, oldValue, (size_t)n*vd*sizeof(float));
+        }
+    }
+
+private:
+
+    // Scratch space for finding the simplex enclosing a point. Each
+    // thread gets its own.
+    struct Simplex {
+        Simplex(int d_) : d(d_), elevated(d_+1), barycentric(d_+2),
+                          greedy(d_+1), rank(d_+1), keys((d_+1)*d_) {}
+
+        // The key of the vertex with the given remainder
+        const short *key(int remainder) const {return &keys[remainder*d];}
+
+        int d;
+        vector<float> elevated, barycentric;
+        vector<short> greedy;
+        vector<char> rank;
+        vector<short> keys;
+    };
+
+    // Find the simplex containing a position vector, filling in the
+    // keys and barycentric weights of its vertices.
+    void locate(const float *position, Simplex &s) const {
+        float *elevated = &s.elevated[0];
+        float *barycentric = &s.barycentric[0];
+        short *mygreedy = &s.greedy[0];
+        char *myrank = &s.rank[0];
 
         // first rotate position into the (d+1)-dimensional hyperplane
         elevated[d] = -d*position[d-1]*scaleFactor[d-1];
@@ -299,8 +528,6 @@ public:
 
         // prepare to find the closest lattice points
         float scale = 1.0f/(d+1);
-        char *myrank = rank;
-        short *mygreedy = greedy;
 
         // greedily search for the closest zero-colored lattice point
         int sum = 0;
@@ -355,155 +582,36 @@ public:
         }
         barycentric[0] += 1.0f + barycentric[d+1];
 
-        if (!splatting) {
-            for (int i = 0; i < vd; i++) {
-                value[i] = 0.0f;
-            }
-        }
-
-        // Splat the value into each vertex of the simplex, with barycentric weights.
+        // Compute the location of each lattice point explicitly (all
+        // but the last coordinate - it's redundant because they sum
+        // to zero)
         for (int remainder = 0; remainder <= d; remainder++) {
-            // Compute the location of the lattice point explicitly (all but the last coordinate - it's redundant because they sum to zero)
+            short *key = &s.keys[remainder*d];
             for (int i = 0; i < d; i++) {
                 key[i] = mygreedy[i] + canonical[remainder*(d+1) + myrank[i]];
             }
-
-            // Retrieve pointer to the value at this vertex.
-            float *val = hashTable.lookup(key, true);
-
-            // Accumulate values with barycentric weight.
-            if (splatting) {
-                for (int i = 0; i < vd; i++) {
-                    val[i] += barycentric[remainder]*value[i];
-                }
-            } else {
-                for (int i = 0; i < vd; i++) {
-                    value[i] += barycentric[remainder]*val[i];
-                }
-            }
-
-            if (record) {
-                // Record this interaction to use later when slicing
-                replay[nReplay].offset = val - hashTable.getValues();
-                replay[nReplay].weight = barycentric[remainder];
-                nReplay++;
-            }
-
-        }
-    }
-
-    /* Performs splatting with given position and value vectors. Set
-     * record to true if you're going to use the cheaper version of
-     * slice that reuses the weights computed by splatting. */
-    void splat(float *position, float *value, bool record = true) {
-        splat_or_slice(position, value, true, record);
-    }
-
-    /* Performs splicing with given position and value vectors. If
-     * slicing using the same vectors used to splat, call the other
-     * version of slice instead. */
-    void slice(float *position, float *value) {
-        splat_or_slice(position, value, false, false);
-    }
-
-    // Prepare for slicing
-    void beginSlice() {
-        nReplay = 0;
-    }
-
-    /* Performs slicing out of position vectors. Note that the barycentric weights and the simplex
-     * containing each position vector were calculated and stored in the splatting step.
-     * We may reuse this to accelerate the algorithm. (See pg. 6 in paper.)
-     */
-    void slice(float *col) {
-        float *base = hashTable.getValues();
-        for (int j = 0; j < vd; j++) { col[j] = 0; }
-        for (int i = 0; i <= d; i++) {
-            ReplayEntry r = replay[nReplay++];
-            for (int j = 0; j < vd; j++) {
-                col[j] += r.weight*base[r.offset + j];
-            }
         }
     }
 
-    /* Performs a Gaussian blur along each projected axis in the hyperplane. */
-    void blur() {
-        // Prepare arrays
-        short *neighbor1 = new short[d+1];
-        short *neighbor2 = new short[d+1];
-        float *newValue = new float[vd*hashTable.size()];
-        float *oldValue = hashTable.getValues();
-        float *hashTableBase = oldValue;
-
-        float *zero = new float[vd];
-        for (int k = 0; k < vd; k++) { zero[k] = 0; }
-
-        // For each of d+1 axes,
-        for (int j = 0; j <= d; j++) {
-            // For each vertex in the lattice,
-            for (int i = 0; i < hashTable.size(); i++) { // blur point i in dimension j
-                short *currentKey = hashTable.getKeys() + i*(d); // keys to current vertex
-                for (int k = 0; k < d; k++) {
-                    neighbor1[k] = currentKey[k] + 1;
-                    neighbor2[k] = currentKey[k] - 1;
-                }
-                neighbor1[j] = currentKey[j] - d;
-                neighbor2[j] = currentKey[j] + d; // keys to the neighbors along the given axis.
-
-                float *oldVal = oldValue + i*vd;
-                float *newVal = newValue + i*vd;
-
-                float *vm1, *vp1;
-
-                vm1 = hashTable.lookup(neighbor1, false); // look up first neighbor
-                if (vm1) { vm1 = vm1 - hashTableBase + oldValue; }
-                else { vm1 = zero; }
-
-                vp1 = hashTable.lookup(neighbor2, false); // look up second neighbor
-                if (vp1) { vp1 = vp1 - hashTableBase + oldValue; }
-                else { vp1 = zero; }
-
-                // Mix values of the three vertices
-                for (int k = 0; k < vd; k++) {
-                    newVal[k] = (0.25f*vm1[k] + 0.5f*oldVal[k] + 0.25f*vp1[k]);
-                }
-            }
-            float *tmp = newValue;
-            newValue = oldValue;
-            oldValue = tmp;
-            // the freshest data is now in oldValue, and newValue is ready to be written over
-        }
-
-        // depending where we ended up, we may have to copy data
-        if (oldValue != hashTableBase) {
-            memcpy(hashTableBase, oldValue, hashTable.size()*vd*sizeof(float));
-            delete[] oldValue;
-        } else {
-            delete[] newValue;
-        }
-
-        delete[] zero;
-        delete[] neighbor1;
-        delete[] neighbor2;
-    }
-
-private:
-
     int d, vd, nData;
-    float *elevated, *scaleFactor, *barycentric;
-    short *canonical;
-    short *key;
+    vector<float> scaleFactor;
+    vector<short> canonical;
 
     // slicing is done by replaying splatting (ie storing the sparse matrix)
     struct ReplayEntry {
-        int offset;
+        int vertex;
         float weight;
-    } *replay;
-    int nReplay;
+    };
+    vector<ReplayEntry> replay, sliceReplay;
+
+    // How the points were divided among threads by build. For
+    // blocks after the first, remap maps the indices of vertices in
+    // that block's private table to indices in the final table.
+    int blocks;
+    vector<int> blockStart;
+    vector<vector<int> > remap;
 
 public:
-    char  *rank;
-    short *greedy;
     HashTablePermutohedral hashTable;
 };
 
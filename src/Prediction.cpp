@@ -6,6 +6,7 @@
 #include "Calculus.h"
 #include "Statistics.h"
 #include "Convolve.h"
+#include "Multigrid.h"
 namespace ImageStack {
 
 void Inpaint::help() {
@@ -116,6 +117,10 @@ void SeamlessClone::help() {
             " interprets this as a mask, and composites the second image in the"
             " stack over the third image in the stack using that mask.\n"
             "\n"
+            "By default the correction that hides the seam is found by diffusion,"
+            " as in -inpaint. Given the optional argument 'multigrid', it is instead"
+            " the exact membrane (Laplace) solution, found with -multigrid.\n"
+            "\n"
             "Usage: ImageStack -load a.jpg -load b.jpg -load mask.png -seamlessclone\n"
             "       ImageStack -load a.jpg -load b.jpg -evalchannels [0] [1] [2] \\\n"
             "       \"x>width/2\" -seamlessclone -display\n\n");
@@ -151,23 +156,35 @@ bool SeamlessClone::test() {
     Image lapBg = Convolve::apply(background, lap, Convolve::Clamp);
     Image lapIm = Convolve::apply(im, lap, Convolve::Clamp);
     Composite::apply(lapBg, lapFg, 1-mask);
+    if (!nearlyEqual(lapIm, lapBg)) { return false; }
+
+    // The same with the exact membrane solution
+    im = background.copy();
+    SeamlessClone::apply(im, foreground, mask, true);
+    lapIm = Convolve::apply(im, lap, Convolve::Clamp);
     return nearlyEqual(lapIm, lapBg);
 }
 
 void SeamlessClone::parse(vector<string> args) {
-    assert(args.size() == 0, "-seamlessclone takes no arguments\n");
+    assert(args.size() < 2, "-seamlessclone takes zero or one arguments\n");
+
+    bool multigrid = false;
+    if (args.size() == 1) {
+        multigrid = (args[0] == "multigrid");
+        assert(multigrid || args[0] == "inpaint", "The method must be inpaint or multigrid\n");
+    }
 
     if (stack(0).channels == 1) {
-        apply(stack(2), stack(1), stack(0));
+        apply(stack(2), stack(1), stack(0), multigrid);
         pop();
         pop();
     } else {
-        apply(stack(1), stack(0));
+        apply(stack(1), stack(0), multigrid);
         pop();
     }
 }
 
-void SeamlessClone::apply(Image dst, Image src) {
+void SeamlessClone::apply(Image dst, Image src, bool multigrid) {
     assert(src.channels > 1, "Source image needs at least two channels\n");
     assert(src.channels == dst.channels || src.channels == dst.channels + 1,
            "Source image and destination image must either have matching channel"
@@ -182,14 +199,14 @@ void SeamlessClone::apply(Image dst, Image src) {
               src.region(0, 0, 0, 0,
                          src.width, src.height,
                          src.frames, dst.channels),
-              src.channel(dst.channels));
+              src.channel(dst.channels), multigrid);
 
     } else {
-        apply(dst, src, src.channel(dst.channels-1));
+        apply(dst, src, src.channel(dst.channels-1), multigrid);
     }
 }
 
-void SeamlessClone::apply(Image dst, Image src, Image mask) {
+void SeamlessClone::apply(Image dst, Image src, Image mask, bool multigrid) {
     assert(src.channels == dst.channels, "The source and destination images must have the same number of channels\n");
 
     assert(dst.frames == src.frames && dst.width == src.width && dst.height == src.height,
@@ -200,7 +217,23 @@ void SeamlessClone::apply(Image dst, Image src, Image mask) {
     assert(mask.channels == 1, "Mask must have one channel\n");
 
     // Generate a smooth patch to fix discontinuities between source and destination
-    Image patch = Inpaint::apply(dst-src, mask);
+    Image patch;
+    if (multigrid) {
+        // Solve for the smoothest patch that matches the difference
+        // where the mask is high. The large target weight pins those
+        // pixels, and the edges at the image boundary are cut.
+        Image target(mask.width, mask.height, mask.frames, 1);
+        target.set(mask * 10000);
+        Image sx(mask.width, mask.height, mask.frames, 1), sy = sx.copy();
+        sx.set(1);
+        sy.set(1);
+        sx.region(0, 0, 0, 0, 1, mask.height, mask.frames, 1).set(0);
+        sy.region(0, 0, 0, 0, mask.width, 1, mask.frames, 1).set(0);
+        Image zeros(dst.width, dst.height, dst.frames, dst.channels);
+        patch = Multigrid::apply(dst-src, zeros, zeros, target, sx, sy, 100, 1e-8);
+    } else {
+        patch = Inpaint::apply(dst-src, mask);
+    }
 
     for (int c = 0; c < dst.channels; c++) {
         dst.channel(c).set((1-mask)*(src.channel(c) + patch.channel(c)) + mask*dst.channel(c));
@@ -15,8 +15,8 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static void apply(Image dst, Image src, Image mask);
-    static void apply(Image dst, Image src);
+    static void apply(Image dst, Image src, Image mask, bool multigrid = false);
+    static void apply(Image dst, Image src, bool multigrid = false);
 };
 
 }
@@ -1813,18 +1813,22 @@ Image PatchPCA3D::apply(Image im, float sigma, int newChannels) {
 
     Eigenvectors e(patchSize*patchSize*patchSize*im.channels, newChannels);
     for (int iter = 0; iter < min(1000, im.width*im.height*im.frames); iter++) {
-        int t = randomInt(patchSize/2, im.frames-1-patchSize/2);
+        // Patches may not fit in short videos, in which case they're
+        // clamped at the first and last frames
+        int t = (im.frames < patchSize ? randomInt(0, im.frames-1) :
+                 randomInt(patchSize/2, im.frames-1-patchSize/2));
         int x = randomInt(patchSize/2, im.width-1-patchSize/2);
         int y = randomInt(patchSize/2, im.height-1-patchSize/2);
         int j = 0;
         for (int dt = -patchSize/2; dt <= patchSize/2; dt++) {
+            int tt = clamp(t+dt, 0, im.frames-1);
             for (int dy = -patchSize/2; dy <= patchSize/2; dy++) {
                 for (int dx = -patchSize/2; dx <= patchSize/2; dx++) {
                     for (int c = 0; c < im.channels; c++) {
                         vec[j] = (mask[dx+patchSize/2]*
                                   mask[dy+patchSize/2]*
                                   mask[dt+patchSize/2]*
-                                  im(x+dx, y+dy, t+dy, c));
+                                  im(x+dx, y+dy, tt, c));
                         j++;
                     }
                 }
@@ -8,6 +8,7 @@
 #include "Paint.h"
 #include "Statistics.h"
 #include "LAHBPCG.h"
+#include "Multigrid.h"
 namespace ImageStack {
 
 void WLS::help() {
@@ -15,7 +16,8 @@ void WLS::help() {
             " Edge-Preserving Decompositions for Multi-Scale Tone and Detail"
             " Manipulation by Farbman et al. The first parameter (alpha) controls"
             " the sensitivity to edges, and the second one (lambda) controls the"
-            " amount of smoothing.\n"
+            " amount of smoothing. An optional third argument selects the solver:"
+            " 'pcg' (the default) or 'multigrid' (see -multigrid).\n"
             "\n"
             "Usage: ImageStack -load in.jpg -wls 1.2 0.25 -save blurry.jpg\n");
 }
@@ -35,6 +37,7 @@ bool WLS::test() {
     }
     Noise::apply(a, -0.2, 0.2);
 
+    Image b = WLS::apply(a, 1.0, 0.5, 0.01, true);
     a = WLS::apply(a, 1.0, 0.5, 0.01);
 
     // Make sure wls cleaned it up
@@ -49,6 +52,9 @@ bool WLS::test() {
         if (fabs(a(x, y, 0) - correct) > 0.1) return false;
         if (fabs(a(x, y, 1) - correct*0.5) > 0.1) return false;
         if (fabs(a(x, y, 2) - correct*0.25) > 0.1) return false;
+        for (int c = 0; c < 3; c++) {
+            if (fabs(a(x, y, c) - b(x, y, c)) > 0.02) return false;
+        }
     }
 
     return true;
@@ -57,18 +63,24 @@ bool WLS::test() {
 void WLS::parse(vector<string> args) {
     float alpha = 0, lambda = 0;
 
-    assert(args.size() == 2, "-wls takes two arguments");
+    assert(args.size() == 2 || args.size() == 3, "-wls takes two or three arguments");
 
     alpha = readFloat(args[0]);
     lambda = readFloat(args[1]);
 
-    Image im = apply(stack(0), alpha, lambda, 0.01);
+    bool multigrid = false;
+    if (args.size() == 3) {
+        multigrid = (args[2] == "multigrid");
+        assert(multigrid || args[2] == "pcg", "The solver must be pcg or multigrid\n");
+    }
+
+    Image im = apply(stack(0), alpha, lambda, 0.01, multigrid);
 
     pop();
     push(im);
 }
 
-Image WLS::apply(Image im, float alpha, float lambda, float tolerance) {
+Image WLS::apply(Image im, float alpha, float lambda, float tolerance, bool multigrid) {
 
     Image L;
 
@@ -120,6 +132,12 @@ Image WLS::apply(Image im, float alpha, float lambda, float tolerance) {
     // For this filter gx and gy is 0 all over (target gradient is smooth)
     Image zeros(im.width, im.height, 1, im.channels);
 
+    // The weights vary over orders of magnitude, so multigrid uses
+    // W-cycles.
+    if (multigrid) {
+        return Multigrid::apply(im, zeros, zeros, w, Lx, Ly, 100, tolerance, true);
+    }
+
     // Solve using the fast preconditioned conjugate gradient.
     Image x = LAHBPCG::apply(im, zeros, zeros, w, Lx, Ly, 200, tolerance);
 
@@ -7,7 +7,8 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, float alpha, float lambda, float tolerance);
+    static Image apply(Image im, float alpha, float lambda, float tolerance,
+                       bool multigrid = false);
 };
 
 }
@@ -43,6 +43,10 @@ using ::std::isnan;
 inline float isinf(float x) {
     return (!_finite(x) && !_isnan(x));
 }
+// Microsoft has an underscore in front of snprintf for some reason
+#ifndef snprintf
+#define snprintf _snprintf
+#endif
 #endif
 
 // Some core files that everyone should include